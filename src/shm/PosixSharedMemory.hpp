@@ -0,0 +1,358 @@
+ /*
+ * *
+ * * Filename: PosixSharedMemory.hpp
+ * *
+ * * Description:
+ * *   POSIX/memfd sibling of the System V SharedMemory class, with the same API shape
+ * *     (CreateOrAttach, Attach, Detach, Remove, MarkForRemoval, Stat, accessors). The
+ * *     segment is a file descriptor - a shm_open(3) name under /dev/shm or an anonymous
+ * *     memfd_create(2) file - mapped with mmap(2). Being a file it can grow or shrink
+ * *     (ftruncate + mremap), be sealed against further changes (F_SEAL_GROW, F_SEAL_WRITE,
+ * *     ...) and be handed to an unrelated process over a UNIX domain socket with
+ * *     SCM_RIGHTS, so large buffers move between processes without a copy and without
+ * *     ftok key collisions.
+ * *
+ * *  Author:
+ * *    JEP  J. Enrique Peraza
+ * *
+ */
+#pragma once
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+#include <string.h>
+#include "SharedMemory.hpp"
+
+namespace ipc
+{
+  class PosixSharedMemory
+  {
+    public:
+      PosixSharedMemory (void)=default;
+      PosixSharedMemory (const PosixSharedMemory&)=delete;// One owner per fd/mapping.
+      PosixSharedMemory& operator= (const PosixSharedMemory&)=delete;
+      // Moving hands the fd and mapping over without another mmap().
+      PosixSharedMemory (PosixSharedMemory&& o) noexcept { Take(o); }
+      PosixSharedMemory& operator= (PosixSharedMemory&& o) noexcept
+      {
+        if (this!=&o)                   // Not ourselves?
+        {                               // No, drop what we hold first.
+          Detach();
+          if(owner)
+            Remove();
+          else
+            Close();
+          Take(o);                      // Then steal theirs.
+        }                               // Done moving.
+        return *this;
+      }
+      ~PosixSharedMemory (void)
+      {
+        Detach();
+        if(owner)
+          Remove();
+        else
+          Close();
+      }
+      // Create or open a named POSIX segment (name must start with '/'). The
+      // flags are the SysV ones (SHM_CREATE/SHM_EXCL) so callers can switch
+      // backends; a segment we create, or one smaller than size, is grown to size.
+      ShmResult CreateOrAttach (
+        const char* nm,                 // The name of the segment ("/foo")
+        size_t size,                    // The size of the segment
+        int mode=SHM_PERM_600,          // The access mode
+        int flags=SHM_CREATE)           // The creation flags
+      {                                 // ~~~~~~~~~ CreateOrAttach ~~~~~~~~~
+        if (fd>=0)                      // Already open?
+          return {fd,0};                // Yes, return it with no error code.
+        if (nm==nullptr||strlen(nm)>=sizeof(name))// Bad name?
+          return {-1,EINVAL};           // Yes, error out.
+        int oflag=O_RDWR|O_CLOEXEC;     // Always read/write.
+        if (flags&IPC_CREAT)            // Create if missing?
+          oflag|=O_CREAT;               // Yes.
+        if (flags&IPC_EXCL)             // Fail if it exists?
+          oflag|=O_EXCL;                // Yes.
+        int f=shm_open(nm,oflag,mode);  // Open the segment.
+        if (f<0)                        // Error?
+          return {-1,errno};            // Yes, return error code.
+        struct stat st;                 // Current size.
+        if (fstat(f,&st)!=0)            // Could we get it?
+        {                               // No, so clean up.
+          int e=errno;                  // Save the reason.
+          close(f);                     // Drop the fd.
+          return {-1,e};                // Return error code.
+        }                               // Done with stat.
+        if ((size_t)st.st_size<size&&ftruncate(f,(off_t)size)!=0)
+        {                               // Could not grow it to size.
+          int e=errno;                  // Save the reason.
+          close(f);                     // Drop the fd.
+          return {-1,e};                // Return error code.
+        }                               // Done sizing.
+        fd=f;                           // Store the fd.
+        memsize=((size_t)st.st_size>size)?(size_t)st.st_size:size;// Store the size.
+        strcpy(name,nm);                // Remember the name for Remove().
+        owner=(flags&IPC_EXCL)?true:false;// Set owner flag
+        return {fd,0};                  // Return the fd with no error code
+      }                                 // ~~~~~~~~~ CreateOrAttach ~~~~~~~~~
+      // Create an anonymous memfd segment. It has no name to collide with and
+      // disappears with its last fd/mapping; share it with SendFd() or fork.
+      ShmResult CreateAnonymous (
+        const char* tag,                // Shows up in /proc/PID/fd (debugging only)
+        size_t size,                    // The size of the segment
+        bool sealable=true)             // Allow Seal() later
+      {                                 // ~~~~~~~~~ CreateAnonymous ~~~~~~~~~
+        if (fd>=0)                      // Already open?
+          return {fd,0};                // Yes, return it with no error code.
+        int f=memfd_create(tag?tag:"ipc",MFD_CLOEXEC|(sealable?MFD_ALLOW_SEALING:0));
+        if (f<0)                        // Error?
+          return {-1,errno};            // Yes, return error code.
+        if (ftruncate(f,(off_t)size)!=0)// Could we size it?
+        {                               // No, so clean up.
+          int e=errno;                  // Save the reason.
+          close(f);                     // Drop the fd.
+          return {-1,e};                // Return error code.
+        }                               // Done sizing.
+        fd=f;                           // Store the fd.
+        memsize=size;                   // Store the size.
+        name[0]='\0';                   // Nothing to unlink.
+        owner=true;                     // We made it.
+        return {fd,0};                  // Return the fd with no error code
+      }                                 // ~~~~~~~~~ CreateAnonymous ~~~~~~~~~
+      ShmResult Attach (
+        int prot=PROT_READ|PROT_WRITE)  // The mapping protection
+      {                                 // ~~~~~~~~~ Attach ~~~~~~~~~~~~~~
+        if (fd<0)                       // Nothing open?
+          return {-1,EINVAL};           // Yes, we cant attach. Error out.
+        if (memptr!=nullptr)            // Already mapped?
+          return {fd,0};                // Yes, nothing to do.
+        void* p=mmap(nullptr,memsize,prot,MAP_SHARED,fd,0);
+        if (p==MAP_FAILED)              // Error?
+          return {-1,errno};            // Yes, return error code
+        memptr=p;                       // Store the pointer
+        mapsize=memsize;                // Bytes actually mapped
+        return {fd,0};                  // Return success
+      }                                 // ~~~~~~~~~ Attach ~~~~~~~~~~~~~~
+      ShmResult Detach (void)
+      {                                 // ~~~~~~~~~ Detach ~~~~~~~~~~~~~~
+        if (memptr!=nullptr)            // Are we mapped?
+        {                               // Yes, so we will...
+          if (munmap(memptr,mapsize)!=0)// Try to unmap it
+            return {-1,errno};          // Error? Yes, return error code
+          memptr=nullptr;               // Clear the pointer
+          mapsize=0;                    // Nothing mapped
+        }                               // No, we have unmapped or were never mapped
+        return {0,0};                   // Return success
+      }                                 // ~~~~~~~~~ Detach ~~~~~~~~~~~~~~
+      // Remove the segment: unlink its name (if any) and close our fd.
+      ShmResult Remove (void)
+      {                               // ~~~~~~~~~ Remove ~~~~~~~~~~~~~~
+        if (fd<0)                     // Nothing open?
+          return {-1,EINVAL};         // Yes, we cant remove. Error out.
+        ShmResult r=MarkForRemoval(); // Drop the name.
+        Detach();                     // Drop our mapping.
+        Close();                      // Drop our fd.
+        return r;                     // Success or the unlink error
+      }                               // ~~~~~~~~~ Remove ~~~~~~~~~~~~~~
+      // Unlink the name; the memory lives on until the last fd/mapping goes.
+      ShmResult MarkForRemoval (void)
+      {                               // ~~~~~~~~~ MarkForRemoval ~~~~~~~~~~
+        if (fd<0)                     // Nothing open?
+          return {-1,EINVAL};         // Yes, we cant mark what we do not know.
+        if (name[0]!='\0')            // Do we have a name to drop?
+        {                             // Yes, so unlink it.
+          if (shm_unlink(name)!=0&&errno!=ENOENT)
+            return {-1,errno};        // Error? Yes, return error code
+          name[0]='\0';               // Done with the name.
+        }                             // memfds have no name to drop.
+        return {0,0};                 // Return success
+      }                               // ~~~~~~~~~ MarkForRemoval ~~~~~~~~~~
+      // Query size/perm/owner/etc.
+      ShmResult Stat (
+        struct stat* buf) const       // The buffer to fill with the info
+      {                               // ~~~~~~~~~ Stat ~~~~~~~~~~~~~~
+        if (fd<0)                     // Nothing open?
+          return {-1,EINVAL};         // Yes, we cant stat what we do not know.
+        if (fstat(fd,buf)!=0)         // Try to get the segment info
+          return {-1,errno};          // Error? Yes, return error code
+        return {0,0};                 // Return success
+      }                               // ~~~~~~~~~ Stat ~~~~~~~~~~~~~~ //
+      // Grow or shrink the segment and our mapping. The mapping may move, so
+      // re-read GetPointer() afterwards. Peers pick the new size up with Remap().
+      ShmResult Resize (
+        size_t size)                  // The new size
+      {                               // ~~~~~~~~~ Resize ~~~~~~~~~~~~~~
+        if (fd<0||size==0)            // Nothing open or nonsense size?
+          return {-1,EINVAL};         // Yes, error out.
+        if (ftruncate(fd,(off_t)size)!=0)// Resize the file (EPERM if sealed).
+          return {-1,errno};          // Error? Yes, return error code
+        memsize=size;                 // New size.
+        return Remap();               // Follow it with the mapping.
+      }                               // ~~~~~~~~~ Resize ~~~~~~~~~~~~~~
+      // Resize our mapping to the segment's current size (after a peer grew it).
+      ShmResult Remap (void)
+      {                               // ~~~~~~~~~ Remap ~~~~~~~~~~~~~~
+        struct stat st;               // Current size.
+        if (fd<0)                     // Nothing open?
+          return {-1,EINVAL};         // Yes, error out.
+        if (fstat(fd,&st)!=0)         // Get the size.
+          return {-1,errno};          // Error? Yes, return error code
+        memsize=(size_t)st.st_size;   // Size of the segment now.
+        if (memptr==nullptr||mapsize==memsize)// Not mapped or already right?
+          return {fd,0};              // Yes, nothing to move.
+        void* p=mremap(memptr,mapsize,memsize,MREMAP_MAYMOVE);
+        if (p==MAP_FAILED)            // Error?
+          return {-1,errno};          // Yes, the old mapping is still intact.
+        memptr=p;                     // Possibly moved.
+        mapsize=memsize;              // Bytes mapped now.
+        return {fd,0};                // Return success
+      }                               // ~~~~~~~~~ Remap ~~~~~~~~~~~~~~
+      // Add seals (F_SEAL_SHRINK|F_SEAL_GROW|F_SEAL_WRITE|F_SEAL_SEAL). Only for
+      // memfds created sealable; F_SEAL_WRITE fails with EBUSY while any
+      // writable shared mapping exists, so Detach() first.
+      ShmResult Seal (
+        int seals)                    // Seals to add
+      {                               // ~~~~~~~~~ Seal ~~~~~~~~~~~~~~
+        if (fd<0)                     // Nothing open?
+          return {-1,EINVAL};         // Yes, error out.
+        if (fcntl(fd,F_ADD_SEALS,seals)!=0)// Add them.
+          return {-1,errno};          // Error? Yes, return error code
+        return {0,0};                 // Return success
+      }                               // ~~~~~~~~~ Seal ~~~~~~~~~~~~~~
+      // Seals currently on the segment (in code).
+      ShmResult GetSeals (void) const
+      {                               // ~~~~~~~~~ GetSeals ~~~~~~~~~~~~~~
+        if (fd<0)                     // Nothing open?
+          return {-1,EINVAL};         // Yes, error out.
+        int s=fcntl(fd,F_GET_SEALS);  // Ask.
+        if (s<0)                      // Error?
+          return {-1,errno};          // Yes, return error code
+        return {s,0};                 // The seals.
+      }                               // ~~~~~~~~~ GetSeals ~~~~~~~~~~~~~~
+      // Pass our fd (and the segment size) over a connected UNIX socket.
+      ShmResult SendFd (
+        int sock) const               // Connected AF_UNIX socket
+      {                               // ~~~~~~~~~ SendFd ~~~~~~~~~~~~~~
+        if (fd<0)                     // Nothing open?
+          return {-1,EINVAL};         // Yes, nothing to send.
+        uint64_t sz=memsize;          // Payload: the size.
+        struct iovec iov={&sz,sizeof(sz)};
+        union { char buf[CMSG_SPACE(sizeof(int))]; struct cmsghdr align; } ctl;
+        memset(&ctl,0,sizeof(ctl));   // Clean control buffer.
+        struct msghdr msg;            // The message.
+        memset(&msg,0,sizeof(msg));   // Clean message.
+        msg.msg_iov=&iov;             // One iovec...
+        msg.msg_iovlen=1;             // ...with the size.
+        msg.msg_control=ctl.buf;      // Control buffer...
+        msg.msg_controllen=sizeof(ctl.buf);// ...with room for one fd.
+        struct cmsghdr* c=CMSG_FIRSTHDR(&msg);
+        c->cmsg_level=SOL_SOCKET;     // Socket level...
+        c->cmsg_type=SCM_RIGHTS;      // ...fd passing.
+        c->cmsg_len=CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(c),&fd,sizeof(int));
+        ssize_t n;                    // Bytes sent.
+        do                            // Retry if a signal interrupts us.
+          n=sendmsg(sock,&msg,MSG_NOSIGNAL);
+        while (n<0&&errno==EINTR);    // Done sending.
+        if (n<0)                      // Error?
+          return {-1,errno};          // Yes, return error code
+        return {0,0};                 // Return success
+      }                               // ~~~~~~~~~ SendFd ~~~~~~~~~~~~~~
+      // Receive a segment fd sent with SendFd() and adopt it (not as owner).
+      ShmResult ReceiveFd (
+        int sock)                     // Connected AF_UNIX socket
+      {                               // ~~~~~~~~~ ReceiveFd ~~~~~~~~~~~~~~
+        if (fd>=0)                    // Already holding a segment?
+          return {-1,EBUSY};          // Yes, refuse to leak it.
+        uint64_t sz=0;                // Payload: the size.
+        struct iovec iov={&sz,sizeof(sz)};
+        union { char buf[CMSG_SPACE(sizeof(int))]; struct cmsghdr align; } ctl;
+        struct msghdr msg;            // The message.
+        memset(&msg,0,sizeof(msg));   // Clean message.
+        msg.msg_iov=&iov;             // One iovec...
+        msg.msg_iovlen=1;             // ...for the size.
+        msg.msg_control=ctl.buf;      // Control buffer...
+        msg.msg_controllen=sizeof(ctl.buf);// ...with room for one fd.
+        ssize_t n;                    // Bytes received.
+        do                            // Retry if a signal interrupts us.
+          n=recvmsg(sock,&msg,MSG_CMSG_CLOEXEC);
+        while (n<0&&errno==EINTR);    // Done receiving.
+        if (n<0)                      // Error?
+          return {-1,errno};          // Yes, return error code
+        struct cmsghdr* c=CMSG_FIRSTHDR(&msg);
+        if (n!=(ssize_t)sizeof(sz)||(msg.msg_flags&MSG_CTRUNC)!=0||c==nullptr||
+          c->cmsg_level!=SOL_SOCKET||c->cmsg_type!=SCM_RIGHTS||
+          c->cmsg_len!=CMSG_LEN(sizeof(int)))
+        {                             // Not one of our messages...
+          CloseFds(&msg);             // ...but any fds in it are ours now.
+          return {-1,EPROTO};         // Refuse it.
+        }                             // Done rejecting.
+        memcpy(&fd,CMSG_DATA(c),sizeof(int));// Adopt the fd.
+        memsize=(size_t)sz;           // Sender's size...
+        name[0]='\0';                 // No name to unlink.
+        owner=false;                  // The sender owns it.
+        return Remap();               // ...corrected by fstat.
+      }                               // ~~~~~~~~~ ReceiveFd ~~~~~~~~~~~~~~
+      // Accessors
+      void* GetPointer (void) const { return memptr; }
+      size_t GetShmSize (void) const { return memsize; }
+      int GetFd (void) const { return fd; }
+      const char* GetName (void) const { return name; }
+      bool IsOwner (void) const { return owner; }
+    private:
+      // Close every fd an SCM_RIGHTS message installed in this process.
+      static void CloseFds (
+        struct msghdr* msg)           // Message received
+      {                               // ~~~~~~~~~ CloseFds ~~~~~~~~~~~~~~
+        for (struct cmsghdr* c=CMSG_FIRSTHDR(msg);c!=nullptr;c=CMSG_NXTHDR(msg,c))
+        {
+          if (c->cmsg_level!=SOL_SOCKET||c->cmsg_type!=SCM_RIGHTS)
+            continue;                 // Not fds.
+          size_t k=(c->cmsg_len-CMSG_LEN(0))/sizeof(int);// Fds it carries.
+          for (size_t i=0;i<k;i++)    // Every one...
+          {
+            int f;                    // ...copied out (CMSG_DATA may be unaligned)...
+            memcpy(&f,CMSG_DATA(c)+i*sizeof(int),sizeof(int));
+            close(f);                 // ...and closed.
+          }                           // Done with this header.
+        }                             // Done with the message.
+      }                               // ~~~~~~~~~ CloseFds ~~~~~~~~~~~~~~
+      // Steal o's fd and mapping and leave it closed, so its destructor does nothing.
+      void Take (
+        PosixSharedMemory& o)         // Object to move from
+      {                               // ~~~~~~~~~ Take ~~~~~~~~~~~~~~
+        fd=o.fd;                      // The segment...
+        memptr=o.memptr;              // ...its mapping...
+        memsize=o.memsize;            // ...size...
+        mapsize=o.mapsize;            // ...mapped bytes...
+        owner=o.owner;                // ...and who removes it.
+        memcpy(name,o.name,sizeof(name));// Name to unlink.
+        o.fd=-1;                      // Close the source...
+        o.memptr=nullptr;             // ...without unmapping...
+        o.memsize=0;                  // ...or unlinking...
+        o.mapsize=0;                  // ...what is ours now.
+        o.owner=false;                // Not the owner any more.
+        o.name[0]='\0';               // No name.
+      }                               // ~~~~~~~~~ Take ~~~~~~~~~~~~~~
+      void Close (void)
+      {                               // ~~~~~~~~~ Close ~~~~~~~~~~~~~~
+        if (fd>=0)                    // Anything open?
+          close(fd);                  // Yes, close it.
+        fd=-1;                        // Clear the fd.
+        memsize=0;                    // Clear the size
+        owner=false;                  // Clear the owner flag
+      }                               // ~~~~~~~~~ Close ~~~~~~~~~~~~~~
+      int fd{-1};                     // Segment file descriptor
+      void* memptr{nullptr};          // Pointer to the memory region
+      size_t memsize{0};              // Size of the segment
+      size_t mapsize{0};              // Bytes currently mapped at memptr
+      bool owner{false};              // True if this instance created the segment
+      char name[NAME_MAX+1]{};        // shm_open() name, empty for memfds
+  };
+}
@@ -15,11 +15,21 @@
 #include <sys/ipc.h>
 #include <sys/shm.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <stdint.h>
 #include <stddef.h>
 #include <errno.h>
 #include <string.h> // memset
+#ifndef SHM_HUGE_SHIFT
+#define SHM_HUGE_SHIFT 26               // Older headers: log2(page size) lives here in shmflg
+#endif
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22           // Linux 5.14+, older headers do not know it
+#endif
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23          // Linux 5.14+, older headers do not know it
+#endif
 
 namespace ipc
 {
@@ -30,17 +40,40 @@ namespace ipc
     int errn;                           // errn=errno snapshot
   };                                    // ShmResult
   // Access flags
-  enum
+  enum ShmPerms
   {
     SHM_PERM_600=0600,                  // user read/write
     SHM_PERM_644=0644                   // user read/write, group/others read
-  } SHM_PERMS;                          // Permission flags
+  };                                    // Permission flags
   // Mode flags
-  enum
+  enum ShmModes
   {
     SHM_CREATE=IPC_CREAT,               // create if key does not exist
     SHM_EXCL=IPC_EXCL                   // fail if key exists
-  } SHM_MODES;                          // Creation flags
+  };                                    // Creation flags
+  // Page size to back the segment with (value is log2 of the size)
+  enum ShmPageSize
+  {
+    SHM_PAGE_DEFAULT=0,                 // Normal pages
+    SHM_PAGE_2MB=21,                    // SHM_HUGETLB|SHM_HUGE_2MB
+    SHM_PAGE_1GB=30                     // SHM_HUGETLB|SHM_HUGE_1GB
+  };                                    // ShmPageSize
+  // How to fault the pages in before first use
+  enum ShmPrefault
+  {
+    SHM_PREFAULT_NONE=0,                // Fault lazily on first touch
+    SHM_PREFAULT_TOUCH=1,               // Touch one byte per page after attach
+    SHM_PREFAULT_POPULATE=2             // MADV_POPULATE_WRITE (_READ if read-only), touch if unsupported
+  };                                    // ShmPrefault
+  // Placement policy applied by CreateOrAttach()/Attach()
+  struct ShmPolicy
+  {
+    int pagesize{SHM_PAGE_DEFAULT};     // ShmPageSize
+    bool fallback{true};                // Use normal (THP-advised) pages if huge pages are unavailable
+    bool lock{false};                   // SHM_LOCK the segment in RAM
+    int prefault{SHM_PREFAULT_NONE};    // ShmPrefault
+    bool dontfork{false};               // MADV_DONTFORK: children do not inherit the mapping
+  };                                    // ShmPolicy
   // Key maker (blacksmith ftok wrapper)
   inline key_t MakeKey(
     const char* path,                   // The path to the file
@@ -53,6 +86,21 @@ namespace ipc
   {
     public:
       SharedMemory (void)=default;
+      SharedMemory (const SharedMemory&)=delete;// A copy would detach/remove twice.
+      SharedMemory& operator= (const SharedMemory&)=delete;
+      // Moving hands the attachment (and ownership) over without another shmat().
+      SharedMemory (SharedMemory&& o) noexcept { Take(o); }
+      SharedMemory& operator= (SharedMemory&& o) noexcept
+      {
+        if (this!=&o)                   // Not ourselves?
+        {                               // No, drop what we hold first.
+          Detach();
+          if(owner)
+            Remove();
+          Take(o);                      // Then steal theirs.
+        }                               // Done moving.
+        return *this;
+      }
       ~SharedMemory (void)
       {
         Detach();
@@ -77,6 +125,60 @@ namespace ipc
         owner=(flags&IPC_EXCL)?true:false;// Set owner flag
         return {shmid,0};               // Return the ID with no error code
       }                                 // ~~~~~~~~~ CreateOrAttach ~~~~~~~~~
+      // Create or attach with a page size/locking/prefault policy. The size is
+      // rounded up to a whole number of huge pages. If the kernel has no huge
+      // pages to give (ENOMEM/EINVAL/EPERM) and pol.fallback is set, the segment
+      // is created with normal pages instead; IsHugePageBacked() tells which.
+      ShmResult CreateOrAttach (
+        key_t key,                      // The key for the segment
+        size_t size,                    // The size of the segment
+        const ShmPolicy& pol,           // Page size/lock/prefault policy
+        int mode=SHM_PERM_600,          // The access mode
+        int flags=SHM_CREATE)           // The creation flags
+      {                                 // ~~~~~~~~~ CreateOrAttach ~~~~~~~~~
+        if (shmid>=0)                   // ID already initialized?
+          return {shmid,0};             // yes, return it with no error code.
+        policy=pol;                     // Remember it for Attach().
+        if (pol.pagesize!=SHM_PAGE_DEFAULT)// Asked for huge pages?
+        {                               // Yes, so try them first.
+          size_t hp=(size_t)1<<pol.pagesize;// Huge page size.
+          size_t sz=(size+hp-1)&~(hp-1);// Whole huge pages only.
+          int id=shmget(key,sz,mode|flags|SHM_HUGETLB|(pol.pagesize<<SHM_HUGE_SHIFT));
+          if (id>=0)                    // Did we get them?
+          {                             // Yes, so record it.
+            shmid=id;                   // Store the ID.
+            memsize=sz;                 // Store the (rounded) size.
+            pagesize=hp;                // Backed by huge pages.
+            owner=(flags&IPC_EXCL)?true:false;// Set owner flag
+            return {shmid,0};           // Return the ID with no error code
+          }                             // Done with huge page success.
+          int err=errno;                // Why did it fail?
+          if (!pol.fallback||(err!=ENOMEM&&err!=EINVAL&&err!=EPERM))
+            return {-1,err};            // Not a "no huge pages" error, or no fallback.
+        }                               // Done trying huge pages.
+        ShmResult r=CreateOrAttach(key,size,mode,flags);// Normal pages.
+        if (r.code>=0)                  // Did that work?
+          pagesize=(size_t)sysconf(_SC_PAGESIZE);// Yes, normal page size.
+        return r;                       // Return the ID or error
+      }                                 // ~~~~~~~~~ CreateOrAttach ~~~~~~~~~
+      // Take over an existing segment by ID (e.g. one found in a ShmRegistry)
+      // instead of a key. The size comes from the kernel. With own set the
+      // destructor removes the segment, as for one we created.
+      ShmResult Adopt (
+        int id,                         // The segment ID
+        bool own=false)                 // Remove it when we go away?
+      {                                 // ~~~~~~~~~ Adopt ~~~~~~~~~
+        if (shmid>=0)                   // Already bound to a segment?
+          return {-1,EBUSY};            // Yes, one at a time.
+        struct shmid_ds ds;             // Kernel's view of it.
+        if (shmctl(id,IPC_STAT,&ds)!=0) // Does it exist (and may we see it)?
+          return {-1,errno};            // No, return error code
+        shmid=id;                       // Store the ID.
+        memsize=ds.shm_segsz;           // Store the size.
+        owner=own;                      // Set owner flag
+        pagesize=(size_t)sysconf(_SC_PAGESIZE);// Unknown, assume normal pages.
+        return {shmid,0};               // Return the ID with no error code
+      }                                 // ~~~~~~~~~ Adopt ~~~~~~~~~
       ShmResult Attach (
         int shmatt=0)                   // The attach flags
       {                                 // ~~~~~~~~~ Attach ~~~~~~~~~~~~~~
@@ -86,7 +188,7 @@ namespace ipc
         if (p==(void*)-1)               // Error?
           return {-1,errno};            // Yes, return error code
         memptr=p;                       // Store the pointer
-        return {shmid,0};               // Return success
+        return {shmid,ApplyPolicy(shmatt)};// Mapped; errn is any policy step that failed
       }                                 // ~~~~~~~~~ Attach ~~~~~~~~~~~~~~
       ShmResult Detach (void)
       {                                 // ~~~~~~~~~ Detach ~~~~~~~~~~~~~~
@@ -109,6 +211,8 @@ namespace ipc
         memptr=nullptr;               // Clear the pointer
         memsize=0;                    // Clear the size
         owner=false;                  // Clear the owner flag
+        pagesize=0;                   // Clear the page size
+        locked=false;                 // The lock went with the segment
         return {0,0};                 // Return success
       }                               // ~~~~~~~~~ Remove ~~~~~~~~~~~~~~
       // Mark for removal (segment removed when last detach happens)
@@ -120,6 +224,24 @@ namespace ipc
           return {-1,errno};          // Error? Yes, return error code
         return {0,0};                 // Return success
       }                               // ~~~~~~~~~ MarkForRemoval ~~~~~~~~~~
+      // System V segments have a fixed size; kept for parity with the POSIX
+      // backend so generic code (Mapping<T>) can try and fall back.
+      ShmResult Resize (
+        size_t size)                  // The new size
+      {                               // ~~~~~~~~~ Resize ~~~~~~~~~~~~~~
+        if (shmid<0||size==0)         // Nothing bound or nonsense size?
+          return {-1,EINVAL};         // Yes, error out.
+        if (size==memsize)            // Already that size?
+          return {shmid,0};           // Yes, nothing to do.
+        return {-1,ENOTSUP};          // shmget() sizes are final.
+      }                               // ~~~~~~~~~ Resize ~~~~~~~~~~~~~~
+      // Nothing to follow: the size cannot change under us.
+      ShmResult Remap (void)
+      {                               // ~~~~~~~~~ Remap ~~~~~~~~~~~~~~
+        if (shmid<0)                  // Nothing bound?
+          return {-1,EINVAL};         // Yes, error out.
+        return {shmid,0};             // Mapping is already right.
+      }                               // ~~~~~~~~~ Remap ~~~~~~~~~~~~~~
       // Query size/perm/owner/etc.
       ShmResult Stat (
         struct shmid_ds* buf) const   // The buffer to fill with the info
@@ -135,10 +257,95 @@ namespace ipc
       size_t GetShmSize (void) const { return memsize; }
       int GetShmId (void) const { return shmid; }
       bool IsOwner (void) const { return owner; }
+      bool IsHugePageBacked (void) const { return pagesize>(size_t)sysconf(_SC_PAGESIZE); }
+      bool IsLocked (void) const { return locked; }
+      const ShmPolicy& GetPolicy (void) const { return policy; }
     private:
+      // Steal o's segment and leave it unbound, so its destructor does nothing.
+      void Take (
+        SharedMemory& o)              // Object to move from
+      {                               // ~~~~~~~~~ Take ~~~~~~~~~~~~~~
+        shmid=o.shmid;                // The segment...
+        memptr=o.memptr;              // ...its mapping...
+        memsize=o.memsize;            // ...size...
+        owner=o.owner;                // ...and who removes it.
+        policy=o.policy;              // Policy in force.
+        pagesize=o.pagesize;          // Backing page size.
+        locked=o.locked;              // SHM_LOCK state.
+        o.shmid=-1;                   // Unbind the source...
+        o.memptr=nullptr;             // ...so it neither detaches...
+        o.memsize=0;                  // ...nor removes...
+        o.owner=false;                // ...what is ours now.
+        o.pagesize=0;                 // No backing.
+        o.locked=false;               // Not locked.
+      }                               // ~~~~~~~~~ Take ~~~~~~~~~~~~~~
+      // Does this kernel have MADV_POPULATE_READ/WRITE (both came in 5.14)?
+      // Asked once, on a scratch page, so a failure on a real mapping is
+      // never mistaken for an old kernel.
+      static bool CanPopulate (void)
+      {                               // ~~~~~~~~~ CanPopulate ~~~~~~~~~~
+        static const bool yes=[]    // Thread-safe one-time probe.
+        {
+          size_t ps=(size_t)sysconf(_SC_PAGESIZE);// One page...
+          void* p=mmap(nullptr,ps,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+          if (p==MAP_FAILED)          // ...if we can get one.
+            return false;             // No, touch by hand to be safe.
+          bool ok=madvise(p,ps,MADV_POPULATE_WRITE)==0;// Known advice?
+          munmap(p,ps);               // Done with the page.
+          return ok;                  // Supported or not.
+        }();
+        return yes;                   // Probed once.
+      }                               // ~~~~~~~~~ CanPopulate ~~~~~~~~~~
+      // Apply the lock/prefault/dontfork parts of the policy to the fresh
+      // mapping. Every step is attempted; returns the errno of the first
+      // one that failed or 0. The mapping stays usable either way. A
+      // read-only attach (SHM_RDONLY) is prefaulted by reading, never writing.
+      int ApplyPolicy (
+        int shmatt)                   // The flags it was attached with
+      {                               // ~~~~~~~~~ ApplyPolicy ~~~~~~~~~~
+        int err=0;                    // First failure.
+        size_t ps=pagesize?pagesize:(size_t)sysconf(_SC_PAGESIZE);
+        size_t len=(memsize+ps-1)&~(ps-1);// Whole pages of the mapping.
+        if (policy.pagesize!=SHM_PAGE_DEFAULT&&!IsHugePageBacked())
+          (void)madvise(memptr,len,MADV_HUGEPAGE);// Fallback: ask for THP (best effort).
+        if (policy.lock&&!locked)     // Pin it in RAM?
+        {                             // Yes, lock the whole segment.
+          if (shmctl(shmid,SHM_LOCK,nullptr)==0)// Did that work?
+            locked=true;              // Yes, remember it.
+          else if (err==0)            // No, is it the first failure?
+            err=errno;                // Yes, report it (EPERM without CAP_IPC_LOCK).
+        }                             // Done locking.
+        if (policy.dontfork)          // Keep it out of our children?
+          if (madvise(memptr,len,MADV_DONTFORK)!=0&&err==0)
+            err=errno;                // Report the first failure.
+        bool rdonly=(shmatt&SHM_RDONLY)!=0;// May we write to it?
+        if (policy.prefault==SHM_PREFAULT_POPULATE&&CanPopulate())// Let the kernel do it?
+        {                             // Yes, one call maps every page.
+          if (madvise(memptr,len,rdonly?MADV_POPULATE_READ:MADV_POPULATE_WRITE)!=0&&err==0)
+            err=errno;                // Report the first failure.
+          return err;                 // Touching would fail the same way.
+        }                             // Done with populate.
+        if (policy.prefault!=SHM_PREFAULT_NONE&&rdonly)// Read the pages in ourselves?
+        {                             // Yes, one read per page.
+          const volatile char* p=static_cast<const volatile char*>(memptr);
+          for (size_t off=0;off<memsize;off+=ps)// For each page...
+            (void)p[off];             // ...fault it in.
+        }                             // Done reading.
+        else if (policy.prefault!=SHM_PREFAULT_NONE)// Touch the pages ourselves?
+        {                             // Yes, an atomic add of zero per page writes
+          char* p=static_cast<char*>(memptr);// without clobbering a peer's data.
+          for (size_t off=0;off<memsize;off+=ps)// For each page...
+            __atomic_fetch_add(p+off,(char)0,__ATOMIC_RELAXED);
+        }                             // Done touching.
+        return err;                   // First failure or 0.
+      }                               // ~~~~~~~~~ ApplyPolicy ~~~~~~~~~~
+
       int shmid{-1};                  // Shared memory ID
       void* memptr{nullptr};          // Pointer to the memory region
       size_t memsize{0};              // Size of the memory region
       bool owner{false};              // True if this instance created the segment
+      ShmPolicy policy{};             // Page size/lock/prefault policy
+      size_t pagesize{0};             // Page size actually backing the segment
+      bool locked{false};             // True once SHM_LOCK succeeded
   };
 }
\ No newline at end of file
@@ -0,0 +1,408 @@
+ /*
+ * *
+ * * Filename: ShmArena.hpp
+ * *
+ * * Description:
+ * *   Variable-size allocator that carves objects out of a shared memory segment. Sizes
+ * *     are rounded to one of 60 size classes (16-byte steps up to 128 bytes, then four
+ * *     classes per power of two up to 1MB). Each class keeps a lock-free free list in the
+ * *     segment (a Treiber stack whose head carries an ABA tag); fresh blocks are bumped
+ * *     off the end of the heap. All links are offsets from the arena, so every process
+ * *     can allocate and free no matter where it attached the segment.
+ * *
+ * *   ShmArena::Magazine is an optional process-local front end that caches a handful
+ * *     of blocks per class and moves them to/from the shared lists in chains, so the
+ * *     steady state costs one CAS per batch instead of one per call.
+ * *
+ * *   ShmAllocator<T> is a C++ allocator whose pointer type is offset_ptr<T>, so a
+ * *     container built in the arena that stores allocator_traits::pointer (std::vector,
+ * *     or map-style containers such as Boost.Container's) keeps position-independent
+ * *     pointers and can be used from every process. libstdc++'s std::map/std::list
+ * *     store raw node pointers and its std::basic_string rejects fancy pointers; those
+ * *     are only safe when every process maps the segment at the same address.
+ * *
+ * *   Usage:
+ * *     ipc::ShmArena* a=nullptr;
+ * *     ipc::ShmArena::Open(shm,&a);
+ * *     typedef std::vector<int,ipc::ShmAllocator<int>> Vec;
+ * *     Vec* v=new (a->Allocate(sizeof(Vec))) Vec(ipc::ShmAllocator<int>(a));
+ * *     a->SetRoot(0,v);                   // Peers find it with a->GetRoot(0)
+ * *
+ * *  Author:
+ * *    JEP  J. Enrique Peraza
+ * *
+ */
+#pragma once
+#include <atomic>
+#include <new>
+#include <cassert>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include "ShmLayout.hpp"
+#include "ShmOffsetPtr.hpp"
+
+namespace ipc
+{
+  class ShmArena
+  {
+    public:
+      static constexpr uint16_t kVersion=1;// Bump when the layout below changes.
+      static constexpr int kClasses=60; // Number of size classes.
+      static constexpr size_t kMaxAlloc=(size_t)1<<20;// Largest block we hand out.
+      static constexpr int kRoots=8;    // Well-known root slots.
+      static constexpr size_t kHeader=16;// Block header (keeps payloads 16-aligned).
+      // Size class of an n-byte request (n<=kMaxAlloc).
+      static int ClassOf (
+        size_t n)                       // Bytes requested
+      {                                 // ~~~~~~~~~ ClassOf ~~~~~~~~~
+        if (n<=128)                     // Small sizes?
+          return (n==0)?0:(int)((n+15)/16-1);// 16-byte steps.
+        int p=63-__builtin_clzll((unsigned long long)(n-1));// n in (2^p,2^(p+1)].
+        size_t step=(size_t)1<<(p-2);   // Four classes per doubling.
+        int sub=(int)((n-1-((size_t)1<<p))/step);
+        return 8+(p-7)*4+sub;           // Class index.
+      }                                 // ~~~~~~~~~ ClassOf ~~~~~~~~~
+      // Payload size of class c.
+      static size_t ClassSize (
+        int c)                          // Class index
+      {                                 // ~~~~~~~~~ ClassSize ~~~~~~~~~
+        if (c<8)                        // Small class?
+          return (size_t)(c+1)*16;      // 16-byte steps.
+        int p=7+(c-8)/4;                // The power of two below it.
+        size_t step=(size_t)1<<(p-2);   // Spacing at that power.
+        return ((size_t)1<<p)+(size_t)((c-8)%4+1)*step;
+      }                                 // ~~~~~~~~~ ClassSize ~~~~~~~~~
+      // Format a fresh region or validate one formatted by another process.
+      // The arena manages the whole region, so every process must pass the
+      // same length (normally the segment size).
+      static ShmResult Open (
+        void* mem,                      // Start of the region (cache line aligned)
+        size_t len,                     // Bytes available
+        ShmArena** out)                 // Where to return the arena
+      {                                 // ~~~~~~~~~ Open ~~~~~~~~~
+        if (out==nullptr)               // Nowhere to put the result?
+          return {-1,EINVAL};           // Yes, error out.
+        *out=nullptr;                   // Nothing yet.
+        if (len<sizeof(ShmArena)+kHeader+16)// Room for at least one block?
+          return {-1,EINVAL};           // No, too small.
+        if (len>((uint64_t)1<<kOffBits))// Beyond what a tagged offset can name?
+          return {-1,EFBIG};            // Yes, too large.
+        ShmResult r=ShmLayoutClaim(mem,len,Spec(len));
+        if (r.code<0)                   // Bad region or layout?
+          return r;                     // Yes, pass the error along.
+        ShmArena* a=static_cast<ShmArena*>(mem);
+        if (r.code==1)                  // Are we the formatter?
+        {                               // Yes, so set up an empty heap.
+          a->brk.store(sizeof(ShmArena),std::memory_order_relaxed);
+          a->limit=len;                 // End of the heap.
+          for (int i=0;i<kClasses;i++)  // Every free list...
+            a->freelist[i].store(0,std::memory_order_relaxed);// ...starts empty.
+          for (int i=0;i<kRoots;i++)    // Every root...
+            a->roots[i].store(0,std::memory_order_relaxed);// ...starts null.
+          ShmLayoutPublish(mem);        // Let everybody else in.
+        }                               // Done formatting.
+        *out=a;                         // Hand back the arena.
+        return {0,0};                   // Success.
+      }                                 // ~~~~~~~~~ Open ~~~~~~~~~
+      // Convenience overload for an attached segment.
+      template<typename Seg>
+      static ShmResult Open (
+        Seg& seg,                       // An attached segment
+        ShmArena** out)                 // Where to return the arena
+      {                                 // ~~~~~~~~~ Open ~~~~~~~~~
+        if (seg.GetPointer()==nullptr)  // Not attached?
+          return {-1,EINVAL};           // Yes, nothing to open.
+        return Open(seg.GetPointer(),seg.GetShmSize(),out);
+      }                                 // ~~~~~~~~~ Open ~~~~~~~~~
+      // Allocate n bytes (16-byte aligned). Returns nullptr when the arena is
+      // exhausted or n>kMaxAlloc.
+      void* Allocate (
+        size_t n)                       // Bytes requested
+      {                                 // ~~~~~~~~~ Allocate ~~~~~~~~~
+        if (n>kMaxAlloc)                // Too big for any class?
+          return nullptr;               // Yes, refuse.
+        int c=ClassOf(n);               // Its class.
+        uint64_t b=PopList(c);          // Recycle a freed block...
+        if (b==0)                       // ...if there was one.
+          b=Bump(c,1);                  // Otherwise carve a new one.
+        return (b==0)?nullptr:Payload(b);// Null when exhausted.
+      }                                 // ~~~~~~~~~ Allocate ~~~~~~~~~
+      // Return a block obtained from Allocate() (any process may free it).
+      void Deallocate (
+        void* p)                        // The payload pointer (nullptr is ignored)
+      {                                 // ~~~~~~~~~ Deallocate ~~~~~~~~~
+        if (p==nullptr)                 // Nothing to free?
+          return;                       // Yes, done.
+        uint64_t b=BlockOf(p);          // Its block offset.
+        assert(HeaderAt(b)->magic==kBlockMagic);// Not one of ours?
+        PushChain(HeaderAt(b)->cls,b,b);// Back onto its class list.
+      }                                 // ~~~~~~~~~ Deallocate ~~~~~~~~~
+      // Usable size of a block obtained from Allocate().
+      size_t UsableSize (
+        const void* p) const            // The payload pointer
+      {                                 // ~~~~~~~~~ UsableSize ~~~~~~~~~
+        return ClassSize(HeaderAt(BlockOf(p))->cls);
+      }                                 // ~~~~~~~~~ UsableSize ~~~~~~~~~
+      // Publish/find well-known objects (e.g. a container) by slot.
+      bool SetRoot (
+        int i,                          // Root slot [0,kRoots)
+        const void* p)                  // Object inside the arena or nullptr
+      {                                 // ~~~~~~~~~ SetRoot ~~~~~~~~~
+        if (i<0||i>=kRoots)             // Bad slot?
+          return false;                 // Yes, refuse.
+        roots[i].store(p?ToOffset(p):0,std::memory_order_release);
+        return true;                    // Published.
+      }                                 // ~~~~~~~~~ SetRoot ~~~~~~~~~
+      void* GetRoot (
+        int i) const                    // Root slot [0,kRoots)
+      {                                 // ~~~~~~~~~ GetRoot ~~~~~~~~~
+        if (i<0||i>=kRoots)             // Bad slot?
+          return nullptr;               // Yes, nothing there.
+        uint64_t o=roots[i].load(std::memory_order_acquire);
+        return o?FromOffset(o):nullptr; // Address in this process.
+      }                                 // ~~~~~~~~~ GetRoot ~~~~~~~~~
+      // Offset <-> address translation for this process.
+      uint64_t ToOffset (const void* p) const { return (uint64_t)((const char*)p-(const char*)this); }
+      void* FromOffset (uint64_t o) const { return (char*)const_cast<ShmArena*>(this)+o; }
+      // Bytes carved off the heap so far (live + free-listed).
+      size_t BytesCarved (void) const { return brk.load(std::memory_order_relaxed)-sizeof(ShmArena); }
+      size_t Capacity (void) const { return limit-sizeof(ShmArena); }
+      // Process-local block cache. Create one per thread (it is not thread
+      // safe) and use it instead of the arena on hot paths. A Magazine that
+      // crosses a fork() is emptied without returning its blocks, which
+      // would otherwise be handed out twice; those few blocks are leaked.
+      class Magazine
+      {
+        public:
+          static constexpr int kDepth=32;// Blocks cached per class.
+          explicit Magazine (ShmArena* a) : arena(a),pid(getpid()) { memset(count,0,sizeof(count)); }
+          Magazine (const Magazine&)=delete;
+          Magazine& operator= (const Magazine&)=delete;
+          ~Magazine (void) { Flush(); }
+          void* Allocate (
+            size_t n)                   // Bytes requested
+          {                             // ~~~~~~~~~ Allocate ~~~~~~~~~
+            if (n>kMaxAlloc)            // Too big for any class?
+              return nullptr;           // Yes, refuse.
+            CheckFork();                // Drop blocks inherited from a parent.
+            int c=ClassOf(n);           // Its class.
+            if (count[c]==0)            // Nothing cached?
+              Refill(c);                // Grab a batch.
+            if (count[c]==0)            // Still nothing?
+              return nullptr;           // The arena is exhausted.
+            return arena->Payload(slots[c][--count[c]]);
+          }                             // ~~~~~~~~~ Allocate ~~~~~~~~~
+          void Deallocate (
+            void* p)                    // The payload pointer
+          {                             // ~~~~~~~~~ Deallocate ~~~~~~~~~
+            if (p==nullptr)             // Nothing to free?
+              return;                   // Yes, done.
+            CheckFork();                // Drop blocks inherited from a parent.
+            uint64_t b=arena->BlockOf(p);// Its block.
+            int c=arena->HeaderAt(b)->cls;// Its class.
+            if (count[c]==kDepth)       // Cache full?
+              Spill(c,kDepth/2);        // Give half back in one chain.
+            slots[c][count[c]++]=b;     // Keep it.
+          }                             // ~~~~~~~~~ Deallocate ~~~~~~~~~
+          // Return every cached block to the arena.
+          void Flush (void)
+          {                             // ~~~~~~~~~ Flush ~~~~~~~~~
+            CheckFork();                // Never return a parent's blocks.
+            for (int c=0;c<kClasses;c++)// For each class...
+              if (count[c]>0)           // ...with cached blocks...
+                Spill(c,count[c]);      // ...give them all back.
+          }                             // ~~~~~~~~~ Flush ~~~~~~~~~
+        private:
+          void CheckFork (void)
+          {                             // ~~~~~~~~~ CheckFork ~~~~~~~~~
+            pid_t me=getpid();          // Cached by glibc, cheap.
+            if (me!=pid)                // Were we copied by fork()?
+            {                           // Yes, the parent still owns these blocks.
+              memset(count,0,sizeof(count));// Forget them.
+              pid=me;                   // We are the owner now.
+            }                           // Done with fork check.
+          }                             // ~~~~~~~~~ CheckFork ~~~~~~~~~
+          void Refill (
+            int c)                      // Class to refill
+          {                             // ~~~~~~~~~ Refill ~~~~~~~~~
+            count[c]=arena->PopBatch(c,slots[c],kDepth/2);// Recycled blocks first.
+            if (count[c]==0)            // None?
+            {                           // Carve a run of fresh ones.
+              int k=kDepth/2;           // How many.
+              uint64_t b=0;             // First block of the run.
+              while (k>0&&(b=arena->Bump(c,k))==0)// Not enough room?
+                k/=2;                   // Try a shorter run.
+              size_t stride=kHeader+ClassSize(c);// Block stride.
+              for (int i=0;i<k;i++)     // Cache the run.
+                slots[c][count[c]++]=b+(uint64_t)i*stride;
+            }                           // Done carving.
+          }                             // ~~~~~~~~~ Refill ~~~~~~~~~
+          void Spill (
+            int c,                      // Class to spill
+            int n)                      // How many blocks
+          {                             // ~~~~~~~~~ Spill ~~~~~~~~~
+            uint64_t* s=&slots[c][count[c]-n];// The last n cached blocks.
+            for (int i=0;i+1<n;i++)     // Link them together...
+              arena->NextOf(s[i])->store(s[i+1],std::memory_order_relaxed);
+            arena->PushChain(c,s[0],s[n-1]);// ...and push the chain in one CAS.
+            count[c]-=n;                // Gone.
+          }                             // ~~~~~~~~~ Spill ~~~~~~~~~
+          ShmArena* arena;              // Arena we cache for
+          pid_t pid;                    // Process that owns the cached blocks
+          int count[kClasses];          // Cached blocks per class
+          uint64_t slots[kClasses][kDepth];// Cached block offsets
+      };                                // Magazine
+    private:
+      ShmArena (void)=delete;           // Only ever placed on top of a segment.
+      static constexpr int kOffBits=40; // Offset bits in a tagged list head.
+      static constexpr uint64_t kOffMask=((uint64_t)1<<kOffBits)-1;
+      struct BlockHeader
+      {
+        uint32_t cls;                   // Size class
+        uint32_t magic;                 // kBlockMagic, asserted on free
+        uint64_t pad;                   // Keeps the payload 16-aligned
+      };                                // BlockHeader
+      static_assert(sizeof(BlockHeader)==kHeader,"block header size");
+      static constexpr uint32_t kBlockMagic=0xa110c8edu;
+      static ShmLayoutSpec Spec (
+        size_t len)                     // Bytes managed
+      {                                 // ~~~~~~~~~ Spec ~~~~~~~~~
+        return {SHM_KIND_ARENA,kVersion,0,(uint64_t)len,(uint64_t)len};
+      }                                 // ~~~~~~~~~ Spec ~~~~~~~~~
+      BlockHeader* HeaderAt (uint64_t b) const { return static_cast<BlockHeader*>(FromOffset(b)); }
+      std::atomic<uint64_t>* NextOf (uint64_t b) const { return static_cast<std::atomic<uint64_t>*>(FromOffset(b+kHeader)); }
+      void* Payload (uint64_t b) const { return FromOffset(b+kHeader); }
+      uint64_t BlockOf (const void* p) const { return ToOffset(p)-kHeader; }
+      // Carve n consecutive blocks of class c off the heap. Returns the first
+      // block's offset, or 0 if they do not fit.
+      uint64_t Bump (
+        int c,                          // Size class
+        int n)                          // Number of blocks
+      {                                 // ~~~~~~~~~ Bump ~~~~~~~~~
+        size_t stride=kHeader+ClassSize(c);// Bytes per block.
+        uint64_t need=stride*(uint64_t)n;// Bytes for the run.
+        uint64_t b=brk.load(std::memory_order_relaxed);
+        do                              // Until we move the break.
+        {
+          if (b+need>limit)             // Past the end of the heap?
+            return 0;                   // Yes, exhausted.
+        } while (!brk.compare_exchange_weak(b,b+need,std::memory_order_relaxed));
+        for (int i=0;i<n;i++)           // Stamp each block.
+        {
+          BlockHeader* h=HeaderAt(b+(uint64_t)i*stride);
+          h->cls=(uint32_t)c;           // Its class.
+          h->magic=kBlockMagic;         // Ours.
+        }                               // Done stamping.
+        return b;                       // First block.
+      }                                 // ~~~~~~~~~ Bump ~~~~~~~~~
+      // Pop one block off class c's free list (0 if empty).
+      uint64_t PopList (
+        int c)                          // Size class
+      {                                 // ~~~~~~~~~ PopList ~~~~~~~~~
+        uint64_t h=freelist[c].load(std::memory_order_acquire);
+        for (;;)                        // Until we pop or see it empty.
+        {
+          uint64_t b=h&kOffMask;        // Top block.
+          if (b==0)                     // Empty?
+            return 0;                   // Yes.
+          // The block may be popped and reused under us; then the tag has
+          // moved on and the CAS below fails, so a stale next is harmless.
+          uint64_t nx=NextOf(b)->load(std::memory_order_relaxed);
+          uint64_t t=(h>>kOffBits)+1;   // Next tag.
+          if (freelist[c].compare_exchange_weak(h,(t<<kOffBits)|(nx&kOffMask),
+            std::memory_order_acquire,std::memory_order_acquire))
+            return b;                   // Got it.
+        }                               // h was reloaded, try again.
+      }                                 // ~~~~~~~~~ PopList ~~~~~~~~~
+      // Take up to n blocks of class c with a single CAS: detach the whole
+      // list, keep the first n and push the remainder back as one chain.
+      int PopBatch (
+        int c,                          // Size class
+        uint64_t* out,                  // Where to put the blocks
+        int n)                          // Max blocks
+      {                                 // ~~~~~~~~~ PopBatch ~~~~~~~~~
+        uint64_t h=freelist[c].load(std::memory_order_acquire);
+        do                              // Until we detach the list or see it empty.
+        {
+          if ((h&kOffMask)==0)          // Empty?
+            return 0;                   // Yes, nothing to take.
+        } while (!freelist[c].compare_exchange_weak(h,((h>>kOffBits)+1)<<kOffBits,
+          std::memory_order_acquire,std::memory_order_acquire));
+        uint64_t b=h&kOffMask;          // The detached chain is ours now.
+        int k=0;                        // Blocks taken.
+        while (b!=0&&k<n)               // Take up to n.
+        {
+          out[k++]=b;                   // Keep it.
+          b=NextOf(b)->load(std::memory_order_relaxed);// Next in chain.
+        }                               // Done taking.
+        if (b!=0)                       // Leftovers?
+        {                               // Yes, find the tail and give them back.
+          uint64_t t=b;                 // Walk to the tail.
+          for (uint64_t nx;(nx=NextOf(t)->load(std::memory_order_relaxed))!=0;t=nx)
+            ;                           // Nothing, just walking.
+          PushChain(c,b,t);             // One CAS.
+        }                               // Done with leftovers.
+        return k;                       // Blocks taken.
+      }                                 // ~~~~~~~~~ PopBatch ~~~~~~~~~
+      // Push the already linked chain first..last onto class c's free list.
+      void PushChain (
+        int c,                          // Size class
+        uint64_t first,                 // Head of the chain
+        uint64_t last)                  // Tail of the chain
+      {                                 // ~~~~~~~~~ PushChain ~~~~~~~~~
+        uint64_t h=freelist[c].load(std::memory_order_relaxed);
+        do                              // Until our chain is on top.
+          NextOf(last)->store(h&kOffMask,std::memory_order_relaxed);
+        while (!freelist[c].compare_exchange_weak(h,(((h>>kOffBits)+1)<<kOffBits)|first,
+          std::memory_order_release,std::memory_order_relaxed));
+      }                                 // ~~~~~~~~~ PushChain ~~~~~~~~~
+      ShmLayoutHeader hdr;              // Versioned header (one cache line)
+      alignas(kCacheLine) std::atomic<uint64_t> brk;// Offset of the first uncarved byte
+      uint64_t limit;                   // Offset of the end of the heap
+      alignas(kCacheLine) std::atomic<uint64_t> roots[kRoots];// Well-known objects
+      alignas(kCacheLine) std::atomic<uint64_t> freelist[kClasses];// Tag<<40|offset per class
+  };
+  // C++ allocator over a ShmArena. It holds an offset_ptr to the arena, so the
+  // container (which embeds its allocator) can itself live in the arena.
+  template<typename T>
+  class ShmAllocator
+  {
+    public:
+      typedef T value_type;
+      typedef offset_ptr<T> pointer;
+      typedef offset_ptr<const T> const_pointer;
+      typedef offset_ptr<void> void_pointer;
+      typedef offset_ptr<const void> const_void_pointer;
+      typedef std::size_t size_type;
+      typedef std::ptrdiff_t difference_type;
+      template<typename U> struct rebind { typedef ShmAllocator<U> other; };
+      explicit ShmAllocator (ShmArena* a) noexcept : arena(a) {}
+      ShmAllocator (const ShmAllocator& o) noexcept : arena(o.arena.get()) {}
+      template<typename U>
+      ShmAllocator (const ShmAllocator<U>& o) noexcept : arena(o.GetArena()) {}
+      ShmAllocator& operator= (const ShmAllocator& o) noexcept { arena=o.arena.get(); return *this; }
+      pointer allocate (
+        size_type n)                    // Number of T's
+      {                                 // ~~~~~~~~~ allocate ~~~~~~~~~
+        if (n>ShmArena::kMaxAlloc/sizeof(T))// Bigger than the largest class?
+          throw std::bad_array_new_length();// Yes, as std::allocator would.
+        void* p=arena->Allocate(n*sizeof(T));// Carve it.
+        if (p==nullptr)                 // Exhausted?
+          throw std::bad_alloc();       // Yes, as std::allocator would.
+        return pointer(static_cast<T*>(p));
+      }                                 // ~~~~~~~~~ allocate ~~~~~~~~~
+      void deallocate (
+        pointer p,                      // What allocate() returned
+        size_type)                      // Number of T's (unused, blocks know their class)
+      {                                 // ~~~~~~~~~ deallocate ~~~~~~~~~
+        arena->Deallocate(p.get());     // Back to its free list.
+      }                                 // ~~~~~~~~~ deallocate ~~~~~~~~~
+      ShmArena* GetArena (void) const noexcept { return arena.get(); }
+      friend bool operator== (const ShmAllocator& a,const ShmAllocator& b) noexcept { return a.arena==b.arena; }
+      friend bool operator!= (const ShmAllocator& a,const ShmAllocator& b) noexcept { return a.arena!=b.arena; }
+    private:
+      offset_ptr<ShmArena> arena;       // The arena, position independent
+  };
+}
@@ -0,0 +1,321 @@
+ /*
+ * *
+ * * Filename: ShmBroadcast.hpp
+ * *
+ * * Description:
+ * *   One-to-many broadcast log in a shared memory segment. A single writer appends
+ * *     variable-length records to a byte ring; any number of subscribers, in any process,
+ * *     read every record through their own process-local cursor. The record is written
+ * *     once no matter how many subscribers there are, and subscribers never write to
+ * *     the segment, so they cannot slow the writer down or each other.
+ * *
+ * *   The writer never waits. A subscriber that falls more than a ring's worth behind is
+ * *     overrun: the bytes under its cursor have been reused. The writer advances a
+ * *     reserve counter before it touches the ring and the head counter after; a reader
+ * *     copies a record and then checks the reserve counter, so a torn copy is always
+ * *     detected. An overrun subscriber gets EOVERFLOW once, skips to the newest record
+ * *     and can tell how many records it lost from the per-record sequence numbers.
+ * *
+ * *   Records are 16-byte aligned with a 16-byte header {length, type, sequence} and never
+ * *     wrap: when a record does not fit before the end of the ring the writer fills the
+ * *     rest with a padding record that readers skip. Payloads are limited to a quarter
+ * *     of the ring.
+ * *
+ * *   Blocking: subscribers that prefer to sleep use Read() with a timeout, which waits
+ * *     on a futex doorbell in the segment; the writer only enters the kernel to ring it
+ * *     when somebody is asleep. Event loops can instead have the writer bump an eventfd
+ * *     (shared by fork() or SCM_RIGHTS, see PosixSharedMemory::SendFd()) and poll it.
+ * *
+ * *   Usage:
+ * *     ipc::ShmBroadcast* b=nullptr;
+ * *     ipc::ShmBroadcast::Open(shm,&b);
+ * *     b->Publish(msg,len);                       // writer
+ * *     ipc::ShmBroadcast::Subscriber sub(b);      // each reader, starts at the head
+ * *     sub.Read(buf,sizeof(buf),&len);            // sleeps until a record arrives
+ * *
+ * *  Author:
+ * *    JEP  J. Enrique Peraza
+ * *
+ */
+#pragma once
+#include <atomic>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include "ShmLayout.hpp"
+#include "ShmFutex.hpp"
+
+namespace ipc
+{
+  class ShmBroadcast
+  {
+    public:
+      static constexpr uint16_t kVersion=1;// Bump when the layout below changes.
+      static constexpr uint64_t kAlign=16;// Record alignment (and header size).
+      static constexpr uint64_t kMinRing=4096;// Smallest ring we format.
+      static constexpr uint32_t kPadType=0xffffffffu;// Type of the filler record.
+      // Bytes a segment needs for a ring of capacity bytes (a power of two).
+      static size_t RequiredBytes (
+        uint64_t capacity)              // Ring bytes
+      {                                 // ~~~~~~~~~ RequiredBytes ~~~~~~~~~
+        return RingOffset()+capacity;   // Control block plus ring.
+      }                                 // ~~~~~~~~~ RequiredBytes ~~~~~~~~~
+      // Format (first caller) or validate the log at mem. The ring is the
+      // largest power of two that fits in len.
+      static ShmResult Open (
+        void* mem,                      // Start of the region (cache line aligned)
+        size_t len,                     // Bytes available
+        ShmBroadcast** out)             // Where to return the log
+      {                                 // ~~~~~~~~~ Open ~~~~~~~~~
+        if (out==nullptr)               // Nowhere to put the result?
+          return {-1,EINVAL};           // Yes, error out.
+        *out=nullptr;                   // Nothing yet.
+        if (len<RequiredBytes(kMinRing))// Room for the smallest ring?
+          return {-1,EINVAL};           // No, too small.
+        uint64_t cap=kMinRing;          // Ring bytes...
+        while (RequiredBytes(cap*2)<=len&&cap<((uint64_t)1<<40))
+          cap*=2;                       // ...as many as fit.
+        ShmResult r=ShmLayoutClaim(mem,len,Spec(cap));
+        if (r.code<0)                   // Bad region or layout?
+          return r;                     // Yes, pass the error along.
+        ShmBroadcast* b=static_cast<ShmBroadcast*>(mem);
+        if (r.code==1)                  // Are we the formatter?
+        {                               // Yes, so set up an empty log.
+          b->mask=cap-1;                // Ring index mask.
+          b->head.store(0,std::memory_order_relaxed);
+          b->reserve.store(0,std::memory_order_relaxed);
+          b->seq=0;                     // No records yet.
+          b->pending=0;                 // Nothing reserved.
+          b->bell.seq.store(0,std::memory_order_relaxed);
+          b->bell.waiters.store(0,std::memory_order_relaxed);
+          ShmLayoutPublish(mem);        // Let everybody else in.
+        }                               // Done formatting.
+        *out=b;                         // Hand back the log.
+        return {0,0};                   // Success.
+      }                                 // ~~~~~~~~~ Open ~~~~~~~~~
+      // Convenience overload for an attached segment.
+      template<typename Seg>
+      static ShmResult Open (
+        Seg& seg,                       // An attached segment
+        ShmBroadcast** out)             // Where to return the log
+      {                                 // ~~~~~~~~~ Open ~~~~~~~~~
+        if (seg.GetPointer()==nullptr)  // Not attached?
+          return {-1,EINVAL};           // Yes, nothing to open.
+        return Open(seg.GetPointer(),seg.GetShmSize(),out);
+      }                                 // ~~~~~~~~~ Open ~~~~~~~~~
+      // Writer: reserve room for a len-byte record and return where to write
+      // its payload (16-byte aligned). Nothing is visible until Commit().
+      // nullptr with EMSGSIZE in *err if len exceeds MaxRecord().
+      void* Reserve (
+        uint32_t len,                   // Payload bytes
+        uint32_t type=0,                // Application record type (not kPadType)
+        int* err=nullptr)               // Out: errno on failure
+      {                                 // ~~~~~~~~~ Reserve ~~~~~~~~~
+        if (len>MaxRecord()||type==kPadType)// Too big, or our filler type?
+        {
+          if (err!=nullptr)             // Caller wants to know why?
+            *err=(type==kPadType)?EINVAL:EMSGSIZE;
+          return nullptr;               // Refuse.
+        }                               // Done with bad request.
+        uint64_t pos=head.load(std::memory_order_relaxed);// Only we move it.
+        uint64_t total=RecordBytes(len);// Header plus padded payload.
+        uint64_t off=pos&mask;          // Where it would start.
+        uint64_t pad=(off+total>mask+1)?mask+1-off:0;// Filler to the end?
+        uint64_t end=pos+pad+total;     // Head after this record.
+        // Announce the bytes we are about to overwrite before touching them:
+        // a reader that sees any of our new bytes also sees this.
+        reserve.store(end,std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        if (pad!=0)                     // Need a filler first?
+          WriteHeader(off,(uint32_t)(pad-kAlign),kPadType,0);
+        off=(pos+pad)&mask;             // Where the record goes.
+        WriteHeader(off,len,type,seq);  // Its header.
+        pending=end;                    // What Commit() publishes.
+        return Ring()+off+kAlign;       // Payload.
+      }                                 // ~~~~~~~~~ Reserve ~~~~~~~~~
+      // Writer: publish the record from Reserve() and ring the doorbell.
+      // If efd>=0 also add 1 to that eventfd for polling subscribers.
+      void Commit (
+        int efd=-1)                     // Optional eventfd
+      {                                 // ~~~~~~~~~ Commit ~~~~~~~~~
+        seq++;                          // Next record's number.
+        head.store(pending,std::memory_order_release);// Payload before head.
+        bell.Notify(INT_MAX);           // Wake sleepers (no syscall if none).
+        if (efd>=0)                     // Event loop subscribers?
+        {
+          uint64_t one=1;               // eventfd counter increment.
+          (void)!write(efd,&one,sizeof(one));// Best effort (EAGAIN: already pending).
+        }                               // Done with eventfd.
+      }                                 // ~~~~~~~~~ Commit ~~~~~~~~~
+      // Writer: append one record. {-1,EMSGSIZE} if len exceeds MaxRecord().
+      // code is the record's sequence number.
+      ShmResult Publish (
+        const void* data,               // Payload
+        uint32_t len,                   // Payload bytes
+        uint32_t type=0,                // Application record type
+        int efd=-1)                     // Optional eventfd to bump
+      {                                 // ~~~~~~~~~ Publish ~~~~~~~~~
+        int err=0;                      // Why Reserve() failed.
+        void* p=Reserve(len,type,&err); // Room for it.
+        if (p==nullptr)                 // Too big?
+          return {-1,err};              // Yes.
+        memcpy(p,data,len);             // Written once for everybody.
+        uint64_t n=seq;                 // Its number.
+        Commit(efd);                    // Make it visible.
+        return {(int)(n&INT_MAX),0};    // Published.
+      }                                 // ~~~~~~~~~ Publish ~~~~~~~~~
+      // Largest payload a record may carry.
+      uint32_t MaxRecord (void) const { return (uint32_t)((mask+1)/4-kAlign); }
+      uint64_t Capacity (void) const { return mask+1; }
+      // Bytes published so far (monotonic).
+      uint64_t Head (void) const { return head.load(std::memory_order_acquire); }
+      // Process-local read cursor. Cheap to create; one per reader.
+      class Subscriber
+      {
+        public:
+          // Start at the head: only records published from now on are seen.
+          explicit Subscriber (
+            ShmBroadcast* b)            // The log
+            : bc(b),cursor(b->Head()) {}
+          // Copy the next record into buf. code==1: *len (and *type, *seq)
+          // describe it; code==0: nothing new. code<0: errn is EOVERFLOW (we
+          // were overrun and skipped to the head, see Lost()), EMSGSIZE (*len
+          // says how big a buffer it needs; the record is not consumed) or
+          // EPROTO (the ring holds garbage).
+          ShmResult TryRead (
+            void* buf,                  // Where to copy the payload
+            size_t cap,                 // Room in buf
+            uint32_t* len,              // Out: payload bytes
+            uint32_t* type=nullptr,     // Out: record type
+            uint64_t* rseq=nullptr)     // Out: record sequence number
+          {                             // ~~~~~~~~~ TryRead ~~~~~~~~~
+            for (;;)                    // Skipping filler records.
+            {
+              uint64_t h=bc->head.load(std::memory_order_acquire);
+              if (cursor==h)            // Caught up?
+                return {0,0};           // Nothing new.
+              if (h-cursor>bc->mask+1)  // Already lapped?
+                return Overrun();       // Yes, skip ahead.
+              uint64_t off=cursor&bc->mask;// Where our record starts.
+              Header hd;                // Possibly torn copy.
+              memcpy(&hd,bc->Ring()+off,sizeof(hd));
+              uint64_t total=RecordBytes(hd.len);// Bytes it claims.
+              bool sane=(off+total<=bc->mask+1);// Fits before the end?
+              bool fits=sane&&(hd.type==kPadType||hd.len<=cap);
+              if (fits&&hd.type!=kPadType)// Worth copying?
+                memcpy(buf,bc->Ring()+off+kAlign,hd.len);
+              std::atomic_thread_fence(std::memory_order_acquire);// Copies before the check.
+              if (bc->reserve.load(std::memory_order_relaxed)-cursor>bc->mask+1)
+                return Overrun();       // Writer reused our bytes mid-copy.
+              if (!sane)                // Consistent, but nonsense?
+                return {-1,EPROTO};     // Not written by Publish().
+              if (hd.type==kPadType)    // Filler?
+              {
+                cursor+=total;          // Skip to the start of the ring.
+                continue;               // And read the real record.
+              }                         // Done with filler.
+              *len=hd.len;              // Its size.
+              if (!fits)                // Caller's buffer too small?
+                return {-1,EMSGSIZE};   // Yes, record left in place.
+              if (type!=nullptr)        // Caller wants the type?
+                *type=hd.type;          // Yes.
+              if (rseq!=nullptr)        // Caller wants the number?
+                *rseq=hd.seq;           // Yes.
+              if (expect!=UINT64_MAX&&hd.seq>expect)// Records lost to an overrun?
+                lost+=hd.seq-expect;    // Count them.
+              expect=hd.seq+1;          // What should come next.
+              cursor+=total;            // Consumed.
+              return {1,0};             // One record.
+            }                           // Done skipping filler.
+          }                             // ~~~~~~~~~ TryRead ~~~~~~~~~
+          // Like TryRead() but sleeps on the doorbell while there is nothing
+          // to read. timeout is relative (nullptr: forever); {-1,ETIMEDOUT}
+          // when it expires.
+          ShmResult Read (
+            void* buf,                  // Where to copy the payload
+            size_t cap,                 // Room in buf
+            uint32_t* len,              // Out: payload bytes
+            const struct timespec* timeout=nullptr,// Relative timeout or nullptr
+            uint32_t* type=nullptr,     // Out: record type
+            uint64_t* rseq=nullptr)     // Out: record sequence number
+          {                             // ~~~~~~~~~ Read ~~~~~~~~~
+            for (;;)                    // Until a record or the timeout.
+            {
+              ShmResult r=TryRead(buf,cap,len,type,rseq);
+              if (r.code!=0)            // Record or error?
+                return r;               // Yes, hand it back.
+              uint32_t tok=bc->bell.PrepareWait();// Announce ourselves...
+              if (bc->head.load(std::memory_order_acquire)!=cursor)
+              {                         // ...but something arrived meanwhile.
+                bc->bell.CancelWait();  // Withdraw.
+                continue;               // Read it.
+              }                         // Done with late arrival.
+              r=bc->bell.Wait(tok,timeout);// Sleep until the writer rings.
+              if (r.code<0&&r.errn==ETIMEDOUT)// Nothing for too long?
+                return r;               // Yes, give up.
+            }                           // Done waiting.
+          }                             // ~~~~~~~~~ Read ~~~~~~~~~
+          // Skip everything published so far.
+          void SeekHead (void) { cursor=bc->Head(); expect=UINT64_MAX; }
+          // Bytes published but not read yet.
+          uint64_t Backlog (void) const { return bc->Head()-cursor; }
+          // Records skipped because of overruns (known once we read again).
+          uint64_t Lost (void) const { return lost; }
+          // Times we were overrun.
+          uint64_t Overruns (void) const { return overruns; }
+        private:
+          // Lapped by the writer: resynchronise at the head.
+          ShmResult Overrun (void)
+          {                             // ~~~~~~~~~ Overrun ~~~~~~~~~
+            cursor=bc->Head();          // Newest record boundary.
+            overruns++;                 // Count it.
+            return {-1,EOVERFLOW};      // Tell the caller once.
+          }                             // ~~~~~~~~~ Overrun ~~~~~~~~~
+          ShmBroadcast* bc;             // The log
+          uint64_t cursor;              // Next byte position to read
+          uint64_t expect{UINT64_MAX};  // Next sequence number expected
+          uint64_t lost{0};             // Records skipped
+          uint64_t overruns{0};         // EOVERFLOW count
+      };                                // Subscriber
+    private:
+      ShmBroadcast (void)=delete;       // Only ever placed on top of a segment.
+      struct Header
+      {
+        uint32_t len;                   // Payload bytes
+        uint32_t type;                  // Application type or kPadType
+        uint64_t seq;                   // Record number
+      };                                // Header
+      static_assert(sizeof(Header)==kAlign,"record header is one alignment unit");
+      static constexpr size_t RingOffset (void) { return (sizeof(ShmBroadcast)+kCacheLine-1)&~(kCacheLine-1); }
+      static uint64_t RecordBytes (uint32_t len) { return kAlign+(((uint64_t)len+kAlign-1)&~(kAlign-1)); }
+      static ShmLayoutSpec Spec (
+        uint64_t capacity)              // Ring bytes
+      {                                 // ~~~~~~~~~ Spec ~~~~~~~~~
+        return {SHM_KIND_BROADCAST,kVersion,0,capacity,(uint64_t)RequiredBytes(capacity)};
+      }                                 // ~~~~~~~~~ Spec ~~~~~~~~~
+      char* Ring (void) const
+      {                                 // ~~~~~~~~~ Ring ~~~~~~~~~
+        return reinterpret_cast<char*>(const_cast<ShmBroadcast*>(this))+RingOffset();
+      }                                 // ~~~~~~~~~ Ring ~~~~~~~~~
+      void WriteHeader (
+        uint64_t off,                   // Ring offset
+        uint32_t len,                   // Payload bytes
+        uint32_t type,                  // Type
+        uint64_t s)                     // Sequence number
+      {                                 // ~~~~~~~~~ WriteHeader ~~~~~~~~~
+        Header hd={len,type,s};         // The header.
+        memcpy(Ring()+off,&hd,sizeof(hd));// Into the ring.
+      }                                 // ~~~~~~~~~ WriteHeader ~~~~~~~~~
+      ShmLayoutHeader hdr;              // Versioned header (one cache line)
+      uint64_t mask;                    // Ring bytes - 1
+      alignas(kCacheLine) std::atomic<uint64_t> head;// Published end (readers poll it)
+      uint64_t seq;                     // Next record number (writer only)
+      uint64_t pending;                 // Head after the reserved record (writer only)
+      alignas(kCacheLine) std::atomic<uint64_t> reserve;// End of what the writer may be writing
+      alignas(kCacheLine) ShmEventCount bell;// Doorbell for sleeping subscribers
+      // Followed by the ring itself (see RingOffset()).
+  };
+}
@@ -0,0 +1,94 @@
+ /*
+ * *
+ * * Filename: ShmFutex.hpp
+ * *
+ * * Description:
+ * *   Thin wrappers around futex(2) for 32-bit words that live in a shared memory
+ * *     segment. These are the *shared* futex operations (no FUTEX_PRIVATE_FLAG), so
+ * *     the kernel keys the wait queue on the physical page and a waiter in one process
+ * *     can be woken by another process that has the same segment attached anywhere.
+ * *
+ * *  Author:
+ * *    JEP  J. Enrique Peraza
+ * *
+ */
+#pragma once
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <limits.h>
+#include <atomic>
+#include <stdint.h>
+#include "SharedMemory.hpp"
+
+namespace ipc
+{
+  static_assert(sizeof(std::atomic<uint32_t>)==sizeof(uint32_t),"futex word must be 32 bits");
+  // Sleep while *addr==expected. A null timeout sleeps forever; otherwise
+  // it is relative (CLOCK_MONOTONIC). Returns {0,0} when woken, {-1,EAGAIN}
+  // when the word had already changed, {-1,ETIMEDOUT} or {-1,EINTR}.
+  inline ShmResult FutexWait (
+    std::atomic<uint32_t>* addr,        // The futex word (in the segment)
+    uint32_t expected,                  // Value we saw before deciding to sleep
+    const struct timespec* timeout=nullptr)// Relative timeout or nullptr
+  {                                     // ~~~~~~~~~ FutexWait ~~~~~~~~~
+    if (syscall(SYS_futex,reinterpret_cast<uint32_t*>(addr),FUTEX_WAIT,
+      expected,timeout,nullptr,0)!=0)   // Did we fail to sleep or time out?
+      return {-1,errno};                // Yes, hand back why.
+    return {0,0};                       // Woken up (possibly spuriously).
+  }                                     // ~~~~~~~~~ FutexWait ~~~~~~~~~
+  // Wake up to n waiters sleeping on addr. Returns the number woken.
+  inline ShmResult FutexWake (
+    std::atomic<uint32_t>* addr,        // The futex word (in the segment)
+    int n=INT_MAX)                      // How many to wake
+  {                                     // ~~~~~~~~~ FutexWake ~~~~~~~~~
+    long r=syscall(SYS_futex,reinterpret_cast<uint32_t*>(addr),FUTEX_WAKE,
+      n,nullptr,nullptr,0);             // Wake them.
+    if (r<0)                            // Did the wake fail?
+      return {-1,errno};                // Yes, hand back why.
+    return {(int)r,0};                  // How many we woke.
+  }                                     // ~~~~~~~~~ FutexWake ~~~~~~~~~
+  // An event count: a futex word that is bumped on every notification plus a
+  // count of sleepers so that notifiers skip the system call when nobody waits.
+  struct ShmEventCount
+  {
+    std::atomic<uint32_t> seq;          // Bumped by Notify(), slept on by waiters
+    std::atomic<uint32_t> waiters;      // Number of threads inside Wait()
+    // Waiter side, step 1: snapshot the sequence and announce ourselves. The
+    // caller must re-check its condition after PrepareWait() and before Wait().
+    uint32_t PrepareWait (void)
+    {                                   // ~~~~~~~~~ PrepareWait ~~~~~~~~~
+      uint32_t s=seq.load(std::memory_order_acquire);
+      waiters.fetch_add(1,std::memory_order_seq_cst);
+      return s;                         // Token for Wait()/CancelWait().
+    }                                   // ~~~~~~~~~ PrepareWait ~~~~~~~~~
+    // Waiter side, step 2a: the condition still does not hold, go to sleep.
+    ShmResult Wait (
+      uint32_t token,                   // Value returned by PrepareWait()
+      const struct timespec* timeout=nullptr)// Relative timeout or nullptr
+    {                                   // ~~~~~~~~~ Wait ~~~~~~~~~
+      ShmResult r=FutexWait(&seq,token,timeout);
+      waiters.fetch_sub(1,std::memory_order_relaxed);
+      return r;                         // EAGAIN means we were already notified.
+    }                                   // ~~~~~~~~~ Wait ~~~~~~~~~
+    // Waiter side, step 2b: the condition came true, no need to sleep.
+    void CancelWait (void)
+    {                                   // ~~~~~~~~~ CancelWait ~~~~~~~~~
+      waiters.fetch_sub(1,std::memory_order_relaxed);
+    }                                   // ~~~~~~~~~ CancelWait ~~~~~~~~~
+    // Notifier side: call after making the condition true.
+    void Notify (
+      int n=1)                          // How many sleepers to wake
+    {                                   // ~~~~~~~~~ Notify ~~~~~~~~~
+      // Order our condition store before the waiters load (pairs with the
+      // seq_cst increment in PrepareWait()).
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (waiters.load(std::memory_order_relaxed)==0)// Anybody sleeping?
+        return;                         // No, stay out of the kernel.
+      seq.fetch_add(1,std::memory_order_release);// Invalidate their tokens.
+      FutexWake(&seq,n);                // And wake them.
+    }                                   // ~~~~~~~~~ Notify ~~~~~~~~~
+  };                                    // ShmEventCount
+}
@@ -0,0 +1,514 @@
+ /*
+ * *
+ * * Filename: ShmHashMap.hpp
+ * *
+ * * Description:
+ * *   Fixed-capacity concurrent hash map that lives entirely inside a shared memory
+ * *     segment, keys and values stored inline, so every process that attaches the segment
+ * *     can look things up without building a private copy. K and V must be trivially
+ * *     copyable; the default hash and equality work on the bytes of K (which must then
+ * *     have no padding), so hashes agree across processes and builds.
+ * *
+ * *   Layout: open addressing over groups of 16 slots. Each slot has a one-byte tag
+ * *     (empty, tombstone, busy, or 0x80|7 hash bits) kept in a separate tag array, so a
+ * *     probe tests a whole group with one SSE2 compare and only touches the slots whose
+ * *     tag matches. Probing is linear over groups starting at the key's home group.
+ * *
+ * *   Concurrency: lookups are lock-free. Writers serialise per key on the robust mutex
+ * *     of the key's home stripe (64 stripes) and bump that stripe's sequence counter
+ * *     around every change to an existing slot; readers validate against it and retry,
+ * *     as ShmSnapshot does. New slots are claimed with a CAS on the tag and only become
+ * *     visible once fully written. A slot's key never changes while the map is online:
+ * *     erased slots become tombstones that are not reused until Compact(). A writer that
+ * *     dies mid-update is repaired by the next writer (or by a reader that gives up
+ * *     waiting) through the mutex's EOWNERDEAD path.
+ * *
+ * *   Offline maintenance (no other process may use the map meanwhile): Compact() drops
+ * *     tombstones, CopyInto() rehashes everything into another map - e.g. a bigger one
+ * *     in a second segment sized with RequiredBytes() - which is how the map is resized.
+ * *
+ * *   Usage:
+ * *     typedef ipc::ShmHashMap<Symbol,uint32_t> Map;
+ * *     shm.CreateOrAttach(key,Map::RequiredBytes(1<<20));
+ * *     Map* m=nullptr;
+ * *     Map::Open(shm,&m);                  // Capacity follows from the segment size
+ * *     m->Insert(sym,slot);  m->Find(sym,&slot);
+ * *
+ * *  Author:
+ * *    JEP  J. Enrique Peraza
+ * *
+ */
+#pragma once
+#include <atomic>
+#include <new>
+#include <vector>
+#include <type_traits>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <sched.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "ShmLayout.hpp"
+#include "ShmMutex.hpp"
+
+namespace ipc
+{
+  // 64-bit finaliser (splitmix64): spreads every input bit over the output.
+  inline uint64_t ShmHashMix (
+    uint64_t x)                         // Value to scramble
+  {                                     // ~~~~~~~~~ ShmHashMix ~~~~~~~~~
+    x^=x>>30;                           // Fold the high bits down...
+    x*=0xbf58476d1ce4e5b9ULL;           // ...multiply...
+    x^=x>>27;                           // ...fold again...
+    x*=0x94d049bb133111ebULL;           // ...multiply...
+    return x^(x>>31);                   // ...and a last fold.
+  }                                     // ~~~~~~~~~ ShmHashMix ~~~~~~~~~
+  // Hash a byte string eight bytes at a time. Stable across processes and
+  // builds, which std::hash does not promise.
+  inline uint64_t ShmHashBytes (
+    const void* p,                      // The bytes
+    size_t n,                           // How many
+    uint64_t seed=0x9e3779b97f4a7c15ULL)// Seed
+  {                                     // ~~~~~~~~~ ShmHashBytes ~~~~~~~~~
+    const unsigned char* b=static_cast<const unsigned char*>(p);
+    uint64_t h=seed^(n*0xff51afd7ed558ccdULL);// Length feeds the seed.
+    for (;n>=8;n-=8,b+=8)               // Whole words.
+    {
+      uint64_t w;                       // Next word.
+      memcpy(&w,b,8);                   // Unaligned-safe load.
+      h=ShmHashMix(h^w);                // Absorb it.
+    }                                   // Done with whole words.
+    if (n>0)                            // Ragged tail?
+    {
+      uint64_t w=0;                     // Zero padded.
+      memcpy(&w,b,n);                   // Load what is there.
+      h=ShmHashMix(h^w^((uint64_t)n<<56));// Absorb it.
+    }                                   // Done with the tail.
+    return h;                           // Hash.
+  }                                     // ~~~~~~~~~ ShmHashBytes ~~~~~~~~~
+  // Default hash: the bytes of the key.
+  template<typename K>
+  struct ShmHash
+  {
+    uint64_t operator() (const K& k) const noexcept
+    {                                   // ~~~~~~~~~ operator() ~~~~~~~~~
+      static_assert(std::has_unique_object_representations<K>::value,
+        "ShmHash hashes the bytes of K; K has padding or floats, supply a hash");
+      if constexpr (std::is_integral<K>::value)// Integer key?
+        return ShmHashMix((uint64_t)k); // One mix is enough.
+      return ShmHashBytes(&k,sizeof(K));// Bytes of the key.
+    }                                   // ~~~~~~~~~ operator() ~~~~~~~~~
+  };                                    // ShmHash
+  // Default equality: the bytes of the key.
+  template<typename K>
+  struct ShmKeyEqual
+  {
+    bool operator() (const K& a,const K& b) const noexcept { return memcmp(&a,&b,sizeof(K))==0; }
+  };                                    // ShmKeyEqual
+  template<typename K,typename V,typename Hash=ShmHash<K>,typename Eq=ShmKeyEqual<K>>
+  class ShmHashMap
+  {
+    static_assert(std::is_trivially_copyable<K>::value,"K must be trivially copyable");
+    static_assert(std::is_trivially_copyable<V>::value,"V must be trivially copyable");
+    public:
+      static constexpr uint16_t kVersion=1;// Bump when the layout below changes.
+      static constexpr uint64_t kGroup=16;// Slots per group (one SSE2 compare).
+      static constexpr int kStripes=64; // Writer lock stripes.
+      // Bytes a segment needs for capacity slots (a power of two >= kGroup).
+      static size_t RequiredBytes (
+        uint64_t capacity)              // Slots
+      {                                 // ~~~~~~~~~ RequiredBytes ~~~~~~~~~
+        return SlotOffset(capacity)+capacity*sizeof(Slot);
+      }                                 // ~~~~~~~~~ RequiredBytes ~~~~~~~~~
+      // Largest capacity that fits in len bytes (0 if not even one group).
+      static uint64_t CapacityFor (
+        size_t len)                     // Bytes available
+      {                                 // ~~~~~~~~~ CapacityFor ~~~~~~~~~
+        uint64_t c=0;                   // Best so far.
+        for (uint64_t n=kGroup;n<((uint64_t)1<<40)&&RequiredBytes(n)<=len;n<<=1)
+          c=n;                          // Fits, try twice as many.
+        return c;                       // Largest that fit.
+      }                                 // ~~~~~~~~~ CapacityFor ~~~~~~~~~
+      // Format (first caller) or validate the map at mem. The capacity is the
+      // largest power of two that fits in len, so every process that opens the
+      // same segment agrees on it.
+      static ShmResult Open (
+        void* mem,                      // Start of the region (cache line aligned)
+        size_t len,                     // Bytes available
+        ShmHashMap** out)               // Where to return the map
+      {                                 // ~~~~~~~~~ Open ~~~~~~~~~
+        if (out==nullptr)               // Nowhere to put the result?
+          return {-1,EINVAL};           // Yes, error out.
+        *out=nullptr;                   // Nothing yet.
+        uint64_t cap=CapacityFor(len);  // Slots that fit.
+        if (cap==0)                     // Room for at least one group?
+          return {-1,EINVAL};           // No, too small.
+        ShmResult r=ShmLayoutClaim(mem,len,Spec(cap));
+        if (r.code<0)                   // Bad region or layout?
+          return r;                     // Yes, pass the error along.
+        ShmHashMap* m=static_cast<ShmHashMap*>(mem);
+        if (r.code==1)                  // Are we the formatter?
+        {                               // Yes, so set up an empty table.
+          m->ngroups=cap/kGroup;        // Groups.
+          m->limit=cap-cap/8;           // Keep 1/8 empty so probes terminate fast.
+          m->Reset();                   // Counters, stripes, tags.
+          ShmLayoutPublish(mem);        // Let everybody else in.
+        }                               // Done formatting.
+        *out=m;                         // Hand back the map.
+        return {0,0};                   // Success.
+      }                                 // ~~~~~~~~~ Open ~~~~~~~~~
+      // Convenience overload for an attached segment.
+      template<typename Seg>
+      static ShmResult Open (
+        Seg& seg,                       // An attached segment
+        ShmHashMap** out)               // Where to return the map
+      {                                 // ~~~~~~~~~ Open ~~~~~~~~~
+        if (seg.GetPointer()==nullptr)  // Not attached?
+          return {-1,EINVAL};           // Yes, nothing to open.
+        return Open(seg.GetPointer(),seg.GetShmSize(),out);
+      }                                 // ~~~~~~~~~ Open ~~~~~~~~~
+      // Lock-free lookup. Copies the value to *out (if not null) when found.
+      bool Find (
+        const K& k,                     // Key
+        V* out=nullptr) const           // Where to copy the value
+      {                                 // ~~~~~~~~~ Find ~~~~~~~~~
+        uint64_t h=Hash()(k);           // Its hash.
+        Stripe& s=StripeOf(h);          // Who guards it.
+        for (unsigned n=1;;n++)         // Until a probe survives validation.
+        {
+          uint32_t s1=s.seq.load(std::memory_order_acquire);
+          if ((s1&1)==0)                // No writer mid-update?
+          {                             // Probe.
+            int64_t i=Locate(k,h);      // Where is it?
+            if (i>=0&&out!=nullptr)     // Found and wanted?
+              memcpy(static_cast<void*>(out),&SlotAt(i)->val,sizeof(V));// Possibly torn.
+            std::atomic_thread_fence(std::memory_order_acquire);// Copy before the re-check.
+            if (s.seq.load(std::memory_order_relaxed)==s1)// Nothing overlapped?
+              return i>=0;              // Consistent answer.
+          }                             // Done probing.
+          Backoff(s,n);                 // Let the writer finish.
+        }                               // Done retrying.
+      }                                 // ~~~~~~~~~ Find ~~~~~~~~~
+      bool Contains (const K& k) const { return Find(k,nullptr); }
+      // Insert k->v, or overwrite the value of an existing k. code==1: inserted,
+      // code==0: updated (errn==EEXIST and untouched if !overwrite).
+      // {-1,ENOSPC} once 7/8 of the slots are used (tombstones count).
+      ShmResult Insert (
+        const K& k,                     // Key
+        const V& v,                     // Value
+        bool overwrite=true)            // Update an existing key?
+      {                                 // ~~~~~~~~~ Insert ~~~~~~~~~
+        uint64_t h=Hash()(k);           // Its hash.
+        Stripe& s=StripeOf(h);          // Who guards it.
+        ShmResult r=LockStripe(s);      // Serialise writers of this key.
+        if (r.code<0)                   // Broken lock?
+          return r;                     // Yes, pass it on.
+        int64_t i=Locate(k,h);          // Already there?
+        if (i>=0)                       // Yes.
+        {
+          if (overwrite)                // Update it?
+          {                             // Yes, under the seqlock.
+            BeginWrite(s);              // Readers retry from here...
+            memcpy(static_cast<void*>(&SlotAt(i)->val),&v,sizeof(V));
+            EndWrite(s);                // ...to here.
+          }                             // Done updating.
+          s.mtx.Unlock();               // Next writer.
+          return {0,overwrite?0:EEXIST};// Updated (or left alone).
+        }                               // Done with existing.
+        if (used.fetch_add(1,std::memory_order_relaxed)>=limit)// Room for one more?
+        {                               // No, undo the reservation.
+          used.fetch_sub(1,std::memory_order_relaxed);
+          s.mtx.Unlock();               // Next writer.
+          return {-1,ENOSPC};           // Full (Compact() or grow).
+        }                               // Done with full.
+        uint8_t t=TagOf(h);             // Its tag.
+        uint64_t g=GroupOf(h);          // Its home group.
+        uint8_t* tags=Tags();           // Tag array.
+        for (uint64_t n=0;n<ngroups;n++,g=(g+1)&(ngroups-1))
+        {
+          for (uint32_t m=MatchByte(tags+g*kGroup,kEmpty);m!=0;m&=m-1)
+          {                             // Each empty slot in the group...
+            uint64_t idx=g*kGroup+__builtin_ctz(m);
+            uint8_t e=kEmpty;           // ...that is still empty...
+            if (!__atomic_compare_exchange_n(&tags[idx],&e,kBusy,false,
+              __ATOMIC_ACQ_REL,__ATOMIC_RELAXED))
+              continue;                 // ...is claimed by us (or try the next).
+            Slot* sl=SlotAt(idx);       // Ours now, invisible to readers.
+            memcpy(static_cast<void*>(&sl->key),&k,sizeof(K));
+            memcpy(static_cast<void*>(&sl->val),&v,sizeof(V));
+            __atomic_store_n(&tags[idx],t,__ATOMIC_RELEASE);// Publish.
+            live.fetch_add(1,std::memory_order_relaxed);
+            s.mtx.Unlock();             // Next writer.
+            return {1,0};               // Inserted.
+          }                             // Done with the group.
+        }                               // Done probing.
+        used.fetch_sub(1,std::memory_order_relaxed);// Raced to a full table.
+        s.mtx.Unlock();                 // Next writer.
+        return {-1,ENOSPC};             // Full.
+      }                                 // ~~~~~~~~~ Insert ~~~~~~~~~
+      // Remove k. {-1,ENOENT} if it was not there.
+      ShmResult Erase (
+        const K& k)                     // Key
+      {                                 // ~~~~~~~~~ Erase ~~~~~~~~~
+        uint64_t h=Hash()(k);           // Its hash.
+        Stripe& s=StripeOf(h);          // Who guards it.
+        ShmResult r=LockStripe(s);      // Serialise writers of this key.
+        if (r.code<0)                   // Broken lock?
+          return r;                     // Yes, pass it on.
+        int64_t i=Locate(k,h);          // Where is it?
+        if (i<0)                        // Not there?
+        {
+          s.mtx.Unlock();               // Next writer.
+          return {-1,ENOENT};           // Nothing to erase.
+        }                               // Done with missing.
+        BeginWrite(s);                  // Readers that matched it retry...
+        __atomic_store_n(&Tags()[i],kTomb,__ATOMIC_RELAXED);
+        EndWrite(s);                    // ...and no longer find it.
+        live.fetch_sub(1,std::memory_order_relaxed);
+        tombs.fetch_add(1,std::memory_order_relaxed);
+        s.mtx.Unlock();                 // Next writer.
+        return {0,0};                   // Erased.
+      }                                 // ~~~~~~~~~ Erase ~~~~~~~~~
+      // Call f(key,value) for every entry. Entries inserted or erased while
+      // this runs may or may not be seen; each value is a consistent copy.
+      template<typename F>
+      void ForEach (
+        F f) const                      // Callback (const K&, const V&)
+      {                                 // ~~~~~~~~~ ForEach ~~~~~~~~~
+        const uint8_t* tags=Tags();     // Tag array.
+        for (uint64_t i=0;i<ngroups*kGroup;i++)// Every slot.
+        {
+          if (!(__atomic_load_n(&tags[i],__ATOMIC_ACQUIRE)&kFull))// Holds an entry?
+            continue;                   // No.
+          K k;                          // Keys never change online,
+          memcpy(static_cast<void*>(&k),&SlotAt(i)->key,sizeof(K));
+          V v;                          // but values do: look it up properly.
+          if (Find(k,&v))               // Still there?
+            f(static_cast<const K&>(k),static_cast<const V&>(v));
+        }                               // Done with slots.
+      }                                 // ~~~~~~~~~ ForEach ~~~~~~~~~
+      // Offline: rebuild the table without tombstones (and without slots
+      // leaked by writers that died mid-insert). Returns the live entries.
+      ShmResult Compact (void)
+      {                                 // ~~~~~~~~~ Compact ~~~~~~~~~
+        std::vector<Slot> keep;         // Live entries.
+        try { keep.reserve(live.load(std::memory_order_relaxed)); }
+        catch (const std::bad_alloc&) { return {-1,ENOMEM}; }
+        uint8_t* tags=Tags();           // Tag array.
+        for (uint64_t i=0;i<ngroups*kGroup;i++)// Every slot.
+          if (tags[i]&kFull)            // Holds an entry?
+            keep.push_back(*SlotAt(i)); // Keep it.
+        Reset();                        // Empty table.
+        for (const Slot& sl:keep)       // Put them back...
+          Place(sl);                    // ...without tombstones in the way.
+        return {(int)keep.size(),0};    // Live entries.
+      }                                 // ~~~~~~~~~ Compact ~~~~~~~~~
+      // Offline resize: insert every entry into dst (typically a bigger map in
+      // a second segment). Returns the entries copied or dst's ENOSPC.
+      ShmResult CopyInto (
+        ShmHashMap* dst) const          // Destination map
+      {                                 // ~~~~~~~~~ CopyInto ~~~~~~~~~
+        if (dst==nullptr||dst==this)    // Nowhere sensible to copy?
+          return {-1,EINVAL};           // Yes, refuse.
+        const uint8_t* tags=Tags();     // Tag array.
+        int n=0;                        // Copied.
+        for (uint64_t i=0;i<ngroups*kGroup;i++)// Every slot.
+        {
+          if (!(tags[i]&kFull))         // Holds an entry?
+            continue;                   // No.
+          const Slot* sl=SlotAt(i);     // The entry.
+          ShmResult r=dst->Insert(sl->key,sl->val);
+          if (r.code<0)                 // Did it fit?
+            return r;                   // No.
+          n++;                          // One more.
+        }                               // Done with slots.
+        return {n,0};                   // Copied.
+      }                                 // ~~~~~~~~~ CopyInto ~~~~~~~~~
+      uint64_t Size (void) const { return live.load(std::memory_order_relaxed); }
+      uint64_t Tombstones (void) const { return tombs.load(std::memory_order_relaxed); }
+      uint64_t Capacity (void) const { return ngroups*kGroup; }
+      // Entries Insert() accepts before ENOSPC (live+tombstones count).
+      uint64_t Limit (void) const { return limit; }
+      // Stripes repaired after a writer died holding them.
+      uint64_t Recoveries (void) const { return recoveries.load(std::memory_order_relaxed); }
+    private:
+      ShmHashMap (void)=delete;         // Only ever placed on top of a segment.
+      struct Slot
+      {
+        K key;                          // Never changes while the slot is full
+        V val;                          // Changes under the stripe seqlock
+      };                                // Slot
+      // Writer lock and reader validation counter for 1/kStripes of the groups.
+      struct alignas(kCacheLine) Stripe
+      {
+        ShmMutex mtx;                   // Writers of keys homed here
+        std::atomic<uint32_t> seq;      // Odd while an existing slot changes
+      };                                // Stripe
+      static constexpr uint8_t kEmpty=0x00;// Never used: probes stop here
+      static constexpr uint8_t kTomb=0x01;// Erased: probes go on
+      static constexpr uint8_t kBusy=0x02;// Claimed, being written
+      static constexpr uint8_t kFull=0x80;// Set in the tag of every entry
+      static constexpr size_t Align (size_t n) { return (n+kCacheLine-1)&~(kCacheLine-1); }
+      static size_t TagOffset (void) { return Align(sizeof(ShmHashMap)); }
+      static size_t SlotOffset (uint64_t capacity) { return Align(TagOffset()+capacity); }
+      static ShmLayoutSpec Spec (
+        uint64_t capacity)              // Slots
+      {                                 // ~~~~~~~~~ Spec ~~~~~~~~~
+        return {SHM_KIND_HASHMAP,kVersion,(uint32_t)sizeof(Slot),capacity,
+          (uint64_t)RequiredBytes(capacity)};// What Open() expects to find.
+      }                                 // ~~~~~~~~~ Spec ~~~~~~~~~
+      uint8_t* Tags (void) const
+      {                                 // ~~~~~~~~~ Tags ~~~~~~~~~
+        return reinterpret_cast<uint8_t*>(const_cast<ShmHashMap*>(this))+TagOffset();
+      }                                 // ~~~~~~~~~ Tags ~~~~~~~~~
+      Slot* SlotAt (
+        uint64_t i) const               // Slot index
+      {                                 // ~~~~~~~~~ SlotAt ~~~~~~~~~
+        return reinterpret_cast<Slot*>(reinterpret_cast<char*>(const_cast<ShmHashMap*>(this))+
+          SlotOffset(ngroups*kGroup))+i;
+      }                                 // ~~~~~~~~~ SlotAt ~~~~~~~~~
+      static uint8_t TagOf (uint64_t h) { return (uint8_t)(kFull|(h&0x7f)); }
+      uint64_t GroupOf (uint64_t h) const { return (h>>7)&(ngroups-1); }
+      Stripe& StripeOf (uint64_t h) const { return stripes[GroupOf(h)&(kStripes-1)]; }
+      // Bit i set where byte i of the 16-byte group equals b.
+      static uint32_t MatchByte (
+        const uint8_t* g,               // Group of tags (16-byte aligned)
+        uint8_t b)                      // Tag to look for
+      {                                 // ~~~~~~~~~ MatchByte ~~~~~~~~~
+#if defined(__SSE2__)
+        __m128i v=_mm_load_si128(reinterpret_cast<const __m128i*>(g));
+        return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v,_mm_set1_epi8((char)b)));
+#else
+        uint32_t m=0;                   // Portable fallback, byte by byte.
+        for (uint64_t i=0;i<kGroup;i++) // Every tag in the group.
+          m|=(uint32_t)(__atomic_load_n(g+i,__ATOMIC_RELAXED)==b)<<i;
+        return m;                       // Matches.
+#endif
+      }                                 // ~~~~~~~~~ MatchByte ~~~~~~~~~
+      // Slot index holding k, or -1. Readers call it under seqlock validation,
+      // writers with the key's stripe held.
+      int64_t Locate (
+        const K& k,                     // Key
+        uint64_t h) const               // Its hash
+      {                                 // ~~~~~~~~~ Locate ~~~~~~~~~
+        uint8_t t=TagOf(h);             // Its tag.
+        uint64_t g=GroupOf(h);          // Its home group.
+        const uint8_t* tags=Tags();     // Tag array.
+        for (uint64_t n=0;n<ngroups;n++,g=(g+1)&(ngroups-1))
+        {
+          const uint8_t* tg=tags+g*kGroup;// This group's tags.
+          for (uint32_t m=MatchByte(tg,t);m!=0;m&=m-1)
+          {                             // Each slot with our tag...
+            uint64_t idx=g*kGroup+__builtin_ctz(m);
+            if (__atomic_load_n(&tags[idx],__ATOMIC_ACQUIRE)==t&&// ...still full (key visible)...
+              Eq()(SlotAt(idx)->key,k)) // ...and really ours?
+              return (int64_t)idx;      // Found.
+          }                             // Done with candidates.
+          if (MatchByte(tg,kEmpty)!=0)  // Never-used slot: k was never pushed past it.
+            return -1;                  // Not here.
+        }                               // Done probing.
+        return -1;                      // Went all the way round.
+      }                                 // ~~~~~~~~~ Locate ~~~~~~~~~
+      // Offline insert of an entry known to be absent.
+      void Place (
+        const Slot& sl)                 // Entry
+      {                                 // ~~~~~~~~~ Place ~~~~~~~~~
+        uint64_t h=Hash()(sl.key);      // Its hash.
+        uint8_t* tags=Tags();           // Tag array.
+        for (uint64_t g=GroupOf(h);;g=(g+1)&(ngroups-1))
+        {
+          uint32_t m=MatchByte(tags+g*kGroup,kEmpty);
+          if (m==0)                     // Group full?
+            continue;                   // Next one (there is room: it fit before).
+          uint64_t idx=g*kGroup+__builtin_ctz(m);
+          *SlotAt(idx)=sl;              // Store it.
+          tags[idx]=TagOf(h);           // Mark it full.
+          used.fetch_add(1,std::memory_order_relaxed);
+          live.fetch_add(1,std::memory_order_relaxed);
+          return;                       // Placed.
+        }                               // Done probing.
+      }                                 // ~~~~~~~~~ Place ~~~~~~~~~
+      // Empty every slot and stripe (format and Compact()).
+      void Reset (void)
+      {                                 // ~~~~~~~~~ Reset ~~~~~~~~~
+        used.store(0,std::memory_order_relaxed);
+        live.store(0,std::memory_order_relaxed);
+        tombs.store(0,std::memory_order_relaxed);
+        recoveries.store(0,std::memory_order_relaxed);
+        for (int i=0;i<kStripes;i++)    // Every stripe...
+        {
+          stripes[i].mtx.Init();        // ...robust, unlocked...
+          stripes[i].seq.store(0,std::memory_order_relaxed);// ...and quiet.
+        }                               // Done with stripes.
+        memset(Tags(),kEmpty,ngroups*kGroup);// Every slot empty.
+        std::atomic_thread_fence(std::memory_order_release);
+      }                                 // ~~~~~~~~~ Reset ~~~~~~~~~
+      // Take a stripe; if its last holder died, make it usable again.
+      ShmResult LockStripe (
+        Stripe& s) const                // The stripe
+      {                                 // ~~~~~~~~~ LockStripe ~~~~~~~~~
+        ShmResult r=s.mtx.Lock();       // Wait our turn.
+        if (r.code==0&&r.errn==EOWNERDEAD)// Holder died?
+          Repair(s);                    // Yes, fix what it may have left.
+        return r;                       // Held unless code<0.
+      }                                 // ~~~~~~~~~ LockStripe ~~~~~~~~~
+      // With the stripe held after EOWNERDEAD: close an open seqlock write
+      // (the value it was writing may be half new, as after any crash) and
+      // mark the mutex consistent. A slot it left busy stays unused until
+      // Compact().
+      void Repair (
+        Stripe& s) const                // The stripe (held)
+      {                                 // ~~~~~~~~~ Repair ~~~~~~~~~
+        uint32_t q=s.seq.load(std::memory_order_relaxed);
+        if (q&1)                        // Died mid-update?
+          s.seq.store(q+1,std::memory_order_release);// Let readers through.
+        s.mtx.Consistent();             // Back in service.
+        recoveries.fetch_add(1,std::memory_order_relaxed);
+      }                                 // ~~~~~~~~~ Repair ~~~~~~~~~
+      // Reader back-off. A writer that stays mid-update for long may be dead:
+      // try its stripe so the EOWNERDEAD path repairs it.
+      void Backoff (
+        Stripe& s,                      // The stripe we are waiting on
+        unsigned n) const               // Retries so far
+      {                                 // ~~~~~~~~~ Backoff ~~~~~~~~~
+        if ((n&1023)==0)                // Been waiting a while?
+        {                               // Yes, is its writer still alive?
+          ShmResult r=s.mtx.TryLock();  // Steals from a dead owner.
+          if (r.code==0)                // Got it?
+          {
+            if (r.errn==EOWNERDEAD)     // Its holder died?
+              Repair(s);                // Yes, fix it.
+            s.mtx.Unlock();             // Give it back.
+          }                             // Done with got it.
+        }                               // Done checking.
+        if ((n&63)==0)                  // Writer descheduled mid-write?
+          sched_yield();                // Let it finish.
+        else                            // Otherwise...
+          CpuRelax();                   // ...just back off a little.
+      }                                 // ~~~~~~~~~ Backoff ~~~~~~~~~
+      static void BeginWrite (
+        Stripe& s)                      // The stripe (held)
+      {                                 // ~~~~~~~~~ BeginWrite ~~~~~~~~~
+        uint32_t q=s.seq.load(std::memory_order_relaxed);
+        s.seq.store(q+1,std::memory_order_relaxed);// Odd: write in progress.
+        std::atomic_thread_fence(std::memory_order_release);// Odd before the data.
+      }                                 // ~~~~~~~~~ BeginWrite ~~~~~~~~~
+      static void EndWrite (
+        Stripe& s)                      // The stripe (held)
+      {                                 // ~~~~~~~~~ EndWrite ~~~~~~~~~
+        uint32_t q=s.seq.load(std::memory_order_relaxed);
+        s.seq.store(q+1,std::memory_order_release);// Even: data before this.
+      }                                 // ~~~~~~~~~ EndWrite ~~~~~~~~~
+      ShmLayoutHeader hdr;              // Versioned header (one cache line)
+      uint64_t ngroups;                 // Groups of kGroup slots (power of two)
+      uint64_t limit;                   // Max used slots (7/8 of capacity)
+      alignas(kCacheLine) std::atomic<uint64_t> used;// Slots not empty (full+tomb+busy)
+      std::atomic<uint64_t> live;       // Full slots
+      std::atomic<uint64_t> tombs;      // Tombstones
+      mutable std::atomic<uint64_t> recoveries;// Stripes repaired after a death
+      mutable Stripe stripes[kStripes]; // Writer locks and reader seqlocks
+      // Followed by the tag array and the slot array (see TagOffset/SlotOffset).
+  };
+}
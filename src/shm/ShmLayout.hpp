@@ -0,0 +1,138 @@
+ /*
+ * *
+ * * Filename: ShmLayout.hpp
+ * *
+ * * Description:
+ * *   Versioned layout header placed at offset zero of every structure we build inside
+ * *     a shared memory segment. The first process to touch a zero-filled segment claims
+ * *     the header and formats the structure; everybody that attaches later waits for the
+ * *     header to be published and checks that the layout (kind, version, element size,
+ * *     capacity) matches what it was compiled against before using it.
+ * *
+ * *  Author:
+ * *    JEP  J. Enrique Peraza
+ * *
+ */
+#pragma once
+#include <atomic>
+#include <time.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+#include "SharedMemory.hpp"
+
+namespace ipc
+{
+  // Size of a cache line on the machines we run on (x86-64/aarch64).
+  constexpr size_t kCacheLine=64;
+  // Magic number stamped in every header ('IPCS').
+  constexpr uint32_t kShmMagic=0x53435049u;
+  // What kind of structure lives behind the header.
+  enum ShmKind : uint16_t
+  {
+    SHM_KIND_NONE=0,                    // Nothing formatted yet
+    SHM_KIND_RING=1,                    // ipc::ShmRing (SPSC)
+    SHM_KIND_MPMC=2,                    // ipc::ShmMpmcQueue
+    SHM_KIND_ARENA=3,                   // ipc::ShmArena
+    SHM_KIND_SNAPSHOT=4,                // ipc::ShmSnapshot
+    SHM_KIND_SNAPSHOT2=5,               // ipc::ShmDoubleSnapshot
+    SHM_KIND_HASHMAP=6,                 // ipc::ShmHashMap
+    SHM_KIND_BROADCAST=7,               // ipc::ShmBroadcast
+    SHM_KIND_REGISTRY=8                 // ipc::ShmRegistry
+  };                                    // ShmKind
+  // Header life cycle.
+  enum ShmState : uint32_t
+  {
+    SHM_STATE_RAW=0,                    // Zero-filled, nobody claimed it
+    SHM_STATE_INIT=1,                   // Claimed, being formatted
+    SHM_STATE_READY=2                   // Formatted and published
+  };                                    // ShmState
+  // The header itself. It always takes exactly one cache line.
+  struct alignas(kCacheLine) ShmLayoutHeader
+  {
+    std::atomic<uint32_t> state;        // ShmState
+    uint32_t magic;                     // kShmMagic once published
+    uint16_t kind;                      // ShmKind
+    uint16_t version;                   // Layout version of that kind
+    uint32_t elemsize;                  // sizeof(element) or 0
+    uint64_t capacity;                  // Number of slots/bytes (kind specific)
+    uint64_t totalsize;                 // Bytes of the segment used by the structure
+    pid_t creator;                      // PID that formatted the structure
+  };                                    // ShmLayoutHeader
+  static_assert(sizeof(ShmLayoutHeader)==kCacheLine,"header must be one cache line");
+  static_assert(std::atomic<uint32_t>::is_always_lock_free,"need address-free atomics");
+  static_assert(std::atomic<uint64_t>::is_always_lock_free,"need address-free atomics");
+  // The layout description a caller expects to find.
+  struct ShmLayoutSpec
+  {
+    uint16_t kind;                      // ShmKind
+    uint16_t version;                   // Layout version
+    uint32_t elemsize;                  // sizeof(element)
+    uint64_t capacity;                  // Slots/bytes
+    uint64_t totalsize;                 // Bytes needed
+  };                                    // ShmLayoutSpec
+  // Claim a header for formatting or wait for somebody else to publish it.
+  //   code==1: the caller owns the header and must format then ShmLayoutPublish().
+  //   code==0: the header was already published and matches the spec.
+  //   code<0 : errn==EPROTO layout mismatch, ETIMEDOUT formatter never finished,
+  //            EINVAL bad region.
+  inline ShmResult ShmLayoutClaim (
+    void* mem,                          // Start of the structure
+    size_t len,                         // Bytes available from mem
+    const ShmLayoutSpec& spec,          // What we expect to find there
+    long timeoutms=1000)                // How long to wait for a formatter
+  {                                     // ~~~~~~~~~ ShmLayoutClaim ~~~~~~~~~
+    if (mem==nullptr||len<spec.totalsize)// Null or too small a region?
+      return {-1,EINVAL};               // Yes, nothing we can do with it.
+    if (((uintptr_t)mem%kCacheLine)!=0) // Not cache line aligned?
+      return {-1,EINVAL};               // Yes, the layout depends on alignment.
+    ShmLayoutHeader* h=static_cast<ShmLayoutHeader*>(mem);
+    uint32_t st=SHM_STATE_RAW;          // What we hope to find.
+    if (h->state.compare_exchange_strong(st,SHM_STATE_INIT,
+      std::memory_order_acq_rel,std::memory_order_acquire))
+    {                                   // We won the race, stamp the header.
+      h->magic=kShmMagic;               // Magic number.
+      h->kind=spec.kind;                // Kind of structure.
+      h->version=spec.version;          // Its layout version.
+      h->elemsize=spec.elemsize;        // Element size.
+      h->capacity=spec.capacity;        // Capacity.
+      h->totalsize=spec.totalsize;      // Footprint.
+      h->creator=getpid();              // Who formatted it.
+      return {1,0};                     // Caller formats the body now.
+    }                                   // Done claiming the header.
+    struct timespec t0,t1;              // Wait-for-publish timer.
+    clock_gettime(CLOCK_MONOTONIC,&t0); // Start the clock.
+    while (st!=SHM_STATE_READY)         // Somebody is still formatting?
+    {                                   // Yes, give them a chance.
+      if (st!=SHM_STATE_INIT)           // Garbage in the state word?
+        return {-1,EPROTO};             // Yes, this is not one of ours.
+      sched_yield();                    // Let the formatter run.
+      clock_gettime(CLOCK_MONOTONIC,&t1);// How long have we waited?
+      if ((t1.tv_sec-t0.tv_sec)*1000L+(t1.tv_nsec-t0.tv_nsec)/1000000L>timeoutms)
+        return {-1,ETIMEDOUT};          // Formatter died or is stuck.
+      st=h->state.load(std::memory_order_acquire);
+    }                                   // Done waiting for the formatter.
+    if (h->magic!=kShmMagic||h->kind!=spec.kind||h->version!=spec.version||
+        h->elemsize!=spec.elemsize||h->capacity!=spec.capacity||
+        h->totalsize!=spec.totalsize)   // Does the published layout match ours?
+      return {-1,EPROTO};               // No, refuse to touch it.
+    return {0,0};                       // Yes, ready to use.
+  }                                     // ~~~~~~~~~ ShmLayoutClaim ~~~~~~~~~
+  // Spin-wait hint for busy loops on shared words.
+  inline void CpuRelax (void)
+  {                                     // ~~~~~~~~~ CpuRelax ~~~~~~~~~
+#if defined(__x86_64__)||defined(__i386__)
+    __builtin_ia32_pause();             // PAUSE: back off the memory bus.
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");      // YIELD: same idea on ARM.
+#endif
+  }                                     // ~~~~~~~~~ CpuRelax ~~~~~~~~~
+  // Publish a header claimed with ShmLayoutClaim() once the body is formatted.
+  inline void ShmLayoutPublish (
+    void* mem)                          // Start of the structure
+  {                                     // ~~~~~~~~~ ShmLayoutPublish ~~~~~~~~~
+    static_cast<ShmLayoutHeader*>(mem)->state.store(SHM_STATE_READY,
+      std::memory_order_release);       // Body stores happen-before this.
+  }                                     // ~~~~~~~~~ ShmLayoutPublish ~~~~~~~~~
+}
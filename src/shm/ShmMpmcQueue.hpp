@@ -0,0 +1,199 @@
+ /*
+ * *
+ * * Filename: ShmMpmcQueue.hpp
+ * *
+ * * Description:
+ * *   Bounded multi-producer/multi-consumer queue that lives entirely inside a shared
+ * *     memory segment. It is Dmitry Vyukov's array queue: every slot carries a sequence
+ * *     number, producers and consumers each claim positions with a single CAS on their
+ * *     own counter and then hand the slot over through its sequence, so there is no
+ * *     global lock and no producer ever waits on another one. When the queue is empty
+ * *     (or full) the blocking calls sleep with FUTEX_WAIT on an event count inside the
+ * *     segment instead of spinning or going through semop(2).
+ * *
+ * *  Author:
+ * *    JEP  J. Enrique Peraza
+ * *
+ */
+#pragma once
+#include <atomic>
+#include <type_traits>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include "ShmLayout.hpp"
+#include "ShmFutex.hpp"
+
+namespace ipc
+{
+  template<typename T,size_t N>
+  class ShmMpmcQueue
+  {
+    static_assert(N>=2&&(N&(N-1))==0,"queue capacity must be a power of two");
+    static_assert(std::is_trivially_copyable<T>::value,"queue elements are copied between processes");
+    public:
+      static constexpr uint16_t kVersion=1;// Bump when the layout below changes.
+      // Bytes a segment needs to hold the queue.
+      static constexpr size_t RequiredBytes (void) { return sizeof(ShmMpmcQueue); }
+      static constexpr size_t Capacity (void) { return N; }
+      // Format a fresh region or validate one formatted by another process.
+      static ShmResult Open (
+        void* mem,                      // Start of the region (cache line aligned)
+        size_t len,                     // Bytes available
+        ShmMpmcQueue** out)             // Where to return the queue
+      {                                 // ~~~~~~~~~ Open ~~~~~~~~~
+        if (out==nullptr)               // Nowhere to put the result?
+          return {-1,EINVAL};           // Yes, error out.
+        *out=nullptr;                   // Nothing yet.
+        ShmResult r=ShmLayoutClaim(mem,len,Spec());
+        if (r.code<0)                   // Bad region or layout?
+          return r;                     // Yes, pass the error along.
+        ShmMpmcQueue* q=static_cast<ShmMpmcQueue*>(mem);
+        if (r.code==1)                  // Are we the formatter?
+        {                               // Yes, so number the slots.
+          for (size_t i=0;i<N;i++)      // For each slot...
+            q->cells[i].seq.store(i,std::memory_order_relaxed);// ...free for lap 0.
+          q->enqpos.store(0,std::memory_order_relaxed);
+          q->deqpos.store(0,std::memory_order_relaxed);
+          q->notempty.seq.store(0,std::memory_order_relaxed);
+          q->notempty.waiters.store(0,std::memory_order_relaxed);
+          q->notfull.seq.store(0,std::memory_order_relaxed);
+          q->notfull.waiters.store(0,std::memory_order_relaxed);
+          ShmLayoutPublish(mem);        // Let everybody else in.
+        }                               // Done formatting.
+        *out=q;                         // Hand back the queue.
+        return {0,0};                   // Success.
+      }                                 // ~~~~~~~~~ Open ~~~~~~~~~
+      // Convenience overload for an attached segment.
+      template<typename Seg>
+      static ShmResult Open (
+        Seg& seg,                       // An attached segment
+        ShmMpmcQueue** out)             // Where to return the queue
+      {                                 // ~~~~~~~~~ Open ~~~~~~~~~
+        if (seg.GetPointer()==nullptr)  // Not attached?
+          return {-1,EINVAL};           // Yes, nothing to open.
+        return Open(seg.GetPointer(),seg.GetShmSize(),out);
+      }                                 // ~~~~~~~~~ Open ~~~~~~~~~
+      // Enqueue without blocking. False when the queue is full.
+      bool TryPush (
+        const T& v)                     // Element to enqueue
+      {                                 // ~~~~~~~~~ TryPush ~~~~~~~~~
+        uint64_t pos=enqpos.load(std::memory_order_relaxed);
+        Cell* c=nullptr;                // The slot we will claim.
+        for (;;)                        // Until we claim a slot or see it full.
+        {                               // Look at the slot for this position.
+          c=&cells[pos&(N-1)];          // Slot for pos.
+          uint64_t seq=c->seq.load(std::memory_order_acquire);
+          int64_t dif=(int64_t)seq-(int64_t)pos;
+          if (dif==0)                   // Slot free for this lap?
+          {                             // Yes, try to claim the position.
+            if (enqpos.compare_exchange_weak(pos,pos+1,std::memory_order_relaxed))
+              break;                    // Ours, go fill it.
+          }                             // Lost the race, pos was reloaded.
+          else if (dif<0)               // Slot still holds last lap's element?
+            return false;               // Yes, the queue is full.
+          else                          // Another producer got ahead of us.
+            pos=enqpos.load(std::memory_order_relaxed);// Try the next position.
+        }                               // Done claiming.
+        memcpy(&c->data,&v,sizeof(T));  // Fill the slot.
+        c->seq.store(pos+1,std::memory_order_release);// Hand it to consumers.
+        notempty.Notify();              // Wake a sleeping consumer (if any).
+        return true;                    // Enqueued.
+      }                                 // ~~~~~~~~~ TryPush ~~~~~~~~~
+      // Dequeue without blocking. False when the queue is empty.
+      bool TryPop (
+        T& v)                           // Where to put the element
+      {                                 // ~~~~~~~~~ TryPop ~~~~~~~~~
+        uint64_t pos=deqpos.load(std::memory_order_relaxed);
+        Cell* c=nullptr;                // The slot we will claim.
+        for (;;)                        // Until we claim a slot or see it empty.
+        {                               // Look at the slot for this position.
+          c=&cells[pos&(N-1)];          // Slot for pos.
+          uint64_t seq=c->seq.load(std::memory_order_acquire);
+          int64_t dif=(int64_t)seq-(int64_t)(pos+1);
+          if (dif==0)                   // Slot filled for this lap?
+          {                             // Yes, try to claim the position.
+            if (deqpos.compare_exchange_weak(pos,pos+1,std::memory_order_relaxed))
+              break;                    // Ours, go empty it.
+          }                             // Lost the race, pos was reloaded.
+          else if (dif<0)               // Producer has not filled it yet?
+            return false;               // Yes, the queue is empty.
+          else                          // Another consumer got ahead of us.
+            pos=deqpos.load(std::memory_order_relaxed);// Try the next position.
+        }                               // Done claiming.
+        memcpy(&v,&c->data,sizeof(T));  // Empty the slot.
+        c->seq.store(pos+N,std::memory_order_release);// Free it for the next lap.
+        notfull.Notify();               // Wake a sleeping producer (if any).
+        return true;                    // Dequeued.
+      }                                 // ~~~~~~~~~ TryPop ~~~~~~~~~
+      // Enqueue, sleeping on the futex while the queue is full. With a timeout
+      // returns false if it expired first.
+      bool Push (
+        const T& v,                     // Element to enqueue
+        const struct timespec* timeout=nullptr)// Relative timeout per sleep or nullptr
+      {                                 // ~~~~~~~~~ Push ~~~~~~~~~
+        for (;;)                        // Until we get it in.
+        {                               // Fast path first.
+          if (TryPush(v))               // Room?
+            return true;                // Yes, done.
+          uint32_t tok=notfull.PrepareWait();// Announce we are about to sleep.
+          if (TryPush(v))               // Did a consumer free a slot meanwhile?
+          {                             // Yes, no need to sleep.
+            notfull.CancelWait();       // Withdraw.
+            return true;                // Done.
+          }                             // Still full.
+          ShmResult r=notfull.Wait(tok,timeout);// Sleep until a pop.
+          if (r.code<0&&r.errn==ETIMEDOUT)// Did we time out?
+            return false;               // Yes, give up.
+        }                               // Try again.
+      }                                 // ~~~~~~~~~ Push ~~~~~~~~~
+      // Dequeue, sleeping on the futex while the queue is empty. With a timeout
+      // returns false if it expired first.
+      bool Pop (
+        T& v,                           // Where to put the element
+        const struct timespec* timeout=nullptr)// Relative timeout per sleep or nullptr
+      {                                 // ~~~~~~~~~ Pop ~~~~~~~~~
+        for (;;)                        // Until we get something.
+        {                               // Fast path first.
+          if (TryPop(v))                // Anything queued?
+            return true;                // Yes, done.
+          uint32_t tok=notempty.PrepareWait();// Announce we are about to sleep.
+          if (TryPop(v))                // Did a producer push meanwhile?
+          {                             // Yes, no need to sleep.
+            notempty.CancelWait();      // Withdraw.
+            return true;                // Done.
+          }                             // Still empty.
+          ShmResult r=notempty.Wait(tok,timeout);// Sleep until a push.
+          if (r.code<0&&r.errn==ETIMEDOUT)// Did we time out?
+            return false;               // Yes, give up.
+        }                               // Try again.
+      }                                 // ~~~~~~~~~ Pop ~~~~~~~~~
+      // Approximate number of queued elements.
+      size_t Size (void) const
+      {                                 // ~~~~~~~~~ Size ~~~~~~~~~
+        uint64_t d=deqpos.load(std::memory_order_acquire);
+        uint64_t e=enqpos.load(std::memory_order_acquire);
+        return (e>d)?(size_t)(e-d):0;   // Never negative.
+      }                                 // ~~~~~~~~~ Size ~~~~~~~~~
+      bool Empty (void) const { return Size()==0; }
+    private:
+      ShmMpmcQueue (void)=delete;       // Only ever placed on top of a segment.
+      static ShmLayoutSpec Spec (void)
+      {                                 // ~~~~~~~~~ Spec ~~~~~~~~~
+        return {SHM_KIND_MPMC,kVersion,(uint32_t)sizeof(T),(uint64_t)N,
+          (uint64_t)sizeof(ShmMpmcQueue)};// What Open() expects to find.
+      }                                 // ~~~~~~~~~ Spec ~~~~~~~~~
+      struct Cell
+      {
+        std::atomic<uint64_t> seq;      // Lap stamp: pos free, pos+1 full
+        T data;                         // The element
+      };                                // Cell
+      ShmLayoutHeader hdr;              // Versioned header (one cache line)
+      alignas(kCacheLine) std::atomic<uint64_t> enqpos;// Next position to fill
+      alignas(kCacheLine) std::atomic<uint64_t> deqpos;// Next position to drain
+      alignas(kCacheLine) ShmEventCount notempty;// Consumers sleep here
+      alignas(kCacheLine) ShmEventCount notfull;// Producers sleep here
+      alignas(kCacheLine) Cell cells[N];// The slots
+  };
+}
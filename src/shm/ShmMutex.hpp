@@ -0,0 +1,371 @@
+ /*
+ * *
+ * * Filename: ShmMutex.hpp
+ * *
+ * * Description:
+ * *   Process-shared mutex and condition variable built directly on futex(2), meant to be
+ * *     embedded in structures that live in a shared memory segment. A zero-filled
+ * *     ShmMutex is a valid unlocked robust mutex, so a fresh segment needs no
+ * *     initialisation (call Init() for priority inheritance or a different probe).
+ * *
+ * *   The lock word follows the kernel's owner-TID protocol (TID | FUTEX_WAITERS), which
+ * *     is what makes FUTEX_LOCK_PI usable for the priority inheritance variant. Lockers
+ * *     spin for an adaptive number of iterations before sleeping.
+ * *
+ * *   Dead owners: the kernel robust list of every thread belongs to glibc, so instead of
+ * *     registering our own we detect a dead owner from user space. Waiters sleep with a
+ * *     probe timeout and check whether the owning TID still exists; a holder-only pair
+ * *     of acquire/release counters tells the next owner that its predecessor never
+ * *     unlocked. Either way the new owner gets the lock with errn==EOWNERDEAD and must
+ * *     repair the protected data and call Consistent() before Unlock(), otherwise the
+ * *     mutex becomes ENOTRECOVERABLE - the same contract as a robust pthread mutex.
+ * *     A TID recycled by the kernel before the probe fires looks alive; the window is
+ * *     small but real.
+ * *
+ * *  Author:
+ * *    JEP  J. Enrique Peraza
+ * *
+ */
+#pragma once
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <limits.h>
+#include <atomic>
+#include <stdint.h>
+#include "ShmLayout.hpp"
+#include "ShmFutex.hpp"
+
+namespace ipc
+{
+  // Mutex flags for ShmMutex::Init()
+  enum
+  {
+    SHM_MUTEX_PI=1,                     // Priority inheritance (FUTEX_LOCK_PI)
+    SHM_MUTEX_NONROBUST=2               // Never probe for dead owners
+  };                                    // ShmMutex flags
+  // Calling thread's TID, cached per thread. The fork hook clears the cache
+  // in the child, where the only surviving thread has a new TID.
+  inline thread_local pid_t shmCachedTid=0;
+  inline const int shmTidAtFork=pthread_atfork(nullptr,nullptr,[] { shmCachedTid=0; });
+  inline pid_t ShmSelfTid (void)
+  {                                     // ~~~~~~~~~ ShmSelfTid ~~~~~~~~~
+    if (shmCachedTid==0)                // Not cached yet?
+      shmCachedTid=(pid_t)syscall(SYS_gettid);// Ask the kernel once.
+    return shmCachedTid;                // Our TID.
+  }                                     // ~~~~~~~~~ ShmSelfTid ~~~~~~~~~
+  class ShmMutex
+  {
+    public:
+      // Format in place (optional: all-zero memory is a robust, non-PI mutex).
+      void Init (
+        int fl=0,                       // SHM_MUTEX_* flags
+        unsigned probe=0)               // Dead-owner probe interval in ms (0: 50ms)
+      {                                 // ~~~~~~~~~ Init ~~~~~~~~~
+        word.store(0,std::memory_order_relaxed);
+        flags=(uint32_t)fl;             // Behaviour.
+        probems=probe;                  // Probe interval.
+        acquired=released=0;            // No history.
+        state=kConsistent;              // Healthy.
+        spin.store(0,std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+      }                                 // ~~~~~~~~~ Init ~~~~~~~~~
+      // Acquire. code==0 means we hold the lock; errn==EOWNERDEAD additionally
+      // means the previous owner died holding it. code<0: errn is ETIMEDOUT,
+      // ENOTRECOVERABLE or EDEADLK and we do not hold the lock.
+      ShmResult Lock (
+        const struct timespec* timeout=nullptr)// Relative timeout or nullptr
+      {                                 // ~~~~~~~~~ Lock ~~~~~~~~~
+        pid_t me=ShmSelfTid();          // Who we are.
+        uint32_t v=0;                   // Expect it free.
+        if (word.compare_exchange_strong(v,(uint32_t)me,std::memory_order_acquire,
+          std::memory_order_relaxed))   // Uncontended fast path.
+          return Acquired();            // Ours.
+        if ((v&FUTEX_TID_MASK)==(uint32_t)me)// Relocking our own mutex?
+          return {-1,EDEADLK};          // Yes, that would deadlock.
+        if (SpinAcquire(me))            // Owner let go while we spun?
+          return Acquired();            // Ours.
+        ShmResult r=(flags&SHM_MUTEX_PI)?SlowLockPi(me,timeout):SlowLock(me,timeout);
+        if (r.code<0)                   // Timed out or broken?
+          return r;                     // Yes, we do not hold it.
+        return Acquired();              // Ours.
+      }                                 // ~~~~~~~~~ Lock ~~~~~~~~~
+      // Acquire only if free. {-1,EBUSY} when somebody holds it.
+      ShmResult TryLock (void)
+      {                                 // ~~~~~~~~~ TryLock ~~~~~~~~~
+        uint32_t v=0;                   // Expect it free.
+        if (!word.compare_exchange_strong(v,(uint32_t)ShmSelfTid(),
+          std::memory_order_acquire,std::memory_order_relaxed))
+        {                               // Held by somebody.
+          if (!(flags&SHM_MUTEX_NONROBUST)&&OwnerDead(v)&&Steal(v,ShmSelfTid()))
+            return Acquired();          // ...who was dead, so it is ours.
+          return {-1,EBUSY};            // Busy.
+        }                               // Done with busy.
+        return Acquired();              // Ours.
+      }                                 // ~~~~~~~~~ TryLock ~~~~~~~~~
+      ShmResult Unlock (void)
+      {                                 // ~~~~~~~~~ Unlock ~~~~~~~~~
+        pid_t me=ShmSelfTid();          // Who we are.
+        uint32_t v=word.load(std::memory_order_relaxed);
+        if ((v&FUTEX_TID_MASK)!=(uint32_t)me)// Do we own it?
+          return {-1,EPERM};            // No.
+        if (state==kInconsistent)       // Owner died and nobody called Consistent()?
+          state=kNotRecoverable;        // Yes, poison it for good.
+        released++;                     // Clean release (holder-only counter).
+        if (flags&SHM_MUTEX_PI)         // Priority inheritance?
+        {                               // Yes, the kernel may hold waiters.
+          v=(uint32_t)me;               // Expect no waiters.
+          if (!word.compare_exchange_strong(v,0,std::memory_order_release,
+            std::memory_order_relaxed)) // Waiters queued in the kernel?
+            if (syscall(SYS_futex,reinterpret_cast<uint32_t*>(&word),FUTEX_UNLOCK_PI,
+              0,nullptr,nullptr,0)!=0)  // Hand it to the top waiter.
+              return {-1,errno};        // Should not happen.
+        }                               // Done with PI.
+        else if (word.exchange(0,std::memory_order_release)&FUTEX_WAITERS)
+          FutexWake(&word,(state==kNotRecoverable)?INT_MAX:1);// Wake a sleeper.
+        return {0,0};                   // Released.
+      }                                 // ~~~~~~~~~ Unlock ~~~~~~~~~
+      // After EOWNERDEAD: the data is repaired, keep using the mutex.
+      ShmResult Consistent (void)
+      {                                 // ~~~~~~~~~ Consistent ~~~~~~~~~
+        if ((word.load(std::memory_order_relaxed)&FUTEX_TID_MASK)!=(uint32_t)ShmSelfTid())
+          return {-1,EPERM};            // Only the owner may say so.
+        if (state!=kInconsistent)       // Nothing to repair?
+          return {-1,EINVAL};           // Yes, as pthread_mutex_consistent().
+        state=kConsistent;              // Healthy again.
+        return {0,0};                   // Done.
+      }                                 // ~~~~~~~~~ Consistent ~~~~~~~~~
+      // TID of the current owner (0 if free).
+      pid_t Owner (void) const { return (pid_t)(word.load(std::memory_order_relaxed)&FUTEX_TID_MASK); }
+    private:
+      static constexpr uint32_t kConsistent=0;
+      static constexpr uint32_t kInconsistent=1;
+      static constexpr uint32_t kNotRecoverable=2;
+      static constexpr int kMaxSpin=200;// Spin budget ceiling.
+      static constexpr unsigned kDefaultProbeMs=50;
+      // Bookkeeping every successful acquisition goes through.
+      ShmResult Acquired (void)
+      {                                 // ~~~~~~~~~ Acquired ~~~~~~~~~
+        if (state==kNotRecoverable)     // Poisoned by an earlier owner death?
+        {                               // Yes, give it back and refuse.
+          released++;                   // Balance the books.
+          acquired++;                   // (both holder-only).
+          if (flags&SHM_MUTEX_PI)       // PI word must go through the kernel.
+          {
+            uint32_t v=(uint32_t)ShmSelfTid();
+            if (!word.compare_exchange_strong(v,0,std::memory_order_release))
+              syscall(SYS_futex,reinterpret_cast<uint32_t*>(&word),FUTEX_UNLOCK_PI,0,nullptr,nullptr,0);
+          }
+          else if (word.exchange(0,std::memory_order_release)&FUTEX_WAITERS)
+            FutexWake(&word,INT_MAX);   // Let everybody see ENOTRECOVERABLE.
+          return {-1,ENOTRECOVERABLE};  // Broken for good.
+        }                               // Done with poisoned.
+        bool died=(acquired!=released); // Did the last owner skip Unlock()?
+        acquired++;                     // One more acquisition.
+        if (died)                       // Previous owner died holding it?
+        {                               // Yes, the data may be half updated.
+          released=acquired-1;          // Re-balance the books.
+          state=kInconsistent;          // Until Consistent() is called.
+          return {0,EOWNERDEAD};        // Held, but tell the caller.
+        }                               // Done with dead owner.
+        return {0,0};                   // Held.
+      }                                 // ~~~~~~~~~ Acquired ~~~~~~~~~
+      static bool MultiCpu (void)
+      {                                 // ~~~~~~~~~ MultiCpu ~~~~~~~~~
+        static const bool smp=sysconf(_SC_NPROCESSORS_ONLN)>1;
+        return smp;                     // Spinning is pointless on one CPU.
+      }                                 // ~~~~~~~~~ MultiCpu ~~~~~~~~~
+      // Spin for the adaptive budget hoping the owner lets go.
+      bool SpinAcquire (
+        pid_t me)                       // Our TID
+      {                                 // ~~~~~~~~~ SpinAcquire ~~~~~~~~~
+        if (!MultiCpu())                // Single CPU?
+          return false;                 // Yes, the owner cannot run while we spin.
+        int budget=spin.load(std::memory_order_relaxed)*2+10;
+        if (budget>kMaxSpin)            // Cap it.
+          budget=kMaxSpin;              // At the ceiling.
+        for (int i=0;i<budget;i++)      // Spin...
+        {
+          CpuRelax();                   // ...politely.
+          uint32_t v=word.load(std::memory_order_relaxed);
+          if (v==0&&word.compare_exchange_weak(v,(uint32_t)me,
+            std::memory_order_acquire,std::memory_order_relaxed))
+          {                             // Got it: move the budget toward what it took.
+            int s=spin.load(std::memory_order_relaxed);
+            spin.store(s+(i-s)/8,std::memory_order_relaxed);
+            return true;                // Ours.
+          }                             // Done with got it.
+        }                               // Spun out: spinning did not pay off.
+        int s=spin.load(std::memory_order_relaxed);
+        spin.store(s+(budget-s)/8,std::memory_order_relaxed);
+        return false;                   // Go to sleep.
+      }                                 // ~~~~~~~~~ SpinAcquire ~~~~~~~~~
+      // Is the thread named in the lock word gone?
+      static bool OwnerDead (
+        uint32_t v)                     // Lock word
+      {                                 // ~~~~~~~~~ OwnerDead ~~~~~~~~~
+        pid_t t=(pid_t)(v&FUTEX_TID_MASK);// Owner TID.
+        return t!=0&&kill(t,0)==-1&&errno==ESRCH;// No such thread.
+      }                                 // ~~~~~~~~~ OwnerDead ~~~~~~~~~
+      // Take the lock over from a dead owner (keeps the waiters bit).
+      bool Steal (
+        uint32_t v,                     // Lock word naming the dead owner
+        pid_t me)                       // Our TID
+      {                                 // ~~~~~~~~~ Steal ~~~~~~~~~
+        return word.compare_exchange_strong(v,(uint32_t)me|(v&FUTEX_WAITERS),
+          std::memory_order_acquire,std::memory_order_relaxed);
+      }                                 // ~~~~~~~~~ Steal ~~~~~~~~~
+      // How long the next sleep may last: the probe interval, clipped to
+      // what is left of the caller's timeout. False once that has expired.
+      bool NextSleep (
+        const struct timespec* timeout, // Caller's relative timeout or nullptr
+        const struct timespec& start,   // When Lock() started (monotonic)
+        struct timespec* out,           // Relative sleep
+        bool* forever) const            // Out: sleep without a timeout
+      {                                 // ~~~~~~~~~ NextSleep ~~~~~~~~~
+        bool robust=!(flags&SHM_MUTEX_NONROBUST);
+        long long left=-1;              // ns left of the caller's timeout.
+        if (timeout!=nullptr)           // Caller has a deadline?
+        {                               // Yes, how much of it is left?
+          struct timespec now;          // Current time.
+          clock_gettime(CLOCK_MONOTONIC,&now);
+          long long used=(now.tv_sec-start.tv_sec)*1000000000LL+(now.tv_nsec-start.tv_nsec);
+          left=timeout->tv_sec*1000000000LL+timeout->tv_nsec-used;
+          if (left<=0)                  // Expired?
+            return false;               // Yes.
+        }                               // Done with deadline.
+        long long probe=robust?(long long)(probems?probems:kDefaultProbeMs)*1000000LL:-1;
+        long long ns=(left<0)?probe:((probe<0||left<probe)?left:probe);
+        *forever=(ns<0);                // No deadline and no probing.
+        if (ns>=0)                      // Bounded sleep?
+        {
+          out->tv_sec=(time_t)(ns/1000000000LL);
+          out->tv_nsec=(long)(ns%1000000000LL);
+        }
+        return true;                    // Sleep.
+      }                                 // ~~~~~~~~~ NextSleep ~~~~~~~~~
+      ShmResult SlowLock (
+        pid_t me,                       // Our TID
+        const struct timespec* timeout) // Relative timeout or nullptr
+      {                                 // ~~~~~~~~~ SlowLock ~~~~~~~~~
+        struct timespec start,nap;      // Start time and next sleep.
+        bool forever=false;             // Sleep without timeout?
+        clock_gettime(CLOCK_MONOTONIC,&start);
+        uint32_t v=word.load(std::memory_order_relaxed);
+        for (;;)                        // Until we own it.
+        {
+          if ((v&FUTEX_TID_MASK)==0)    // Free?
+          {                             // Yes; others may sleep, so keep the waiters bit.
+            if (word.compare_exchange_weak(v,(uint32_t)me|FUTEX_WAITERS,
+              std::memory_order_acquire,std::memory_order_relaxed))
+              return {0,0};             // Ours.
+            continue;                   // v reloaded.
+          }                             // Done with free.
+          if (!(v&FUTEX_WAITERS))       // Does the owner know to wake somebody?
+          {                             // No, tell it.
+            if (!word.compare_exchange_weak(v,v|FUTEX_WAITERS,
+              std::memory_order_relaxed))
+              continue;                 // v reloaded.
+            v|=FUTEX_WAITERS;           // What the word holds now.
+          }                             // Done flagging.
+          if (!NextSleep(timeout,start,&nap,&forever))// Out of time?
+            return {-1,ETIMEDOUT};      // Yes.
+          ShmResult r=FutexWait(&word,v,forever?nullptr:&nap);
+          if (r.code<0&&r.errn==ETIMEDOUT&&!(flags&SHM_MUTEX_NONROBUST)&&OwnerDead(v)&&Steal(v,me))
+            return {0,0};               // Owner died, the lock is ours.
+          v=word.load(std::memory_order_relaxed);// Look again.
+        }                               // Done looping.
+      }                                 // ~~~~~~~~~ SlowLock ~~~~~~~~~
+      ShmResult SlowLockPi (
+        pid_t me,                       // Our TID
+        const struct timespec* timeout) // Relative timeout or nullptr
+      {                                 // ~~~~~~~~~ SlowLockPi ~~~~~~~~~
+        struct timespec start,nap;      // Start time and next sleep.
+        bool forever=false;             // Sleep without timeout?
+        clock_gettime(CLOCK_MONOTONIC,&start);
+        for (;;)                        // Until we own it.
+        {
+          if (!NextSleep(timeout,start,&nap,&forever))// Out of time?
+            return {-1,ETIMEDOUT};      // Yes.
+          struct timespec abs;          // FUTEX_LOCK_PI wants CLOCK_REALTIME absolute.
+          if (!forever)                 // Bounded?
+          {
+            clock_gettime(CLOCK_REALTIME,&abs);
+            abs.tv_sec+=nap.tv_sec;     // Add the nap.
+            abs.tv_nsec+=nap.tv_nsec;   // ...
+            if (abs.tv_nsec>=1000000000L)// Carry.
+            {
+              abs.tv_sec++;
+              abs.tv_nsec-=1000000000L;
+            }
+          }
+          // The kernel queues us, boosts the owner and, when the owner dies
+          // with waiters queued, hands the lock to the top waiter.
+          if (syscall(SYS_futex,reinterpret_cast<uint32_t*>(&word),FUTEX_LOCK_PI,
+            0,forever?nullptr:&abs,nullptr,0)==0)
+            return {0,0};               // Ours.
+          int e=errno;                  // Why not?
+          if (e==EDEADLK)               // We already own it?
+            return {-1,EDEADLK};        // Yes.
+          if (e==ETIMEDOUT||e==ESRCH||e==EOWNERDEAD)// Owner slow or gone?
+          {                             // Gone and nobody queued: take it over.
+            uint32_t v=word.load(std::memory_order_relaxed);
+            if (!(flags&SHM_MUTEX_NONROBUST)&&OwnerDead(v)&&Steal(v,me))
+              return {0,0};             // Ours.
+          }                             // EINTR/EAGAIN: just go again.
+          uint32_t v=0;                 // Maybe it is free by now.
+          if (word.compare_exchange_strong(v,(uint32_t)me,std::memory_order_acquire,
+            std::memory_order_relaxed))
+            return {0,0};               // Ours.
+        }                               // Done looping.
+      }                                 // ~~~~~~~~~ SlowLockPi ~~~~~~~~~
+      std::atomic<uint32_t> word;       // Owner TID | FUTEX_WAITERS
+      uint32_t flags;                   // SHM_MUTEX_*
+      uint32_t acquired;                // Acquisitions (written by the holder only)
+      uint32_t released;                // Clean releases (written by the holder only)
+      uint32_t state;                   // kConsistent/kInconsistent/kNotRecoverable
+      std::atomic<int32_t> spin;        // Adaptive spin budget
+      uint32_t probems;                 // Dead-owner probe interval (ms), 0: default
+      uint32_t pad;                     // Keep it 8-byte sized
+  };
+  static_assert(sizeof(ShmMutex)==32,"ShmMutex layout is shared between processes");
+  // Condition variable for use with ShmMutex. All-zero memory is valid.
+  class ShmCondVar
+  {
+    public:
+      void Init (void)
+      {                                 // ~~~~~~~~~ Init ~~~~~~~~~
+        ev.seq.store(0,std::memory_order_relaxed);
+        ev.waiters.store(0,std::memory_order_relaxed);
+      }                                 // ~~~~~~~~~ Init ~~~~~~~~~
+      // Atomically release m and sleep until signalled (or the relative
+      // timeout expires), then reacquire m. Returns what Lock() returned,
+      // or {0,ETIMEDOUT} if we timed out (the mutex is held again either way
+      // unless code<0). Spurious wakeups happen: wait in a loop.
+      ShmResult Wait (
+        ShmMutex& m,                    // Held by the caller
+        const struct timespec* timeout=nullptr)// Relative timeout or nullptr
+      {                                 // ~~~~~~~~~ Wait ~~~~~~~~~
+        uint32_t tok=ev.PrepareWait();  // Register before we let go.
+        ShmResult u=m.Unlock();         // Let the signaller in.
+        if (u.code<0)                   // Not ours to release?
+        {                               // Yes, do not sleep with it.
+          ev.CancelWait();              // Withdraw.
+          return u;                     // EPERM.
+        }                               // Done with bad unlock.
+        ShmResult w=ev.Wait(tok,timeout);// Sleep.
+        ShmResult r=m.Lock();           // Take it back.
+        if (r.code==0&&r.errn==0&&w.code<0&&w.errn==ETIMEDOUT)
+          return {0,ETIMEDOUT};         // Held, but we timed out.
+        return r;                       // Held (maybe EOWNERDEAD) or broken.
+      }                                 // ~~~~~~~~~ Wait ~~~~~~~~~
+      void Signal (void) { ev.Notify(1); }
+      void Broadcast (void) { ev.Notify(INT_MAX); }
+    private:
+      ShmEventCount ev;                 // Futex word plus sleeper count
+  };
+}
@@ -0,0 +1,361 @@
+ /*
+ * *
+ * * Filename: ShmNuma.hpp
+ * *
+ * * Description:
+ * *   NUMA placement for attached shared memory segments: bind a segment (or a sub-range
+ * *     of it) to a node, prefer a node, interleave it across nodes, migrate pages that
+ * *     already exist, and report which node every page actually landed on. These are
+ * *     raw mbind(2)/move_pages(2)/get_mempolicy(2) calls, so there is no libnuma
+ * *     dependency.
+ * *
+ * *   A policy set with mbind() on a System V or POSIX segment is a shared policy: it
+ * *     belongs to the segment, not to our mapping, and governs the pages faulted in by
+ * *     every attacher. It only affects pages faulted in after the call; pass
+ * *     SHM_NUMA_MOVE (pages only we map) or SHM_NUMA_MOVE_ALL (every page, needs
+ * *     CAP_SYS_NICE) to move the ones that already exist, e.g. after a prefault policy.
+ * *
+ * *   Single-node machines and kernels built without CONFIG_NUMA: placing on node 0 (or
+ * *     interleaving over the allowed nodes) succeeds with errn==ENOSYS when the kernel
+ * *     lacks the calls, and ShmNumaQuery() falls back to mincore(2), reporting node 0
+ * *     for resident pages. Asking for any other node fails with EINVAL.
+ * *
+ * *  Author:
+ * *    JEP  J. Enrique Peraza
+ * *
+ */
+#pragma once
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <new>
+#include "SharedMemory.hpp"
+
+namespace ipc
+{
+  // What to do with pages that already exist when a policy is applied
+  enum ShmNumaMove
+  {
+    SHM_NUMA_NOMOVE=0,                  // Only new faults follow the policy
+    SHM_NUMA_MOVE=MPOL_MF_MOVE,         // Move existing pages mapped only by us
+    SHM_NUMA_MOVE_ALL=MPOL_MF_MOVE_ALL  // Move every existing page (CAP_SYS_NICE)
+  };                                    // ShmNumaMove
+  // A set of NUMA nodes in the layout the kernel expects.
+  struct ShmNodeMask
+  {
+    static constexpr int kMaxNodes=1024;// CONFIG_NODES_SHIFT tops out at 10
+    static constexpr int kBits=8*sizeof(unsigned long);
+    unsigned long bits[kMaxNodes/kBits]{};// Bit n: node n
+    void Set (int n) { bits[n/kBits]|=1UL<<(n%kBits); }
+    void Clear (int n) { bits[n/kBits]&=~(1UL<<(n%kBits)); }
+    bool Test (int n) const { return (bits[n/kBits]>>(n%kBits))&1UL; }
+    int Count (void) const
+    {                                   // ~~~~~~~~~ Count ~~~~~~~~~
+      int c=0;                          // Nodes in the set.
+      for (unsigned long w:bits)        // For each word...
+        c+=__builtin_popcountl(w);      // ...count its bits.
+      return c;                         // Total.
+    }                                   // ~~~~~~~~~ Count ~~~~~~~~~
+    // Only node 0 (or nothing) - what a non-NUMA kernel can honour.
+    bool NodeZeroOnly (void) const
+    {                                   // ~~~~~~~~~ NodeZeroOnly ~~~~~~~~~
+      if (bits[0]&~1UL)                 // Anything but node 0 in the first word?
+        return false;                   // Yes.
+      for (size_t i=1;i<sizeof(bits)/sizeof(bits[0]);i++)
+        if (bits[i])                    // Anything in the rest?
+          return false;                 // Yes.
+      return true;                      // Node 0 at most.
+    }                                   // ~~~~~~~~~ NodeZeroOnly ~~~~~~~~~
+  };                                    // ShmNodeMask
+  // Nodes this process may allocate from. Without NUMA support in the
+  // kernel that is node 0, returned with errn==ENOSYS.
+  inline ShmResult ShmNumaAllowed (
+    ShmNodeMask* mask)                  // Out: allowed nodes
+  {                                     // ~~~~~~~~~ ShmNumaAllowed ~~~~~~~~~
+    *mask=ShmNodeMask{};                // Start empty.
+    if (syscall(SYS_get_mempolicy,nullptr,mask->bits,(unsigned long)ShmNodeMask::kMaxNodes,
+      nullptr,(unsigned long)MPOL_F_MEMS_ALLOWED)!=0)
+    {                                   // No NUMA here?
+      int err=errno;                    // Why?
+      if (err!=ENOSYS)                  // Something else went wrong?
+        return {-1,err};                // Yes, report it.
+      mask->Set(0);                     // Everything lives on node 0.
+      return {1,ENOSYS};                // One node, the fallback.
+    }                                   // Done with fallback.
+    return {mask->Count(),0};           // Number of nodes.
+  }                                     // ~~~~~~~~~ ShmNumaAllowed ~~~~~~~~~
+  // Number of nodes we may allocate from (1 when NUMA is unavailable).
+  inline int ShmNumaNodeCount (void)
+  {                                     // ~~~~~~~~~ ShmNumaNodeCount ~~~~~~~~~
+    ShmNodeMask m;                      // Allowed nodes.
+    ShmResult r=ShmNumaAllowed(&m);     // Ask.
+    return (r.code>0)?r.code:1;         // At least one.
+  }                                     // ~~~~~~~~~ ShmNumaNodeCount ~~~~~~~~~
+  // Widen [addr,addr+len) to whole pages, as mbind() wants.
+  inline void ShmNumaPageSpan (
+    void* addr,                         // Start of the range
+    size_t len,                         // Length of the range
+    void** start,                       // Out: page-aligned start
+    size_t* plen)                       // Out: length in whole pages
+  {                                     // ~~~~~~~~~ ShmNumaPageSpan ~~~~~~~~~
+    uintptr_t ps=(uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t a=(uintptr_t)addr&~(ps-1);// Round the start down...
+    uintptr_t e=((uintptr_t)addr+len+ps-1)&~(ps-1);// ...and the end up.
+    *start=(void*)a;                    // Aligned start.
+    *plen=(size_t)(e-a);                // Whole pages.
+  }                                     // ~~~~~~~~~ ShmNumaPageSpan ~~~~~~~~~
+  // Apply an MPOL_* mode to a range of an attached segment.
+  inline ShmResult ShmNumaPolicy (
+    void* addr,                         // Start of the range (any alignment)
+    size_t len,                         // Length of the range
+    int mode,                           // MPOL_BIND/PREFERRED/INTERLEAVE/DEFAULT
+    const ShmNodeMask* nodes,           // Nodes for the mode (nullptr for DEFAULT)
+    int move=SHM_NUMA_NOMOVE)           // ShmNumaMove
+  {                                     // ~~~~~~~~~ ShmNumaPolicy ~~~~~~~~~
+    if (addr==nullptr||len==0)          // Nothing attached?
+      return {-1,EINVAL};               // Nothing to place.
+    void* start;                        // Page-aligned start.
+    size_t plen;                        // Whole pages.
+    ShmNumaPageSpan(addr,len,&start,&plen);
+    if (syscall(SYS_mbind,start,(unsigned long)plen,(unsigned long)mode,
+      nodes?nodes->bits:nullptr,nodes?(unsigned long)ShmNodeMask::kMaxNodes:0UL,
+      (unsigned)move)!=0)               // Did the kernel take it?
+    {                                   // No.
+      int err=errno;                    // Why?
+      if (err==ENOSYS&&(nodes==nullptr||nodes->NodeZeroOnly()))
+        return {0,ENOSYS};              // No NUMA: everything is on node 0 anyway.
+      if (err==ENOSYS)                  // Asked for a node that cannot exist?
+        return {-1,EINVAL};             // As mbind() says for offline nodes.
+      return {-1,err};                  // Real failure (EIO: pages would not move).
+    }                                   // Done with failure.
+    return {0,0};                       // Placed.
+  }                                     // ~~~~~~~~~ ShmNumaPolicy ~~~~~~~~~
+  // Allocate the range only from node.
+  inline ShmResult ShmNumaBind (
+    void* addr,                         // Start of the range
+    size_t len,                         // Length of the range
+    int node,                           // Target node
+    int move=SHM_NUMA_NOMOVE)           // ShmNumaMove
+  {                                     // ~~~~~~~~~ ShmNumaBind ~~~~~~~~~
+    if (node<0||node>=ShmNodeMask::kMaxNodes)// Sane node number?
+      return {-1,EINVAL};               // No.
+    ShmNodeMask m;                      // Just that node.
+    m.Set(node);                        // Set it.
+    return ShmNumaPolicy(addr,len,MPOL_BIND,&m,move);
+  }                                     // ~~~~~~~~~ ShmNumaBind ~~~~~~~~~
+  // Allocate the range from node while it has memory, elsewhere otherwise.
+  inline ShmResult ShmNumaPrefer (
+    void* addr,                         // Start of the range
+    size_t len,                         // Length of the range
+    int node)                           // Preferred node
+  {                                     // ~~~~~~~~~ ShmNumaPrefer ~~~~~~~~~
+    if (node<0||node>=ShmNodeMask::kMaxNodes)// Sane node number?
+      return {-1,EINVAL};               // No.
+    ShmNodeMask m;                      // Just that node.
+    m.Set(node);                        // Set it.
+    return ShmNumaPolicy(addr,len,MPOL_PREFERRED,&m);
+  }                                     // ~~~~~~~~~ ShmNumaPrefer ~~~~~~~~~
+  // Spread the range page by page over nodes (all allowed nodes if nullptr).
+  inline ShmResult ShmNumaInterleave (
+    void* addr,                         // Start of the range
+    size_t len,                         // Length of the range
+    const ShmNodeMask* nodes=nullptr,   // Nodes to use or nullptr for all
+    int move=SHM_NUMA_NOMOVE)           // ShmNumaMove
+  {                                     // ~~~~~~~~~ ShmNumaInterleave ~~~~~~~~~
+    ShmNodeMask all;                    // Allowed nodes.
+    if (nodes==nullptr)                 // Caller wants all of them?
+    {                                   // Yes, look them up.
+      ShmResult r=ShmNumaAllowed(&all); // Ask.
+      if (r.code<0)                     // Could we?
+        return r;                       // No.
+      nodes=&all;                       // Use them.
+    }                                   // Done with all.
+    return ShmNumaPolicy(addr,len,MPOL_INTERLEAVE,nodes,move);
+  }                                     // ~~~~~~~~~ ShmNumaInterleave ~~~~~~~~~
+  // Drop any policy on the range (back to the process policy).
+  inline ShmResult ShmNumaReset (
+    void* addr,                         // Start of the range
+    size_t len)                         // Length of the range
+  {                                     // ~~~~~~~~~ ShmNumaReset ~~~~~~~~~
+    return ShmNumaPolicy(addr,len,MPOL_DEFAULT,nullptr);
+  }                                     // ~~~~~~~~~ ShmNumaReset ~~~~~~~~~
+  // Run move_pages(2) over the whole pages of a range in batches. With a
+  // null node array it only queries. status[] gets, per page, the node or
+  // -errno (-ENOENT: not faulted in yet).
+  inline ShmResult ShmNumaMovePages (
+    void* addr,                         // Start of the range
+    size_t len,                         // Length of the range
+    int node,                           // Target node, or -1 to only query
+    int* status,                        // Out: one entry per page
+    size_t npages,                      // Capacity of status
+    int flags)                          // MPOL_MF_MOVE or MPOL_MF_MOVE_ALL
+  {                                     // ~~~~~~~~~ ShmNumaMovePages ~~~~~~~~~
+    size_t ps=(size_t)sysconf(_SC_PAGESIZE);
+    void* start;                        // Page-aligned start.
+    size_t plen;                        // Whole pages.
+    ShmNumaPageSpan(addr,len,&start,&plen);
+    size_t n=plen/ps;                   // Pages in the range.
+    if (npages<n)                       // Room for every page?
+      return {-1,ERANGE};               // No.
+    const size_t kBatch=512;            // Pages per system call.
+    void* pages[kBatch];                // Addresses of the batch.
+    int nodes[kBatch];                  // Target of each page.
+    for (size_t i=0;i<n;i+=kBatch)      // For each batch...
+    {
+      size_t cnt=(n-i<kBatch)?n-i:kBatch;// Pages in this one.
+      for (size_t j=0;j<cnt;j++)        // For each page...
+      {
+        pages[j]=static_cast<char*>(start)+(i+j)*ps;
+        nodes[j]=node;                  // Where it should go.
+      }                                 // Done filling.
+      if (syscall(SYS_move_pages,0,(unsigned long)cnt,pages,(node<0)?nullptr:nodes,
+        status+i,flags)<0)              // Did the batch fail as a whole?
+        return {-1,errno};              // Yes (ENOSYS without NUMA).
+    }                                   // Done with batches.
+    return {(int)n,0};                  // Pages reported.
+  }                                     // ~~~~~~~~~ ShmNumaMovePages ~~~~~~~~~
+  // Report where each page of a range lives: status[i] is the node of the
+  // i-th page or -ENOENT if it has not been faulted in. Returns the number
+  // of pages in the range; size status with ShmNumaPageCount().
+  inline ShmResult ShmNumaQuery (
+    void* addr,                         // Start of the range
+    size_t len,                         // Length of the range
+    int* status,                        // Out: one entry per page
+    size_t npages)                      // Capacity of status
+  {                                     // ~~~~~~~~~ ShmNumaQuery ~~~~~~~~~
+    ShmResult r=ShmNumaMovePages(addr,len,-1,status,npages,0);
+    if (r.code>=0||r.errn!=ENOSYS)      // Answered, or a real failure?
+      return r;                         // Yes.
+    size_t ps=(size_t)sysconf(_SC_PAGESIZE);
+    void* start;                        // Page-aligned start.
+    size_t plen;                        // Whole pages.
+    ShmNumaPageSpan(addr,len,&start,&plen);
+    size_t n=plen/ps;                   // Pages in the range.
+    const size_t kBatch=4096;           // Pages per mincore() call.
+    unsigned char vec[kBatch];          // Residency of the batch.
+    for (size_t i=0;i<n;i+=kBatch)      // No NUMA: resident means node 0.
+    {
+      size_t cnt=(n-i<kBatch)?n-i:kBatch;// Pages in this one.
+      if (mincore(static_cast<char*>(start)+i*ps,cnt*ps,vec)!=0)
+        return {-1,errno};              // Not mapped?
+      for (size_t j=0;j<cnt;j++)        // For each page...
+        status[i+j]=(vec[j]&1)?0:-ENOENT;// ...node 0 or not there yet.
+    }                                   // Done with batches.
+    return {(int)n,ENOSYS};             // Answered by the fallback.
+  }                                     // ~~~~~~~~~ ShmNumaQuery ~~~~~~~~~
+  // Move the existing pages of a range to node now (the policy is left
+  // alone; combine with ShmNumaBind() so that new faults land there too).
+  // Returns the number of pages that ended up on node.
+  inline ShmResult ShmNumaMigrate (
+    void* addr,                         // Start of the range
+    size_t len,                         // Length of the range
+    int node,                           // Target node
+    int move=SHM_NUMA_MOVE)             // SHM_NUMA_MOVE or SHM_NUMA_MOVE_ALL
+  {                                     // ~~~~~~~~~ ShmNumaMigrate ~~~~~~~~~
+    if (node<0||node>=ShmNodeMask::kMaxNodes)// Sane node number?
+      return {-1,EINVAL};               // No.
+    size_t ps=(size_t)sysconf(_SC_PAGESIZE);
+    size_t n=(len+2*ps-1)/ps;           // Upper bound on the pages spanned.
+    int* status=new (std::nothrow) int[n];// Per-page outcome.
+    if (status==nullptr)                // Could we get it?
+      return {-1,ENOMEM};               // No.
+    ShmResult r=ShmNumaMovePages(addr,len,node,status,n,move?move:SHM_NUMA_MOVE);
+    if (r.code<0&&r.errn==ENOSYS)       // No NUMA in this kernel?
+      r=(node==0)?ShmResult{0,ENOSYS}:ShmResult{-1,EINVAL};// Node 0 is all there is.
+    else if (r.code>=0)                 // Moved what it could?
+    {                                   // Yes, count what is on node now.
+      int on=0;                         // Pages on the target.
+      for (int i=0;i<r.code;i++)        // For each page...
+        on+=(status[i]==node);          // ...did it make it?
+      r={on,0};                         // Pages now on node.
+    }                                   // Done counting.
+    delete[] status;                    // Done with the outcomes.
+    return r;                           // Count or error.
+  }                                     // ~~~~~~~~~ ShmNumaMigrate ~~~~~~~~~
+  // Pages spanned by a range (how big ShmNumaQuery()'s status must be).
+  inline size_t ShmNumaPageCount (
+    void* addr,                         // Start of the range
+    size_t len)                         // Length of the range
+  {                                     // ~~~~~~~~~ ShmNumaPageCount ~~~~~~~~~
+    void* start;                        // Page-aligned start.
+    size_t plen;                        // Whole pages.
+    ShmNumaPageSpan(addr,len,&start,&plen);
+    return plen/(size_t)sysconf(_SC_PAGESIZE);
+  }                                     // ~~~~~~~~~ ShmNumaPageCount ~~~~~~~~~
+  // Resolve [off,off+len) of an attached segment (len 0: to the end).
+  template<typename Seg>
+  inline ShmResult ShmNumaRange (
+    const Seg& seg,                     // SharedMemory or PosixSharedMemory
+    size_t off,                         // Offset into the segment
+    size_t len,                         // Length, 0 for the rest
+    void** addr,                        // Out: start address
+    size_t* rlen)                       // Out: length
+  {                                     // ~~~~~~~~~ ShmNumaRange ~~~~~~~~~
+    if (seg.GetPointer()==nullptr)      // Attached?
+      return {-1,EINVAL};               // No.
+    size_t size=seg.GetShmSize();       // Segment size.
+    if (off>size||(len!=0&&len>size-off))// Out of bounds?
+      return {-1,ERANGE};               // Yes.
+    *addr=static_cast<char*>(seg.GetPointer())+off;
+    *rlen=len?len:size-off;             // To the end if unspecified.
+    return {0,0};                       // Resolved.
+  }                                     // ~~~~~~~~~ ShmNumaRange ~~~~~~~~~
+  // Segment overloads: the whole segment or [off,off+len) of it.
+  template<typename Seg>
+  inline ShmResult ShmNumaBind (
+    const Seg& seg,                     // Attached segment
+    int node,                           // Target node
+    int move=SHM_NUMA_NOMOVE,           // ShmNumaMove
+    size_t off=0,                       // Offset of the sub-range
+    size_t len=0)                       // Length of the sub-range, 0: to the end
+  {                                     // ~~~~~~~~~ ShmNumaBind ~~~~~~~~~
+    void* a;                            // Range start.
+    size_t l;                           // Range length.
+    ShmResult r=ShmNumaRange(seg,off,len,&a,&l);
+    return (r.code<0)?r:ShmNumaBind(a,l,node,move);
+  }                                     // ~~~~~~~~~ ShmNumaBind ~~~~~~~~~
+  template<typename Seg>
+  inline ShmResult ShmNumaInterleave (
+    const Seg& seg,                     // Attached segment
+    const ShmNodeMask* nodes=nullptr,   // Nodes to use or nullptr for all
+    int move=SHM_NUMA_NOMOVE,           // ShmNumaMove
+    size_t off=0,                       // Offset of the sub-range
+    size_t len=0)                       // Length of the sub-range, 0: to the end
+  {                                     // ~~~~~~~~~ ShmNumaInterleave ~~~~~~~~~
+    void* a;                            // Range start.
+    size_t l;                           // Range length.
+    ShmResult r=ShmNumaRange(seg,off,len,&a,&l);
+    return (r.code<0)?r:ShmNumaInterleave(a,l,nodes,move);
+  }                                     // ~~~~~~~~~ ShmNumaInterleave ~~~~~~~~~
+  template<typename Seg>
+  inline ShmResult ShmNumaMigrate (
+    const Seg& seg,                     // Attached segment
+    int node,                           // Target node
+    int move=SHM_NUMA_MOVE,             // SHM_NUMA_MOVE or SHM_NUMA_MOVE_ALL
+    size_t off=0,                       // Offset of the sub-range
+    size_t len=0)                       // Length of the sub-range, 0: to the end
+  {                                     // ~~~~~~~~~ ShmNumaMigrate ~~~~~~~~~
+    void* a;                            // Range start.
+    size_t l;                           // Range length.
+    ShmResult r=ShmNumaRange(seg,off,len,&a,&l);
+    return (r.code<0)?r:ShmNumaMigrate(a,l,node,move);
+  }                                     // ~~~~~~~~~ ShmNumaMigrate ~~~~~~~~~
+  template<typename Seg>
+  inline ShmResult ShmNumaQuery (
+    const Seg& seg,                     // Attached segment
+    int* status,                        // Out: one entry per page
+    size_t npages,                      // Capacity of status
+    size_t off=0,                       // Offset of the sub-range
+    size_t len=0)                       // Length of the sub-range, 0: to the end
+  {                                     // ~~~~~~~~~ ShmNumaQuery ~~~~~~~~~
+    void* a;                            // Range start.
+    size_t l;                           // Range length.
+    ShmResult r=ShmNumaRange(seg,off,len,&a,&l);
+    return (r.code<0)?r:ShmNumaQuery(a,l,status,npages);
+  }                                     // ~~~~~~~~~ ShmNumaQuery ~~~~~~~~~
+}
@@ -0,0 +1,101 @@
+ /*
+ * *
+ * * Filename: ShmOffsetPtr.hpp
+ * *
+ * * Description:
+ * *   Self-relative pointer for data structures stored in a shared memory segment. It
+ * *     keeps the distance from its own address to the target instead of the target's
+ * *     address, so a structure made of offset_ptrs means the same thing in every process
+ * *     no matter where each one attached the segment. It models a random access iterator
+ * *     and a "fancy pointer" (std::pointer_traits), which is what lets allocator-aware
+ * *     containers keep their internal pointers in the segment.
+ * *
+ * *   The distance 1 encodes null: a target can never sit one byte past its own pointer
+ * *     because offset_ptr is always at least pointer aligned.
+ * *
+ * *  Author:
+ * *    JEP  J. Enrique Peraza
+ * *
+ */
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <type_traits>
+
+namespace ipc
+{
+  template<typename T>
+  class offset_ptr
+  {
+    public:
+      typedef T element_type;
+      typedef typename std::remove_cv<T>::type value_type;
+      typedef std::ptrdiff_t difference_type;
+      typedef T* pointer;
+      typedef typename std::add_lvalue_reference<T>::type reference;
+      typedef std::random_access_iterator_tag iterator_category;
+      template<typename U> using rebind=offset_ptr<U>;
+      offset_ptr (void) noexcept { Set(nullptr); }
+      offset_ptr (std::nullptr_t) noexcept { Set(nullptr); }
+      offset_ptr (T* p) noexcept { Set(p); }
+      offset_ptr (const offset_ptr& o) noexcept { Set(o.get()); }
+      // Implicit where T* would convert implicitly (derived->base, T->void).
+      template<typename U,typename=typename std::enable_if<std::is_convertible<U*,T*>::value>::type>
+      offset_ptr (const offset_ptr<U>& o) noexcept { Set(o.get()); }
+      // Explicit for static_cast (void->T, base->derived), as with raw pointers.
+      template<typename U,typename=typename std::enable_if<!std::is_convertible<U*,T*>::value>::type,typename=void>
+      explicit offset_ptr (const offset_ptr<U>& o) noexcept { Set(static_cast<T*>(o.get())); }
+      offset_ptr& operator= (const offset_ptr& o) noexcept { Set(o.get()); return *this; }
+      offset_ptr& operator= (T* p) noexcept { Set(p); return *this; }
+      offset_ptr& operator= (std::nullptr_t) noexcept { Set(nullptr); return *this; }
+      // Raw address in this process.
+      T* get (void) const noexcept
+      {                                 // ~~~~~~~~~ get ~~~~~~~~~
+        if (off==1)                     // Null?
+          return nullptr;               // Yes.
+        return reinterpret_cast<T*>(reinterpret_cast<std::uintptr_t>(this)+off);
+      }                                 // ~~~~~~~~~ get ~~~~~~~~~
+      reference operator* (void) const noexcept { return *get(); }
+      T* operator-> (void) const noexcept { return get(); }
+      template<typename U=T>
+      typename std::enable_if<!std::is_void<U>::value,U&>::type
+        operator[] (difference_type i) const noexcept { return get()[i]; }
+      explicit operator bool (void) const noexcept { return off!=1; }
+      // std::pointer_traits<offset_ptr<T>>::pointer_to()
+      template<typename U=T>
+      static offset_ptr pointer_to (typename std::enable_if<!std::is_void<U>::value,U&>::type r) noexcept
+      {                                 // ~~~~~~~~~ pointer_to ~~~~~~~~~
+        return offset_ptr(std::addressof(r));
+      }                                 // ~~~~~~~~~ pointer_to ~~~~~~~~~
+      // Pointer arithmetic, in elements of T.
+      offset_ptr& operator+= (difference_type n) noexcept { Set(get()+n); return *this; }
+      offset_ptr& operator-= (difference_type n) noexcept { Set(get()-n); return *this; }
+      offset_ptr& operator++ (void) noexcept { return *this+=1; }
+      offset_ptr& operator-- (void) noexcept { return *this-=1; }
+      offset_ptr operator++ (int) noexcept { offset_ptr t(*this); ++*this; return t; }
+      offset_ptr operator-- (int) noexcept { offset_ptr t(*this); --*this; return t; }
+      friend offset_ptr operator+ (offset_ptr p,difference_type n) noexcept { return p+=n; }
+      friend offset_ptr operator+ (difference_type n,offset_ptr p) noexcept { return p+=n; }
+      friend offset_ptr operator- (offset_ptr p,difference_type n) noexcept { return p-=n; }
+      friend difference_type operator- (const offset_ptr& a,const offset_ptr& b) noexcept { return a.get()-b.get(); }
+      friend bool operator== (const offset_ptr& a,const offset_ptr& b) noexcept { return a.get()==b.get(); }
+      friend bool operator!= (const offset_ptr& a,const offset_ptr& b) noexcept { return a.get()!=b.get(); }
+      friend bool operator< (const offset_ptr& a,const offset_ptr& b) noexcept { return a.get()<b.get(); }
+      friend bool operator> (const offset_ptr& a,const offset_ptr& b) noexcept { return a.get()>b.get(); }
+      friend bool operator<= (const offset_ptr& a,const offset_ptr& b) noexcept { return a.get()<=b.get(); }
+      friend bool operator>= (const offset_ptr& a,const offset_ptr& b) noexcept { return a.get()>=b.get(); }
+      friend bool operator== (const offset_ptr& a,std::nullptr_t) noexcept { return !a; }
+      friend bool operator!= (const offset_ptr& a,std::nullptr_t) noexcept { return (bool)a; }
+    private:
+      void Set (const volatile void* p) noexcept
+      {                                 // ~~~~~~~~~ Set ~~~~~~~~~
+        if (p==nullptr)                 // Null?
+          off=1;                        // Yes, the reserved distance.
+        else                            // Otherwise distance from us to the target.
+          off=(std::intptr_t)(reinterpret_cast<std::uintptr_t>(p)-reinterpret_cast<std::uintptr_t>(this));
+      }                                 // ~~~~~~~~~ Set ~~~~~~~~~
+      std::intptr_t off;                // Target minus this, 1 for null
+  };
+}
@@ -0,0 +1,493 @@
+ /*
+ * *
+ * * Filename: ShmRegistry.hpp
+ * *
+ * * Description:
+ * *   Registry of named shared memory segments, kept in a small segment of its own at a
+ * *     well-known key. Segments made through the registry are created IPC_PRIVATE, so no
+ * *     ftok() key is involved and inode reuse cannot make two names collide; peers find
+ * *     them by name and get the segment ID, size and layout kind/version without
+ * *     guessing. Every Attach() through the registry records the attacher's PID.
+ * *
+ * *   Lifecycle: Reap() walks the entries and removes (IPC_RMID) every segment nobody
+ * *     can still be using - no attachments according to the kernel (shm_nattch==0), no
+ * *     registered attacher alive and its creator (shm_cpid) dead - and forgets entries
+ * *     whose segment has vanished or whose ID was recycled. Create()/Attach() run it on
+ * *     their own every ReapInterval() seconds, so crashed services do not leak memory
+ * *     until somebody runs ipcrm. Entries flagged SHM_REG_PERSISTENT are never reaped.
+ * *     Liveness is kill(pid,0), so a recycled PID keeps a segment alive a little longer.
+ * *
+ * *   All operations take a robust ShmMutex in the registry; a process that dies holding
+ * *     it leaves at worst a half-made entry, which the next locker cleans up.
+ * *
+ * *   Usage:
+ * *     ipc::SharedMemory regseg,seg;
+ * *     ipc::ShmRegistry* reg=nullptr;
+ * *     ipc::ShmRegistry::OpenDefault(regseg,&reg);
+ * *     reg->CreateOrAttach("md.book.L2",64<<20,&seg,ipc::SHM_KIND_RING,1);
+ * *
+ * *  Author:
+ * *    JEP  J. Enrique Peraza
+ * *
+ */
+#pragma once
+#include <vector>
+#include <signal.h>
+#include <time.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "SharedMemory.hpp"
+#include "ShmLayout.hpp"
+#include "ShmMutex.hpp"
+
+namespace ipc
+{
+  // Default key of the registry segment ('IPCR'); not derived from a path.
+  constexpr key_t kShmRegistryKey=0x49504352;
+  // Entry flags
+  enum
+  {
+    SHM_REG_PERSISTENT=1                // Never reap, even with nobody attached
+  };                                    // Registry entry flags
+  // What the registry knows about one segment.
+  struct ShmRegEntry
+  {
+    static constexpr int kNameMax=64;   // Including the terminating NUL
+    static constexpr int kMaxAttachers=16;// Tracked attacher PIDs
+    uint32_t state;                     // Free, being made, or live
+    uint32_t flags;                     // SHM_REG_*
+    char name[kNameMax];                // Human-readable name
+    int shmid;                          // Segment ID
+    uint16_t kind;                      // ShmKind of the structure in it (or 0)
+    uint16_t version;                   // Its layout version (or 0)
+    uint64_t size;                      // Segment size
+    pid_t creator;                      // Process that created it
+    int64_t created;                    // time() it was created
+    pid_t attachers[kMaxAttachers];     // Processes attached through the registry (0: free)
+  };                                    // ShmRegEntry
+  class ShmRegistry
+  {
+    public:
+      static constexpr uint16_t kVersion=1;// Bump when the layout below changes.
+      static constexpr int kEntries=256;// Named segments per registry.
+      static size_t RequiredBytes (void) { return sizeof(ShmRegistry); }
+      // Format (first caller) or validate the registry at mem.
+      static ShmResult Open (
+        void* mem,                      // Start of the region (cache line aligned)
+        size_t len,                     // Bytes available
+        ShmRegistry** out)              // Where to return the registry
+      {                                 // ~~~~~~~~~ Open ~~~~~~~~~
+        if (out==nullptr)               // Nowhere to put the result?
+          return {-1,EINVAL};           // Yes, error out.
+        *out=nullptr;                   // Nothing yet.
+        ShmResult r=ShmLayoutClaim(mem,len,Spec());
+        if (r.code<0)                   // Bad region or layout?
+          return r;                     // Yes, pass the error along.
+        ShmRegistry* g=static_cast<ShmRegistry*>(mem);
+        if (r.code==1)                  // Are we the formatter?
+        {                               // Yes, so start empty.
+          g->mtx.Init();                // Robust, unlocked.
+          g->interval=5;                // Reap at most every 5 seconds.
+          g->lastreap=0;                // Never reaped.
+          memset(g->entries,0,sizeof(g->entries));// Every entry free.
+          ShmLayoutPublish(mem);        // Let everybody else in.
+        }                               // Done formatting.
+        *out=g;                         // Hand back the registry.
+        return {0,0};                   // Success.
+      }                                 // ~~~~~~~~~ Open ~~~~~~~~~
+      // Convenience overload for an attached segment.
+      template<typename Seg>
+      static ShmResult Open (
+        Seg& seg,                       // An attached segment
+        ShmRegistry** out)              // Where to return the registry
+      {                                 // ~~~~~~~~~ Open ~~~~~~~~~
+        if (seg.GetPointer()==nullptr)  // Not attached?
+          return {-1,EINVAL};           // Yes, nothing to open.
+        return Open(seg.GetPointer(),seg.GetShmSize(),out);
+      }                                 // ~~~~~~~~~ Open ~~~~~~~~~
+      // Create or attach the registry segment at key and open it. The
+      // registry segment itself is never removed by us.
+      static ShmResult OpenDefault (
+        SharedMemory& seg,              // Unbound segment object to use
+        ShmRegistry** out,              // Where to return the registry
+        key_t key=kShmRegistryKey,      // Registry key
+        int mode=SHM_PERM_600)          // Permissions if we create it
+      {                                 // ~~~~~~~~~ OpenDefault ~~~~~~~~~
+        ShmResult r=seg.CreateOrAttach(key,RequiredBytes(),mode,SHM_CREATE);
+        if (r.code<0)                   // Could we get it?
+          return r;                     // No.
+        r=seg.Attach();                 // Map it.
+        if (r.code<0)                   // Could we map it?
+          return r;                     // No.
+        return Open(seg,out);           // Format or validate.
+      }                                 // ~~~~~~~~~ OpenDefault ~~~~~~~~~
+      // Create a new named segment and attach it through seg (which must not
+      // be bound yet). seg does not own the segment: the registry decides
+      // when it goes away. {-1,EEXIST} if the name is taken.
+      ShmResult Create (
+        const char* name,               // Name to register
+        size_t size,                    // Segment size
+        SharedMemory* seg,              // Unbound segment object
+        uint16_t kind=SHM_KIND_NONE,    // ShmKind that will live in it
+        uint16_t version=0,             // Its layout version
+        int mode=SHM_PERM_600,          // Permissions
+        uint32_t flags=0)               // SHM_REG_*
+      {                                 // ~~~~~~~~~ Create ~~~~~~~~~
+        ShmResult r=Lock();             // Serialise with everybody.
+        if (r.code<0)                   // Broken lock?
+          return r;                     // Yes.
+        r=CreateLocked(name,size,seg,kind,version,mode,flags);
+        mtx.Unlock();                   // Next.
+        return r;                       // ID or error.
+      }                                 // ~~~~~~~~~ Create ~~~~~~~~~
+      // Attach a registered segment by name through seg and record us as an
+      // attacher. version<0 accepts any layout version. {-1,ENOENT} if the
+      // name is unknown, {-1,EPROTO} on a version mismatch.
+      ShmResult Attach (
+        const char* name,               // Registered name
+        SharedMemory* seg,              // Unbound segment object
+        int version=-1)                 // Expected layout version or -1
+      {                                 // ~~~~~~~~~ Attach ~~~~~~~~~
+        ShmResult r=Lock();             // Serialise with everybody.
+        if (r.code<0)                   // Broken lock?
+          return r;                     // Yes.
+        r=AttachLocked(name,seg,version);
+        mtx.Unlock();                   // Next.
+        return r;                       // ID or error.
+      }                                 // ~~~~~~~~~ Attach ~~~~~~~~~
+      // Attach name if it is registered, create it otherwise. code==1: we
+      // created it (format it); code==0: it existed (size/version checked).
+      ShmResult CreateOrAttach (
+        const char* name,               // Name
+        size_t size,                    // Size if we create it (minimum otherwise)
+        SharedMemory* seg,              // Unbound segment object
+        uint16_t kind=SHM_KIND_NONE,    // ShmKind that lives in it
+        uint16_t version=0,             // Its layout version
+        int mode=SHM_PERM_600,          // Permissions if we create it
+        uint32_t flags=0)               // SHM_REG_* if we create it
+      {                                 // ~~~~~~~~~ CreateOrAttach ~~~~~~~~~
+        if (name==nullptr||name[0]=='\0'||seg==nullptr)// Nothing to look up?
+          return {-1,EINVAL};           // Refuse before Find() reads it.
+        ShmResult r=Lock();             // One decision at a time.
+        if (r.code<0)                   // Broken lock?
+          return r;                     // Yes.
+        ShmRegEntry* e=Find(name);      // Registered (and still there)?
+        if (e==nullptr)                 // No, make it.
+        {
+          r=CreateLocked(name,size,seg,kind,version,mode,flags);
+          if (r.code>=0)                // Made it?
+            r={1,r.errn};               // Tell the caller to format it.
+        }                               // Done creating.
+        else if (e->size<size||e->kind!=kind)// Not what we were going to make?
+          r={-1,EPROTO};                // Refuse.
+        else                            // Use it.
+        {
+          r=AttachLocked(name,seg,version);
+          if (r.code>=0)                // Attached?
+            r={0,r.errn};               // Existing segment.
+        }                               // Done attaching.
+        mtx.Unlock();                   // Next.
+        return r;                       // 1 created, 0 attached, or error.
+      }                                 // ~~~~~~~~~ CreateOrAttach ~~~~~~~~~
+      // Unregister us as an attacher and detach seg.
+      ShmResult Detach (
+        const char* name,               // Registered name
+        SharedMemory* seg)              // Segment attached through Attach()/Create()
+      {                                 // ~~~~~~~~~ Detach ~~~~~~~~~
+        ShmResult r=Lock();             // Serialise with everybody.
+        if (r.code<0)                   // Broken lock?
+          return r;                     // Yes.
+        ShmRegEntry* e=Find(name);      // Registered?
+        if (e!=nullptr)                 // Yes, forget us.
+          for (pid_t& p:e->attachers)   // Every tracked attacher...
+            if (p==getpid())            // ...that is us...
+              p=0;                      // ...is dropped.
+        mtx.Unlock();                   // Next.
+        return seg->Detach();           // Unmap.
+      }                                 // ~~~~~~~~~ Detach ~~~~~~~~~
+      // Remove the segment now (IPC_RMID; attached processes keep their
+      // mapping until they detach) and forget the name.
+      ShmResult Remove (
+        const char* name)               // Registered name
+      {                                 // ~~~~~~~~~ Remove ~~~~~~~~~
+        ShmResult r=Lock();             // Serialise with everybody.
+        if (r.code<0)                   // Broken lock?
+          return r;                     // Yes.
+        ShmRegEntry* e=Find(name);      // Registered?
+        if (e==nullptr)                 // No?
+          r={-1,ENOENT};                // Nothing to remove.
+        else                            // Yes, out it goes.
+        {
+          if (shmctl(e->shmid,IPC_RMID,nullptr)!=0&&errno!=EINVAL&&errno!=EIDRM)
+            r={-1,errno};               // Not ours to remove (EPERM)?
+          else                          // Gone.
+          {
+            memset(e,0,sizeof(*e));     // Forget it.
+            r={0,0};                    // Removed.
+          }                             // Done removing.
+        }                               // Done with found.
+        mtx.Unlock();                   // Next.
+        return r;                       // Result.
+      }                                 // ~~~~~~~~~ Remove ~~~~~~~~~
+      // Copy the entry for name. {-1,ENOENT} if unknown.
+      ShmResult Lookup (
+        const char* name,               // Registered name
+        ShmRegEntry* out)               // Where to copy it
+      {                                 // ~~~~~~~~~ Lookup ~~~~~~~~~
+        ShmResult r=Lock();             // Serialise with everybody.
+        if (r.code<0)                   // Broken lock?
+          return r;                     // Yes.
+        ShmRegEntry* e=Find(name);      // Registered?
+        if (e!=nullptr)                 // Yes?
+          *out=*e;                      // Copy it.
+        mtx.Unlock();                   // Next.
+        return (e==nullptr)?ShmResult{-1,ENOENT}:ShmResult{e->shmid,0};
+      }                                 // ~~~~~~~~~ Lookup ~~~~~~~~~
+      // Remove orphaned segments and forget stale entries now. Returns the
+      // number of entries reclaimed.
+      ShmResult Reap (void)
+      {                                 // ~~~~~~~~~ Reap ~~~~~~~~~
+        ShmResult r=Lock();             // Serialise with everybody.
+        if (r.code<0)                   // Broken lock?
+          return r;                     // Yes.
+        int n=ReapLocked();             // Sweep.
+        mtx.Unlock();                   // Next.
+        return {n,0};                   // Reclaimed.
+      }                                 // ~~~~~~~~~ Reap ~~~~~~~~~
+      // Copies of every live entry (taken under the lock).
+      std::vector<ShmRegEntry> List (void)
+      {                                 // ~~~~~~~~~ List ~~~~~~~~~
+        std::vector<ShmRegEntry> v;     // Copies.
+        if (Lock().code<0)              // Broken lock?
+          return v;                     // Nothing to show.
+        for (const ShmRegEntry& e:entries)// Every entry...
+          if (e.state==kLive)           // ...in use...
+            v.push_back(e);             // ...is copied.
+        mtx.Unlock();                   // Next.
+        return v;                       // The copies.
+      }                                 // ~~~~~~~~~ List ~~~~~~~~~
+      // How often Create()/Attach() reap on their own (0: never).
+      void SetReapInterval (unsigned secs) { interval=secs; }
+      unsigned ReapInterval (void) const { return interval; }
+      // Is a process alive? (EPERM: it exists, it just is not ours.)
+      static bool Alive (
+        pid_t pid)                      // Process ID
+      {                                 // ~~~~~~~~~ Alive ~~~~~~~~~
+        return pid>0&&(kill(pid,0)==0||errno==EPERM);
+      }                                 // ~~~~~~~~~ Alive ~~~~~~~~~
+    private:
+      ShmRegistry (void)=delete;        // Only ever placed on top of a segment.
+      static constexpr uint32_t kFree=0;// Entry unused
+      static constexpr uint32_t kBusy=1;// Being made (segment may exist)
+      static constexpr uint32_t kLive=2;// Registered
+      static constexpr int kGone=0;     // Current(): segment removed or ID recycled
+      static constexpr int kSame=1;     // Current(): still the entry's segment
+      static constexpr int kUnknown=2;  // Current(): we may not look (EACCES)
+      static ShmLayoutSpec Spec (void)
+      {                                 // ~~~~~~~~~ Spec ~~~~~~~~~
+        return {SHM_KIND_REGISTRY,kVersion,(uint32_t)sizeof(ShmRegEntry),kEntries,
+          (uint64_t)sizeof(ShmRegistry)};// What Open() expects to find.
+      }                                 // ~~~~~~~~~ Spec ~~~~~~~~~
+      // Take the registry lock, cleaning up after a holder that died.
+      ShmResult Lock (void)
+      {                                 // ~~~~~~~~~ Lock ~~~~~~~~~
+        ShmResult r=mtx.Lock();         // Wait our turn.
+        if (r.code==0&&r.errn==EOWNERDEAD)// Holder died in here?
+        {                               // Yes, undo its half-made entry.
+          for (ShmRegEntry& e:entries)  // Every entry...
+            if (e.state==kBusy)         // ...caught mid-creation...
+              Discard(&e);              // ...goes, segment and all.
+          mtx.Consistent();             // Back in service.
+          r={0,0};                      // Held and consistent.
+        }                               // Done repairing.
+        return r;                       // Held unless code<0.
+      }                                 // ~~~~~~~~~ Lock ~~~~~~~~~
+      // Live entry named name whose segment still exists, or nullptr.
+      ShmRegEntry* Find (
+        const char* name)               // Name
+      {                                 // ~~~~~~~~~ Find ~~~~~~~~~
+        if (name==nullptr)              // No name?
+          return nullptr;               // Matches nothing.
+        for (ShmRegEntry& e:entries)    // Linear: kEntries is small.
+        {
+          if (e.state!=kLive||strncmp(e.name,name,ShmRegEntry::kNameMax)!=0)
+            continue;                   // Not it.
+          struct shmid_ds ds;           // Kernel's view.
+          if (Current(e,&ds)==kGone)    // Segment gone or ID recycled?
+          {
+            memset(&e,0,sizeof(e));     // Yes, forget it.
+            return nullptr;             // Unknown now.
+          }                             // Done with stale.
+          return &e;                    // Found (kept too if we may not look).
+        }                               // Done scanning.
+        return nullptr;                 // Unknown.
+      }                                 // ~~~~~~~~~ Find ~~~~~~~~~
+      // Does the entry still describe the segment the kernel knows by its ID?
+      // kSame (ds filled in), kGone, or kUnknown if IPC_STAT is refused (ds
+      // zeroed and not to be trusted: the segment may well still be in use).
+      static int Current (
+        const ShmRegEntry& e,           // Entry
+        struct shmid_ds* ds)            // Out: kernel's view
+      {                                 // ~~~~~~~~~ Current ~~~~~~~~~
+        if (shmctl(e.shmid,IPC_STAT,ds)!=0)// Still there?
+        {
+          memset(ds,0,sizeof(*ds));     // Nothing read.
+          return (errno==EACCES)?kUnknown:kGone;// Gone, unless we just may not look.
+        }                               // Done with the failure.
+        return (ds->shm_cpid==e.creator&&ds->shm_segsz==e.size)?kSame:kGone;
+      }                                 // ~~~~~~~~~ Current ~~~~~~~~~
+      // Remove an entry's segment if nobody is attached, and free the entry.
+      static void Discard (
+        ShmRegEntry* e)                 // Entry
+      {                                 // ~~~~~~~~~ Discard ~~~~~~~~~
+        struct shmid_ds ds;             // Kernel's view.
+        if (e->shmid>=0&&e->creator!=0&&shmctl(e->shmid,IPC_STAT,&ds)==0&&
+          ds.shm_cpid==e->creator&&ds.shm_nattch==0)// Ours and unused?
+          shmctl(e->shmid,IPC_RMID,nullptr);// Remove it.
+        memset(e,0,sizeof(*e));         // Free the entry.
+      }                                 // ~~~~~~~~~ Discard ~~~~~~~~~
+      // Record pid as an attacher of e (no-op if already there or full).
+      static void AddAttacher (
+        ShmRegEntry* e,                 // Entry
+        pid_t pid)                      // Attacher
+      {                                 // ~~~~~~~~~ AddAttacher ~~~~~~~~~
+        pid_t* slot=nullptr;            // First free slot.
+        for (pid_t& p:e->attachers)     // Every tracked attacher...
+        {
+          if (p==pid)                   // ...already us?
+            return;                     // Yes, nothing to do.
+          if (slot==nullptr&&(p==0||!Alive(p)))// Free (or held by the dead)?
+            slot=&p;                    // Use it.
+        }                               // Done scanning.
+        if (slot!=nullptr)              // Room?
+          *slot=pid;                    // Track us (shm_nattch covers us anyway).
+      }                                 // ~~~~~~~~~ AddAttacher ~~~~~~~~~
+      void MaybeReap (void)
+      {                                 // ~~~~~~~~~ MaybeReap ~~~~~~~~~
+        int64_t now=(int64_t)time(nullptr);// Wall clock seconds.
+        if (interval!=0&&now-lastreap>=(int64_t)interval)// Due?
+          ReapLocked();                 // Yes, sweep.
+      }                                 // ~~~~~~~~~ MaybeReap ~~~~~~~~~
+      int ReapLocked (void)
+      {                                 // ~~~~~~~~~ ReapLocked ~~~~~~~~~
+        int n=0;                        // Reclaimed.
+        lastreap=(int64_t)time(nullptr);// Sweeping now.
+        for (ShmRegEntry& e:entries)    // Every entry.
+        {
+          if (e.state==kFree)           // Unused?
+            continue;                   // Nothing to do.
+          struct shmid_ds ds;           // Kernel's view.
+          int view=(e.state==kLive)?Current(e,&ds):kGone;// Is it still there?
+          if (view==kUnknown)           // May not look?
+            continue;                   // Then leave it alone.
+          if (view==kGone)              // Half made, vanished or recycled?
+          {
+            if (e.state!=kLive)         // Half made (creator died)?
+              Discard(&e);              // Remove what it made.
+            else                        // Vanished or somebody else's now.
+              memset(&e,0,sizeof(e));   // Just forget it.
+            n++;                        // Reclaimed.
+            continue;                   // Next entry.
+          }                             // Done with stale.
+          int live=0;                   // Registered attachers still alive.
+          for (pid_t& p:e.attachers)    // Every tracked attacher...
+          {
+            if (p!=0&&!Alive(p))        // ...that died...
+              p=0;                      // ...is dropped.
+            live+=(p!=0);               // Count the rest.
+          }                             // Done pruning.
+          if ((e.flags&SHM_REG_PERSISTENT)||ds.shm_nattch!=0||live!=0||Alive(e.creator))
+            continue;                   // Still somebody's.
+          if (shmctl(e.shmid,IPC_RMID,nullptr)!=0&&errno!=EINVAL&&errno!=EIDRM)
+            continue;                   // Not ours to remove; leave it listed.
+          memset(&e,0,sizeof(e));       // Orphan reclaimed.
+          n++;                          // Count it.
+        }                               // Done sweeping.
+        return n;                       // Reclaimed.
+      }                                 // ~~~~~~~~~ ReapLocked ~~~~~~~~~
+      ShmResult CreateLocked (
+        const char* name,               // Name to register
+        size_t size,                    // Segment size
+        SharedMemory* seg,              // Unbound segment object
+        uint16_t kind,                  // ShmKind that will live in it
+        uint16_t version,               // Its layout version
+        int mode,                       // Permissions
+        uint32_t flags)                 // SHM_REG_*
+      {                                 // ~~~~~~~~~ CreateLocked ~~~~~~~~~
+        if (name==nullptr||name[0]=='\0'||seg==nullptr)// Nothing to register?
+          return {-1,EINVAL};           // Refuse.
+        if (strlen(name)>=(size_t)ShmRegEntry::kNameMax)// Room for the name?
+          return {-1,ENAMETOOLONG};     // No.
+        MaybeReap();                    // Make room for ourselves first.
+        if (Find(name)!=nullptr)        // Taken?
+          return {-1,EEXIST};           // Yes.
+        ShmRegEntry* e=nullptr;         // Free entry.
+        for (ShmRegEntry& x:entries)    // Find one.
+          if (x.state==kFree)           // Unused?
+          {
+            e=&x;                       // Take it.
+            break;                      // Done.
+          }
+        if (e==nullptr)                 // Registry full?
+          return {-1,ENOSPC};           // Yes.
+        memset(e,0,sizeof(*e));         // Clean slate.
+        e->shmid=-1;                    // No segment yet.
+        e->state=kBusy;                 // Half made until the end.
+        int id=shmget(IPC_PRIVATE,size,mode|IPC_CREAT|IPC_EXCL);
+        if (id<0)                       // Could we make it?
+        {
+          int err=errno;                // Why not?
+          memset(e,0,sizeof(*e));       // Give the entry back.
+          return {-1,err};              // Report it.
+        }                               // Done with failure.
+        e->shmid=id;                    // From here Discard() can remove it.
+        e->creator=getpid();            // shm_cpid will say the same.
+        strncpy(e->name,name,ShmRegEntry::kNameMax-1);
+        e->flags=flags;                 // Behaviour.
+        e->kind=kind;                   // What lives in it.
+        e->version=version;             // Its layout version.
+        e->created=(int64_t)time(nullptr);// When.
+        struct shmid_ds ds;             // Kernel's view.
+        e->size=(shmctl(id,IPC_STAT,&ds)==0)?ds.shm_segsz:size;
+        ShmResult r=seg->Adopt(id,false);// The registry owns its lifetime.
+        if (r.code>=0)                  // Bound?
+          r=seg->Attach();              // Map it.
+        if (r.code<0)                   // Could we?
+        {
+          Discard(e);                   // Undo everything.
+          return r;                     // Report it.
+        }                               // Done with failure.
+        AddAttacher(e,getpid());        // We are using it.
+        e->state=kLive;                 // Registered.
+        return {id,r.errn};             // ID (errn: policy failures, if any).
+      }                                 // ~~~~~~~~~ CreateLocked ~~~~~~~~~
+      ShmResult AttachLocked (
+        const char* name,               // Registered name
+        SharedMemory* seg,              // Unbound segment object
+        int version)                    // Expected layout version or -1
+      {                                 // ~~~~~~~~~ AttachLocked ~~~~~~~~~
+        if (name==nullptr||seg==nullptr)// Nothing to look for?
+          return {-1,EINVAL};           // Refuse.
+        MaybeReap();                    // Opportunistic sweep.
+        ShmRegEntry* e=Find(name);      // Registered?
+        if (e==nullptr)                 // No?
+          return {-1,ENOENT};           // Unknown name.
+        if (version>=0&&e->version!=(uint16_t)version)// Layout we understand?
+          return {-1,EPROTO};           // No.
+        ShmResult r=seg->Adopt(e->shmid,false);// Bind to it.
+        if (r.code>=0)                  // Bound?
+          r=seg->Attach();              // Map it.
+        if (r.code<0)                   // Could we?
+          return r;                     // No.
+        AddAttacher(e,getpid());        // Track us.
+        return {e->shmid,r.errn};       // Attached.
+      }                                 // ~~~~~~~~~ AttachLocked ~~~~~~~~~
+      ShmLayoutHeader hdr;              // Versioned header (one cache line)
+      ShmMutex mtx;                     // Guards everything below
+      uint32_t interval;                // Auto-reap period (seconds, 0: off)
+      int64_t lastreap;                 // time() of the last sweep
+      ShmRegEntry entries[kEntries];    // The names
+  };
+}
@@ -0,0 +1,160 @@
+ /*
+ * *
+ * * Filename: ShmRing.hpp
+ * *
+ * * Description:
+ * *   Lock-free single-producer/single-consumer ring buffer that lives inside a shared
+ * *     memory segment. Head and tail are free-running 64-bit counters, each on its own
+ * *     cache line next to a private copy of the other side's counter, so the fast path
+ * *     is a couple of acquire/release atomics and a memcpy - no system calls. Elements
+ * *     must be trivially copyable because they are moved around with memcpy and read
+ * *     back by a different process.
+ * *
+ * *   Usage:
+ * *     ipc::SharedMemory shm;
+ * *     shm.CreateOrAttach(key,ipc::ShmRing<Tick,4096>::RequiredBytes());
+ * *     shm.Attach();
+ * *     ipc::ShmRing<Tick,4096>* ring=nullptr;
+ * *     ipc::ShmRing<Tick,4096>::Open(shm,&ring);  // formats or validates
+ * *
+ * *  Author:
+ * *    JEP  J. Enrique Peraza
+ * *
+ */
+#pragma once
+#include <atomic>
+#include <type_traits>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "ShmLayout.hpp"
+
+namespace ipc
+{
+  template<typename T,size_t N>
+  class ShmRing
+  {
+    static_assert(N>=2&&(N&(N-1))==0,"ring capacity must be a power of two");
+    static_assert(std::is_trivially_copyable<T>::value,"ring elements are memcpy'd between processes");
+    public:
+      static constexpr uint16_t kVersion=1;// Bump when the layout below changes.
+      // Bytes a segment needs to hold the ring.
+      static constexpr size_t RequiredBytes (void) { return sizeof(ShmRing); }
+      static constexpr size_t Capacity (void) { return N; }
+      // Format a fresh region or validate one formatted by another process.
+      static ShmResult Open (
+        void* mem,                      // Start of the region (cache line aligned)
+        size_t len,                     // Bytes available
+        ShmRing** out)                  // Where to return the ring
+      {                                 // ~~~~~~~~~ Open ~~~~~~~~~
+        if (out==nullptr)               // Nowhere to put the result?
+          return {-1,EINVAL};           // Yes, error out.
+        *out=nullptr;                   // Nothing yet.
+        ShmResult r=ShmLayoutClaim(mem,len,Spec());
+        if (r.code<0)                   // Bad region or layout?
+          return r;                     // Yes, pass the error along.
+        ShmRing* q=static_cast<ShmRing*>(mem);
+        if (r.code==1)                  // Are we the formatter?
+        {                               // Yes, so reset the indices.
+          q->tail.store(0,std::memory_order_relaxed);
+          q->headcache=0;               // Producer's view of head.
+          q->head.store(0,std::memory_order_relaxed);
+          q->tailcache=0;               // Consumer's view of tail.
+          ShmLayoutPublish(mem);        // Let everybody else in.
+        }                               // Done formatting.
+        *out=q;                         // Hand back the ring.
+        return {0,0};                   // Success.
+      }                                 // ~~~~~~~~~ Open ~~~~~~~~~
+      // Convenience overload for an attached segment.
+      template<typename Seg>
+      static ShmResult Open (
+        Seg& seg,                       // An attached segment
+        ShmRing** out)                  // Where to return the ring
+      {                                 // ~~~~~~~~~ Open ~~~~~~~~~
+        if (seg.GetPointer()==nullptr)  // Not attached?
+          return {-1,EINVAL};           // Yes, nothing to open.
+        return Open(seg.GetPointer(),seg.GetShmSize(),out);
+      }                                 // ~~~~~~~~~ Open ~~~~~~~~~
+      // Producer: push one element. False when the ring is full.
+      bool TryPush (
+        const T& v)                     // Element to push
+      {                                 // ~~~~~~~~~ TryPush ~~~~~~~~~
+        return TryPushN(&v,1)==1;       // A batch of one.
+      }                                 // ~~~~~~~~~ TryPush ~~~~~~~~~
+      // Consumer: pop one element. False when the ring is empty.
+      bool TryPop (
+        T& v)                           // Where to put the element
+      {                                 // ~~~~~~~~~ TryPop ~~~~~~~~~
+        return TryPopN(&v,1)==1;        // A batch of one.
+      }                                 // ~~~~~~~~~ TryPop ~~~~~~~~~
+      // Producer: push up to n elements, returns how many went in.
+      size_t TryPushN (
+        const T* src,                   // Elements to push
+        size_t n)                       // How many
+      {                                 // ~~~~~~~~~ TryPushN ~~~~~~~~~
+        uint64_t t=tail.load(std::memory_order_relaxed);// Only we write tail.
+        size_t room=N-(size_t)(t-headcache);// Room according to our cached head.
+        if (room<n)                     // Not enough room as far as we know?
+        {                               // Yes, so refresh our view of head.
+          headcache=head.load(std::memory_order_acquire);
+          room=N-(size_t)(t-headcache); // Room now.
+        }                               // Done refreshing.
+        if (n>room)                     // Still more than fits?
+          n=room;                       // Yes, push what fits.
+        if (n==0)                       // Full?
+          return 0;                     // Yes, nothing pushed.
+        size_t i=(size_t)t&(N-1);       // First slot to write.
+        size_t k=(n<N-i)?n:N-i;         // Elements before the wrap point.
+        memcpy(&slots[i],src,k*sizeof(T));// Up to the end of the array.
+        if (k<n)                        // Did we wrap?
+          memcpy(&slots[0],src+k,(n-k)*sizeof(T));// Yes, the rest goes at the front.
+        tail.store(t+n,std::memory_order_release);// Publish the elements.
+        return n;                       // How many we pushed.
+      }                                 // ~~~~~~~~~ TryPushN ~~~~~~~~~
+      // Consumer: pop up to n elements, returns how many came out.
+      size_t TryPopN (
+        T* dst,                         // Where to put them
+        size_t n)                       // Room in dst
+      {                                 // ~~~~~~~~~ TryPopN ~~~~~~~~~
+        uint64_t h=head.load(std::memory_order_relaxed);// Only we write head.
+        size_t avail=(size_t)(tailcache-h);// Elements according to our cached tail.
+        if (avail<n)                    // Fewer than asked for as far as we know?
+        {                               // Yes, so refresh our view of tail.
+          tailcache=tail.load(std::memory_order_acquire);
+          avail=(size_t)(tailcache-h);  // Elements now.
+        }                               // Done refreshing.
+        if (n>avail)                    // More than there is?
+          n=avail;                      // Yes, take what there is.
+        if (n==0)                       // Empty?
+          return 0;                     // Yes, nothing popped.
+        size_t i=(size_t)h&(N-1);       // First slot to read.
+        size_t k=(n<N-i)?n:N-i;         // Elements before the wrap point.
+        memcpy(dst,&slots[i],k*sizeof(T));// Up to the end of the array.
+        if (k<n)                        // Did we wrap?
+          memcpy(dst+k,&slots[0],(n-k)*sizeof(T));// Yes, the rest is at the front.
+        head.store(h+n,std::memory_order_release);// Hand the slots back.
+        return n;                       // How many we popped.
+      }                                 // ~~~~~~~~~ TryPopN ~~~~~~~~~
+      // Approximate number of queued elements (exact from either end).
+      size_t Size (void) const
+      {                                 // ~~~~~~~~~ Size ~~~~~~~~~
+        uint64_t h=head.load(std::memory_order_acquire);
+        uint64_t t=tail.load(std::memory_order_acquire);
+        return (t>h)?(size_t)(t-h):0;   // Never negative.
+      }                                 // ~~~~~~~~~ Size ~~~~~~~~~
+      bool Empty (void) const { return Size()==0; }
+    private:
+      ShmRing (void)=delete;            // Only ever placed on top of a segment.
+      static ShmLayoutSpec Spec (void)
+      {                                 // ~~~~~~~~~ Spec ~~~~~~~~~
+        return {SHM_KIND_RING,kVersion,(uint32_t)sizeof(T),(uint64_t)N,
+          (uint64_t)sizeof(ShmRing)};   // What Open() expects to find.
+      }                                 // ~~~~~~~~~ Spec ~~~~~~~~~
+      ShmLayoutHeader hdr;              // Versioned header (one cache line)
+      alignas(kCacheLine) std::atomic<uint64_t> tail;// Next slot to write (producer)
+      uint64_t headcache;               // Producer's last view of head
+      alignas(kCacheLine) std::atomic<uint64_t> head;// Next slot to read (consumer)
+      uint64_t tailcache;               // Consumer's last view of tail
+      alignas(kCacheLine) T slots[N];   // The elements
+  };
+}
@@ -0,0 +1,303 @@
+ /*
+ * *
+ * * Filename: ShmSnapshot.hpp
+ * *
+ * * Description:
+ * *   One-writer/many-reader publication of a struct through a shared memory segment,
+ * *     protected by a sequence lock. The writer never waits for anybody: it makes the
+ * *     sequence odd, updates the data and makes it even again. Readers never write to
+ * *     the shared lines on the fast path: they copy the data between two loads of the
+ * *     sequence and retry if a write overlapped the copy. The only shared store a
+ * *     reader makes is bumping the retry counter, so the contention it causes can be
+ * *     measured.
+ * *
+ * *   ShmSnapshot<T>       : single copy, best when T is small or writes are rare.
+ * *   ShmDoubleSnapshot<T> : two copies written alternately, so a reader copying a very
+ * *                          large T only retries when the writer publishes twice in
+ * *                          the time it takes to make one copy.
+ * *
+ * *   Only one process may write at a time; serialize multiple writers externally.
+ * *   The data copy races with the writer by design (the sequence check discards torn
+ * *   copies), which is why T must be trivially copyable.
+ * *
+ * *  Author:
+ * *    JEP  J. Enrique Peraza
+ * *
+ */
+#pragma once
+#include <atomic>
+#include <type_traits>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <sched.h>
+#include "ShmLayout.hpp"
+
+namespace ipc
+{
+  // Per-reader counters (kept by the caller, never shared).
+  struct ShmSnapshotStats
+  {
+    uint64_t reads{0};                  // Consistent copies taken
+    uint64_t retries{0};                // Copies thrown away because of a writer
+  };                                    // ShmSnapshotStats
+  template<typename T>
+  class ShmSnapshot
+  {
+    static_assert(std::is_trivially_copyable<T>::value,"snapshots are copied with memcpy");
+    public:
+      static constexpr uint16_t kVersion=1;// Bump when the layout below changes.
+      static constexpr size_t RequiredBytes (void) { return sizeof(ShmSnapshot); }
+      // Format a fresh region or validate one formatted by another process.
+      static ShmResult Open (
+        void* mem,                      // Start of the region (cache line aligned)
+        size_t len,                     // Bytes available
+        ShmSnapshot** out)              // Where to return the snapshot
+      {                                 // ~~~~~~~~~ Open ~~~~~~~~~
+        if (out==nullptr)               // Nowhere to put the result?
+          return {-1,EINVAL};           // Yes, error out.
+        *out=nullptr;                   // Nothing yet.
+        ShmResult r=ShmLayoutClaim(mem,len,Spec());
+        if (r.code<0)                   // Bad region or layout?
+          return r;                     // Yes, pass the error along.
+        ShmSnapshot* s=static_cast<ShmSnapshot*>(mem);
+        if (r.code==1)                  // Are we the formatter?
+        {                               // Yes, version 0 is all zeroes.
+          s->seq.store(0,std::memory_order_relaxed);
+          s->retries.store(0,std::memory_order_relaxed);
+          memset(static_cast<void*>(&s->data),0,sizeof(T));
+          ShmLayoutPublish(mem);        // Let everybody else in.
+        }                               // Done formatting.
+        *out=s;                         // Hand back the snapshot.
+        return {0,0};                   // Success.
+      }                                 // ~~~~~~~~~ Open ~~~~~~~~~
+      // Convenience overload for an attached segment.
+      template<typename Seg>
+      static ShmResult Open (
+        Seg& seg,                       // An attached segment
+        ShmSnapshot** out)              // Where to return the snapshot
+      {                                 // ~~~~~~~~~ Open ~~~~~~~~~
+        if (seg.GetPointer()==nullptr)  // Not attached?
+          return {-1,EINVAL};           // Yes, nothing to open.
+        return Open(seg.GetPointer(),seg.GetShmSize(),out);
+      }                                 // ~~~~~~~~~ Open ~~~~~~~~~
+      // Writer: publish a whole new value.
+      void Publish (
+        const T& v)                     // The new value
+      {                                 // ~~~~~~~~~ Publish ~~~~~~~~~
+        memcpy(static_cast<void*>(BeginWrite()),&v,sizeof(T));
+        EndWrite();                     // Make it visible.
+      }                                 // ~~~~~~~~~ Publish ~~~~~~~~~
+      // Writer: update in place (only the fields you touch are written).
+      // Readers retry until EndWrite() is called.
+      T* BeginWrite (void)
+      {                                 // ~~~~~~~~~ BeginWrite ~~~~~~~~~
+        uint64_t s=seq.load(std::memory_order_relaxed);
+        seq.store(s+1,std::memory_order_relaxed);// Odd: write in progress.
+        std::atomic_thread_fence(std::memory_order_release);// Odd before the data.
+        return &data;                   // Edit away.
+      }                                 // ~~~~~~~~~ BeginWrite ~~~~~~~~~
+      void EndWrite (void)
+      {                                 // ~~~~~~~~~ EndWrite ~~~~~~~~~
+        uint64_t s=seq.load(std::memory_order_relaxed);
+        seq.store(s+1,std::memory_order_release);// Even: data before this.
+      }                                 // ~~~~~~~~~ EndWrite ~~~~~~~~~
+      // Reader: one attempt. False if a write overlapped the copy.
+      bool TryRead (
+        T& out,                         // Where to copy the value
+        uint64_t* version=nullptr) const// Optional: version copied
+      {                                 // ~~~~~~~~~ TryRead ~~~~~~~~~
+        uint64_t s1=seq.load(std::memory_order_acquire);
+        if (s1&1)                       // Writer in the middle of it?
+          return false;                 // Yes, do not bother copying.
+        memcpy(static_cast<void*>(&out),&data,sizeof(T));// Possibly torn copy.
+        std::atomic_thread_fence(std::memory_order_acquire);// Copy before the re-check.
+        if (seq.load(std::memory_order_relaxed)!=s1)// Did a write overlap?
+          return false;                 // Yes, the copy is garbage.
+        if (version!=nullptr)           // Caller wants the version?
+          *version=s1/2;                // Yes, one per publication.
+        return true;                    // Consistent copy.
+      }                                 // ~~~~~~~~~ TryRead ~~~~~~~~~
+      // Reader: copy a consistent value, retrying as needed. Returns the
+      // version copied (0 means never published).
+      uint64_t Read (
+        T& out,                         // Where to copy the value
+        ShmSnapshotStats* st=nullptr)   // Optional per-reader counters
+      {                                 // ~~~~~~~~~ Read ~~~~~~~~~
+        uint64_t v=0;                   // Version we copied.
+        for (unsigned n=1;!TryRead(out,&v);n++)// Until a copy survives.
+        {
+          retries.fetch_add(1,std::memory_order_relaxed);// Shared contention counter.
+          if (st!=nullptr)              // Caller counting too?
+            st->retries++;              // Yes.
+          if ((n&63)==0)                // Writer descheduled mid-write?
+            sched_yield();              // Let it finish.
+          else                          // Otherwise...
+            CpuRelax();                 // ...just back off a little.
+        }                               // Done retrying.
+        if (st!=nullptr)                // Caller counting?
+          st->reads++;                  // Yes, one more read.
+        return v;                       // Version copied.
+      }                                 // ~~~~~~~~~ Read ~~~~~~~~~
+      // Reader: copy only if something newer than *last was published.
+      bool ReadIfChanged (
+        T& out,                         // Where to copy the value
+        uint64_t* last,                 // In: version we hold. Out: version now held.
+        ShmSnapshotStats* st=nullptr)   // Optional per-reader counters
+      {                                 // ~~~~~~~~~ ReadIfChanged ~~~~~~~~~
+        if (Version()==*last)           // Nothing new?
+          return false;                 // Yes, keep what we have.
+        *last=Read(out,st);             // Copy the new one.
+        return true;                    // Changed.
+      }                                 // ~~~~~~~~~ ReadIfChanged ~~~~~~~~~
+      // Number of completed publications.
+      uint64_t Version (void) const { return seq.load(std::memory_order_acquire)/2; }
+      // Retries by every reader of this snapshot, in every process.
+      uint64_t TotalRetries (void) const { return retries.load(std::memory_order_relaxed); }
+    private:
+      ShmSnapshot (void)=delete;        // Only ever placed on top of a segment.
+      static ShmLayoutSpec Spec (void)
+      {                                 // ~~~~~~~~~ Spec ~~~~~~~~~
+        return {SHM_KIND_SNAPSHOT,kVersion,(uint32_t)sizeof(T),1,
+          (uint64_t)sizeof(ShmSnapshot)};// What Open() expects to find.
+      }                                 // ~~~~~~~~~ Spec ~~~~~~~~~
+      ShmLayoutHeader hdr;              // Versioned header (one cache line)
+      alignas(kCacheLine) std::atomic<uint64_t> seq;// Odd while writing
+      alignas(kCacheLine) std::atomic<uint64_t> retries;// Reader retries, all processes
+      alignas(kCacheLine) T data;       // The published value
+  };
+  template<typename T>
+  class ShmDoubleSnapshot
+  {
+    static_assert(std::is_trivially_copyable<T>::value,"snapshots are copied with memcpy");
+    public:
+      static constexpr uint16_t kVersion=2;// Bump when the layout below changes.
+      static constexpr size_t RequiredBytes (void) { return sizeof(ShmDoubleSnapshot); }
+      // Format a fresh region or validate one formatted by another process.
+      static ShmResult Open (
+        void* mem,                      // Start of the region (cache line aligned)
+        size_t len,                     // Bytes available
+        ShmDoubleSnapshot** out)        // Where to return the snapshot
+      {                                 // ~~~~~~~~~ Open ~~~~~~~~~
+        if (out==nullptr)               // Nowhere to put the result?
+          return {-1,EINVAL};           // Yes, error out.
+        *out=nullptr;                   // Nothing yet.
+        ShmResult r=ShmLayoutClaim(mem,len,Spec());
+        if (r.code<0)                   // Bad region or layout?
+          return r;                     // Yes, pass the error along.
+        ShmDoubleSnapshot* s=static_cast<ShmDoubleSnapshot*>(mem);
+        if (r.code==1)                  // Are we the formatter?
+        {                               // Yes, version 0 lives in slot 0.
+          s->current.store(0,std::memory_order_relaxed);
+          s->retries.store(0,std::memory_order_relaxed);
+          for (int i=0;i<2;i++)         // Both slots...
+          {
+            s->slot[i].seq.store(0,std::memory_order_relaxed);
+            s->slot[i].version.store(0,std::memory_order_relaxed);
+            memset(static_cast<void*>(&s->slot[i].data),0,sizeof(T));// ...all zeroes.
+          }                             // Done with slots.
+          ShmLayoutPublish(mem);        // Let everybody else in.
+        }                               // Done formatting.
+        *out=s;                         // Hand back the snapshot.
+        return {0,0};                   // Success.
+      }                                 // ~~~~~~~~~ Open ~~~~~~~~~
+      // Convenience overload for an attached segment.
+      template<typename Seg>
+      static ShmResult Open (
+        Seg& seg,                       // An attached segment
+        ShmDoubleSnapshot** out)        // Where to return the snapshot
+      {                                 // ~~~~~~~~~ Open ~~~~~~~~~
+        if (seg.GetPointer()==nullptr)  // Not attached?
+          return {-1,EINVAL};           // Yes, nothing to open.
+        return Open(seg.GetPointer(),seg.GetShmSize(),out);
+      }                                 // ~~~~~~~~~ Open ~~~~~~~~~
+      // Writer: publish a whole new value into the idle slot, then flip.
+      void Publish (
+        const T& v)                     // The new value
+      {                                 // ~~~~~~~~~ Publish ~~~~~~~~~
+        uint64_t next=current.load(std::memory_order_relaxed)+1;
+        Slot& s=slot[next&1];           // The slot readers are not using.
+        uint64_t q=s.seq.load(std::memory_order_relaxed);
+        s.seq.store(q+1,std::memory_order_relaxed);// Odd: write in progress.
+        std::atomic_thread_fence(std::memory_order_release);// Odd before the data.
+        s.version.store(next,std::memory_order_relaxed);// Which value this is...
+        memcpy(static_cast<void*>(&s.data),&v,sizeof(T));// ...and the value.
+        s.seq.store(q+2,std::memory_order_release);// Even: data before this.
+        current.store(next,std::memory_order_release);// Point readers at it.
+      }                                 // ~~~~~~~~~ Publish ~~~~~~~~~
+      // Reader: one attempt. False if the writer lapped us during the copy.
+      bool TryRead (
+        T& out,                         // Where to copy the value
+        uint64_t* version=nullptr) const// Optional: version copied
+      {                                 // ~~~~~~~~~ TryRead ~~~~~~~~~
+        uint64_t v=current.load(std::memory_order_acquire);
+        const Slot& s=slot[v&1];        // Latest complete slot.
+        uint64_t s1=s.seq.load(std::memory_order_acquire);
+        if (s1&1)                       // Already being rewritten (we were lapped)?
+          return false;                 // Yes, start over.
+        // The slot may have been refilled with v+2, v+4... since we read
+        // current, so the version comes from the slot, inside the same window.
+        uint64_t sv=s.version.load(std::memory_order_relaxed);
+        memcpy(static_cast<void*>(&out),&s.data,sizeof(T));// Possibly torn copy.
+        std::atomic_thread_fence(std::memory_order_acquire);// Copy before the re-check.
+        if (s.seq.load(std::memory_order_relaxed)!=s1)// Did a write overlap?
+          return false;                 // Yes, the copy and sv are garbage.
+        if (version!=nullptr)           // Caller wants the version?
+          *version=sv;                  // Yes, the one actually copied.
+        return true;                    // Consistent copy.
+      }                                 // ~~~~~~~~~ TryRead ~~~~~~~~~
+      // Reader: copy a consistent value, retrying as needed. Returns the
+      // version copied (0 means never published).
+      uint64_t Read (
+        T& out,                         // Where to copy the value
+        ShmSnapshotStats* st=nullptr)   // Optional per-reader counters
+      {                                 // ~~~~~~~~~ Read ~~~~~~~~~
+        uint64_t v=0;                   // Version we copied.
+        for (unsigned n=1;!TryRead(out,&v);n++)// Until a copy survives.
+        {
+          retries.fetch_add(1,std::memory_order_relaxed);// Shared contention counter.
+          if (st!=nullptr)              // Caller counting too?
+            st->retries++;              // Yes.
+          if ((n&63)==0)                // Writer descheduled mid-write?
+            sched_yield();              // Let it finish.
+          else                          // Otherwise...
+            CpuRelax();                 // ...just back off a little.
+        }                               // Done retrying.
+        if (st!=nullptr)                // Caller counting?
+          st->reads++;                  // Yes, one more read.
+        return v;                       // Version copied.
+      }                                 // ~~~~~~~~~ Read ~~~~~~~~~
+      // Reader: copy only if something newer than *last was published.
+      bool ReadIfChanged (
+        T& out,                         // Where to copy the value
+        uint64_t* last,                 // In: version we hold. Out: version now held.
+        ShmSnapshotStats* st=nullptr)   // Optional per-reader counters
+      {                                 // ~~~~~~~~~ ReadIfChanged ~~~~~~~~~
+        if (Version()==*last)           // Nothing new?
+          return false;                 // Yes, keep what we have.
+        *last=Read(out,st);             // Copy the new one.
+        return true;                    // Changed.
+      }                                 // ~~~~~~~~~ ReadIfChanged ~~~~~~~~~
+      // Number of completed publications.
+      uint64_t Version (void) const { return current.load(std::memory_order_acquire); }
+      // Retries by every reader of this snapshot, in every process.
+      uint64_t TotalRetries (void) const { return retries.load(std::memory_order_relaxed); }
+    private:
+      ShmDoubleSnapshot (void)=delete;  // Only ever placed on top of a segment.
+      static ShmLayoutSpec Spec (void)
+      {                                 // ~~~~~~~~~ Spec ~~~~~~~~~
+        return {SHM_KIND_SNAPSHOT2,kVersion,(uint32_t)sizeof(T),2,
+          (uint64_t)sizeof(ShmDoubleSnapshot)};// What Open() expects to find.
+      }                                 // ~~~~~~~~~ Spec ~~~~~~~~~
+      struct alignas(kCacheLine) Slot
+      {
+        std::atomic<uint64_t> seq;      // Odd while this slot is written
+        std::atomic<uint64_t> version;  // Version of data (set while seq is odd)
+        alignas(kCacheLine) T data;     // One copy of the value
+      };                                // Slot
+      ShmLayoutHeader hdr;              // Versioned header (one cache line)
+      alignas(kCacheLine) std::atomic<uint64_t> current;// Latest version; slot is current&1
+      alignas(kCacheLine) std::atomic<uint64_t> retries;// Reader retries, all processes
+      Slot slot[2];                     // The two copies
+  };
+}
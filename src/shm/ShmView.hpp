@@ -0,0 +1,251 @@
+ /*
+ * *
+ * * Filename: ShmView.hpp
+ * *
+ * * Description:
+ * *   Typed views of attached segments, so callers stop casting GetPointer() by hand.
+ * *     ShmSpan<T> is a non-owning, span-style view of count T's at a byte offset of a
+ * *     segment; it is only handed out after checking that the range lies inside the
+ * *     segment and that the address is suitably aligned for T. Mapping<T,Seg> owns the
+ * *     segment object (moved in, so the attachment is reused rather than redone) and
+ * *     points a T at an offset in it, optionally checking that a published
+ * *     ShmLayoutHeader of the expected kind and version sits there first. Mappings are
+ * *     move-only and can live in containers or be handed from stage to stage.
+ * *
+ * *   Usage:
+ * *     ipc::SharedMemory shm;
+ * *     shm.CreateOrAttach(key,sizeof(Book));
+ * *     ipc::Mapping<Book> book;
+ * *     ipc::Mapping<Book>::Map(std::move(shm),&book);      // attaches if needed
+ * *     book->bid[0]=...;
+ * *     ipc::ShmSpan<Level> lv;
+ * *     ipc::ShmSpan<Level>::From(book.Segment(),offsetof(Book,lv),64,&lv);
+ * *
+ * *  Author:
+ * *    JEP  J. Enrique Peraza
+ * *
+ */
+#pragma once
+#include <type_traits>
+#include <utility>
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+#include "SharedMemory.hpp"
+#include "ShmLayout.hpp"
+
+namespace ipc
+{
+  // Can count T's start off bytes into a len-byte region at base?
+  //   EINVAL: no region or misaligned for T; ERANGE: runs past the end.
+  template<typename T>
+  inline ShmResult ShmViewCheck (
+    const void* base,                   // Start of the region
+    size_t len,                         // Bytes in the region
+    size_t off,                         // Byte offset of the first T
+    size_t count)                       // Number of T's
+  {                                     // ~~~~~~~~~ ShmViewCheck ~~~~~~~~~
+    if (base==nullptr)                  // Not attached?
+      return {-1,EINVAL};               // Nothing to view.
+    if (off>len||count>(len-off)/sizeof(T))// Past the end (without overflowing)?
+      return {-1,ERANGE};               // Yes.
+    if (((uintptr_t)base+off)%alignof(T)!=0)// Misaligned for T?
+      return {-1,EINVAL};               // Yes, loads could tear or trap.
+    return {0,0};                       // Fits.
+  }                                     // ~~~~~~~~~ ShmViewCheck ~~~~~~~~~
+  template<typename T>
+  class ShmSpan
+  {
+    static_assert(std::is_trivially_copyable<T>::value,"shared memory holds raw bytes only");
+    public:
+      ShmSpan (void)=default;           // Empty view.
+      // View count T's at byte offset off of a region.
+      static ShmResult From (
+        void* base,                     // Start of the region
+        size_t len,                     // Bytes in the region
+        size_t off,                     // Byte offset of the first T
+        size_t count,                   // Number of T's
+        ShmSpan* out)                   // Where to return the view
+      {                                 // ~~~~~~~~~ From ~~~~~~~~~
+        if (out==nullptr)               // Nowhere to put it?
+          return {-1,EINVAL};           // Yes, error out.
+        *out=ShmSpan();                 // Nothing yet.
+        ShmResult r=ShmViewCheck<T>(base,len,off,count);
+        if (r.code<0)                   // Out of bounds or misaligned?
+          return r;                     // Yes.
+        out->ptr=reinterpret_cast<T*>(static_cast<char*>(base)+off);
+        out->count=count;               // Length.
+        return {0,0};                   // Success.
+      }                                 // ~~~~~~~~~ From ~~~~~~~~~
+      // Convenience overload for an attached segment.
+      template<typename Seg>
+      static ShmResult From (
+        Seg& seg,                       // An attached segment
+        size_t off,                     // Byte offset of the first T
+        size_t count,                   // Number of T's
+        ShmSpan* out)                   // Where to return the view
+      {                                 // ~~~~~~~~~ From ~~~~~~~~~
+        return From(seg.GetPointer(),seg.GetShmSize(),off,count,out);
+      }                                 // ~~~~~~~~~ From ~~~~~~~~~
+      // Every whole T from off to the end of the segment.
+      template<typename Seg>
+      static ShmResult FromRest (
+        Seg& seg,                       // An attached segment
+        size_t off,                     // Byte offset of the first T
+        ShmSpan* out)                   // Where to return the view
+      {                                 // ~~~~~~~~~ FromRest ~~~~~~~~~
+        size_t len=seg.GetShmSize();    // Segment size.
+        return From(seg.GetPointer(),len,off,(off<=len)?(len-off)/sizeof(T):1,out);
+      }                                 // ~~~~~~~~~ FromRest ~~~~~~~~~
+      T* data (void) const { return ptr; }
+      size_t size (void) const { return count; }
+      size_t size_bytes (void) const { return count*sizeof(T); }
+      bool empty (void) const { return count==0; }
+      T* begin (void) const { return ptr; }
+      T* end (void) const { return ptr+count; }
+      T& operator[] (size_t i) const { return ptr[i]; }// Unchecked, like std::span.
+      // Checked element access: nullptr if i is out of range.
+      T* At (size_t i) const { return (i<count)?ptr+i:nullptr; }
+      // Sub-view [first,first+n); empty if that is not inside this view.
+      ShmSpan Subspan (
+        size_t first,                   // First element
+        size_t n) const                 // Elements
+      {                                 // ~~~~~~~~~ Subspan ~~~~~~~~~
+        ShmSpan s;                      // Empty unless it fits.
+        if (first<=count&&n<=count-first)// Inside us?
+        {
+          s.ptr=ptr+first;              // Yes, start there...
+          s.count=n;                    // ...for n.
+        }                               // Done checking.
+        return s;                       // The view.
+      }                                 // ~~~~~~~~~ Subspan ~~~~~~~~~
+    private:
+      T* ptr{nullptr};                  // First element
+      size_t count{0};                  // Elements
+  };
+  // Owns a segment object and views a T inside it.
+  template<typename T,typename Seg=SharedMemory>
+  class Mapping
+  {
+    static_assert(std::is_trivially_copyable<T>::value||std::is_standard_layout<T>::value,
+      "shared memory holds raw bytes only");
+    public:
+      Mapping (void)=default;           // Empty.
+      Mapping (const Mapping&)=delete;  // The segment has one owner.
+      Mapping& operator= (const Mapping&)=delete;
+      Mapping (Mapping&& o) noexcept : seg(std::move(o.seg)), obj(o.obj), off(o.off),
+        kind(o.kind), version(o.version) { o.obj=nullptr; }
+      Mapping& operator= (Mapping&& o) noexcept
+      {
+        if (this!=&o)                   // Not ourselves?
+        {
+          seg=std::move(o.seg);         // Drops ours, takes theirs.
+          obj=o.obj;                    // The view...
+          off=o.off;                    // ...where it was...
+          kind=o.kind;                  // ...and what it...
+          version=o.version;            // ...was checked against.
+          o.obj=nullptr;                // Source is empty now.
+        }                               // Done moving.
+        return *this;
+      }
+      // Take over s (attaching it if it is not attached yet) and view the T
+      // at byte offset at. ERANGE/EINVAL as for ShmViewCheck(); on failure
+      // the segment object is left in *out so nothing leaks.
+      static ShmResult Map (
+        Seg&& s,                        // Bound segment object (moved from)
+        Mapping* out,                   // Where to return the mapping
+        size_t at=0)                    // Byte offset of the T
+      {                                 // ~~~~~~~~~ Map ~~~~~~~~~
+        return Map(std::move(s),out,SHM_KIND_NONE,0,at);
+      }                                 // ~~~~~~~~~ Map ~~~~~~~~~
+      // Same, but a published ShmLayoutHeader of kind/version must sit at the
+      // offset and fit in the segment: EPROTO if it does not match, EAGAIN
+      // if it has not been published yet.
+      static ShmResult Map (
+        Seg&& s,                        // Bound segment object (moved from)
+        Mapping* out,                   // Where to return the mapping
+        uint16_t k,                     // Expected ShmKind (SHM_KIND_NONE: no check)
+        uint16_t v,                     // Expected layout version
+        size_t at=0)                    // Byte offset of the T
+      {                                 // ~~~~~~~~~ Map ~~~~~~~~~
+        if (out==nullptr)               // Nowhere to put it?
+          return {-1,EINVAL};           // Yes, error out.
+        *out=Mapping();                 // Drop whatever it held.
+        out->seg=std::move(s);          // Ours now, attached or not.
+        out->off=at;                    // Where the T lives.
+        out->kind=k;                    // What must be there...
+        out->version=v;                 // ...if anything.
+        if (out->seg.GetPointer()==nullptr)// Not attached yet?
+        {
+          ShmResult r=out->seg.Attach();// Map it (once).
+          if (r.code<0)                 // Could we?
+            return r;                   // No.
+        }                               // Done attaching.
+        return out->Bind();             // Check and point.
+      }                                 // ~~~~~~~~~ Map ~~~~~~~~~
+      // Grow/shrink the segment (POSIX backend; ENOTSUP for System V) and
+      // revalidate the view, which may have moved.
+      ShmResult Resize (
+        size_t size)                    // New segment size
+      {                                 // ~~~~~~~~~ Resize ~~~~~~~~~
+        ShmResult r=seg.Resize(size);   // Backend does the work.
+        if (r.code<0)                   // Could it?
+          return r;                     // No, the old view stands.
+        return Bind();                  // Re-point (and re-check) the view.
+      }                                 // ~~~~~~~~~ Resize ~~~~~~~~~
+      // Follow a resize done by a peer.
+      ShmResult Remap (void)
+      {                                 // ~~~~~~~~~ Remap ~~~~~~~~~
+        ShmResult r=seg.Remap();        // Backend does the work.
+        if (r.code<0)                   // Could it?
+          return r;                     // No, the old view stands.
+        return Bind();                  // Re-point (and re-check) the view.
+      }                                 // ~~~~~~~~~ Remap ~~~~~~~~~
+      // Typed view of count U's at byte offset at of the same segment.
+      template<typename U>
+      ShmResult Span (
+        size_t at,                      // Byte offset of the first U
+        size_t count,                   // Number of U's
+        ShmSpan<U>* out)                // Where to return the view
+      {                                 // ~~~~~~~~~ Span ~~~~~~~~~
+        return ShmSpan<U>::From(seg,at,count,out);
+      }                                 // ~~~~~~~~~ Span ~~~~~~~~~
+      T* get (void) const { return obj; }
+      T* operator-> (void) const { return obj; }
+      T& operator* (void) const { return *obj; }
+      explicit operator bool (void) const { return obj!=nullptr; }
+      Seg& Segment (void) { return seg; }
+      const Seg& Segment (void) const { return seg; }
+    private:
+      // Check the T (and its header) against the current mapping and point at it.
+      ShmResult Bind (void)
+      {                                 // ~~~~~~~~~ Bind ~~~~~~~~~
+        obj=nullptr;                    // Invalid until proven otherwise.
+        void* base=seg.GetPointer();    // Current mapping.
+        size_t len=seg.GetShmSize();    // Current size.
+        ShmResult r=ShmViewCheck<T>(base,len,off,1);
+        if (r.code<0)                   // Does a T fit there?
+          return r;                     // No.
+        char* p=static_cast<char*>(base)+off;// Where it starts.
+        if (kind!=SHM_KIND_NONE)        // Layout header to check?
+        {
+          const ShmLayoutHeader* h=reinterpret_cast<const ShmLayoutHeader*>(p);
+          if (len-off<sizeof(*h))       // Room for the header at all?
+            return {-1,ERANGE};         // No.
+          uint32_t st=h->state.load(std::memory_order_acquire);
+          if (st==SHM_STATE_RAW||st==SHM_STATE_INIT)// Not published yet?
+            return {-1,EAGAIN};         // Try again once it is formatted.
+          if (st!=SHM_STATE_READY||h->magic!=kShmMagic||h->kind!=kind||
+            h->version!=version||h->totalsize>len-off)// Something else, or truncated?
+            return {-1,EPROTO};         // Refuse to touch it.
+        }                               // Done with the header.
+        obj=reinterpret_cast<T*>(p);    // Valid.
+        return {0,0};                   // Success.
+      }                                 // ~~~~~~~~~ Bind ~~~~~~~~~
+      Seg seg;                          // The segment (owned)
+      T* obj{nullptr};                  // The T in it, or nullptr
+      size_t off{0};                    // Its byte offset
+      uint16_t kind{SHM_KIND_NONE};     // Expected ShmKind or SHM_KIND_NONE
+      uint16_t version{0};              // Expected layout version
+  };
+}
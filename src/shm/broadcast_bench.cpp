@@ -0,0 +1,204 @@
+/**
+ * Fan-out benchmark for ipc::ShmBroadcast against one pipe per subscriber. For every
+ * subscriber count from one up to the maximum (doubling each round) one writer sends the
+ * same stream of fixed-size messages to every subscriber, first through a broadcast log
+ * (written once, read by all, subscribers sleep on the doorbell) and then through N
+ * pipes (written N times). Printed per round:
+ *
+ *    bcast-w/s   messages per second the broadcast writer published
+ *    bcast-r/s   messages per second each subscriber received, on average
+ *    lost%       share of messages subscribers missed because they were overrun
+ *    pipes/s     messages per second delivered to every pipe subscriber
+ *
+ * The broadcast writer never waits for slow subscribers, so on a loaded box lost% is
+ * where the cost shows up; the pipe writer blocks instead.
+ *
+ *    broadcast_bench [max-subscribers [message-bytes [messages [ring-KB]]]]
+ */
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <stdint.h>
+#include <vector>
+#include "ShmBroadcast.hpp"
+extern "C" {
+#include "tlpi_hdr.h"
+}
+
+struct Results                          // Shared with the subscribers.
+{
+  std::atomic<int> done;                // Writer finished.
+  uint64_t got[64];                     // Messages received per subscriber.
+  uint64_t lost[64];                    // Messages lost per subscriber.
+};
+
+static double nowSec (void)             // Monotonic time in seconds.
+{
+  struct timespec ts;                   // Current time.
+  clock_gettime(CLOCK_MONOTONIC,&ts);   // Get it.
+  return ts.tv_sec+ts.tv_nsec/1e9;      // As a double.
+}
+
+static void awaitStart (                // Block until the parent opens the gate.
+  int gate)                             // Read end of the gate pipe.
+{
+  char c;                               // Nothing is ever written.
+  if (read(gate,&c,1)==-1)              // EOF when the parent closes its end.
+    errExit("read");                    // Anything else is an error.
+  close(gate);                          // Done with the gate.
+}
+
+static double broadcastRound (          // Writer plus n broadcast subscribers.
+  ipc::ShmBroadcast* b,                 // The log in the segment.
+  Results* res,                         // Shared counters.
+  int n,                                // Subscribers.
+  uint32_t size,                        // Message bytes.
+  uint64_t msgs)                        // Messages to publish.
+{
+  int gate[2];                          // Start gate.
+  std::vector<pid_t> kids(n);           // Child PIDs.
+  if (pipe(gate)==-1)                   // Could we make the gate?
+    errExit("pipe");                    // No, bail.
+  res->done.store(0);                   // Writer not finished.
+  for (int i=0;i<n;i++)                 // Fork the subscribers.
+  {
+    kids[i]=fork();                     // One subscriber.
+    if (kids[i]==-1)                    // Did fork fail?
+      errExit("fork");                  // Yes, bail.
+    if (kids[i]==0)                     // Child?
+    {                                   // Yes, read until the writer is done.
+      close(gate[1]);                   // Only the parent holds the write end.
+      ipc::ShmBroadcast::Subscriber sub(b);// Start at the head...
+      awaitStart(gate[0]);              // ...before the writer starts.
+      std::vector<char> buf(size);      // Message buffer.
+      struct timespec nap={0,10000000}; // Recheck the done flag every 10ms.
+      uint64_t got=0;                   // Messages received.
+      for (;;)                          // Until the writer is done and we are drained.
+      {
+        uint32_t len;                   // Message bytes.
+        ipc::ShmResult r=sub.Read(buf.data(),buf.size(),&len,&nap);
+        if (r.code==1)                  // A message?
+          got++;                        // Count it.
+        else if (r.errn==ETIMEDOUT&&res->done.load())// Idle and no more coming?
+          break;                        // Yes, done.
+        else if (r.code<0&&r.errn!=EOVERFLOW&&r.errn!=ETIMEDOUT)
+          errExitEN(r.errn,"Read");     // Anything but an overrun is a bug.
+      }                                 // Done reading.
+      uint32_t len;                     // Drain the count of the last lap.
+      while (sub.TryRead(buf.data(),buf.size(),&len).code==1)
+        got++;                          // Stragglers.
+      res->got[i]=got;                  // Report.
+      res->lost[i]=msgs-got;            // Everything else was overrun.
+      _exit(EXIT_SUCCESS);              // No atexit handlers in children.
+    }                                   // Done with subscriber child.
+  }                                     // Done forking.
+  close(gate[0]);                       // Parent only needs the write end.
+  std::vector<char> msg(size,'m');      // The message.
+  close(gate[1]);                       // Open the gate.
+  double t0=nowSec();                   // Start the clock.
+  for (uint64_t j=0;j<msgs;j++)         // Publish the stream.
+  {
+    memcpy(msg.data(),&j,sizeof(j)<size?sizeof(j):size);
+    ipc::ShmResult r=b->Publish(msg.data(),size);
+    if (r.code<0)                       // Did it fit?
+      errExitEN(r.errn,"Publish");      // No, bail.
+  }                                     // Done publishing.
+  double secs=nowSec()-t0;              // Writer time.
+  res->done.store(1);                   // Tell the subscribers.
+  for (int i=0;i<n;i++)                 // Wait for every subscriber.
+    if (waitpid(kids[i],NULL,0)==-1)    // Did waitpid fail?
+      errExit("waitpid");               // Yes, bail.
+  return secs;                          // Writer seconds.
+}
+
+static double pipeRound (               // Writer plus n pipe subscribers.
+  int n,                                // Subscribers.
+  uint32_t size,                        // Message bytes.
+  uint64_t msgs)                        // Messages to send.
+{
+  std::vector<int> wfd(n);              // Write end per subscriber.
+  std::vector<pid_t> kids(n);           // Child PIDs.
+  for (int i=0;i<n;i++)                 // One pipe and child each.
+  {
+    int fd[2];                          // This subscriber's pipe.
+    if (pipe(fd)==-1)                   // Could we make it?
+      errExit("pipe");                  // No, bail.
+    kids[i]=fork();                     // One subscriber.
+    if (kids[i]==-1)                    // Did fork fail?
+      errExit("fork");                  // Yes, bail.
+    if (kids[i]==0)                     // Child?
+    {                                   // Yes, read to EOF.
+      close(fd[1]);                     // Only the parent writes.
+      for (int k=0;k<i;k++)             // Siblings' write ends we inherited...
+        close(wfd[k]);                  // ...would keep their pipes open.
+      std::vector<char> buf(64*1024);   // Read buffer.
+      while (read(fd[0],buf.data(),buf.size())>0)
+        continue;                       // Just consume.
+      _exit(EXIT_SUCCESS);              // No atexit handlers in children.
+    }                                   // Done with subscriber child.
+    close(fd[0]);                       // Parent only writes.
+    wfd[i]=fd[1];                       // Remember the write end.
+  }                                     // Done forking.
+  std::vector<char> msg(size,'m');      // The message.
+  double t0=nowSec();                   // Start the clock.
+  for (uint64_t j=0;j<msgs;j++)         // Send the stream...
+    for (int i=0;i<n;i++)               // ...to every subscriber.
+      if (write(wfd[i],msg.data(),size)!=(ssize_t)size)
+        errExit("write");               // Short write or error.
+  for (int i=0;i<n;i++)                 // EOF for everybody.
+    close(wfd[i]);                      // Close it.
+  for (int i=0;i<n;i++)                 // Wait until all have drained.
+    if (waitpid(kids[i],NULL,0)==-1)    // Did waitpid fail?
+      errExit("waitpid");               // Yes, bail.
+  return nowSec()-t0;                   // Delivery time.
+}
+
+int main (
+  int argc,                             // The argument count.
+  char* argv[])                         // The argument vector.
+{
+  if (argc>1&&strcmp(argv[1],"--help")==0)// Asking for help?
+    usageErr("%s [max-subscribers [message-bytes [messages [ring-KB]]]]\n",argv[0]);
+  int maxn=(argc>1)?getInt(argv[1],GN_GT_0,"max-subscribers"):8;
+  uint32_t size=(argc>2)?getInt(argv[2],GN_GT_0,"message-bytes"):256;
+  uint64_t msgs=(argc>3)?getLong(argv[3],GN_GT_0,"messages"):1000000;
+  size_t ringkb=(argc>4)?getInt(argv[4],GN_GT_0,"ring-KB"):4096;
+  if (maxn>64)                          // Room in the results block?
+    cmdLineErr("at most 64 subscribers\n");
+  ipc::SharedMemory shm;                // Private segment for the log.
+  ipc::ShmResult r=shm.CreateOrAttach(IPC_PRIVATE,
+    ipc::ShmBroadcast::RequiredBytes(ringkb*1024),ipc::SHM_PERM_600,IPC_CREAT|IPC_EXCL);
+  if (r.code<0)                         // Could we create it?
+    errExitEN(r.errn,"shmget");         // No, bail.
+  r=shm.Attach();                       // Map it.
+  if (r.code<0)                         // Could we map it?
+    errExitEN(r.errn,"shmat");          // No, bail.
+  shm.MarkForRemoval();                 // Gone once the last process detaches.
+  ipc::ShmBroadcast* b=nullptr;         // The log.
+  r=ipc::ShmBroadcast::Open(shm,&b);    // Format it.
+  if (r.code<0)                         // Did that work?
+    errExitEN(r.errn,"ShmBroadcast::Open");// No, bail.
+  if (size>b->MaxRecord())              // Does a message fit?
+    cmdLineErr("message-bytes must be at most %u for this ring\n",b->MaxRecord());
+  Results* res=static_cast<Results*>(mmap(NULL,sizeof(Results),PROT_READ|PROT_WRITE,
+    MAP_SHARED|MAP_ANONYMOUS,-1,0));    // Counters the children fill in.
+  if (res==MAP_FAILED)                  // Could we map them?
+    errExit("mmap");                    // No, bail.
+  printf("%u-byte messages, %llu per round, %zu KB ring\n",size,(unsigned long long)msgs,ringkb);
+  printf("%6s %12s %12s %8s %12s\n","subs","bcast-w/s","bcast-r/s","lost%","pipes/s");
+  for (int n=1;n<=maxn;n*=2)            // Double the subscribers each round.
+  {
+    double bsecs=broadcastRound(b,res,n,size,msgs);
+    uint64_t got=0,lost=0;              // Totals over subscribers.
+    for (int i=0;i<n;i++)               // Add them up.
+    {
+      got+=res->got[i];                 // Received.
+      lost+=res->lost[i];               // Overrun.
+    }                                   // Done adding.
+    double psecs=pipeRound(n,size,msgs);// Same stream through pipes.
+    printf("%6d %12.0f %12.0f %7.2f%% %12.0f\n",n,msgs/bsecs,(double)got/n/bsecs,
+      100.0*lost/((double)msgs*n),msgs/psecs);
+    fflush(stdout);                     // Show progress as we go.
+  }                                     // Done with all rounds.
+  exit(EXIT_SUCCESS);                   // Segment goes away on detach.
+}
@@ -0,0 +1,169 @@
+/**
+ * Lookup benchmark for ipc::ShmHashMap. The parent builds a symbol->slot map of the
+ * requested size in a private System V segment, then for every reader count from one up
+ * to the maximum (doubling each round) forks that many processes that look up random
+ * symbols for the given number of seconds while, optionally, one more process keeps
+ * updating values. Each reader sends its count back over a pipe and the parent prints
+ * the aggregate lookups per second. For comparison it first times building the same
+ * table as a private std::unordered_map, which is what each process pays without the
+ * shared map:
+ *
+ *    hashmap_bench [max-readers [symbols [seconds [writer(0|1)]]]]
+ */
+#include <sys/wait.h>
+#include <time.h>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "ShmHashMap.hpp"
+extern "C" {
+#include "tlpi_hdr.h"
+}
+
+struct Symbol                           // Fixed-size key, no padding.
+{
+  char name[24];                        // NUL padded.
+};
+typedef ipc::ShmHashMap<Symbol,uint64_t> Map;
+
+static double nowSec (void)             // Monotonic time in seconds.
+{
+  struct timespec ts;                   // Current time.
+  clock_gettime(CLOCK_MONOTONIC,&ts);   // Get it.
+  return ts.tv_sec+ts.tv_nsec/1e9;      // As a double.
+}
+
+static uint64_t nextRand (              // xorshift64*: cheap per-process PRNG.
+  uint64_t* s)                          // State (non-zero).
+{
+  *s^=*s>>12;                           // Scramble...
+  *s^=*s<<25;                           // ...the...
+  *s^=*s>>27;                           // ...state...
+  return *s*0x2545f4914f6cdd1dULL;      // ...and mix the output.
+}
+
+static void awaitStart (                // Block until the parent opens the gate.
+  int gate)                             // Read end of the gate pipe.
+{
+  char c;                               // Nothing is ever written.
+  if (read(gate,&c,1)==-1)              // EOF when the parent closes its end.
+    errExit("read");                    // Anything else is an error.
+  close(gate);                          // Done with the gate.
+}
+
+static double runRound (                // One round with n readers.
+  Map* m,                               // The map in the segment.
+  const std::vector<Symbol>& syms,      // Keys to look up.
+  int n,                                // Readers.
+  double secs,                          // How long they read.
+  bool writer)                          // Run an updater alongside?
+{
+  int gate[2],res[2];                   // Start gate and result pipe.
+  std::vector<pid_t> kids;              // Child PIDs.
+  if (pipe(gate)==-1||pipe(res)==-1)    // Could we make the pipes?
+    errExit("pipe");                    // No, bail.
+  for (int i=0;i<n+(writer?1:0);i++)    // Fork the readers (and the writer).
+  {
+    pid_t pid=fork();                   // One child.
+    if (pid==-1)                        // Did fork fail?
+      errExit("fork");                  // Yes, bail.
+    if (pid==0)                         // Child?
+    {                                   // Yes, go to work.
+      close(gate[1]);                   // Only the parent holds the write end.
+      close(res[0]);                    // We only report.
+      awaitStart(gate[0]);              // Wait for the gun.
+      uint64_t seed=0x9e3779b97f4a7c15ULL*(i+1);// Per-child sequence.
+      uint64_t ops=0,miss=0;            // Work done.
+      double end=nowSec()+secs;         // When to stop.
+      if (i==n)                         // The writer?
+      {                                 // Yes, keep rewriting values.
+        while (nowSec()<end)            // Until time is up.
+          for (int j=0;j<1024;j++,ops++)// A batch between clock reads.
+            m->Insert(syms[nextRand(&seed)%syms.size()],ops);
+        _exit(EXIT_SUCCESS);            // Writers do not report.
+      }                                 // Done with writer.
+      while (nowSec()<end)              // Until time is up.
+        for (int j=0;j<4096;j++,ops++)  // A batch between clock reads.
+        {
+          uint64_t v;                   // Looked-up value.
+          if (!m->Find(syms[nextRand(&seed)%syms.size()],&v))
+            miss++;                     // Should not happen.
+        }                               // Done with batch.
+      if (miss!=0)                      // Did every lookup hit?
+        fatal("%llu lookups missed",(unsigned long long)miss);
+      if (write(res[1],&ops,sizeof(ops))!=sizeof(ops))
+        errExit("write");               // Report our count.
+      _exit(EXIT_SUCCESS);              // No atexit handlers in children.
+    }                                   // Done with child.
+    kids.push_back(pid);                // Remember it.
+  }                                     // Done forking.
+  close(gate[0]);                       // Parent only needs the write end.
+  close(res[1]);                        // And only the read end of results.
+  close(gate[1]);                       // Open the gate.
+  uint64_t total=0,ops;                 // Lookups by every reader.
+  while (read(res[0],&ops,sizeof(ops))==sizeof(ops))
+    total+=ops;                         // Add each report.
+  close(res[0]);                        // Done with results.
+  for (pid_t pid:kids)                  // Wait for every child.
+    if (waitpid(pid,NULL,0)==-1)        // Did waitpid fail?
+      errExit("waitpid");               // Yes, bail.
+  return total/secs;                    // Lookups per second.
+}
+
+int main (
+  int argc,                             // The argument count.
+  char* argv[])                         // The argument vector.
+{
+  if (argc>1&&strcmp(argv[1],"--help")==0)// Asking for help?
+    usageErr("%s [max-readers [symbols [seconds [writer(0|1)]]]]\n",argv[0]);
+  int maxr=(argc>1)?getInt(argv[1],GN_GT_0,"max-readers"):8;
+  long nsym=(argc>2)?getLong(argv[2],GN_GT_0,"symbols"):1000000;
+  int secs=(argc>3)?getInt(argv[3],GN_GT_0,"seconds"):2;
+  bool writer=(argc>4)?getInt(argv[4],0,"writer")!=0:false;
+  std::vector<Symbol> syms(nsym);       // The keys.
+  for (long i=0;i<nsym;i++)             // Make them up.
+  {
+    memset(&syms[i],0,sizeof(Symbol));  // NUL padded.
+    snprintf(syms[i].name,sizeof(syms[i].name),"SYM.%08u.X",(unsigned)i);
+  }                                     // Done making keys.
+  double t0=nowSec();                   // Time the private build.
+  std::unordered_map<std::string,uint64_t> priv;
+  priv.reserve(nsym);                   // Best case: no rehash.
+  for (long i=0;i<nsym;i++)             // Insert every symbol.
+    priv.emplace(syms[i].name,(uint64_t)i);
+  double tpriv=nowSec()-t0;             // Per-process startup cost today.
+  uint64_t cap=Map::kGroup;             // Smallest power of two...
+  while (cap-cap/8<(uint64_t)nsym)      // ...that holds them below the load limit.
+    cap<<=1;                            // Double it.
+  ipc::SharedMemory shm;                // Private segment for the map.
+  ipc::ShmResult r=shm.CreateOrAttach(IPC_PRIVATE,Map::RequiredBytes(cap),
+    ipc::SHM_PERM_600,IPC_CREAT|IPC_EXCL);
+  if (r.code<0)                         // Could we create it?
+    errExitEN(r.errn,"shmget");         // No, bail.
+  r=shm.Attach();                       // Map it.
+  if (r.code<0)                         // Could we map it?
+    errExitEN(r.errn,"shmat");          // No, bail.
+  shm.MarkForRemoval();                 // Gone once the last process detaches.
+  Map* m=nullptr;                       // The map.
+  t0=nowSec();                          // Time the one shared build.
+  r=Map::Open(shm,&m);                  // Format it.
+  if (r.code<0)                         // Did that work?
+    errExitEN(r.errn,"ShmHashMap::Open");// No, bail.
+  for (long i=0;i<nsym;i++)             // Insert every symbol.
+    if ((r=m->Insert(syms[i],(uint64_t)i)).code<0)
+      errExitEN(r.errn,"Insert");       // Full?
+  double tshm=nowSec()-t0;              // Paid once, by one process.
+  printf("%ld symbols: private unordered_map build %.3f s/process, shared map build %.3f s once\n",
+    nsym,tpriv,tshm);
+  printf("capacity %llu, %.1f MB shared\n",(unsigned long long)m->Capacity(),
+    Map::RequiredBytes(cap)/1048576.0);
+  printf("%8s %14s %14s%s\n","readers","lookups/sec","per-reader",writer?"  (1 writer updating)":"");
+  for (int n=1;n<=maxr;n*=2)            // Double the readers each round.
+  {
+    double rate=runRound(m,syms,n,secs,writer);
+    printf("%8d %14.0f %14.0f\n",n,rate,rate/n);
+    fflush(stdout);                     // Show progress as we go.
+  }                                     // Done with all rounds.
+  exit(EXIT_SUCCESS);                   // Segment goes away on detach.
+}
@@ -0,0 +1,506 @@
+/**
+ * One-way latency and throughput of the local IPC transports, measured the same way for
+ * each: a sender process and a receiver process (optionally pinned to given CPUs) move
+ * messages of each requested size through
+ *
+ *    shmring      ipc::ShmRing of 64-byte chunks in a System V segment, receiver polls
+ *    shmring-efd  the same ring, receiver sleeps on an eventfd doorbell when it is empty
+ *    pipe         write()/read() on a pipe
+ *    vmsplice     vmsplice() of the sender's pages into a pipe, read() on the other end
+ *    unix-stream  AF_UNIX SOCK_STREAM socket pair
+ *    unix-seqpkt  AF_UNIX SOCK_SEQPACKET socket pair
+ *    sigqueue     real-time signal whose sigval carries the payload (8 bytes at most,
+ *                 so it only runs for sizes up to 8), received with sigwaitinfo()
+ *
+ * Latency: the sender stamps CLOCK_MONOTONIC into the first 8 bytes and sends one message
+ * at a time, waiting until the receiver has taken it, so no sample includes queueing
+ * behind the previous one; the receiver records arrival minus stamp. Throughput: the
+ * sender then sends back to back and the rate is from the sender's first send to the
+ * receiver's last receive. Output is a table, CSV or JSON (with log2 latency histograms):
+ *
+ *    ipc_transport_bench [-s sizes] [-t transports] [-n samples] [-m messages]
+ *                        [-c tx-cpu,rx-cpu] [-o table|csv|json]
+ *
+ * sizes and transports are comma-separated lists; defaults are 8,64,512,4096,65536 and
+ * all transports. Throughput messages are capped at 256 MB worth per run.
+ */
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <vector>
+#include "SharedMemory.hpp"
+#include "ShmRing.hpp"
+extern "C" {
+#include "tlpi_hdr.h"
+}
+
+struct Chunk                            // Ring element: messages travel as chunks.
+{
+  char b[64];                           // One cache line of payload.
+};
+typedef ipc::ShmRing<Chunk,16384> Ring; // 1 MB of chunks.
+static const int kMaxSamples=1000000;   // Latency samples per run, at most.
+static const int kBuckets=48;           // log2(ns) histogram buckets.
+
+struct Control                          // Shared between sender and receiver.
+{
+  std::atomic<uint64_t> taken;          // Messages the receiver has consumed.
+  uint64_t rxend;                       // Receiver's clock after the last message.
+  uint64_t lat[kMaxSamples];            // One-way latencies (ns).
+};
+
+static uint64_t nowNs (void)            // Monotonic time in nanoseconds.
+{
+  struct timespec ts;                   // Current time.
+  clock_gettime(CLOCK_MONOTONIC,&ts);   // Get it.
+  return (uint64_t)ts.tv_sec*1000000000ULL+ts.tv_nsec;
+}
+
+static void pinTo (                     // Pin the calling process to one CPU.
+  int cpu)                              // CPU number, or -1 for no pinning.
+{
+  if (cpu<0)                            // Asked to pin?
+    return;                             // No.
+  cpu_set_t set;                        // Just that CPU.
+  CPU_ZERO(&set);                       // Start empty.
+  CPU_SET(cpu,&set);                    // Add it.
+  if (sched_setaffinity(0,sizeof(set),&set)==-1)
+    errExit("sched_setaffinity %d",cpu);// Offline or not allowed.
+}
+
+static void writeAll (                  // write() until every byte is out.
+  int fd,                               // Descriptor.
+  const char* p,                        // Bytes.
+  size_t len)                           // How many.
+{
+  while (len>0)                         // Until done.
+  {
+    ssize_t n=write(fd,p,len);          // As much as fits.
+    if (n<0)                            // Did it fail?
+    {
+      if (errno==EINTR)                 // Interrupted?
+        continue;                       // Yes, again.
+      errExit("write");                 // No, bail.
+    }                                   // Done with failure.
+    p+=n;                               // Advance.
+    len-=n;                             // Remaining.
+  }                                     // Done writing.
+}
+
+static void readAll (                   // read() until every byte is in.
+  int fd,                               // Descriptor.
+  char* p,                              // Buffer.
+  size_t len)                           // How many.
+{
+  while (len>0)                         // Until done.
+  {
+    ssize_t n=read(fd,p,len);           // As much as is there.
+    if (n<0&&errno==EINTR)              // Interrupted?
+      continue;                         // Yes, again.
+    if (n<=0)                           // Error or early EOF?
+      errExit("read");                  // Yes, bail.
+    p+=n;                               // Advance.
+    len-=n;                             // Remaining.
+  }                                     // Done reading.
+}
+
+class Transport                         // One way of moving a message.
+{
+  public:
+    virtual ~Transport (void) {}
+    virtual const char* Name (void) const=0;
+    virtual bool Supports (size_t size) const { return size>=sizeof(uint64_t); }
+    virtual void Setup (void)=0;        // Before fork.
+    virtual void SenderSide (pid_t) {}  // After fork, in the sender.
+    virtual void ReceiverSide (void) {} // After fork, in the receiver.
+    virtual void Send (const char* p,size_t len)=0;
+    virtual void Recv (char* p,size_t len)=0;
+    virtual void Teardown (void) {}     // In the sender, after the run.
+};
+
+class RingTransport : public Transport  // ShmRing, polled or with a doorbell.
+{
+  public:
+    explicit RingTransport (bool doorbell) : bell(doorbell) {}
+    const char* Name (void) const override { return bell?"shmring-efd":"shmring"; }
+    void Setup (void) override
+    {
+      shm=new ipc::SharedMemory();      // Fresh private segment per run.
+      ipc::ShmResult r=shm->CreateOrAttach(IPC_PRIVATE,Ring::RequiredBytes(),
+        ipc::SHM_PERM_600,IPC_CREAT|IPC_EXCL);
+      if (r.code<0||(r=shm->Attach()).code<0)
+        errExitEN(r.errn,"shm");        // Could not make or map it.
+      shm->MarkForRemoval();            // Gone once both sides detach.
+      if ((r=Ring::Open(*shm,&ring)).code<0)
+        errExitEN(r.errn,"ShmRing::Open");
+      efd=bell?eventfd(0,0):-1;         // Doorbell, if any.
+      if (bell&&efd==-1)                // Could we make it?
+        errExit("eventfd");             // No, bail.
+    }
+    void Send (const char* p,size_t len) override
+    {
+      size_t n=(len+sizeof(Chunk)-1)/sizeof(Chunk);// Chunks in the message.
+      const Chunk* c=reinterpret_cast<const Chunk*>(p);
+      while (n>0)                       // Until all are in.
+      {
+        size_t k=ring->TryPushN(c,n);   // As many as fit.
+        if (k==0)                       // Full?
+          sched_yield();                // Let the receiver drain.
+        c+=k;                           // Advance.
+        n-=k;                           // Remaining.
+      }                                 // Done pushing.
+      uint64_t one=1;                   // Doorbell increment.
+      if (bell&&write(efd,&one,sizeof(one))!=sizeof(one))
+        errExit("write eventfd");       // Ring it.
+    }
+    void Recv (char* p,size_t len) override
+    {
+      size_t n=(len+sizeof(Chunk)-1)/sizeof(Chunk);// Chunks in the message.
+      Chunk* c=reinterpret_cast<Chunk*>(p);
+      while (n>0)                       // Until all are out.
+      {
+        size_t k=ring->TryPopN(c,n);    // As many as are there.
+        if (k==0)                       // Empty?
+        {
+          uint64_t v;                   // Doorbell count.
+          if (!bell)                    // Polling?
+            sched_yield();              // Yes, let the sender run.
+          else if (read(efd,&v,sizeof(v))!=sizeof(v))
+            errExit("read eventfd");    // Sleep until rung.
+        }                               // Done waiting.
+        c+=k;                           // Advance.
+        n-=k;                           // Remaining.
+      }                                 // Done popping.
+    }
+    void Teardown (void) override
+    {
+      if (efd!=-1)                      // Doorbell?
+        close(efd);                     // Done with it.
+      delete shm;                       // Detach.
+      shm=nullptr;                      // Next run makes a new one.
+    }
+  private:
+    bool bell;                          // Sleep on an eventfd when empty?
+    ipc::SharedMemory* shm=nullptr;     // The segment.
+    Ring* ring=nullptr;                 // The ring in it.
+    int efd=-1;                         // Doorbell.
+};
+
+class FdTransport : public Transport    // Pipe or socket pair, read()/write().
+{
+  public:
+    FdTransport (const char* nm,int type) : name(nm), socktype(type) {}
+    const char* Name (void) const override { return name; }
+    void Setup (void) override
+    {
+      if (socktype<0)                   // A pipe?
+      {
+        if (pipe(fd)==-1)               // Yes, make it.
+          errExit("pipe");              // Could not.
+      }
+      else if (socketpair(AF_UNIX,socktype,0,fd)==-1)
+        errExit("socketpair");          // Could not.
+    }
+    void SenderSide (pid_t) override { close(fd[0]); }
+    void ReceiverSide (void) override { close(fd[1]); }
+    void Send (const char* p,size_t len) override
+    {
+      if (socktype!=SOCK_SEQPACKET)     // A byte stream?
+        writeAll(fd[1],p,len);          // Yes, loop.
+      else if (send(fd[1],p,len,0)!=(ssize_t)len)
+        errExit("send");                // One record per message.
+    }
+    void Recv (char* p,size_t len) override
+    {
+      if (socktype!=SOCK_SEQPACKET)     // A byte stream?
+        readAll(fd[0],p,len);           // Yes, loop.
+      else if (recv(fd[0],p,len,0)!=(ssize_t)len)
+        errExit("recv");                // One record per message.
+    }
+    void Teardown (void) override { close(fd[1]); }
+  protected:
+    const char* name;                   // Reported name.
+    int socktype;                       // SOCK_* or -1 for a pipe.
+    int fd[2];                          // [0] receiver, [1] sender.
+};
+
+class VmspliceTransport : public FdTransport// Pages handed to the pipe, not copied.
+{
+  public:
+    VmspliceTransport (void) : FdTransport("vmsplice",-1) {}
+    void Setup (void) override
+    {
+      FdTransport::Setup();             // The pipe.
+      stage.assign(kStage,0);           // Sender's staging area.
+      off=0;                            // Next message goes at the start.
+    }
+    void Send (const char* p,size_t len) override
+    {
+      // The pipe references our pages until the reader copies them out, so each
+      // message goes to a fresh part of a staging area much larger than the pipe.
+      if (off+len>stage.size())         // Wrap?
+        off=0;                          // Pipe has long drained that far back.
+      char* q=stage.data()+off;         // Where this message lives.
+      memcpy(q,p,len);                  // Stage it (a real sender builds it in place).
+      off+=(len+63)&~(size_t)63;        // Next one after it.
+      while (len>0)                     // Until the pipe holds all of it.
+      {
+        struct iovec iov={q,len};       // What is left.
+        ssize_t n=vmsplice(fd[1],&iov,1,0);
+        if (n<0)                        // Did it fail?
+          errExit("vmsplice");          // Yes, bail.
+        q+=n;                           // Advance.
+        len-=n;                         // Remaining.
+      }                                 // Done splicing.
+    }
+  private:
+    static const size_t kStage=4*1024*1024;// Far more than a pipe can hold.
+    std::vector<char> stage;            // Staging area.
+    size_t off=0;                       // Next free byte in it.
+};
+
+class SigqueueTransport : public Transport// Real-time signals with a sigval.
+{
+  public:
+    const char* Name (void) const override { return "sigqueue"; }
+    bool Supports (size_t size) const override { return size==sizeof(union sigval); }
+    void Setup (void) override
+    {
+      sigset_t set;                     // SIGRTMIN is taken with sigwaitinfo()...
+      sigemptyset(&set);                // ...so it must be blocked...
+      sigaddset(&set,SIGRTMIN);         // ...in the receiver,...
+      if (sigprocmask(SIG_BLOCK,&set,&old)==-1)// ...which inherits it over fork.
+        errExit("sigprocmask");         // Could not.
+    }
+    void SenderSide (pid_t pid) override { rx=pid; }
+    void Send (const char* p,size_t len) override
+    {
+      union sigval sv;                  // The payload.
+      memcpy(&sv,p,len);                // All of it.
+      while (sigqueue(rx,SIGRTMIN,sv)==-1)// Queue it.
+      {
+        if (errno!=EAGAIN)              // Queue limit reached?
+          errExit("sigqueue");          // No, a real error.
+        sched_yield();                  // Yes, let the receiver drain.
+      }                                 // Done queueing.
+    }
+    void Recv (char* p,size_t len) override
+    {
+      sigset_t set;                     // Just SIGRTMIN.
+      sigemptyset(&set);                // Start empty.
+      sigaddset(&set,SIGRTMIN);         // Add it.
+      siginfo_t si;                     // Carries the sigval.
+      while (sigwaitinfo(&set,&si)==-1) // Take the next one.
+        if (errno!=EINTR)               // Interrupted?
+          errExit("sigwaitinfo");       // No, bail.
+      memcpy(p,&si.si_value,len);       // The payload.
+    }
+    void Teardown (void) override { sigprocmask(SIG_SETMASK,&old,NULL); }
+  private:
+    pid_t rx=0;                         // Receiver.
+    sigset_t old;                       // Mask before Setup().
+};
+
+struct Result                           // One transport at one size.
+{
+  std::string name;                     // Transport.
+  size_t size;                          // Message bytes.
+  uint64_t samples;                     // Latency samples.
+  uint64_t p50,p99,p999,min,max;        // Latency (ns).
+  double msgs;                          // Throughput (messages/s).
+  uint64_t hist[kBuckets];              // Samples per log2(ns) bucket.
+};
+
+static Result runOne (                  // Measure one transport at one size.
+  Transport* t,                         // Transport.
+  Control* ctl,                         // Shared control block.
+  size_t size,                          // Message bytes.
+  int samples,                          // Latency samples.
+  uint64_t msgs,                        // Throughput messages.
+  int rxcpu)                            // Receiver CPU or -1.
+{
+  ctl->taken.store(0);                  // Nothing consumed yet.
+  t->Setup();                           // Pipes, rings, masks.
+  pid_t pid=fork();                     // The receiver.
+  if (pid==-1)                          // Did fork fail?
+    errExit("fork");                    // Yes, bail.
+  if (pid==0)                           // Receiver?
+  {                                     // Yes, take and time.
+    pinTo(rxcpu);                       // Where it was asked to run.
+    t->ReceiverSide();                  // Drop the sender's ends.
+    std::vector<char> buf(size+sizeof(Chunk));// Message (room for a partial chunk).
+    for (int i=0;i<samples;i++)         // Latency phase.
+    {
+      t->Recv(buf.data(),size);         // One message.
+      uint64_t now=nowNs();             // Arrival.
+      uint64_t sent;                    // Stamp.
+      memcpy(&sent,buf.data(),sizeof(sent));
+      ctl->lat[i]=now-sent;             // One-way latency.
+      ctl->taken.store(i+1,std::memory_order_release);// Sender may go on.
+    }                                   // Done sampling.
+    for (uint64_t i=0;i<msgs;i++)       // Throughput phase.
+      t->Recv(buf.data(),size);         // Take them as fast as they come.
+    ctl->rxend=nowNs();                 // Last one in.
+    _exit(EXIT_SUCCESS);                // No atexit handlers in children.
+  }                                     // Done with receiver.
+  t->SenderSide(pid);                   // Drop the receiver's ends.
+  std::vector<char> msg(size+sizeof(Chunk),'m');// Message (room for a partial chunk).
+  for (int i=0;i<samples;i++)           // Latency phase.
+  {
+    uint64_t now=nowNs();               // Departure.
+    memcpy(msg.data(),&now,sizeof(now));// Stamp it.
+    t->Send(msg.data(),size);           // One message.
+    while (ctl->taken.load(std::memory_order_acquire)<(uint64_t)i+1)
+      sched_yield();                    // Until it was taken.
+  }                                     // Done sampling.
+  uint64_t t0=nowNs();                  // Throughput clock starts.
+  for (uint64_t i=0;i<msgs;i++)         // Back to back.
+    t->Send(msg.data(),size);           // Send.
+  if (waitpid(pid,NULL,0)==-1)          // Wait for the receiver.
+    errExit("waitpid");                 // Could not.
+  t->Teardown();                        // Close and unmap.
+  Result res;                           // What we measured.
+  res.name=t->Name();                   // Transport.
+  res.size=size;                        // Message bytes.
+  res.samples=samples;                  // Latency samples.
+  res.msgs=msgs/((ctl->rxend-t0)/1e9);  // Messages per second.
+  std::sort(ctl->lat,ctl->lat+samples); // For the percentiles.
+  res.min=ctl->lat[0];                  // Fastest.
+  res.max=ctl->lat[samples-1];          // Slowest.
+  res.p50=ctl->lat[(size_t)(samples*0.50)];
+  res.p99=ctl->lat[min((size_t)(samples*0.99),(size_t)samples-1)];
+  res.p999=ctl->lat[min((size_t)(samples*0.999),(size_t)samples-1)];
+  memset(res.hist,0,sizeof(res.hist));  // Empty histogram.
+  for (int i=0;i<samples;i++)           // Bucket every sample.
+  {
+    int b=0;                            // floor(log2(ns)).
+    for (uint64_t v=ctl->lat[i];v>1&&b<kBuckets-1;v>>=1)
+      b++;                              // One more doubling.
+    res.hist[b]++;                      // Count it.
+  }                                     // Done bucketing.
+  return res;                           // Done.
+}
+
+static void printResult (               // One result in the chosen format.
+  const Result& r,                      // Result.
+  const char* fmt,                      // table, csv or json.
+  bool first)                           // First of the run?
+{
+  if (strcmp(fmt,"csv")==0)             // Comma-separated?
+  {
+    if (first)                          // Header once.
+      printf("transport,bytes,samples,min_ns,p50_ns,p99_ns,p999_ns,max_ns,msgs_per_s,mb_per_s\n");
+    printf("%s,%zu,%llu,%llu,%llu,%llu,%llu,%llu,%.0f,%.1f\n",r.name.c_str(),r.size,
+      (unsigned long long)r.samples,(unsigned long long)r.min,(unsigned long long)r.p50,
+      (unsigned long long)r.p99,(unsigned long long)r.p999,(unsigned long long)r.max,
+      r.msgs,r.msgs*r.size/1e6);
+  }                                     // Done with CSV.
+  else if (strcmp(fmt,"json")==0)       // JSON (one array)?
+  {
+    printf("%s\n  {\"transport\":\"%s\",\"bytes\":%zu,\"samples\":%llu,\"min_ns\":%llu,"
+      "\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,\"max_ns\":%llu,"
+      "\"msgs_per_s\":%.0f,\"mb_per_s\":%.1f,\"log2_ns_hist\":[",first?"[":",",
+      r.name.c_str(),r.size,(unsigned long long)r.samples,(unsigned long long)r.min,
+      (unsigned long long)r.p50,(unsigned long long)r.p99,(unsigned long long)r.p999,
+      (unsigned long long)r.max,r.msgs,r.msgs*r.size/1e6);
+    int last=kBuckets-1;                // Trim empty high buckets.
+    while (last>0&&r.hist[last]==0)     // Empty?
+      last--;                           // Drop it.
+    for (int b=0;b<=last;b++)           // Bucket b: [2^b, 2^(b+1)) ns.
+      printf("%s%llu",b?",":"",(unsigned long long)r.hist[b]);
+    printf("]}");                       // Close the object.
+  }                                     // Done with JSON.
+  else                                  // Human-readable table.
+  {
+    if (first)                          // Header once.
+      printf("%-12s %7s %9s %9s %9s %10s %12s %10s\n","transport","bytes","min-ns",
+        "p50-ns","p99-ns","p99.9-ns","msgs/s","MB/s");
+    printf("%-12s %7zu %9llu %9llu %9llu %10llu %12.0f %10.1f\n",r.name.c_str(),r.size,
+      (unsigned long long)r.min,(unsigned long long)r.p50,(unsigned long long)r.p99,
+      (unsigned long long)r.p999,r.msgs,r.msgs*r.size/1e6);
+  }                                     // Done with table.
+  fflush(stdout);                       // Show progress as we go.
+}
+
+int main (
+  int argc,                             // The argument count.
+  char* argv[])                         // The argument vector.
+{
+  std::string sizes="8,64,512,4096,65536";// Message sizes.
+  std::string which;                    // Transports (empty: all).
+  int samples=100000;                   // Latency samples per run.
+  uint64_t msgs=200000;                 // Throughput messages per run.
+  int txcpu=-1,rxcpu=-1;                // No pinning.
+  const char* fmt="table";              // Output format.
+  int opt;                              // Current option.
+  while ((opt=getopt(argc,argv,"s:t:n:m:c:o:"))!=-1)
+  {
+    switch (opt)                        // Which option?
+    {
+      case 's': sizes=optarg; break;
+      case 't': which=optarg; break;
+      case 'n': samples=getInt(optarg,GN_GT_0,"samples"); break;
+      case 'm': msgs=getLong(optarg,GN_GT_0,"messages"); break;
+      case 'c':
+        if (sscanf(optarg,"%d,%d",&txcpu,&rxcpu)!=2)
+          cmdLineErr("-c wants tx-cpu,rx-cpu\n");
+        break;
+      case 'o': fmt=optarg; break;
+      default:
+        usageErr("%s [-s sizes] [-t transports] [-n samples] [-m messages] "
+          "[-c tx-cpu,rx-cpu] [-o table|csv|json]\n",argv[0]);
+    }                                   // Done with this option.
+  }                                     // Done with options.
+  if (samples>kMaxSamples)              // Room in the control block?
+    cmdLineErr("at most %d samples\n",kMaxSamples);
+  if (strcmp(fmt,"table")!=0&&strcmp(fmt,"csv")!=0&&strcmp(fmt,"json")!=0)
+    cmdLineErr("-o is table, csv or json\n");
+  std::vector<Transport*> all={new RingTransport(false),new RingTransport(true),
+    new FdTransport("pipe",-1),new VmspliceTransport(),
+    new FdTransport("unix-stream",SOCK_STREAM),new FdTransport("unix-seqpkt",SOCK_SEQPACKET),
+    new SigqueueTransport()};           // Everything we know how to measure.
+  std::vector<Transport*> run;          // What was asked for.
+  for (Transport* t:all)                // Filter by name.
+    if (which.empty()||(","+which+",").find(std::string(",")+t->Name()+",")!=std::string::npos)
+      run.push_back(t);                 // Wanted.
+  if (run.empty())                      // Anything left?
+    cmdLineErr("no such transport: %s\n",which.c_str());
+  Control* ctl=static_cast<Control*>(mmap(NULL,sizeof(Control),PROT_READ|PROT_WRITE,
+    MAP_SHARED|MAP_ANONYMOUS,-1,0));    // Shared with every receiver.
+  if (ctl==MAP_FAILED)                  // Could we map it?
+    errExit("mmap");                    // No, bail.
+  pinTo(txcpu);                         // The parent is the sender.
+  bool first=true;                      // Header/array opener pending.
+  for (size_t pos=0;pos<sizes.size();)  // Every size...
+  {
+    size_t end=sizes.find(',',pos);     // ...in the list.
+    if (end==std::string::npos)         // Last one?
+      end=sizes.size();                 // Yes.
+    size_t size=getLong(sizes.substr(pos,end-pos).c_str(),GN_GT_0,"size");
+    pos=end+1;                          // Next.
+    if (size<sizeof(uint64_t)||size>Ring::Capacity()*sizeof(Chunk)/2)
+      cmdLineErr("sizes must be 8 to %zu bytes\n",Ring::Capacity()*sizeof(Chunk)/2);
+    uint64_t n=min(msgs,(uint64_t)(256u<<20)/size);// At most 256 MB.
+    for (Transport* t:run)              // ...through every transport.
+      if (t->Supports(size))            // sigqueue only carries 8 bytes.
+      {
+        printResult(runOne(t,ctl,size,samples,n,rxcpu),fmt,first);
+        first=false;                    // Header/opener done.
+      }                                 // Done with this transport.
+  }                                     // Done with every size.
+  if (strcmp(fmt,"json")==0)            // Close the array.
+    printf("%s\n",first?"[]":"\n]");
+  for (Transport* t:all)                // Tidy up.
+    delete t;                           // Done.
+  exit(EXIT_SUCCESS);                   // Segments went away on detach.
+}
@@ -0,0 +1,128 @@
+/**
+ * Throughput benchmark for ipc::ShmMpmcQueue. For every worker count from one up to
+ * the maximum given on the command line (doubling each round) this program forks that
+ * many producer processes and that many consumer processes around a queue placed in a
+ * private System V segment. Producers push their share of the operations with the
+ * blocking Push(), consumers drain with the blocking Pop() until they see a poison
+ * element, and the parent reports the aggregate operations per second:
+ *
+ *    mpmc_bench [max-workers [ops-per-producer]]
+ *
+ * A pipe is used as the start gate so that every worker is forked and ready before
+ * the clock starts.
+ */
+#include <sys/wait.h>
+#include <time.h>
+#include <stdint.h>
+#include <vector>
+#include "ShmMpmcQueue.hpp"
+extern "C" {
+#include "tlpi_hdr.h"
+}
+
+typedef ipc::ShmMpmcQueue<uint64_t,4096> Queue;
+static const uint64_t POISON=UINT64_MAX;// Tells a consumer to exit.
+
+static double nowSec (void)             // Monotonic time in seconds.
+{
+  struct timespec ts;                   // Current time.
+  clock_gettime(CLOCK_MONOTONIC,&ts);   // Get it.
+  return ts.tv_sec+ts.tv_nsec/1e9;      // As a double.
+}
+
+static void awaitStart (                // Block until the parent opens the gate.
+  int gate)                             // Read end of the gate pipe.
+{
+  char c;                               // Nothing is ever written.
+  if (read(gate,&c,1)==-1)              // EOF when the parent closes its end.
+    errExit("read");                    // Anything else is an error.
+  close(gate);                          // Done with the gate.
+}
+
+static double runRound (                // One round with n producers/n consumers.
+  Queue* q,                             // The queue in the segment.
+  int n,                                // Workers on each side.
+  uint64_t ops)                         // Pushes per producer.
+{
+  int gate[2];                          // Start gate.
+  std::vector<pid_t> prod(n),cons(n);   // Child PIDs.
+  if (pipe(gate)==-1)                   // Could we make the gate?
+    errExit("pipe");                    // No, bail.
+  for (int i=0;i<n;i++)                 // Fork the consumers.
+  {
+    cons[i]=fork();                     // One consumer.
+    if (cons[i]==-1)                    // Did fork fail?
+      errExit("fork");                  // Yes, bail.
+    if (cons[i]==0)                     // Child?
+    {                                   // Yes, drain until poisoned.
+      close(gate[1]);                   // Only the parent holds the write end.
+      awaitStart(gate[0]);              // Wait for the gun.
+      uint64_t v;                       // Popped element.
+      for (;;)                          // Until poisoned.
+      {
+        q->Pop(v);                      // Sleep if empty.
+        if (v==POISON)                  // Time to go?
+          break;                        // Yes.
+      }                                 // Done draining.
+      _exit(EXIT_SUCCESS);              // No atexit handlers in children.
+    }                                   // Done with consumer child.
+  }                                     // Done forking consumers.
+  for (int i=0;i<n;i++)                 // Fork the producers.
+  {
+    prod[i]=fork();                     // One producer.
+    if (prod[i]==-1)                    // Did fork fail?
+      errExit("fork");                  // Yes, bail.
+    if (prod[i]==0)                     // Child?
+    {                                   // Yes, push our share.
+      close(gate[1]);                   // Only the parent holds the write end.
+      awaitStart(gate[0]);              // Wait for the gun.
+      for (uint64_t j=0;j<ops;j++)      // Our share of the work.
+        q->Push(j);                     // Sleep if full.
+      _exit(EXIT_SUCCESS);              // No atexit handlers in children.
+    }                                   // Done with producer child.
+  }                                     // Done forking producers.
+  close(gate[0]);                       // Parent only needs the write end.
+  double t0=nowSec();                   // Start the clock...
+  close(gate[1]);                       // ...and open the gate.
+  for (int i=0;i<n;i++)                 // Wait for every producer.
+    if (waitpid(prod[i],NULL,0)==-1)    // Did waitpid fail?
+      errExit("waitpid");               // Yes, bail.
+  for (int i=0;i<n;i++)                 // One poison pill per consumer.
+    q->Push(POISON);                    // Queued behind the real work.
+  for (int i=0;i<n;i++)                 // Wait for every consumer.
+    if (waitpid(cons[i],NULL,0)==-1)    // Did waitpid fail?
+      errExit("waitpid");               // Yes, bail.
+  return nowSec()-t0;                   // Elapsed seconds.
+}
+
+int main (
+  int argc,                             // The argument count.
+  char* argv[])                         // The argument vector.
+{
+  if (argc>1&&strcmp(argv[1],"--help")==0)// Asking for help?
+    usageErr("%s [max-workers [ops-per-producer]]\n",argv[0]);
+  int maxw=(argc>1)?getInt(argv[1],GN_GT_0,"max-workers"):16;
+  uint64_t ops=(argc>2)?getLong(argv[2],GN_GT_0,"ops-per-producer"):1000000;
+  ipc::SharedMemory shm;                // Private segment for the queue.
+  ipc::ShmResult r=shm.CreateOrAttach(IPC_PRIVATE,Queue::RequiredBytes(),
+    ipc::SHM_PERM_600,IPC_CREAT|IPC_EXCL);
+  if (r.code<0)                         // Could we create it?
+    errExitEN(r.errn,"shmget");         // No, bail.
+  r=shm.Attach();                       // Map it.
+  if (r.code<0)                         // Could we map it?
+    errExitEN(r.errn,"shmat");          // No, bail.
+  shm.MarkForRemoval();                 // Gone once the last process detaches.
+  Queue* q=nullptr;                     // The queue.
+  r=Queue::Open(shm,&q);                // Format it.
+  if (r.code<0)                         // Did that work?
+    errExitEN(r.errn,"ShmMpmcQueue::Open");// No, bail.
+  printf("%8s %8s %14s %12s\n","workers","procs","ops","ops/sec");
+  for (int n=1;n<=maxw;n*=2)            // Double the workers each round.
+  {
+    double secs=runRound(q,n,ops);      // Run the round.
+    uint64_t total=ops*(uint64_t)n;     // Elements that went through.
+    printf("%8d %8d %14llu %12.0f\n",n,2*n,(unsigned long long)total,total/secs);
+    fflush(stdout);                     // Show progress as we go.
+  }                                     // Done with all rounds.
+  exit(EXIT_SUCCESS);                   // Segment goes away on detach.
+}
@@ -0,0 +1,250 @@
+/**
+ * Contention benchmark for ipc::ShmMutex. For every worker count from one up to the
+ * maximum given on the command line (doubling each round) this program forks that many
+ * processes that all hammer one lock protecting a shared counter, once for each of:
+ *
+ *    shm        ipc::ShmMutex (adaptive spin, futex sleep, dead-owner probing)
+ *    shm-pi     ipc::ShmMutex with SHM_MUTEX_PI (FUTEX_LOCK_PI slow path)
+ *    pthread    PTHREAD_PROCESS_SHARED|PTHREAD_MUTEX_ROBUST pthread mutex
+ *    sysv-sem   System V semaphore used as a binary semaphore (SEM_UNDO)
+ *
+ * and reports lock/unlock pairs per second. It finishes by killing a lock holder and
+ * timing how long the next locker takes to get EOWNERDEAD from each robust lock:
+ *
+ *    mutex_bench [max-workers [ops-per-worker]]
+ */
+#include <sys/wait.h>
+#include <sys/sem.h>
+#include <time.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <vector>
+#include "ShmMutex.hpp"
+extern "C" {
+#include "tlpi_hdr.h"
+}
+
+struct Shared                           // What lives in the segment.
+{
+  ipc::ShmMutex shm;                    // Our mutex.
+  ipc::ShmMutex pi;                     // Our mutex, priority inheritance.
+  pthread_mutex_t pm;                   // Robust process-shared pthread mutex.
+  uint64_t counter;                     // What the locks protect.
+};
+enum Kind { KIND_SHM, KIND_PI, KIND_PTHREAD, KIND_SEM, KIND_COUNT };
+static const char* kindName[KIND_COUNT]={"shm","shm-pi","pthread","sysv-sem"};
+
+static double nowSec (void)             // Monotonic time in seconds.
+{
+  struct timespec ts;                   // Current time.
+  clock_gettime(CLOCK_MONOTONIC,&ts);   // Get it.
+  return ts.tv_sec+ts.tv_nsec/1e9;      // As a double.
+}
+
+static void awaitStart (                // Block until the parent opens the gate.
+  int gate)                             // Read end of the gate pipe.
+{
+  char c;                               // Nothing is ever written.
+  if (read(gate,&c,1)==-1)              // EOF when the parent closes its end.
+    errExit("read");                    // Anything else is an error.
+  close(gate);                          // Done with the gate.
+}
+
+static void semOp (                     // P (-1) or V (+1) on the semaphore.
+  int semid,                            // Semaphore set.
+  int delta)                            // -1 or +1.
+{
+  struct sembuf sop={0,(short)delta,SEM_UNDO};
+  while (semop(semid,&sop,1)==-1)       // Did it fail?
+    if (errno!=EINTR)                   // Other than a signal?
+      errExit("semop");                 // Yes, bail.
+}
+
+static void lockOne (                   // Acquire the lock of the given kind.
+  Shared* s,                            // The segment.
+  int semid,                            // Semaphore set.
+  Kind k)                               // Which lock.
+{
+  ipc::ShmResult r;                     // ShmMutex result.
+  int e;                                // pthread result.
+  switch (k)
+  {
+    case KIND_SHM:
+    case KIND_PI:
+      r=((k==KIND_SHM)?s->shm:s->pi).Lock();
+      if (r.code<0)                     // Broken?
+        errExitEN(r.errn,"ShmMutex::Lock");
+      break;
+    case KIND_PTHREAD:
+      e=pthread_mutex_lock(&s->pm);     // Lock it.
+      if (e!=0)                         // Trouble?
+        errExitEN(e,"pthread_mutex_lock");
+      break;
+    default:
+      semOp(semid,-1);                  // P.
+  }
+}
+
+static void unlockOne (                 // Release the lock of the given kind.
+  Shared* s,                            // The segment.
+  int semid,                            // Semaphore set.
+  Kind k)                               // Which lock.
+{
+  ipc::ShmResult r;                     // ShmMutex result.
+  int e;                                // pthread result.
+  switch (k)
+  {
+    case KIND_SHM:
+    case KIND_PI:
+      r=((k==KIND_SHM)?s->shm:s->pi).Unlock();
+      if (r.code<0)                     // Not ours?
+        errExitEN(r.errn,"ShmMutex::Unlock");
+      break;
+    case KIND_PTHREAD:
+      e=pthread_mutex_unlock(&s->pm);   // Unlock it.
+      if (e!=0)                         // Trouble?
+        errExitEN(e,"pthread_mutex_unlock");
+      break;
+    default:
+      semOp(semid,1);                   // V.
+  }
+}
+
+static double runRound (                // One round with n contending workers.
+  Shared* s,                            // The segment.
+  int semid,                            // Semaphore set.
+  Kind k,                               // Which lock.
+  int n,                                // Workers.
+  uint64_t ops)                         // Lock/unlock pairs per worker.
+{
+  int gate[2];                          // Start gate.
+  std::vector<pid_t> kids(n);           // Child PIDs.
+  if (pipe(gate)==-1)                   // Could we make the gate?
+    errExit("pipe");                    // No, bail.
+  s->counter=0;                         // Fresh count.
+  for (int i=0;i<n;i++)                 // Fork the workers.
+  {
+    kids[i]=fork();                     // One worker.
+    if (kids[i]==-1)                    // Did fork fail?
+      errExit("fork");                  // Yes, bail.
+    if (kids[i]==0)                     // Child?
+    {                                   // Yes, contend.
+      close(gate[1]);                   // Only the parent holds the write end.
+      awaitStart(gate[0]);              // Wait for the gun.
+      for (uint64_t j=0;j<ops;j++)      // Our share of the work.
+      {
+        lockOne(s,semid,k);             // Enter...
+        s->counter++;                   // ...do the critical section...
+        unlockOne(s,semid,k);           // ...and leave.
+      }                                 // Done with our share.
+      _exit(EXIT_SUCCESS);              // No atexit handlers in children.
+    }                                   // Done with worker child.
+  }                                     // Done forking.
+  close(gate[0]);                       // Parent only needs the write end.
+  double t0=nowSec();                   // Start the clock...
+  close(gate[1]);                       // ...and open the gate.
+  for (int i=0;i<n;i++)                 // Wait for every worker.
+    if (waitpid(kids[i],NULL,0)==-1)    // Did waitpid fail?
+      errExit("waitpid");               // Yes, bail.
+  double secs=nowSec()-t0;              // Elapsed seconds.
+  if (s->counter!=ops*(uint64_t)n)      // Did mutual exclusion hold?
+    fatal("%s: counter is %llu, expected %llu",kindName[k],
+      (unsigned long long)s->counter,(unsigned long long)(ops*(uint64_t)n));
+  return secs;                          // Elapsed seconds.
+}
+
+static void recoverRound (              // Time dead-owner recovery of a lock.
+  Shared* s,                            // The segment.
+  Kind k)                               // KIND_SHM, KIND_PI or KIND_PTHREAD.
+{
+  pid_t pid=fork();                     // The victim.
+  if (pid==-1)                          // Did fork fail?
+    errExit("fork");                    // Yes, bail.
+  if (pid==0)                           // Child?
+  {                                     // Yes, lock and die holding it.
+    lockOne(s,-1,k);                    // Take it...
+    _exit(EXIT_SUCCESS);                // ...and never let go.
+  }                                     // Done with victim.
+  if (waitpid(pid,NULL,0)==-1)          // Wait until it is surely dead.
+    errExit("waitpid");                 // Trouble.
+  double t0=nowSec();                   // Start the clock.
+  int err=0;                            // What the lock said.
+  if (k==KIND_PTHREAD)                  // pthread?
+  {                                     // Yes, the kernel robust list did the work.
+    err=pthread_mutex_lock(&s->pm);     // Should be EOWNERDEAD.
+    if (err==EOWNERDEAD)                // As expected?
+      pthread_mutex_consistent(&s->pm); // Repaired.
+    pthread_mutex_unlock(&s->pm);       // Release it.
+  }                                     // Done with pthread.
+  else                                  // Ours.
+  {
+    ipc::ShmMutex& m=(k==KIND_SHM)?s->shm:s->pi;
+    ipc::ShmResult r=m.Lock();          // Should be {0,EOWNERDEAD}.
+    if (r.code<0)                       // Broken?
+      errExitEN(r.errn,"ShmMutex::Lock");
+    err=r.errn;                         // What it said.
+    if (err==EOWNERDEAD)                // As expected?
+      m.Consistent();                   // Repaired.
+    m.Unlock();                         // Release it.
+  }                                     // Done with ours.
+  printf("%-9s recovered in %8.3f ms (%s)\n",kindName[k],(nowSec()-t0)*1e3,
+    (err==EOWNERDEAD)?"EOWNERDEAD":strerror(err));
+}
+
+int main (
+  int argc,                             // The argument count.
+  char* argv[])                         // The argument vector.
+{
+  if (argc>1&&strcmp(argv[1],"--help")==0)// Asking for help?
+    usageErr("%s [max-workers [ops-per-worker]]\n",argv[0]);
+  int maxw=(argc>1)?getInt(argv[1],GN_GT_0,"max-workers"):16;
+  uint64_t ops=(argc>2)?getLong(argv[2],GN_GT_0,"ops-per-worker"):200000;
+  ipc::SharedMemory shm;                // Private segment for the locks.
+  ipc::ShmResult r=shm.CreateOrAttach(IPC_PRIVATE,sizeof(Shared),
+    ipc::SHM_PERM_600,IPC_CREAT|IPC_EXCL);
+  if (r.code<0)                         // Could we create it?
+    errExitEN(r.errn,"shmget");         // No, bail.
+  r=shm.Attach();                       // Map it.
+  if (r.code<0)                         // Could we map it?
+    errExitEN(r.errn,"shmat");          // No, bail.
+  shm.MarkForRemoval();                 // Gone once the last process detaches.
+  Shared* s=static_cast<Shared*>(shm.GetPointer());
+  s->shm.Init();                        // Robust, adaptive.
+  s->pi.Init(ipc::SHM_MUTEX_PI);        // Robust, priority inheritance.
+  pthread_mutexattr_t ma;               // pthread mutex attributes.
+  pthread_mutexattr_init(&ma);          // Defaults...
+  pthread_mutexattr_setpshared(&ma,PTHREAD_PROCESS_SHARED);// ...across processes...
+  pthread_mutexattr_setrobust(&ma,PTHREAD_MUTEX_ROBUST);// ...and robust.
+  int e=pthread_mutex_init(&s->pm,&ma); // Make it.
+  if (e!=0)                             // Did that work?
+    errExitEN(e,"pthread_mutex_init");  // No, bail.
+  pthread_mutexattr_destroy(&ma);       // Done with the attributes.
+  int semid=semget(IPC_PRIVATE,1,S_IRUSR|S_IWUSR);
+  if (semid==-1)                        // Could we make the semaphore?
+    errExit("semget");                  // No, bail.
+  union semun { int val; struct semid_ds* buf; unsigned short* array; } arg;
+  arg.val=1;                            // Binary semaphore, initially free.
+  if (semctl(semid,0,SETVAL,arg)==-1)   // Set it.
+    errExit("semctl");                  // Trouble.
+  printf("%8s","workers");              // Header.
+  for (int k=0;k<KIND_COUNT;k++)        // One column per lock.
+    printf(" %12s",kindName[k]);        // Name it.
+  printf("   (lock/unlock pairs per second)\n");
+  for (int n=1;n<=maxw;n*=2)            // Double the workers each round.
+  {
+    printf("%8d",n);                    // Row label.
+    for (int k=0;k<KIND_COUNT;k++)      // Every kind of lock.
+    {
+      double secs=runRound(s,semid,(Kind)k,n,ops);
+      printf(" %12.0f",ops*(double)n/secs);
+      fflush(stdout);                   // Show progress as we go.
+    }                                   // Done with kinds.
+    printf("\n");                       // End of row.
+  }                                     // Done with all rounds.
+  recoverRound(s,KIND_SHM);             // Owner death: ours...
+  recoverRound(s,KIND_PI);              // ...ours with PI...
+  recoverRound(s,KIND_PTHREAD);         // ...and glibc's.
+  if (semctl(semid,0,IPC_RMID)==-1)     // Remove the semaphore.
+    errExit("semctl");                  // Trouble.
+  exit(EXIT_SUCCESS);                   // Segment goes away on detach.
+}
@@ -0,0 +1,125 @@
+/**
+ * Shows where the pages of a System V segment land under each ipc::ShmNuma placement.
+ * For every placement below the program creates a fresh private segment, applies the
+ * placement right after Attach(), faults every page in and prints how many pages ended
+ * up on each node, as reported by ShmNumaQuery():
+ *
+ *    default      no policy, first touch decides
+ *    bind         ShmNumaBind() of the whole segment to the target node
+ *    interleave   ShmNumaInterleave() over every allowed node
+ *    split        first half bound to node 0, second half to the target node
+ *    migrate      touched first, then ShmNumaBind()+ShmNumaMigrate() to the target node
+ *
+ *    numa_place [size-MB [node]]
+ *
+ * The target node defaults to the highest allowed node. On a single-node box (or a
+ * kernel without NUMA) everything reports node 0, which exercises the fallback path.
+ */
+#include <stdint.h>
+#include <vector>
+#include "ShmNuma.hpp"
+extern "C" {
+#include "tlpi_hdr.h"
+}
+
+enum Place { PLACE_DEFAULT, PLACE_BIND, PLACE_INTERLEAVE, PLACE_SPLIT, PLACE_MIGRATE, PLACE_COUNT };
+static const char* placeName[PLACE_COUNT]={"default","bind","interleave","split","migrate"};
+
+static void touchAll (                  // Fault every page in.
+  ipc::SharedMemory& shm)               // The attached segment.
+{
+  char* p=static_cast<char*>(shm.GetPointer());
+  size_t ps=(size_t)sysconf(_SC_PAGESIZE);
+  for (size_t off=0;off<shm.GetShmSize();off+=ps)
+    p[off]=1;                           // One write per page.
+}
+
+static void report (                    // Print the per-node page histogram.
+  const char* what,                     // Row label.
+  ipc::SharedMemory& shm,               // The attached segment.
+  int nnodes)                           // Columns to print.
+{
+  size_t n=ipc::ShmNumaPageCount(shm.GetPointer(),shm.GetShmSize());
+  std::vector<int> status(n);           // Node of each page.
+  ipc::ShmResult r=ipc::ShmNumaQuery(shm,status.data(),n);
+  if (r.code<0)                         // Could we ask?
+    errExitEN(r.errn,"ShmNumaQuery");   // No, bail.
+  std::vector<size_t> hist(nnodes,0);   // Pages per node.
+  size_t absent=0,other=0;              // Not faulted in / unexpected node.
+  for (size_t i=0;i<n;i++)              // For each page...
+  {
+    if (status[i]<0)                    // Not there?
+      absent++;                         // Count it.
+    else if (status[i]<nnodes)          // A node we print?
+      hist[status[i]]++;                // Count it there.
+    else                                // Somewhere else.
+      other++;                          // Count it.
+  }                                     // Done counting.
+  printf("%-11s",what);                 // Row label.
+  for (int k=0;k<nnodes;k++)            // One column per node.
+    printf(" %10zu",hist[k]);           // Pages on it.
+  printf(" %10zu %10zu%s\n",other,absent,(r.errn==ENOSYS)?"  (mincore fallback)":"");
+}
+
+int main (
+  int argc,                             // The argument count.
+  char* argv[])                         // The argument vector.
+{
+  if (argc>1&&strcmp(argv[1],"--help")==0)// Asking for help?
+    usageErr("%s [size-MB [node]]\n",argv[0]);
+  size_t size=(size_t)((argc>1)?getInt(argv[1],GN_GT_0,"size-MB"):64)<<20;
+  ipc::ShmNodeMask allowed;             // Nodes we may use.
+  ipc::ShmResult r=ipc::ShmNumaAllowed(&allowed);
+  if (r.code<0)                         // Could we ask?
+    errExitEN(r.errn,"ShmNumaAllowed"); // No, bail.
+  int nnodes=0;                         // Highest allowed node + 1.
+  for (int k=0;k<ipc::ShmNodeMask::kMaxNodes;k++)
+    if (allowed.Test(k))                // Allowed?
+      nnodes=k+1;                       // Extend the columns.
+  int node=(argc>2)?getInt(argv[2],0,"node"):nnodes-1;
+  if (node>=nnodes)                     // Room for the target in the table?
+    nnodes=node+1;                      // Grow it (the bind will fail anyway).
+  printf("%d allowed node(s)%s, target node %d, %zu pages\n",r.code,
+    (r.errn==ENOSYS)?" (no NUMA in this kernel)":"",node,size/(size_t)sysconf(_SC_PAGESIZE));
+  printf("%-11s","placement");          // Header.
+  for (int k=0;k<nnodes;k++)            // One column per node.
+    printf(" %9s%d","node",k);          // Name it.
+  printf(" %10s %10s\n","other","absent");
+  for (int p=0;p<PLACE_COUNT;p++)       // Every placement.
+  {
+    ipc::SharedMemory shm;              // Fresh private segment.
+    r=shm.CreateOrAttach(IPC_PRIVATE,size,ipc::SHM_PERM_600,IPC_CREAT|IPC_EXCL);
+    if (r.code<0)                       // Could we create it?
+      errExitEN(r.errn,"shmget");       // No, bail.
+    r=shm.Attach();                     // Map it.
+    if (r.code<0)                       // Could we map it?
+      errExitEN(r.errn,"shmat");        // No, bail.
+    switch (p)
+    {
+      case PLACE_BIND:
+        r=ipc::ShmNumaBind(shm,node);   // Everything on the target.
+        break;
+      case PLACE_INTERLEAVE:
+        r=ipc::ShmNumaInterleave(shm);  // Round robin over all nodes.
+        break;
+      case PLACE_SPLIT:
+        r=ipc::ShmNumaBind(shm,0,ipc::SHM_NUMA_NOMOVE,0,size/2);
+        if (r.code>=0)                  // First half placed?
+          r=ipc::ShmNumaBind(shm,node,ipc::SHM_NUMA_NOMOVE,size/2,size-size/2);
+        break;
+      case PLACE_MIGRATE:
+        touchAll(shm);                  // Pages exist before any policy.
+        r=ipc::ShmNumaBind(shm,node);   // Future faults go to the target...
+        if (r.code>=0)                  // ...and the existing pages...
+          r=ipc::ShmNumaMigrate(shm,node);// ...are moved there now.
+        break;
+      default:
+        r={0,0};                        // First touch.
+    }
+    if (r.code<0)                       // Did the placement work?
+      errExitEN(r.errn,"%s",placeName[p]);// No, bail.
+    touchAll(shm);                      // Fault in whatever is left.
+    report(placeName[p],shm,nnodes);    // Where did it land?
+  }                                     // Done with placements (segments removed).
+  exit(EXIT_SUCCESS);                   // Done.
+}
@@ -0,0 +1,84 @@
+/**
+ * Self-check for the prefault part of ipc::ShmPolicy. For every prefault mode it
+ * creates a private segment with that policy, fills it through a writable attach,
+ * then attaches it again with SHM_RDONLY and reads the pattern back. Read-only
+ * attaches must be prefaulted by reading: a write there is a SIGSEGV. Each case
+ * runs in a child so a crash is reported as a failure of that case, and the exit
+ * status is nonzero if any case failed.
+ *
+ *    shm_prefault_check [-s bytes]
+ */
+#include <sys/wait.h>
+#include "SharedMemory.hpp"
+extern "C" {
+#include "tlpi_hdr.h"
+}
+
+static size_t segSize=1<<20;            // Bytes per segment.
+
+static int runCase (                    // One prefault mode, in this process.
+  int prefault)                         // ShmPrefault
+{
+  ipc::ShmPolicy pol;                   // Defaults...
+  pol.prefault=prefault;                // ...but this prefault mode.
+  ipc::SharedMemory seg;                // Removed when it goes out of scope.
+  ipc::ShmResult r=seg.CreateOrAttach(IPC_PRIVATE,segSize,pol,ipc::SHM_PERM_600,
+    ipc::SHM_CREATE|ipc::SHM_EXCL);
+  if (r.code<0)
+    errExitEN(r.errn,"CreateOrAttach");
+  r=seg.Attach();                       // Writable, prefaulted by writing.
+  if (r.code<0)
+    errExitEN(r.errn,"Attach");
+  unsigned char* p=static_cast<unsigned char*>(seg.GetPointer());
+  for (size_t i=0;i<segSize;i++)        // A pattern to read back.
+    p[i]=(unsigned char)(i*7+prefault);
+  seg.Detach();
+  r=seg.Attach(SHM_RDONLY);             // Read-only, prefaulted by reading.
+  if (r.code<0)
+    errExitEN(r.errn,"Attach(SHM_RDONLY)");
+  const unsigned char* q=static_cast<const unsigned char*>(seg.GetPointer());
+  for (size_t i=0;i<segSize;i++)
+    if (q[i]!=(unsigned char)(i*7+prefault))
+      return 1;                         // Wrong data.
+  return 0;                             // Read back intact.
+}
+
+int main (
+  int argc,                             // The argument count.
+  char* argv[])                         // The argument vector.
+{
+  int opt;                              // Current option.
+  while ((opt=getopt(argc,argv,"s:"))!=-1)
+  {
+    if (opt=='s')
+      segSize=(size_t)getLong(optarg,GN_GT_0,"bytes");
+    else
+      usageErr("%s [-s bytes]\n",argv[0]);
+  }
+  static const struct { int mode; const char* name; } cases[]=
+  {
+    {ipc::SHM_PREFAULT_NONE,"none"},
+    {ipc::SHM_PREFAULT_TOUCH,"touch"},
+    {ipc::SHM_PREFAULT_POPULATE,"populate"},
+  };
+  int failed=0;                         // Cases that failed.
+  for (const auto& c:cases)
+  {
+    fflush(stdout);                     // Nothing buffered twice.
+    pid_t pid=fork();
+    if (pid==-1)
+      errExit("fork");
+    if (pid==0)                         // Child: run the case.
+      _exit(runCase(c.mode));
+    int status;                         // How the child ended.
+    if (waitpid(pid,&status,0)==-1)
+      errExit("waitpid");
+    bool ok=WIFEXITED(status)&&WEXITSTATUS(status)==0;
+    printf("%-9s %s",c.name,ok?"ok":"FAILED");
+    if (WIFSIGNALED(status))            // Crashed?
+      printf(" (signal %d)",WTERMSIG(status));
+    printf("\n");
+    failed+=!ok;
+  }
+  exit(failed==0?EXIT_SUCCESS:EXIT_FAILURE);
+}
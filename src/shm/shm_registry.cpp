@@ -0,0 +1,96 @@
+/**
+ * Command-line view of an ipc::ShmRegistry. Lists the registered segments with their
+ * kernel attach count and which registered attachers are still alive, sweeps orphans,
+ * and creates, removes or pins names by hand:
+ *
+ *    shm_registry [-k key] list
+ *    shm_registry [-k key] reap
+ *    shm_registry [-k key] create name size [kind [version]]
+ *    shm_registry [-k key] rm name
+ *
+ * "create" registers the segment as persistent, since the tool exits right away and the
+ * segment would otherwise be reaped as soon as the next sweep runs.
+ */
+#include <sys/shm.h>
+#include <time.h>
+#include <stdint.h>
+#include "ShmRegistry.hpp"
+extern "C" {
+#include "tlpi_hdr.h"
+}
+
+static void listEntries (               // Print every registered segment.
+  ipc::ShmRegistry* reg)                // The registry.
+{
+  printf("%-32s %10s %12s %5s %4s %8s %6s %s\n","name","shmid","bytes","kind","ver",
+    "creator","nattch","attachers");
+  for (const ipc::ShmRegEntry& e:reg->List())
+  {
+    struct shmid_ds ds;                 // Kernel's view.
+    char nattch[16];                    // Attach count, or '?' if unreadable.
+    if (shmctl(e.shmid,IPC_STAT,&ds)==0)// Can we see it?
+      snprintf(nattch,sizeof(nattch),"%lu",(unsigned long)ds.shm_nattch);
+    else                                // No.
+      snprintf(nattch,sizeof(nattch),"?");
+    printf("%-32s %10d %12llu %5u %4u %7ld%c %6s",e.name,e.shmid,(unsigned long long)e.size,
+      e.kind,e.version,(long)e.creator,ipc::ShmRegistry::Alive(e.creator)?' ':'x',nattch);
+    for (pid_t p:e.attachers)           // Every tracked attacher...
+      if (p!=0)                         // ...that is set...
+        printf(" %ld%s",(long)p,ipc::ShmRegistry::Alive(p)?"":"(x)");// ...dead ones marked.
+    printf("%s\n",(e.flags&ipc::SHM_REG_PERSISTENT)?"  [persistent]":"");
+  }                                     // Done listing.
+}
+
+int main (
+  int argc,                             // The argument count.
+  char* argv[])                         // The argument vector.
+{
+  key_t key=ipc::kShmRegistryKey;       // Registry to open.
+  int opt;                              // Current option.
+  while ((opt=getopt(argc,argv,"k:"))!=-1)
+  {
+    if (opt=='k')                       // Another registry?
+      key=(key_t)getLong(optarg,GN_ANY_BASE,"key");
+    else                                // Anything else.
+      usageErr("%s [-k key] list|reap|create name size [kind [version]]|rm name\n",argv[0]);
+  }                                     // Done with options.
+  if (optind>=argc)                     // No command?
+    usageErr("%s [-k key] list|reap|create name size [kind [version]]|rm name\n",argv[0]);
+  const char* cmd=argv[optind];         // What to do.
+  ipc::SharedMemory regseg;             // The registry's own segment.
+  ipc::ShmRegistry* reg=nullptr;        // The registry in it.
+  ipc::ShmResult r=ipc::ShmRegistry::OpenDefault(regseg,&reg,key);
+  if (r.code<0)                         // Could we open it?
+    errExitEN(r.errn,"ShmRegistry::OpenDefault");
+  if (strcmp(cmd,"list")==0)            // Show what is registered?
+    listEntries(reg);                   // Yes.
+  else if (strcmp(cmd,"reap")==0)       // Sweep orphans?
+  {
+    r=reg->Reap();                      // Yes.
+    if (r.code<0)                       // Did that work?
+      errExitEN(r.errn,"Reap");         // No, bail.
+    printf("%d entries reclaimed\n",r.code);
+  }                                     // Done reaping.
+  else if (strcmp(cmd,"create")==0&&argc-optind>=3)// Register a new segment?
+  {
+    ipc::SharedMemory seg;              // Bound by Create(), not owned.
+    long size=getLong(argv[optind+2],GN_GT_0|GN_ANY_BASE,"size");
+    int kind=(argc-optind>3)?getInt(argv[optind+3],0,"kind"):ipc::SHM_KIND_NONE;
+    int ver=(argc-optind>4)?getInt(argv[optind+4],0,"version"):0;
+    r=reg->Create(argv[optind+1],(size_t)size,&seg,(uint16_t)kind,(uint16_t)ver,
+      ipc::SHM_PERM_600,ipc::SHM_REG_PERSISTENT);
+    if (r.code<0)                       // Did that work?
+      errExitEN(r.errn,"Create");       // No, bail.
+    reg->Detach(argv[optind+1],&seg);   // The tool is not a user of it.
+    printf("%s: shmid %d\n",argv[optind+1],r.code);
+  }                                     // Done creating.
+  else if (strcmp(cmd,"rm")==0&&argc-optind>=2)// Remove a name?
+  {
+    r=reg->Remove(argv[optind+1]);      // Yes.
+    if (r.code<0)                       // Did that work?
+      errExitEN(r.errn,"Remove");       // No, bail.
+  }                                     // Done removing.
+  else                                  // Unknown command.
+    usageErr("%s [-k key] list|reap|create name size [kind [version]]|rm name\n",argv[0]);
+  exit(EXIT_SUCCESS);                   // Registry segment stays.
+}
@@ -0,0 +1,314 @@
+ /*
+ * *
+ * * Filename: ThreadTree.hpp
+ * *
+ * * Description:
+ * *   Header-only C++ front end to the thread_tree red-black tree, for any key and
+ * *     value type. The comparator is a template parameter (std::less<K> unless
+ * *     told otherwise), so it is inlined into the descent: a ThreadTree<uint64_t,V>
+ * *     compares keys in one instruction instead of formatting them as strings for
+ * *     strcmp(). Keys and values are stored by value. Like TREE_MODE_MUTEX, one
+ * *     mutex guards every operation; new nodes are allocated before it is taken
+ * *     and freed after it is dropped. The balancing is the same as thread_tree.c
+ * *     and thread_gtree.h (the C macro version).
+ * *
+ * *   Usage:
+ * *     threads::ThreadTree<uint64_t,int> ids;
+ * *     ids.Insert(42,7);
+ * *     int v;
+ * *     if (ids.Lookup(42,&v)) ...
+ * *     threads::ThreadTree<Key,int,KeyLess> custom;   // any strict weak order
+ * *
+ * *  Author:
+ * *    JEP  J. Enrique Peraza
+ * *
+ */
+#pragma once
+#include <functional>
+#include <mutex>
+#include <utility>
+#include <stddef.h>
+
+namespace threads
+{
+  template<typename K,typename V,typename Compare=std::less<K>>
+  class ThreadTree
+  {
+    public:
+      ThreadTree (void)=default;        // Empty tree.
+      explicit ThreadTree (const Compare& c) : less(c) {}
+      ThreadTree (const ThreadTree&)=delete;// Nodes have one owner.
+      ThreadTree& operator= (const ThreadTree&)=delete;
+      ~ThreadTree (void)
+      {                                 // ~~~~~~~~~ ~ThreadTree ~~~~~~~~~
+        Free(root);                     // Every node.
+      }                                 // ~~~~~~~~~ ~ThreadTree ~~~~~~~~~
+      // Insert key or give it a new value; true if the key was new.
+      bool Insert (
+        const K& key,                   // The key (copied)
+        const V& value)                 // Its value (copied)
+      {                                 // ~~~~~~~~~ Insert ~~~~~~~~~
+        Node* q=new Node{key,value};    // Made outside the lock.
+        bool added=false;               // New key?
+        {
+          std::lock_guard<std::mutex> g(mtx);
+          Node* o=nullptr;              // Parent of the insertion point.
+          int c=0;                      // Side of it.
+          Node* m=Find(key,&o,&c);      // Already there?
+          if (m!=nullptr)               // Yes?
+            m->value=value;             // New value.
+          else                          // No, link q in.
+          {
+            q->parent=o;                // Below o...
+            if (o==nullptr)             // ...or the first node.
+              root=q;
+            else if (c<0)               // Left of o?
+              o->left=q;
+            else                        // Right of o.
+              o->right=q;
+            FixInsert(q);               // Rebalance.
+            count++;                    // One more.
+            q=nullptr;                  // The tree's now.
+            added=true;                 // New key.
+          }                             // Done linking.
+        }                               // Unlocked.
+        delete q;                       // Not needed after all.
+        return added;                   // New key or not.
+      }                                 // ~~~~~~~~~ Insert ~~~~~~~~~
+      // Delete key; true if it was there.
+      bool Delete (
+        const K& key)                   // The key
+      {                                 // ~~~~~~~~~ Delete ~~~~~~~~~
+        Node* p=nullptr;                // The node taken out.
+        {
+          std::lock_guard<std::mutex> g(mtx);
+          Node* o=nullptr;              // Parent (unused).
+          int c=0;                      // Side (unused).
+          p=Find(key,&o,&c);            // The node holding key.
+          if (p==nullptr)               // Not there?
+            return false;               // Nothing to delete.
+          Unlink(p);                    // Out, and rebalance.
+          count--;                      // One less.
+        }                               // Unlocked.
+        delete p;                       // Freed outside the lock.
+        return true;                    // Deleted.
+      }                                 // ~~~~~~~~~ Delete ~~~~~~~~~
+      // Look key up; true if it is there (value copied to *value if not null).
+      bool Lookup (
+        const K& key,                   // The key
+        V* value) const                 // Out: its value, or nullptr
+      {                                 // ~~~~~~~~~ Lookup ~~~~~~~~~
+        std::lock_guard<std::mutex> g(mtx);
+        Node* o=nullptr;                // Parent (unused).
+        int c=0;                        // Side (unused).
+        const Node* p=Find(key,&o,&c);  // The node holding key.
+        if (p!=nullptr&&value!=nullptr) // Found and wanted?
+          *value=p->value;              // Copy it out.
+        return p!=nullptr;              // Found or not.
+      }                                 // ~~~~~~~~~ Lookup ~~~~~~~~~
+      size_t Size (void) const
+      {                                 // ~~~~~~~~~ Size ~~~~~~~~~
+        std::lock_guard<std::mutex> g(mtx);
+        return count;                   // Keys in the tree.
+      }                                 // ~~~~~~~~~ Size ~~~~~~~~~
+    private:
+      enum Color { RED, BLACK };
+      struct Node
+      {
+        K key;                          // The key.
+        V value;                        // Its value.
+        Color color{RED};               // New nodes are red.
+        Node* left{nullptr};            // Smaller keys.
+        Node* right{nullptr};           // Larger keys.
+        Node* parent{nullptr};          // nullptr at the root.
+      };
+      // Three-way compare through the (inlined) strict weak order.
+      int Cmp (
+        const K& a,                     // A key
+        const K& b) const               // Another
+      {                                 // ~~~~~~~~~ Cmp ~~~~~~~~~
+        if (less(a,b))                  // Below?
+          return -1;
+        return less(b,a)?1:0;           // Above or equal.
+      }                                 // ~~~~~~~~~ Cmp ~~~~~~~~~
+      // Node holding key, or nullptr; *parent/*dir say where key would hang.
+      Node* Find (
+        const K& key,                   // The key
+        Node** parent,                  // Out: last node passed
+        int* dir) const                 // Out: <0 left of it, >0 right of it
+      {                                 // ~~~~~~~~~ Find ~~~~~~~~~
+        Node* p=root;                   // Start at the root.
+        Node* o=nullptr;                // No parent yet.
+        int c=0;                        // Last comparison.
+        while (p!=nullptr)              // Until we fall off the tree.
+        {
+          c=Cmp(key,p->key);            // Which way?
+          if (c==0)                     // Found it?
+            break;                      // Yes.
+          o=p;                          // Remember the parent.
+          p=(c<0)?p->left:p->right;     // Down.
+        }                               // Done walking.
+        *parent=o;                      // Where it would hang...
+        *dir=c;                         // ...and on which side.
+        return p;                       // The node, if any.
+      }                                 // ~~~~~~~~~ Find ~~~~~~~~~
+      // Put q (maybe nullptr) where p hangs.
+      void Replace (
+        Node* p,                        // The node replaced
+        Node* q)                        // Its replacement
+      {                                 // ~~~~~~~~~ Replace ~~~~~~~~~
+        if (p->parent==nullptr)         // p was the root?
+          root=q;                       // Then q is.
+        else if (p==p->parent->left)    // A left child?
+          p->parent->left=q;            // q takes its place.
+        else                            // A right child.
+          p->parent->right=q;           // q takes its place.
+        if (q!=nullptr)                 // Anything moved up?
+          q->parent=p->parent;          // It hangs where p did.
+      }                                 // ~~~~~~~~~ Replace ~~~~~~~~~
+      void RotateLeft (Node* p)
+      {                                 // ~~~~~~~~~ RotateLeft ~~~~~~~~~
+        Node* q=p->right;               // Comes up.
+        p->right=q->left;               // Its left subtree moves over.
+        if (q->left!=nullptr)
+          q->left->parent=p;
+        Replace(p,q);                   // q where p was...
+        q->left=p;                      // ...with p on its left.
+        p->parent=q;
+      }                                 // ~~~~~~~~~ RotateLeft ~~~~~~~~~
+      void RotateRight (Node* p)
+      {                                 // ~~~~~~~~~ RotateRight ~~~~~~~~~
+        Node* q=p->left;                // Comes up.
+        p->left=q->right;               // Its right subtree moves over.
+        if (q->right!=nullptr)
+          q->right->parent=p;
+        Replace(p,q);                   // q where p was...
+        q->right=p;                     // ...with p on its right.
+        p->parent=q;
+      }                                 // ~~~~~~~~~ RotateRight ~~~~~~~~~
+      static bool IsBlack (const Node* p) { return p==nullptr||p->color==BLACK; }
+      void FixInsert (Node* p)
+      {                                 // ~~~~~~~~~ FixInsert ~~~~~~~~~
+        while (p->parent!=nullptr&&p->parent->color==RED)// Red under red?
+        {
+          Node* g=p->parent->parent;    // A red parent is never the root.
+          bool left=(p->parent==g->left);// Which side the parent is on.
+          Node* u=left?g->right:g->left;// The uncle.
+          if (!IsBlack(u))              // Red uncle: recolor and move up.
+          {
+            p->parent->color=BLACK;
+            u->color=BLACK;
+            g->color=RED;
+            p=g;
+            continue;
+          }
+          if (left&&p==p->parent->right)// Inner grandchild: make it outer.
+          {
+            p=p->parent;
+            RotateLeft(p);
+          }
+          else if (!left&&p==p->parent->left)
+          {
+            p=p->parent;
+            RotateRight(p);
+          }
+          p->parent->color=BLACK;       // Outer grandchild: rotate g away.
+          g->color=RED;
+          if (left)
+            RotateRight(g);
+          else
+            RotateLeft(g);
+        }                               // Done fixing.
+        root->color=BLACK;              // The root is always black.
+      }                                 // ~~~~~~~~~ FixInsert ~~~~~~~~~
+      // p (maybe nullptr, hence its parent pp) is short a black.
+      void FixDelete (
+        Node* p,                        // The node short a black
+        Node* pp)                       // Its parent
+      {                                 // ~~~~~~~~~ FixDelete ~~~~~~~~~
+        while (p!=root&&IsBlack(p))
+        {
+          bool left=(p==pp->left);      // Which side p is on.
+          Node* s=left?pp->right:pp->left;// The sibling (never nullptr here).
+          if (s->color==RED)            // Red sibling: make it black.
+          {
+            s->color=BLACK;
+            pp->color=RED;
+            if (left) RotateLeft(pp); else RotateRight(pp);
+            s=left?pp->right:pp->left;
+          }
+          if (IsBlack(s->left)&&IsBlack(s->right))// Both nephews black: push it up.
+          {
+            s->color=RED;
+            p=pp;
+            pp=p->parent;
+            continue;
+          }
+          if (IsBlack(left?s->right:s->left))// Near nephew red: make it far.
+          {
+            (left?s->left:s->right)->color=BLACK;
+            s->color=RED;
+            if (left) RotateRight(s); else RotateLeft(s);
+            s=left?pp->right:pp->left;
+          }
+          s->color=pp->color;           // Far nephew red: rotate and stop.
+          pp->color=BLACK;
+          (left?s->right:s->left)->color=BLACK;
+          if (left) RotateLeft(pp); else RotateRight(pp);
+          p=root;
+        }                               // Done fixing.
+        if (p!=nullptr)
+          p->color=BLACK;
+      }                                 // ~~~~~~~~~ FixDelete ~~~~~~~~~
+      // Take p out of the tree and rebalance (p itself is left to the caller).
+      void Unlink (Node* p)
+      {                                 // ~~~~~~~~~ Unlink ~~~~~~~~~
+        Node* x;                        // Moves into the gap.
+        Node* xp;                       // Its parent (x may be nullptr).
+        Color gone=p->color;            // Color taken out of the tree.
+        if (p->left==nullptr||p->right==nullptr)// At most one child?
+        {
+          x=(p->left!=nullptr)?p->left:p->right;// It moves up.
+          xp=p->parent;
+          Replace(p,x);
+        }
+        else                            // Two: the successor takes p's place.
+        {
+          Node* y=p->right;
+          while (y->left!=nullptr)
+            y=y->left;
+          gone=y->color;
+          x=y->right;
+          if (y->parent==p)
+            xp=y;
+          else
+          {
+            xp=y->parent;
+            Replace(y,x);
+            y->right=p->right;
+            y->right->parent=y;
+          }
+          Replace(p,y);
+          y->left=p->left;
+          y->left->parent=y;
+          y->color=p->color;
+        }                               // Done relinking.
+        if (gone==BLACK)                // Did a path lose a black?
+          FixDelete(x,xp);
+      }                                 // ~~~~~~~~~ Unlink ~~~~~~~~~
+      static void Free (Node* p)
+      {                                 // ~~~~~~~~~ Free ~~~~~~~~~
+        while (p!=nullptr)              // Recurse left, loop right.
+        {
+          Node* r=p->right;             // Still to free.
+          Free(p->left);                // Everything smaller.
+          delete p;                     // This one.
+          p=r;                          // Everything larger.
+        }
+      }                                 // ~~~~~~~~~ Free ~~~~~~~~~
+      Node* root{nullptr};              // Root, nullptr when empty
+      size_t count{0};                  // Keys in the tree
+      mutable std::mutex mtx;           // Guards everything
+      Compare less{};                   // The key order
+  };
+}
@@ -0,0 +1,116 @@
+/**
+ * This program measures what 64-bit keys cost in the string-keyed thread_tree
+ * against a tree generated for them by thread_gtree.h. The string tree gets each
+ * key as a fixed-width decimal string, formatted on every operation as a caller
+ * holding a uint64_t order ID would have to, and compares with strcmp(); the
+ * generated tree stores the uint64_t and compares it inline. Both insert n random
+ * keys, look them all up in another order, and delete them.
+ *
+ *    key_bench [-n keys]
+ */
+#include <time.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include "thread_gtree.h"
+
+TREE_DEFINE(U64Tree,uint64_t,int,TREE_CMP_NUM)
+
+static int n=1000000;                   // Keys.
+static uint64_t* ids;                   // The keys, in random order.
+
+// Monotonic time in nanoseconds.
+static double nowNs (void)
+{
+  struct timespec ts;                   // The time.
+  if (clock_gettime(CLOCK_MONOTONIC,&ts)==-1)
+    errExit("clock_gettime");
+  return ts.tv_sec*1e9+ts.tv_nsec;      // In nanoseconds.
+}
+// Print one phase.
+static void report (
+  const char* tree,                     // Which tree.
+  const char* phase,                    // What was measured.
+  double ns,                            // Total time.
+  long found)                           // Lookups that found their key.
+{
+  printf("%-8s %-8s %10.1f ns/op %10ld found\n",tree,phase,ns/n,found);
+}
+// A key as the string tree wants it: 20 digits, so strings sort like numbers.
+static void format (
+  char* buf,                            // 21 bytes.
+  uint64_t id)                          // The key.
+{
+  snprintf(buf,21,"%020" PRIu64,id);
+}
+
+int main (
+  int argc,                             // The argument count.
+  char* argv[])                         // The argument vector.
+{
+  int opt;                              // Current option.
+  while ((opt=getopt(argc,argv,"n:"))!=-1)
+  {
+    if (opt=='n')
+      n=getInt(optarg,GN_GT_0,"keys");
+    else
+      usageErr("%s [-n keys]\n",argv[0]);
+  }
+  ids=(uint64_t*) malloc((size_t)n*sizeof(uint64_t));
+  if (ids==NULL)
+    errExit("malloc");
+  uint64_t x=0x9e3779b97f4a7c15ULL;     // Generator state.
+  for (int i=0;i<n;i++)                 // Random IDs (duplicates are harmless).
+  {
+    x^=x<<13;
+    x^=x>>7;
+    x^=x<<17;
+    ids[i]=x;
+  }
+  char buf[21];                         // A formatted key.
+  int v;                                // Value found.
+  long found=0;                         // Lookups that hit.
+  Tree* tree=(Tree*) malloc(sizeof(Tree));// DestroyTree() frees it.
+  if (tree==NULL)
+    errExit("malloc");
+  Initialize(tree);                     // One mutex, like the generated tree.
+  double t=nowNs();
+  for (int i=0;i<n;i++)
+  {
+    format(buf,ids[i]);
+    InsertNode(tree,buf,i);
+  }
+  report("string","insert",nowNs()-t,0);
+  t=nowNs();
+  for (int i=n-1;i>=0;i--)
+  {
+    format(buf,ids[i]);
+    found+=Lookup(tree,buf,&v);
+  }
+  report("string","lookup",nowNs()-t,found);
+  t=nowNs();
+  for (int i=0;i<n;i++)
+  {
+    format(buf,ids[i]);
+    DeleteNode(tree,buf);
+  }
+  report("string","delete",nowNs()-t,tree->size);
+  DestroyTree(tree);
+  U64Tree u;                            // The generated tree.
+  U64TreeInit(&u);
+  t=nowNs();
+  for (int i=0;i<n;i++)
+    U64TreeInsert(&u,ids[i],i);
+  report("uint64","insert",nowNs()-t,0);
+  found=0;
+  t=nowNs();
+  for (int i=n-1;i>=0;i--)
+    found+=U64TreeLookup(&u,ids[i],&v);
+  report("uint64","lookup",nowNs()-t,found);
+  t=nowNs();
+  for (int i=0;i<n;i++)
+    U64TreeDelete(&u,ids[i]);
+  report("uint64","delete",nowNs()-t,u.size);
+  U64TreeDestroy(&u);
+  free(ids);
+  exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,421 @@
+/**
+ * This program drives every ordered map in src/threads through the same workload:
+ * the red-black tree in its mutex, rwlock and epoch modes, the B+tree, the sharded
+ * tree and the lock-free skip list. Each map is filled with every other key of the
+ * key space, then t threads run random operations on it: a lookup with probability
+ * -r percent, an insert with probability -i percent, a delete otherwise. Inserts and
+ * deletes hit the same key space, so the map stays about half full. Keys are picked
+ * uniformly, or from a Zipf distribution of skew -z (0.99 is the usual "hot keys"
+ * setting), scattered over the key space so the hot keys are not neighbours.
+ *
+ * Every thread runs -o operations, or for -d seconds if given. Each operation is
+ * timed into a per-thread log-linear histogram (16 buckets per power of two, so a
+ * percentile is within 1/16 of the truth). The report gives the total and
+ * per-thread throughput and the p50/p99/p999 latency of each operation. It also
+ * gives how many lock acquisitions had to wait on the tree's lock (tmtx, or trw in
+ * rwlock mode) and for how long. With -S the thread count is swept instead (1, 2,
+ * 4, ... up to -t) and only the throughput is printed, one row per map.
+ *
+ *    map_bench [-n keys] [-l keylen] [-o ops | -d seconds] [-r read%] [-i insert%]
+ *              [-z theta] [-t threads] [-S] [-m name[,name...]]
+ *
+ * Maps: rb-mutex rb-rwlock rb-epoch bplus sharded skiplist (default: all). The
+ * clock reads cost some tens of nanoseconds per operation, which the latencies
+ * include.
+ */
+#include <time.h>
+#include <math.h>
+#include <stdint.h>
+#include "thread_shard.h"
+#include "thread_skiplist.h"
+
+// Latency buckets: exact below 16ns, then 16 per power of two.
+#define HIST_SUB 16
+#define HIST_BUCKETS (HIST_SUB+60*HIST_SUB)
+
+// One map behind the driver.
+typedef struct MapImpl
+{
+  const char* name;                     // What -m calls it.
+  void* (*create)(void);                // Make an empty one.
+  void (*destroy)(void*);               // Free it.
+  void (*insert)(void*,char*,int);      // Insert or update.
+  void (*remove)(void*,char*);          // Delete.
+  bool (*lookup)(void*,char*,int*);     // Look up.
+  void (*waits)(void*,unsigned long*,unsigned long*);// Lock waits so far.
+} MapImpl;
+// Operation kinds.
+enum { OP_LOOKUP, OP_INSERT, OP_DELETE, OP_KINDS };
+static const char* opNames[OP_KINDS]={"lookup","insert","delete"};
+// What one thread did. Threads only write their own.
+typedef struct ThreadStats
+{
+  long ops;                             // Operations run.
+  double ns;                            // Time they took, start to finish.
+  unsigned long hist[OP_KINDS][HIST_BUCKETS];// Latencies per operation kind.
+} ThreadStats;
+
+static int n=1000000;                   // Keys in the key space.
+static int keyLen=16;                   // Bytes per key.
+static long ops=200000;                 // Operations per thread (no -d).
+static double seconds=0;                // Run time per thread count (-d), or 0.
+static int readPct=80;                  // Percentage of lookups.
+static int insertPct=10;                // Percentage of inserts (the rest delete).
+static double theta=0;                  // Zipf skew, 0 for uniform keys.
+static double zetaN,zipfAlpha,zipfEta;  // Zipf constants for n and theta.
+static char* keys;                      // The keys, keyLen+1 bytes apart.
+static const MapImpl* impl;             // The map under test...
+static void* map;                       // ...and its instance.
+static volatile int stop;               // Set when the -d time is up.
+
+// The tree in one mode, as a map.
+static void* treeCreate (TreeMode mode,TreeKind kind)
+{
+  Tree* t=(Tree*) malloc(sizeof(Tree)); // DestroyTree() frees it.
+  if (t==NULL)
+    errExit("malloc");
+  TreeOptions opts={mode,kind};
+  InitializeWithOptions(t,&opts);
+  return t;
+}
+static void* rbMutex (void) { return treeCreate(TREE_MODE_MUTEX,TREE_KIND_RB); }
+static void* rbRwlock (void) { return treeCreate(TREE_MODE_RWLOCK,TREE_KIND_RB); }
+static void* rbEpoch (void) { return treeCreate(TREE_MODE_EPOCH,TREE_KIND_RB); }
+static void* bplus (void) { return treeCreate(TREE_MODE_MUTEX,TREE_KIND_BPLUS); }
+static void treeDestroy (void* m) { DestroyTree((Tree*)m); }
+static void treeInsert (void* m,char* k,int v) { InsertNode((Tree*)m,k,v); }
+static void treeRemove (void* m,char* k) { DeleteNode((Tree*)m,k); }
+static bool treeLookup (void* m,char* k,int* v) { return Lookup((Tree*)m,k,v); }
+static void treeWaits (void* m,unsigned long* w,unsigned long* ns) { LockWaitStats((Tree*)m,w,ns); }
+// The sharded tree (16 mutex shards).
+static void* shardCreate (void)
+{
+  ShardedTree* st=(ShardedTree*) malloc(sizeof(ShardedTree));
+  if (st==NULL)
+    errExit("malloc");
+  ShardedInitialize(st,16,NULL);
+  return st;
+}
+static void shardDestroy (void* m) { ShardedDestroy((ShardedTree*)m); free(m); }
+static void shardInsert (void* m,char* k,int v) { ShardedInsert((ShardedTree*)m,k,v); }
+static void shardRemove (void* m,char* k) { ShardedDelete((ShardedTree*)m,k); }
+static bool shardLookup (void* m,char* k,int* v) { return ShardedLookup((ShardedTree*)m,k,v); }
+static void shardWaits (void* m,unsigned long* w,unsigned long* ns)
+{
+  ShardedTree* st=(ShardedTree*)m;
+  *w=*ns=0;
+  for (int i=0;i<st->nshards;i++)       // Every shard's lock.
+  {
+    unsigned long sw,sns;
+    LockWaitStats(st->shards[i],&sw,&sns);
+    *w+=sw;
+    *ns+=sns;
+  }
+}
+// The skip list (no locks to wait for).
+static void* skipCreate (void)
+{
+  SkipList* sl=(SkipList*) malloc(sizeof(SkipList));
+  if (sl==NULL)
+    errExit("malloc");
+  SkipListInit(sl);
+  return sl;
+}
+static void skipDestroy (void* m) { SkipListDestroy((SkipList*)m); free(m); }
+static void skipInsert (void* m,char* k,int v) { SkipListInsert((SkipList*)m,k,v); }
+static void skipRemove (void* m,char* k) { SkipListDelete((SkipList*)m,k); }
+static bool skipLookup (void* m,char* k,int* v) { return SkipListLookup((SkipList*)m,k,v); }
+static void noWaits (void* m,unsigned long* w,unsigned long* ns) { (void)m; *w=*ns=0; }
+
+static const MapImpl impls[]=
+{
+  {"rb-mutex",rbMutex,treeDestroy,treeInsert,treeRemove,treeLookup,treeWaits},
+  {"rb-rwlock",rbRwlock,treeDestroy,treeInsert,treeRemove,treeLookup,treeWaits},
+  {"rb-epoch",rbEpoch,treeDestroy,treeInsert,treeRemove,treeLookup,treeWaits},
+  {"bplus",bplus,treeDestroy,treeInsert,treeRemove,treeLookup,treeWaits},
+  {"sharded",shardCreate,shardDestroy,shardInsert,shardRemove,shardLookup,shardWaits},
+  {"skiplist",skipCreate,skipDestroy,skipInsert,skipRemove,skipLookup,noWaits},
+};
+
+// Monotonic time in nanoseconds.
+static double nowNs (void)
+{
+  struct timespec ts;                   // The time.
+  if (clock_gettime(CLOCK_MONOTONIC,&ts)==-1)
+    errExit("clock_gettime");
+  return ts.tv_sec*1e9+ts.tv_nsec;      // In nanoseconds.
+}
+// Histogram bucket of a latency.
+static int bucket (uint64_t ns)
+{
+  if (ns<HIST_SUB)                      // Small enough to count exactly?
+    return (int)ns;
+  int m=63-__builtin_clzll(ns);         // Power of two (at least 4).
+  int b=HIST_SUB+(m-4)*HIST_SUB+(int)((ns>>(m-4))&(HIST_SUB-1));
+  return (b<HIST_BUCKETS)?b:HIST_BUCKETS-1;
+}
+// Largest latency that falls in bucket b.
+static uint64_t bucketTop (int b)
+{
+  if (b<HIST_SUB)                       // Exact?
+    return (uint64_t)b;
+  int m=(b-HIST_SUB)/HIST_SUB+4;        // Power of two.
+  uint64_t sub=(uint64_t)((b-HIST_SUB)%HIST_SUB);// Sixteenth of it.
+  return ((HIST_SUB+sub+1)<<(m-4))-1;
+}
+// The latency below which a fraction q of the samples fall.
+static uint64_t percentile (
+  const unsigned long* h,               // Histogram.
+  unsigned long total,                  // Samples in it.
+  double q)                             // Fraction, e.g. 0.99.
+{
+  unsigned long want=(unsigned long)ceil(q*total);// Samples at or below.
+  unsigned long seen=0;
+  for (int b=0;b<HIST_BUCKETS;b++)
+    if ((seen+=h[b])>=want&&want>0)
+      return bucketTop(b);
+  return 0;
+}
+// Write key number i into buf: its decimal digits, padded to keyLen.
+static void makeKey (
+  char* buf,                            // keyLen+1 bytes.
+  int i)                                // Key number.
+{
+  int d=snprintf(buf,keyLen+1,"%d",i);  // The digits...
+  if (d<keyLen)                         // ...padded...
+    memset(buf+d,'x',keyLen-d);
+  buf[keyLen]='\0';                     // ...to keyLen.
+}
+// Set up the Zipf constants (Gray et al., "Quickly generating billion-record
+// synthetic databases", as used by YCSB).
+static void zipfInit (void)
+{
+  zetaN=0;
+  for (int i=1;i<=n;i++)                // zeta(n,theta).
+    zetaN+=1.0/pow(i,theta);
+  double zeta2=1.0+1.0/pow(2,theta);    // zeta(2,theta).
+  zipfAlpha=1.0/(1.0-theta);
+  zipfEta=(1.0-pow(2.0/n,1.0-theta))/(1.0-zeta2/zetaN);
+}
+// A key number: uniform, or a Zipf rank scattered over the key space.
+static int pickKey (uint64_t x)
+{
+  if (theta==0)                         // Uniform?
+    return (int)(x%(uint64_t)n);
+  double u=(double)(x>>11)/9007199254740992.0;// Uniform in [0,1).
+  double uz=u*zetaN;
+  uint64_t rank;                        // 0 is the hottest.
+  if (uz<1.0)
+    rank=0;
+  else if (uz<1.0+pow(0.5,theta))
+    rank=1;
+  else
+    rank=(uint64_t)(n*pow(zipfEta*u-zipfEta+1.0,zipfAlpha));
+  if (rank>=(uint64_t)n)
+    rank=n-1;
+  uint64_t h=rank*0x9e3779b97f4a7c15ULL;// Scatter the ranks...
+  h^=h>>29;
+  return (int)(h%(uint64_t)n);          // ...over the key space (collisions are harmless).
+}
+// One thread's operations.
+static void* worker (void* arg)
+{
+  ThreadStats* st=(ThreadStats*)arg;    // Where to keep score.
+  uint64_t x=(uintptr_t)arg*0x9e3779b97f4a7c15ULL|1;// Generator state.
+  double start=nowNs();                 // Start.
+  long i=0;
+  for (;seconds>0?!stop:i<ops;i++)
+  {
+    x^=x<<13;                           // Next random number.
+    x^=x>>7;
+    x^=x<<17;
+    char* k=keys+(size_t)pickKey(x)*(keyLen+1);// A key.
+    uint64_t y=x*0xd6e8feb86659fd93ULL; // Independent bits for the dice.
+    int dice=(int)((y>>32)%100);        // Which operation.
+    int op=(dice<readPct)?OP_LOOKUP:(dice<readPct+insertPct)?OP_INSERT:OP_DELETE;
+    double t0=nowNs();
+    if (op==OP_LOOKUP)
+    {
+      int v;                            // Value found.
+      impl->lookup(map,k,&v);
+    }
+    else if (op==OP_INSERT)
+      impl->insert(map,k,(int)i);
+    else
+      impl->remove(map,k);
+    st->hist[op][bucket((uint64_t)(nowNs()-t0))]++;
+  }
+  st->ops=i;
+  st->ns=nowNs()-start;
+  return NULL;
+}
+// Run t threads against a fresh, half-full map; returns the total Mops/s.
+static double runThreads (
+  const MapImpl* m,                     // The map.
+  int t,                                // Threads.
+  pthread_t* tids,                      // Room for t.
+  ThreadStats* stats,                   // Room for t.
+  unsigned long* waits,                 // Out: lock acquisitions that waited.
+  unsigned long* waitns)                // Out: time they waited.
+{
+  impl=m;
+  map=m->create();                      // A fresh map...
+  for (int i=0;i<n;i+=2)                // ...half full.
+    m->insert(map,keys+(size_t)i*(keyLen+1),i);
+  unsigned long w0,ns0;                 // Lock waits while filling (none, unless...).
+  m->waits(map,&w0,&ns0);
+  memset(stats,0,t*sizeof(ThreadStats));
+  stop=0;
+  double t0=nowNs();                    // Start.
+  for (int i=0;i<t;i++)
+  {
+    int status=pthread_create(&tids[i],NULL,worker,&stats[i]);
+    if (status!=0)
+      errExitEN(status,"pthread_create");
+  }
+  if (seconds>0)                        // Timed run?
+  {
+    struct timespec ts={(time_t)seconds,(long)((seconds-(time_t)seconds)*1e9)};
+    while (nanosleep(&ts,&ts)==-1&&errno==EINTR)
+      ;
+    stop=1;                             // Time is up.
+  }
+  for (int i=0;i<t;i++)
+  {
+    int status=pthread_join(tids[i],NULL);
+    if (status!=0)
+      errExitEN(status,"pthread_join");
+  }
+  double wall=nowNs()-t0;               // Elapsed.
+  m->waits(map,waits,waitns);
+  *waits-=w0;
+  *waitns-=ns0;
+  m->destroy(map);
+  long total=0;
+  for (int i=0;i<t;i++)
+    total+=stats[i].ops;
+  return total/wall*1e3;
+}
+// The full report for one map at t threads.
+static void report (
+  const MapImpl* m,                     // The map.
+  int t,                                // Threads.
+  pthread_t* tids,                      // Room for t.
+  ThreadStats* stats)                   // Room for t.
+{
+  unsigned long waits,waitns;           // Lock waits.
+  double mops=runThreads(m,t,tids,stats,&waits,&waitns);
+  printf("%s: %.3f Mops/s with %d threads\n",m->name,mops,t);
+  printf("  per thread (Mops/s):");
+  double busy=0;                        // Thread time, all threads.
+  for (int i=0;i<t;i++)
+  {
+    printf(" %.3f",stats[i].ops/stats[i].ns*1e3);
+    busy+=stats[i].ns;
+  }
+  printf("\n");
+  printf("  %-8s %12s %10s %10s %10s\n","op","count","p50 ns","p99 ns","p999 ns");
+  static unsigned long h[HIST_BUCKETS]; // All threads together.
+  for (int op=0;op<OP_KINDS;op++)
+  {
+    unsigned long count=0;
+    memset(h,0,sizeof(h));
+    for (int i=0;i<t;i++)
+      for (int b=0;b<HIST_BUCKETS;b++)
+      {
+        h[b]+=stats[i].hist[op][b];
+        count+=stats[i].hist[op][b];
+      }
+    if (count==0)
+      continue;
+    printf("  %-8s %12lu %10lu %10lu %10lu\n",opNames[op],count,
+      (unsigned long)percentile(h,count,0.50),(unsigned long)percentile(h,count,0.99),
+      (unsigned long)percentile(h,count,0.999));
+  }
+  printf("  lock waits: %lu, %.3f ms in all, %.2f%% of thread time\n",waits,waitns/1e6,
+    busy>0?100.0*waitns/busy:0.0);
+}
+
+int main (
+  int argc,                             // The argument count.
+  char* argv[])                         // The argument vector.
+{
+  int maxThreads=8;                     // Threads (largest count with -S).
+  bool sweep=false;                     // Sweep thread counts?
+  const char* names=NULL;               // Maps to run (NULL: all).
+  int opt;                              // Current option.
+  while ((opt=getopt(argc,argv,"n:l:o:d:r:i:z:t:Sm:"))!=-1)
+  {
+    switch (opt)
+    {
+      case 'n': n=getInt(optarg,GN_GT_0,"keys"); break;
+      case 'l': keyLen=getInt(optarg,GN_GT_0,"keylen"); break;
+      case 'o': ops=getLong(optarg,GN_GT_0,"ops"); break;
+      case 'd': seconds=atof(optarg); break;
+      case 'r': readPct=getInt(optarg,GN_NONNEG,"read%"); break;
+      case 'i': insertPct=getInt(optarg,GN_NONNEG,"insert%"); break;
+      case 'z': theta=atof(optarg); break;
+      case 't': maxThreads=getInt(optarg,GN_GT_0,"threads"); break;
+      case 'S': sweep=true; break;
+      case 'm': names=optarg; break;
+      default:
+        usageErr("%s [-n keys] [-l keylen] [-o ops | -d seconds] [-r read%%] [-i insert%%]"
+          " [-z theta] [-t threads] [-S] [-m name[,name...]]\n",argv[0]);
+    }
+  }
+  if (readPct+insertPct>100)
+    cmdLineErr("read%% plus insert%% is over 100\n");
+  if (keyLen<10)                        // Room for any int's digits?
+    cmdLineErr("keys need at least 10 bytes\n");
+  if (theta<0||theta>=1)                // The generator's range.
+    cmdLineErr("-z takes a skew in [0,1)\n");
+  if (seconds<0)
+    cmdLineErr("-d takes a positive number of seconds\n");
+  keys=(char*) malloc((size_t)n*(keyLen+1));
+  pthread_t* tids=(pthread_t*) malloc(maxThreads*sizeof(pthread_t));
+  ThreadStats* stats=(ThreadStats*) malloc(maxThreads*sizeof(ThreadStats));
+  if (keys==NULL||tids==NULL||stats==NULL)
+    errExit("malloc");
+  for (int i=0;i<n;i++)
+    makeKey(keys+(size_t)i*(keyLen+1),i);
+  if (theta>0)
+    zipfInit();
+  printf("%d keys of %d bytes (%s), ",n,keyLen,theta>0?"zipf":"uniform");
+  if (seconds>0)
+    printf("%.1f s per run, ",seconds);
+  else
+    printf("%ld ops per thread, ",ops);
+  printf("%d%% lookups, %d%% inserts, %d%% deletes\n",readPct,insertPct,
+    100-readPct-insertPct);
+  if (sweep)
+  {
+    printf("%-10s","Mops/s");
+    for (int t=1;t<=maxThreads;t*=2)
+      printf(" %7d",t);
+    printf("  threads\n");
+  }
+  for (size_t i=0;i<sizeof(impls)/sizeof(impls[0]);i++)
+  {
+    const char* s=(names!=NULL)?strstr(names,impls[i].name):NULL;// Asked for?
+    size_t len=strlen(impls[i].name);
+    if (names!=NULL&&(s==NULL||(s!=names&&s[-1]!=',')||(s[len]!='\0'&&s[len]!=',')))
+      continue;                         // No.
+    if (!sweep)                         // One thread count, full report?
+    {
+      report(&impls[i],maxThreads,tids,stats);
+      continue;
+    }
+    printf("%-10s",impls[i].name);      // Throughput per thread count.
+    for (int t=1;t<=maxThreads;t*=2)
+    {
+      unsigned long waits,waitns;
+      printf(" %7.2f",runThreads(&impls[i],t,tids,stats,&waits,&waitns));
+      fflush(stdout);
+    }
+    printf("\n");
+  }
+  free(keys);
+  free(tids);
+  free(stats);
+  exit(EXIT_SUCCESS);
+}
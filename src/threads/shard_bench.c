@@ -0,0 +1,139 @@
+/**
+ * This program measures how a ShardedTree scales with its shard count and with the
+ * number of threads hammering it. The map is loaded with n keys, then for every
+ * combination of shard count (1, 2, 4, ... up to -s) and thread count (1, 2, 4, ...
+ * up to -t) each thread runs ops operations on random keys: with probability -w
+ * percent it rewrites the key's value (a counter update), otherwise it looks the key
+ * up. It prints the total throughput in a table, one row per shard count. With one
+ * shard every writer queues on the same tmtx; more shards spread them out.
+ *
+ *    shard_bench [-n keys] [-l keylen] [-o ops] [-w write%] [-s shards] [-t threads]
+ *                [-m mutex|optimistic|rwlock|epoch]
+ */
+#include <time.h>
+#include <stdint.h>
+#include "thread_shard.h"
+
+static int n=1000000;                   // Keys in the map.
+static int keyLen=16;                   // Bytes per key.
+static int ops=200000;                  // Operations per thread.
+static int writePct=50;                 // Percentage of writes.
+static char* keys;                      // The keys, keyLen+1 bytes apart.
+static ShardedTree map;                 // The map under test.
+
+// Monotonic time in nanoseconds.
+static double nowNs (void)
+{
+  struct timespec ts;                   // The time.
+  if (clock_gettime(CLOCK_MONOTONIC,&ts)==-1)
+    errExit("clock_gettime");
+  return ts.tv_sec*1e9+ts.tv_nsec;      // In nanoseconds.
+}
+// Write key number i into buf: its decimal digits, padded to keyLen.
+static void makeKey (
+  char* buf,                            // keyLen+1 bytes.
+  int i)                                // Key number.
+{
+  int d=snprintf(buf,keyLen+1,"%d",i);  // The digits...
+  if (d<keyLen)                         // ...padded...
+    memset(buf+d,'x',keyLen-d);
+  buf[keyLen]='\0';                     // ...to keyLen.
+}
+// One thread's share of the operations.
+static void* worker (void* arg)
+{
+  uint64_t x=(uintptr_t)arg*0x9e3779b97f4a7c15ULL+1;// Generator state.
+  for (int i=0;i<ops;i++)
+  {
+    x^=x<<13;                           // Next random number.
+    x^=x>>7;
+    x^=x<<17;
+    char* k=keys+(size_t)(x%(uint64_t)n)*(keyLen+1);// A random key.
+    if ((int)((x>>32)%100)<writePct)    // Write?
+      ShardedInsert(&map,k,i);          // Yes, bump its value.
+    else                                // No, read it.
+    {
+      int v;                            // Value found.
+      ShardedLookup(&map,k,&v);
+    }
+  }
+  return NULL;
+}
+
+int main (
+  int argc,                             // The argument count.
+  char* argv[])                         // The argument vector.
+{
+  int maxShards=64;                     // Largest shard count.
+  int maxThreads=8;                     // Largest thread count.
+  TreeOptions opts={TREE_MODE_MUTEX,TREE_KIND_RB};// Every shard's options.
+  int opt;                              // Current option.
+  while ((opt=getopt(argc,argv,"n:l:o:w:s:t:m:"))!=-1)
+  {
+    switch (opt)
+    {
+      case 'n': n=getInt(optarg,GN_GT_0,"keys"); break;
+      case 'l': keyLen=getInt(optarg,GN_GT_0,"keylen"); break;
+      case 'o': ops=getInt(optarg,GN_GT_0,"ops"); break;
+      case 'w': writePct=getInt(optarg,GN_NONNEG,"write%"); break;
+      case 's': maxShards=getInt(optarg,GN_GT_0,"shards"); break;
+      case 't': maxThreads=getInt(optarg,GN_GT_0,"threads"); break;
+      case 'm':
+        if (strcmp(optarg,"mutex")==0) opts.mode=TREE_MODE_MUTEX;
+        else if (strcmp(optarg,"optimistic")==0) opts.mode=TREE_MODE_OPTIMISTIC;
+        else if (strcmp(optarg,"rwlock")==0) opts.mode=TREE_MODE_RWLOCK;
+        else if (strcmp(optarg,"epoch")==0) opts.mode=TREE_MODE_EPOCH;
+        else cmdLineErr("unknown mode %s\n",optarg);
+        break;
+      default:
+        usageErr("%s [-n keys] [-l keylen] [-o ops] [-w write%%] [-s shards] [-t threads]"
+          " [-m mutex|optimistic|rwlock|epoch]\n",argv[0]);
+    }
+  }
+  if (maxShards>SHARD_MAX)
+    cmdLineErr("at most %d shards\n",SHARD_MAX);
+  if (keyLen<10)                        // Room for any int's digits?
+    cmdLineErr("keys need at least 10 bytes\n");
+  keys=(char*) malloc((size_t)n*(keyLen+1));
+  pthread_t* tids=(pthread_t*) malloc(maxThreads*sizeof(pthread_t));
+  if (keys==NULL||tids==NULL)
+    errExit("malloc");
+  for (int i=0;i<n;i++)
+    makeKey(keys+(size_t)i*(keyLen+1),i);
+  printf("%d keys of %d bytes, %d ops per thread, %d%% writes (Mops/s)\n",n,keyLen,
+    ops,writePct);
+  printf("%-8s","shards");
+  for (int t=1;t<=maxThreads;t*=2)
+    printf(" %7d",t);
+  printf("  threads\n");
+  for (int s=1;s<=maxShards;s*=2)
+  {
+    ShardedInitialize(&map,s,&opts);    // s empty shards...
+    for (int i=0;i<n;i++)               // ...loaded with every key.
+      ShardedInsert(&map,keys+(size_t)i*(keyLen+1),i);
+    printf("%-8d",s);
+    for (int t=1;t<=maxThreads;t*=2)
+    {
+      double t0=nowNs();                // Start.
+      for (int i=0;i<t;i++)
+      {
+        int status=pthread_create(&tids[i],NULL,worker,(void*)(uintptr_t)(i+1));
+        if (status!=0)
+          errExitEN(status,"pthread_create");
+      }
+      for (int i=0;i<t;i++)
+      {
+        int status=pthread_join(tids[i],NULL);
+        if (status!=0)
+          errExitEN(status,"pthread_join");
+      }
+      printf(" %7.2f",(double)t*ops/(nowNs()-t0)*1e3);
+      fflush(stdout);
+    }
+    printf("\n");
+    ShardedDestroy(&map);
+  }
+  free(keys);
+  free(tids);
+  exit(EXIT_SUCCESS);
+}
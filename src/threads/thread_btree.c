@@ -0,0 +1,622 @@
+/**
+ * This file implements the B+tree declared in thread_btree.h. Inserts split
+ * full nodes on the way back up and deletes borrow from or merge with a
+ * sibling when a node drops below half full, so every node but the root is
+ * at least half full and all leaves are at the same depth. A search inside a
+ * node counts the prefixes below and not above the key's prefix (four at a
+ * time with AVX2 when the CPU has it, picked once by the first BTreeInit()),
+ * then settles ties among equal prefixes with strcmp().
+ */
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include "thread_btree.h"
+#include "tlpi_hdr.h"
+
+// Fewest keys a node other than the root may hold.
+#define BTREE_MIN (BTREE_ORDER/2)
+
+// The first 8 bytes of a key, big-endian and NUL padded, so that comparing
+// prefixes as unsigned integers orders keys the way strcmp() does.
+static uint64_t Prefix (const char* k)
+{                                       // ------------- Prefix ------------------
+  uint64_t p=0;                         // The prefix.
+  for (int i=0;i<8;i++)                 // Eight bytes...
+  {
+    p<<=8;                              // ...most significant first...
+    if (*k!='\0')                       // ...padded with NUL past the end.
+      p|=(unsigned char)*k++;           // This byte.
+  }                                     // Done with the bytes.
+  return p;                             // The prefix.
+}                                       // ------------- Prefix ------------------
+// Count the prefixes in pfx[0..n) below t (*lt) and not above t (*le).
+static void CountScalar (
+  const uint64_t* pfx,                  // The node's prefixes.
+  int n,                                // How many are in use.
+  uint64_t t,                           // The prefix searched for.
+  int* lt,                              // Out: prefixes below t.
+  int* le)                              // Out: prefixes not above t.
+{                                       // ------------- CountScalar -------------
+  int a=0,b=0;                          // Counts.
+  for (int i=0;i<n;i++)                 // Every prefix.
+  {
+    a+=pfx[i]<t;                        // Below?
+    b+=pfx[i]<=t;                       // Not above?
+  }                                     // Done counting.
+  *lt=a;                                // Below.
+  *le=b;                                // Not above.
+}                                       // ------------- CountScalar -------------
+#if defined(__x86_64__)
+// The same four prefixes at a time. AVX2 compares are signed, so both sides
+// get their sign bit flipped first.
+__attribute__((target("avx2")))
+static void CountAvx2 (
+  const uint64_t* pfx,                  // The node's prefixes.
+  int n,                                // How many are in use.
+  uint64_t t,                           // The prefix searched for.
+  int* lt,                              // Out: prefixes below t.
+  int* le)                              // Out: prefixes not above t.
+{                                       // ------------- CountAvx2 ---------------
+  const __m256i bias=_mm256_set1_epi64x((long long)0x8000000000000000ULL);
+  __m256i tv=_mm256_xor_si256(_mm256_set1_epi64x((long long)t),bias);
+  int a=0,b=0;                          // Counts.
+  for (int i=0;i<n;i+=4)                // Four lanes at a time.
+  {
+    __m256i v=_mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(pfx+i)),bias);
+    unsigned m=(n-i>=4)?0xf:(1u<<(n-i))-1;// Lanes holding keys.
+    unsigned below=(unsigned)_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(tv,v)));
+    unsigned above=(unsigned)_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(v,tv)));
+    a+=__builtin_popcount(below&m);     // Below t.
+    b+=__builtin_popcount(~above&m);    // Not above t.
+  }                                     // Done counting.
+  *lt=a;                                // Below.
+  *le=b;                                // Not above.
+}                                       // ------------- CountAvx2 ---------------
+#endif
+// The prefix counter for this CPU (picked once by PickCount()).
+static void (*Count)(const uint64_t*,int,uint64_t,int*,int*)=CountScalar;
+static pthread_once_t countOnce=PTHREAD_ONCE_INIT;// Guards PickCount().
+
+// Choose the prefix counter for this CPU. Runs once, before any tree is
+// searched, so no search ever sees Count change underneath it.
+static void PickCount (void)
+{                                       // ------------- PickCount ---------------
+#if defined(__x86_64__)
+  __builtin_cpu_init();                 // Find out what the CPU has.
+  if (__builtin_cpu_supports("avx2"))   // Four prefixes per compare?
+    Count=CountAvx2;                    // Yes, use it.
+#endif
+}                                       // ------------- PickCount ---------------
+
+// Position of the first key in p not below key: where key is, or would go.
+static int LowerBound (
+  const BTreeNode* p,                   // The node.
+  const char* key,                      // The key.
+  uint64_t t)                           // Its prefix.
+{                                       // ------------- LowerBound --------------
+  int lt,le;                            // Prefixes below and not above t.
+  Count(p->pfx,p->n,t,&lt,&le);         // Scan the prefixes.
+  while (lt<le&&strcmp(p->keys[lt],key)<0)// Ties: compare whole keys.
+    lt++;                               // Still below.
+  return lt;                            // The position.
+}                                       // ------------- LowerBound --------------
+// Child of inner node p that covers key: the number of separators not above it.
+static int ChildIndex (
+  const BTreeNode* p,                   // The inner node.
+  const char* key,                      // The key.
+  uint64_t t)                           // Its prefix.
+{                                       // ------------- ChildIndex --------------
+  int lt,le;                            // Prefixes below and not above t.
+  Count(p->pfx,p->n,t,&lt,&le);         // Scan the prefixes.
+  while (lt<le&&strcmp(p->keys[lt],key)<=0)// Ties: compare whole keys.
+    lt++;                               // Still not above.
+  return lt;                            // The child.
+}                                       // ------------- ChildIndex --------------
+// A function to allocate a zeroed node on a cache-line boundary.
+static BTreeNode* NewBNode (bool leaf)
+{                                       // ------------- NewBNode ----------------
+  size_t size=leaf?sizeof(BTreeLeaf):sizeof(BTreeInner);// What we need...
+  size=(size+63)&~(size_t)63;           // ...in whole cache lines.
+  BTreeNode* p=(BTreeNode*) aligned_alloc(64,size);// Line aligned.
+  if (p==NULL)                          // Did we fail to allocate memory?
+    errExit("aligned_alloc");           // Yes, print error and exit.
+  memset(p,0,size);                     // Empty.
+  p->leaf=leaf;                         // What it is.
+  return p;                             // The node.
+}                                       // ------------- NewBNode ----------------
+// A function to copy a key the tree will own.
+static char* CopyKey (const char* key)
+{                                       // ------------- CopyKey -----------------
+  char* k=strdup(key);                  // Our copy.
+  if (k==NULL)                          // Did we fail to allocate memory?
+    errExit("strdup");                  // Yes, print error and exit.
+  return k;                             // The copy.
+}                                       // ------------- CopyKey -----------------
+// Move n key slots of p from position from to position to (overlap is fine).
+static void MoveKeys (
+  BTreeNode* p,                         // The node.
+  int to,                               // Destination slot.
+  int from,                             // Source slot.
+  int n)                                // Slots to move.
+{                                       // ------------- MoveKeys ----------------
+  memmove(p->pfx+to,p->pfx+from,n*sizeof(p->pfx[0]));// The prefixes...
+  memmove(p->keys+to,p->keys+from,n*sizeof(p->keys[0]));// ...and the keys.
+}                                       // ------------- MoveKeys ----------------
+// A function to put key/value at position i of a leaf that has room.
+static void LeafPut (
+  BTreeLeaf* l,                         // The leaf.
+  int i,                                // Where.
+  char* k,                              // The key (owned).
+  uint64_t t,                           // Its prefix.
+  int value)                            // Its value.
+{                                       // ------------- LeafPut -----------------
+  MoveKeys(&l->h,i+1,i,l->h.n-i);       // Open a gap...
+  memmove(l->value+i+1,l->value+i,(l->h.n-i)*sizeof(int));
+  l->h.pfx[i]=t;                        // ...and fill it.
+  l->h.keys[i]=k;                       // The key.
+  l->value[i]=value;                    // The value.
+  l->h.n++;                             // One more.
+}                                       // ------------- LeafPut -----------------
+// Insert key into the subtree at p. If p had to split, *right is its new
+// right sibling and *sep (owned) the separator that goes in the parent.
+// Returns true if the key was new.
+static bool Insert (
+  BTreeNode* p,                         // The subtree.
+  const char* key,                      // The key.
+  uint64_t t,                           // Its prefix.
+  int value,                            // Its value.
+  char** sep,                           // Out: separator for the parent.
+  uint64_t* sepfx,                      // Out: its prefix.
+  BTreeNode** right)                    // Out: new right sibling, or NULL.
+{                                       // ------------- Insert ------------------
+  *right=NULL;                          // No split yet.
+  if (p->leaf)                          // At the bottom?
+  {
+    BTreeLeaf* l=(BTreeLeaf*)p;         // Yes, the leaf.
+    int i=LowerBound(p,key,t);          // Where it is or goes.
+    if (i<p->n&&strcmp(p->keys[i],key)==0)// Already there?
+    {
+      l->value[i]=value;                // Yes, new value.
+      return false;                     // Not new.
+    }                                   // Done updating.
+    if (p->n==BTREE_ORDER)              // Full?
+    {                                   // Yes, split it in half first.
+      BTreeLeaf* r=(BTreeLeaf*)NewBNode(true);// The right half.
+      int h=BTREE_ORDER/2;              // Keys staying on the left.
+      memcpy(r->h.pfx,p->pfx+h,(BTREE_ORDER-h)*sizeof(p->pfx[0]));
+      memcpy(r->h.keys,p->keys+h,(BTREE_ORDER-h)*sizeof(p->keys[0]));
+      memcpy(r->value,l->value+h,(BTREE_ORDER-h)*sizeof(int));
+      r->h.n=BTREE_ORDER-h;             // Right half...
+      p->n=h;                           // ...and left half.
+      r->next=l->next;                  // Link it in after l.
+      if (r->next!=NULL)                // Anybody after it?
+        r->next->prev=r;                // Yes, r comes before them now.
+      r->prev=l;                        // l comes before r...
+      l->next=r;                        // ...and r after l.
+      *right=&r->h;                     // The parent needs to know.
+      if (i>h)                          // Does the key go right?
+      {
+        l=r;                            // Yes, into r...
+        i-=h;                           // ...at this position.
+      }                                 // Done picking a half.
+    }                                   // Done splitting.
+    LeafPut(l,i,CopyKey(key),t,value);  // Put it in.
+    if (*right!=NULL)                   // Did we split?
+    {                                   // Yes, the right half's first key separates.
+      *sep=CopyKey((*right)->keys[0]);  // The parent's own copy.
+      *sepfx=(*right)->pfx[0];          // Its prefix.
+    }                                   // Done with the separator.
+    return true;                        // New key.
+  }                                     // Done with a leaf.
+  BTreeInner* q=(BTreeInner*)p;         // An inner node.
+  int i=ChildIndex(p,key,t);            // The child covering key.
+  char* csep=NULL;                      // The child's separator if it splits.
+  uint64_t cpfx=0;                      // Its prefix.
+  BTreeNode* cr=NULL;                   // The child's new sibling.
+  bool added=Insert(q->child[i],key,t,value,&csep,&cpfx,&cr);
+  if (cr==NULL)                         // Did the child split?
+    return added;                       // No, nothing to do here.
+  if (p->n<BTREE_ORDER)                 // Room for one more separator?
+  {                                     // Yes, csep at i, cr right of it.
+    MoveKeys(p,i+1,i,p->n-i);           // Open a gap for the key...
+    memmove(q->child+i+2,q->child+i+1,(p->n-i)*sizeof(q->child[0]));// ...and child.
+    p->pfx[i]=cpfx;                     // The separator...
+    p->keys[i]=csep;                    // ...goes in...
+    q->child[i+1]=cr;                   // ...with the new child.
+    p->n++;                             // One more.
+    return added;                       // No split here.
+  }                                     // Done with room to spare.
+  uint64_t pf[BTREE_ORDER+1];           // All separators, in order...
+  char* ks[BTREE_ORDER+1];              // ...with the new one...
+  BTreeNode* ch[BTREE_ORDER+2];         // ...and all children.
+  for (int j=0,s=0;j<=BTREE_ORDER;j++)  // Merge in the new separator.
+  {
+    if (j==i)                           // Its place?
+    {
+      pf[j]=cpfx;                       // Yes.
+      ks[j]=csep;                       // The separator.
+    }
+    else                                // No, the next old one.
+    {
+      pf[j]=p->pfx[s];                  // Its prefix.
+      ks[j]=p->keys[s++];               // The separator.
+    }
+  }                                     // Done with the separators.
+  for (int j=0,s=0;j<=BTREE_ORDER+1;j++)// Merge in the new child.
+    ch[j]=(j==i+1)?cr:q->child[s++];    // Right of its separator.
+  int h=(BTREE_ORDER+1)/2;              // Separators staying left; ks[h] moves up.
+  BTreeInner* r=(BTreeInner*)NewBNode(false);// The right half.
+  p->n=h;                               // Left keeps ks[0..h)...
+  memcpy(p->pfx,pf,h*sizeof(pf[0]));    // ...their prefixes...
+  memcpy(p->keys,ks,h*sizeof(ks[0]));   // ...keys...
+  memcpy(q->child,ch,(h+1)*sizeof(ch[0]));// ...and children.
+  r->h.n=BTREE_ORDER-h;                 // Right gets ks(h..ORDER]...
+  memcpy(r->h.pfx,pf+h+1,r->h.n*sizeof(pf[0]));// ...their prefixes...
+  memcpy(r->h.keys,ks+h+1,r->h.n*sizeof(ks[0]));// ...keys...
+  memcpy(r->child,ch+h+1,(r->h.n+1)*sizeof(ch[0]));// ...and children.
+  *sep=ks[h];                           // The middle one moves up as it is.
+  *sepfx=pf[h];                         // Its prefix.
+  *right=&r->h;                         // The parent needs to know.
+  return added;                         // New key or not.
+}                                       // ------------- Insert ------------------
+// Child i of q is short of keys and its left sibling can spare one.
+static void BorrowLeft (
+  BTreeInner* q,                        // The parent.
+  int i)                                // The short child.
+{                                       // ------------- BorrowLeft --------------
+  BTreeNode* c=q->child[i];             // The short child.
+  BTreeNode* l=q->child[i-1];           // Its left sibling.
+  MoveKeys(c,1,0,c->n);                 // Room at the front.
+  if (c->leaf)                          // Leaves?
+  {                                     // Yes, move l's last pair over.
+    BTreeLeaf* cl=(BTreeLeaf*)c;        // The short leaf.
+    memmove(cl->value+1,cl->value,c->n*sizeof(int));
+    c->pfx[0]=l->pfx[l->n-1];           // Its prefix...
+    c->keys[0]=l->keys[l->n-1];         // ...key...
+    cl->value[0]=((BTreeLeaf*)l)->value[l->n-1];// ...and value.
+    free(q->h.keys[i-1]);               // The separator is now c's first key.
+    q->h.keys[i-1]=CopyKey(c->keys[0]); // The parent's own copy.
+    q->h.pfx[i-1]=c->pfx[0];            // Its prefix.
+  }                                     // Done with leaves.
+  else                                  // No, rotate through the parent.
+  {
+    BTreeInner* ci=(BTreeInner*)c;      // The short inner node.
+    memmove(ci->child+1,ci->child,(c->n+1)*sizeof(ci->child[0]));
+    c->pfx[0]=q->h.pfx[i-1];            // The separator comes down...
+    c->keys[0]=q->h.keys[i-1];          // ...in front...
+    ci->child[0]=((BTreeInner*)l)->child[l->n];// ...with l's last child.
+    q->h.pfx[i-1]=l->pfx[l->n-1];       // l's last key...
+    q->h.keys[i-1]=l->keys[l->n-1];     // ...goes up.
+  }                                     // Done with inner nodes.
+  l->n--;                               // One less on the left...
+  c->n++;                               // ...one more here.
+}                                       // ------------- BorrowLeft --------------
+// Child i of q is short of keys and its right sibling can spare one.
+static void BorrowRight (
+  BTreeInner* q,                        // The parent.
+  int i)                                // The short child.
+{                                       // ------------- BorrowRight -------------
+  BTreeNode* c=q->child[i];             // The short child.
+  BTreeNode* r=q->child[i+1];           // Its right sibling.
+  if (c->leaf)                          // Leaves?
+  {                                     // Yes, move r's first pair over.
+    BTreeLeaf* rl=(BTreeLeaf*)r;        // The right leaf.
+    c->pfx[c->n]=r->pfx[0];             // Its prefix...
+    c->keys[c->n]=r->keys[0];           // ...key...
+    ((BTreeLeaf*)c)->value[c->n]=rl->value[0];// ...and value.
+    MoveKeys(r,0,1,r->n-1);             // Close the gap in r.
+    memmove(rl->value,rl->value+1,(r->n-1)*sizeof(int));
+    free(q->h.keys[i]);                 // The separator is now r's first key.
+    q->h.keys[i]=CopyKey(r->keys[0]);   // The parent's own copy.
+    q->h.pfx[i]=r->pfx[0];              // Its prefix.
+  }                                     // Done with leaves.
+  else                                  // No, rotate through the parent.
+  {
+    BTreeInner* ri=(BTreeInner*)r;      // The right inner node.
+    c->pfx[c->n]=q->h.pfx[i];           // The separator comes down...
+    c->keys[c->n]=q->h.keys[i];         // ...at the end...
+    ((BTreeInner*)c)->child[c->n+1]=ri->child[0];// ...with r's first child.
+    q->h.pfx[i]=r->pfx[0];              // r's first key...
+    q->h.keys[i]=r->keys[0];            // ...goes up.
+    MoveKeys(r,0,1,r->n-1);             // Close the gaps in r.
+    memmove(ri->child,ri->child+1,r->n*sizeof(ri->child[0]));
+  }                                     // Done with inner nodes.
+  r->n--;                               // One less on the right...
+  c->n++;                               // ...one more here.
+}                                       // ------------- BorrowRight -------------
+// Merge child i+1 of q into child i; neither could spare a key.
+static void Merge (
+  BTreeInner* q,                        // The parent.
+  int i)                                // The left child of the pair.
+{                                       // ------------- Merge -------------------
+  BTreeNode* l=q->child[i];             // The left one stays...
+  BTreeNode* r=q->child[i+1];           // ...the right one goes.
+  if (l->leaf)                          // Leaves?
+  {                                     // Yes, append r's pairs.
+    BTreeLeaf* ll=(BTreeLeaf*)l;        // The left leaf.
+    BTreeLeaf* rl=(BTreeLeaf*)r;        // The right leaf.
+    memcpy(ll->value+l->n,rl->value,r->n*sizeof(int));
+    ll->next=rl->next;                  // Unlink r...
+    if (ll->next!=NULL)                 // ...from its neighbour...
+      ll->next->prev=ll;                // ...too.
+    free(q->h.keys[i]);                 // The separator goes away.
+  }                                     // Done with leaves.
+  else                                  // No, the separator comes down between.
+  {
+    BTreeInner* li=(BTreeInner*)l;      // The left inner node.
+    l->pfx[l->n]=q->h.pfx[i];           // Its prefix...
+    l->keys[l->n]=q->h.keys[i];         // ...and key.
+    l->n++;                             // One more.
+    memcpy(li->child+l->n,((BTreeInner*)r)->child,(r->n+1)*sizeof(li->child[0]));
+  }                                     // Done with inner nodes.
+  memcpy(l->pfx+l->n,r->pfx,r->n*sizeof(r->pfx[0]));// r's prefixes...
+  memcpy(l->keys+l->n,r->keys,r->n*sizeof(r->keys[0]));// ...and keys.
+  l->n+=r->n;                           // All of them.
+  MoveKeys(&q->h,i,i+1,q->h.n-i-1);     // Drop the separator...
+  memmove(q->child+i+1,q->child+i+2,(q->h.n-i-1)*sizeof(q->child[0]));// ...and r.
+  q->h.n--;                             // One less.
+  free(r);                              // r is empty now.
+}                                       // ------------- Merge -------------------
+// Delete key from the subtree at p, fixing up any child that drops below
+// BTREE_MIN; p itself is left to its parent. True if the key was there.
+static bool Delete (
+  BTreeNode* p,                         // The subtree.
+  const char* key,                      // The key.
+  uint64_t t)                           // Its prefix.
+{                                       // ------------- Delete ------------------
+  if (p->leaf)                          // At the bottom?
+  {
+    BTreeLeaf* l=(BTreeLeaf*)p;         // Yes, the leaf.
+    int i=LowerBound(p,key,t);          // Where it would be.
+    if (i==p->n||strcmp(p->keys[i],key)!=0)// Not there?
+      return false;                     // Nothing to delete.
+    free(p->keys[i]);                   // Our copy of the key.
+    MoveKeys(p,i,i+1,p->n-i-1);         // Close the gap.
+    memmove(l->value+i,l->value+i+1,(p->n-i-1)*sizeof(int));
+    p->n--;                             // One less.
+    return true;                        // Deleted.
+  }                                     // Done with a leaf.
+  BTreeInner* q=(BTreeInner*)p;         // An inner node.
+  int i=ChildIndex(p,key,t);            // The child covering key.
+  if (!Delete(q->child[i],key,t))       // Was it there?
+    return false;                       // No.
+  if (q->child[i]->n<BTREE_MIN)         // Did the child run short?
+  {                                     // Yes, a sibling helps out.
+    BTreeNode* l=(i>0)?q->child[i-1]:NULL;// Left sibling, if any.
+    BTreeNode* r=(i<p->n)?q->child[i+1]:NULL;// Right sibling, if any.
+    if (l!=NULL&&l->n>BTREE_MIN)        // Can the left one spare a key?
+      BorrowLeft(q,i);                  // Yes, take it.
+    else if (r!=NULL&&r->n>BTREE_MIN)   // Can the right one?
+      BorrowRight(q,i);                 // Yes, take it.
+    else if (l!=NULL)                   // No, merge with the left one...
+      Merge(q,i-1);                     // ...into it.
+    else                                // Or the right one...
+      Merge(q,i);                       // ...into us.
+  }                                     // Done fixing the child.
+  return true;                          // Deleted.
+}                                       // ------------- Delete ------------------
+// A function to free a subtree with its keys.
+static void FreeSubtree (BTreeNode* p)
+{                                       // ------------- FreeSubtree -------------
+  if (!p->leaf)                         // Children to free first?
+    for (int i=0;i<=p->n;i++)           // Yes, every one.
+      FreeSubtree(((BTreeInner*)p)->child[i]);
+  for (int i=0;i<p->n;i++)              // Every key.
+    free(p->keys[i]);                   // Our copy.
+  free(p);                              // The node.
+}                                       // ------------- FreeSubtree -------------
+// Leaf covering key (the tree is not empty).
+static const BTreeNode* FindLeaf (
+  const BTree* bt,                      // The tree.
+  const char* key,                      // The key.
+  uint64_t t)                           // Its prefix.
+{                                       // ------------- FindLeaf ----------------
+  const BTreeNode* p=bt->root;          // Start at the root.
+  while (!p->leaf)                      // Down to the leaf...
+    p=((const BTreeInner*)p)->child[ChildIndex(p,key,t)];// ...covering key.
+  return p;                             // The leaf.
+}                                       // ------------- FindLeaf ----------------
+
+// A function to initialize an empty B+tree.
+void BTreeInit (BTree* bt)
+{                                       // ------------- BTreeInit ---------------
+  bt->root=NULL;                        // Empty.
+  bt->head=NULL;                        // No leaves.
+  int s=pthread_once(&countOnce,PickCount);// Counter chosen yet?
+  if (s!=0)                             // Error?
+    errExitEN(s,"pthread_once");        // Yes, so exit with error.
+}                                       // ------------- BTreeInit ---------------
+// A function to free every node and key of a B+tree.
+void BTreeDestroy (BTree* bt)
+{                                       // ------------- BTreeDestroy ------------
+  if (bt->root!=NULL)                   // Anything in it?
+    FreeSubtree(bt->root);              // Yes, free it all.
+  bt->root=NULL;                        // Empty.
+  bt->head=NULL;                        // No leaves.
+}                                       // ------------- BTreeDestroy ------------
+// A function to insert or update key; true if the key was new.
+bool BTreeInsert (
+  BTree* bt,                            // The tree.
+  const char* key,                      // The key (copied).
+  int value)                            // Its value.
+{                                       // ------------- BTreeInsert -------------
+  if (bt->root==NULL)                   // First key?
+  {
+    bt->root=NewBNode(true);            // Yes, the root is a leaf...
+    bt->head=(BTreeLeaf*)bt->root;      // ...and the only one.
+  }                                     // Done with an empty tree.
+  char* sep=NULL;                       // Separator if the root splits.
+  uint64_t sepfx=0;                     // Its prefix.
+  BTreeNode* right=NULL;                // The root's new sibling.
+  bool added=Insert(bt->root,key,Prefix(key),value,&sep,&sepfx,&right);
+  if (right!=NULL)                      // Did the root split?
+  {                                     // Yes, grow a level.
+    BTreeInner* r=(BTreeInner*)NewBNode(false);// The new root.
+    r->h.n=1;                           // One separator...
+    r->h.pfx[0]=sepfx;                  // ...its prefix...
+    r->h.keys[0]=sep;                   // ...and key...
+    r->child[0]=bt->root;               // ...between the old root...
+    r->child[1]=right;                  // ...and its sibling.
+    bt->root=&r->h;                     // The new root.
+  }                                     // Done growing.
+  return added;                         // New key or not.
+}                                       // ------------- BTreeInsert -------------
+// A function to delete key; true if it was there.
+bool BTreeDelete (
+  BTree* bt,                            // The tree.
+  const char* key)                      // The key.
+{                                       // ------------- BTreeDelete -------------
+  if (bt->root==NULL)                   // Empty tree?
+    return false;                       // Nothing to delete.
+  if (!Delete(bt->root,key,Prefix(key)))// Was it there?
+    return false;                       // No.
+  BTreeNode* p=bt->root;                // The root may have emptied.
+  if (!p->leaf&&p->n==0)                // Inner root with one child left?
+  {
+    bt->root=((BTreeInner*)p)->child[0];// Yes, that child is the root now.
+    free(p);                            // Shrink a level.
+  }                                     // Done shrinking.
+  else if (p->leaf&&p->n==0)            // Last key gone?
+  {
+    free(p);                            // Yes, the tree is empty.
+    bt->root=NULL;                      // No root...
+    bt->head=NULL;                      // ...and no leaves.
+  }                                     // Done emptying.
+  return true;                          // Deleted.
+}                                       // ------------- BTreeDelete -------------
+// A function to look up key.
+bool BTreeLookup (
+  const BTree* bt,                      // The tree.
+  const char* key,                      // The key.
+  int* value)                           // Out: its value.
+{                                       // ------------- BTreeLookup -------------
+  if (bt->root==NULL)                   // Empty tree?
+    return false;                       // Not found.
+  uint64_t t=Prefix(key);               // Computed once for every level.
+  const BTreeNode* p=FindLeaf(bt,key,t);// The leaf covering key.
+  int i=LowerBound(p,key,t);            // Where it would be.
+  if (i==p->n||strcmp(p->keys[i],key)!=0)// Not there?
+    return false;                       // Not found.
+  *value=((const BTreeLeaf*)p)->value[i];// Its value.
+  return true;                          // Found.
+}                                       // ------------- BTreeLookup -------------
+// A function to find the first key not below key (strict: above key). On
+// success *leaf/*pos is where it sits; walk on through leaf->next.
+bool BTreeCeiling (
+  const BTree* bt,                      // The tree.
+  const char* key,                      // The key.
+  bool strict,                          // Skip key itself?
+  const BTreeLeaf** leaf,               // Out: the leaf holding it.
+  int* pos)                             // Out: its position there.
+{                                       // ------------- BTreeCeiling ------------
+  if (bt->root==NULL)                   // Empty tree?
+    return false;                       // Nothing above anything.
+  uint64_t t=Prefix(key);               // The key's prefix.
+  const BTreeNode* p=FindLeaf(bt,key,t);// Where key would be.
+  int i=LowerBound(p,key,t);            // First one not below it.
+  if (strict&&i<p->n&&strcmp(p->keys[i],key)==0)// The key itself, and unwanted?
+    i++;                                // Yes, the one after.
+  if (i==p->n)                          // Past this leaf?
+  {
+    p=(const BTreeNode*)((const BTreeLeaf*)p)->next;// Yes, the next one...
+    i=0;                                // ...from its start.
+  }                                     // Done moving on.
+  if (p==NULL)                          // Past the last leaf?
+    return false;                       // Nothing there.
+  *leaf=(const BTreeLeaf*)p;            // The leaf...
+  *pos=i;                               // ...and position.
+  return true;                          // Found.
+}                                       // ------------- BTreeCeiling ------------
+// A function to find the last key not above key; walk back through leaf->prev.
+bool BTreeFloor (
+  const BTree* bt,                      // The tree.
+  const char* key,                      // The key.
+  const BTreeLeaf** leaf,               // Out: the leaf holding it.
+  int* pos)                             // Out: its position there.
+{                                       // ------------- BTreeFloor --------------
+  if (bt->root==NULL)                   // Empty tree?
+    return false;                       // Nothing below anything.
+  uint64_t t=Prefix(key);               // The key's prefix.
+  const BTreeNode* p=FindLeaf(bt,key,t);// Where key would be.
+  int i=LowerBound(p,key,t);            // First one not below it.
+  if (i==p->n||strcmp(p->keys[i],key)!=0)// Not the key itself?
+    i--;                                // No, the one before.
+  if (i<0)                              // Before this leaf?
+  {
+    p=(const BTreeNode*)((const BTreeLeaf*)p)->prev;// Yes, the previous one...
+    i=(p!=NULL)?p->n-1:0;               // ...from its end.
+  }                                     // Done moving back.
+  if (p==NULL)                          // Before the first leaf?
+    return false;                       // Nothing there.
+  *leaf=(const BTreeLeaf*)p;            // The leaf...
+  *pos=i;                               // ...and position.
+  return true;                          // Found.
+}                                       // ------------- BTreeFloor --------------
+// A function to build an empty tree from n pairs in strictly increasing key
+// order without a single split: the pairs are spread evenly over just enough
+// leaves, then each level of inner nodes evenly over the one below, until one
+// node is left. Spreading evenly keeps every node but the root at least half
+// full; the separator in front of a child is a copy of its smallest key.
+void BTreeBulkLoad (
+  BTree* bt,                            // The (empty) tree.
+  const BTreePair* pairs,               // The pairs (keys copied).
+  size_t n)                             // How many.
+{                                       // ------------- BTreeBulkLoad -----------
+  if (n==0)                             // Nothing to load?
+    return;                             // Then the tree stays empty.
+  size_t c=(n+BTREE_ORDER-1)/BTREE_ORDER;// Leaves needed.
+  BTreeNode** lv=(BTreeNode**) malloc(c*sizeof(BTreeNode*));// The level just built.
+  const char** lo=(const char**) malloc(c*sizeof(char*));// Smallest key under each.
+  if (lv==NULL||lo==NULL)               // Did we fail to allocate memory?
+    errExit("malloc");                  // Yes, print error and exit.
+  BTreeLeaf* prev=NULL;                 // Leaf filled before this one.
+  for (size_t j=0,at=0;j<c;j++)         // Fill the leaves left to right.
+  {
+    int m=(int)((n-at)/(c-j));          // Its share of the pairs left.
+    BTreeLeaf* l=(BTreeLeaf*)NewBNode(true);// The leaf.
+    for (int i=0;i<m;i++,at++)          // Copy its pairs.
+    {
+      l->h.pfx[i]=Prefix(pairs[at].key);// The prefix...
+      l->h.keys[i]=CopyKey(pairs[at].key);// ...key...
+      l->value[i]=pairs[at].value;      // ...and value.
+    }                                   // Done with its pairs.
+    l->h.n=m;                           // Its keys.
+    l->prev=prev;                       // Link it after the last one.
+    if (prev!=NULL)                     // Is there a last one?
+      prev->next=l;                     // Yes, l follows it.
+    else                                // No, l is the first leaf.
+      bt->head=l;                       // Ordered walks start here.
+    prev=l;                             // Next one goes after l.
+    lv[j]=&l->h;                        // On the bottom level...
+    lo[j]=l->h.keys[0];                 // ...starting at its first key.
+  }                                     // Done with the leaves.
+  while (c>1)                           // Until one node covers everything...
+  {                                     // ...build a level over this one.
+    size_t g=(c+BTREE_ORDER)/(BTREE_ORDER+1);// Parents needed.
+    for (size_t j=0,at=0;j<g;j++)       // Fill them left to right.
+    {
+      int m=(int)((c-at)/(g-j));        // Its share of the children left.
+      BTreeInner* q=(BTreeInner*)NewBNode(false);// The parent.
+      for (int i=0;i<m;i++)             // Hang its children.
+      {
+        q->child[i]=lv[at+i];           // The child.
+        if (i>0)                        // Anything to its left?
+        {                               // Yes, its smallest key separates them.
+          q->h.pfx[i-1]=Prefix(lo[at+i]);// The prefix...
+          q->h.keys[i-1]=CopyKey(lo[at+i]);// ...and our own copy.
+        }                               // Done with the separator.
+      }                                 // Done with its children.
+      q->h.n=m-1;                       // One separator fewer than children.
+      lv[j]=&q->h;                      // On the next level up (j<=at, already read)...
+      lo[j]=lo[at];                     // ...starting at its first child's key.
+      at+=m;                            // Next parent's children.
+    }                                   // Done with the level.
+    c=g;                                // Its width.
+  }                                     // Done building.
+  bt->root=lv[0];                       // The last node built.
+  free(lv);                             // Done with the levels...
+  free(lo);                             // ...and their keys.
+}                                       // ------------- BTreeBulkLoad -----------
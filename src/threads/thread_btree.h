@@ -0,0 +1,76 @@
+/**
+ * This interface file defines a B+tree of string keys and int values, the
+ * cache-conscious alternative to the red-black tree behind the thread_tree
+ * API (TREE_KIND_BPLUS in TreeOptions). Every node holds up to BTREE_ORDER
+ * keys. The node starts with the keys' 8-byte prefixes (big-endian, so they
+ * compare as integers the way the strings compare), which fill its first two
+ * cache lines; a search scans those with SIMD compares where the CPU has
+ * them, and only touches the full key strings when prefixes tie. Nodes are
+ * allocated on cache-line boundaries, inner nodes hold no values, and leaves
+ * are linked both ways so ordered walks never climb back up the tree. The
+ * tree copies the keys it stores. There is no locking in here: thread_tree.c
+ * calls it with the tree's lock held.
+ */
+#ifndef THREAD_BTREE_H
+#define THREAD_BTREE_H
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Keys per node (a multiple of 4 so the SIMD scan never reads past the array).
+#define BTREE_ORDER 16
+
+// What inner nodes and leaves have in common. Search only reads pfx until
+// prefixes tie.
+typedef struct BTreeNode
+{
+    uint64_t pfx[BTREE_ORDER];          // Big-endian first 8 bytes of each key.
+    char* keys[BTREE_ORDER];            // The keys (owned copies).
+    int n;                              // Keys in use.
+    int leaf;                           // Leaf (1) or inner node (0).
+} BTreeNode;                            // BTreeNode structure.
+// An inner node: child[i] holds the keys from keys[i-1] up to keys[i].
+typedef struct BTreeInner
+{
+    BTreeNode h;                        // Keys (separators).
+    BTreeNode* child[BTREE_ORDER+1];    // Subtrees.
+} BTreeInner;                           // BTreeInner structure.
+// A leaf: the key/value pairs, and its neighbours in key order.
+typedef struct BTreeLeaf
+{
+    BTreeNode h;                        // Keys.
+    int value[BTREE_ORDER];             // Their values.
+    struct BTreeLeaf* next;             // Leaf with the next larger keys.
+    struct BTreeLeaf* prev;             // Leaf with the next smaller keys.
+} BTreeLeaf;                            // BTreeLeaf structure.
+// The tree.
+typedef struct BTree
+{
+    BTreeNode* root;                    // Root node, NULL when empty.
+    BTreeLeaf* head;                    // Leaf with the smallest keys.
+} BTree;                                // BTree structure.
+// A key/value pair for loading a tree in one go.
+typedef struct BTreePair
+{
+    char* key;                          // The key.
+    int value;                          // Its value.
+} BTreePair;                            // BTreePair structure.
+
+// A function to initialize an empty B+tree.
+void BTreeInit(BTree* bt);
+// A function to free every node and key of a B+tree.
+void BTreeDestroy(BTree* bt);
+// A function to insert or update key; true if the key was new.
+bool BTreeInsert(BTree* bt,const char* key,int value);
+// A function to delete key; true if it was there.
+bool BTreeDelete(BTree* bt,const char* key);
+// A function to look up key.
+bool BTreeLookup(const BTree* bt,const char* key,int* value);
+// A function to find the first key not below key (strict: above key).
+bool BTreeCeiling(const BTree* bt,const char* key,bool strict,const BTreeLeaf** leaf,int* pos);
+// A function to find the last key not above key.
+bool BTreeFloor(const BTree* bt,const char* key,const BTreeLeaf** leaf,int* pos);
+// A function to build an empty tree from n pairs in strictly increasing key order.
+void BTreeBulkLoad(BTree* bt,const BTreePair* pairs,size_t n);
+
+#endif
@@ -0,0 +1,337 @@
+/**
+ * This interface file generates red-black trees over any key and value type, for
+ * keys that are not strings. thread_tree.h stores char* keys and calls strcmp() at
+ * every step down the tree, so an integer key has to be printed to a string and
+ * compared byte by byte; a tree generated here stores the key itself and compares
+ * with CMP, a macro expanded inline, so a 64-bit key compares in one instruction.
+ *
+ *    TREE_DEFINE(U64Tree,uint64_t,int,TREE_CMP_NUM)
+ *
+ * defines the types U64Tree and U64TreeNode and the functions
+ *
+ *    void U64TreeInit(U64Tree* t);
+ *    void U64TreeDestroy(U64Tree* t);
+ *    bool U64TreeInsert(U64Tree* t,uint64_t key,int value);  (true: key was new)
+ *    bool U64TreeDelete(U64Tree* t,uint64_t key);            (true: key was there)
+ *    bool U64TreeLookup(U64Tree* t,uint64_t key,int* value);
+ *
+ * all static inline, so each translation unit gets its own copy and the compiler
+ * sees the comparison. CMP(a,b) must return <0, 0 or >0 like strcmp(); keys and
+ * values are copied by assignment, so fixed-width keys can be structs compared by
+ * a CMP of their own. Each tree has one mutex around every operation, like
+ * TREE_MODE_MUTEX; the algorithms are the ones thread_tree.c uses.
+ */
+#ifndef THREAD_GTREE_H
+#define THREAD_GTREE_H
+#include "thread_tree.h"
+
+// Three-way compare of numbers (integers, pointers, floats without NaNs).
+#define TREE_CMP_NUM(a,b) (((a)>(b))-((a)<(b)))
+// Three-way compare of strings.
+#define TREE_CMP_STR(a,b) strcmp((a),(b))
+
+// Define tree type P with keys of type K, values of type V and comparison CMP.
+#define TREE_DEFINE(P,K,V,CMP)                                                              \
+typedef struct P##Node                                                                      \
+{                                                                                           \
+  K key;                                /* The key. */                                      \
+  V value;                              /* Its value. */                                    \
+  NodeColor color;                      /* Red or black. */                                 \
+  struct P##Node* left;                 /* Smaller keys. */                                 \
+  struct P##Node* right;                /* Larger keys. */                                  \
+  struct P##Node* parent;               /* NULL at the root. */                             \
+} P##Node;                                                                                  \
+typedef struct P                                                                            \
+{                                                                                           \
+  P##Node* root;                        /* Root, NULL when empty. */                        \
+  pthread_mutex_t tmtx;                 /* Protects the whole tree. */                      \
+  long size;                            /* Keys in the tree. */                             \
+} P;                                                                                        \
+static inline void P##Init (P* t)                                                           \
+{                                                                                           \
+  t->root=NULL;                         /* Empty. */                                        \
+  t->size=0;                            /* No keys. */                                      \
+  int status=pthread_mutex_init(&t->tmtx,NULL);                                             \
+  if (status!=0)                        /* Did we fail to initialize the mutex? */          \
+    errExitEN(status,"pthread_mutex_init");                                                 \
+}                                                                                           \
+static inline void P##Free (P##Node* p)                                                     \
+{                                                                                           \
+  while (p!=NULL)                       /* Recurse left, loop right. */                     \
+  {                                                                                         \
+    P##Node* r=p->right;                /* Still to free. */                                \
+    P##Free(p->left);                   /* Everything smaller. */                           \
+    free(p);                            /* This one. */                                     \
+    p=r;                                /* Everything larger. */                            \
+  }                                                                                         \
+}                                                                                           \
+static inline void P##Destroy (P* t)                                                        \
+{                                                                                           \
+  P##Free(t->root);                     /* Every node. */                                   \
+  t->root=NULL;                         /* Empty. */                                        \
+  t->size=0;                            /* No keys. */                                      \
+  int status=pthread_mutex_destroy(&t->tmtx);                                               \
+  if (status!=0)                        /* Did we fail to destroy the mutex? */             \
+    errExitEN(status,"pthread_mutex_destroy");                                              \
+}                                                                                           \
+static inline void P##Lock (P* t)                                                           \
+{                                                                                           \
+  int status=pthread_mutex_lock(&t->tmtx);                                                  \
+  if (status!=0)                        /* Did we fail to lock the mutex? */                \
+    errExitEN(status,"pthread_mutex_lock");                                                 \
+}                                                                                           \
+static inline void P##Unlock (P* t)                                                         \
+{                                                                                           \
+  int status=pthread_mutex_unlock(&t->tmtx);                                                \
+  if (status!=0)                        /* Did we fail to unlock the mutex? */              \
+    errExitEN(status,"pthread_mutex_unlock");                                               \
+}                                                                                           \
+static inline void P##Replace (P* t,P##Node* p,P##Node* q)                                  \
+{                                                                                           \
+  if (p->parent==NULL)                  /* p was the root? */                               \
+    t->root=q;                          /* Then q is. */                                    \
+  else if (p==p->parent->left)          /* A left child? */                                 \
+    p->parent->left=q;                  /* q takes its place. */                            \
+  else                                  /* A right child. */                                \
+    p->parent->right=q;                 /* q takes its place. */                            \
+  if (q!=NULL)                          /* Anything moved up? */                            \
+    q->parent=p->parent;                /* It hangs where p did. */                         \
+}                                                                                           \
+static inline void P##RotateLeft (P* t,P##Node* p)                                          \
+{                                                                                           \
+  P##Node* q=p->right;                  /* Comes up. */                                     \
+  p->right=q->left;                     /* Its left subtree moves over. */                  \
+  if (q->left!=NULL)                                                                        \
+    q->left->parent=p;                                                                      \
+  P##Replace(t,p,q);                    /* q where p was... */                              \
+  q->left=p;                            /* ...with p on its left. */                        \
+  p->parent=q;                                                                              \
+}                                                                                           \
+static inline void P##RotateRight (P* t,P##Node* p)                                         \
+{                                                                                           \
+  P##Node* q=p->left;                   /* Comes up. */                                     \
+  p->left=q->right;                     /* Its right subtree moves over. */                 \
+  if (q->right!=NULL)                                                                       \
+    q->right->parent=p;                                                                     \
+  P##Replace(t,p,q);                    /* q where p was... */                              \
+  q->right=p;                           /* ...with p on its right. */                       \
+  p->parent=q;                                                                              \
+}                                                                                           \
+static inline void P##FixInsert (P* t,P##Node* p)                                           \
+{                                                                                           \
+  while (p->parent!=NULL&&p->parent->color==RED)/* Red under red? */                        \
+  {                                                                                         \
+    P##Node* g=p->parent->parent;       /* A red parent is never the root. */               \
+    bool left=(p->parent==g->left);     /* Which side the parent is on. */                  \
+    P##Node* u=left?g->right:g->left;   /* The uncle. */                                    \
+    if (u!=NULL&&u->color==RED)         /* Red uncle: recolor and move up. */               \
+    {                                                                                       \
+      p->parent->color=BLACK;                                                               \
+      u->color=BLACK;                                                                       \
+      g->color=RED;                                                                         \
+      p=g;                                                                                  \
+      continue;                                                                             \
+    }                                                                                       \
+    if (left&&p==p->parent->right)      /* Inner grandchild: make it outer. */              \
+    {                                                                                       \
+      p=p->parent;                                                                          \
+      P##RotateLeft(t,p);                                                                   \
+    }                                                                                       \
+    else if (!left&&p==p->parent->left)                                                     \
+    {                                                                                       \
+      p=p->parent;                                                                          \
+      P##RotateRight(t,p);                                                                  \
+    }                                                                                       \
+    p->parent->color=BLACK;             /* Outer grandchild: rotate g away. */              \
+    g->color=RED;                                                                           \
+    if (left)                                                                               \
+      P##RotateRight(t,g);                                                                  \
+    else                                                                                    \
+      P##RotateLeft(t,g);                                                                   \
+  }                                                                                         \
+  t->root->color=BLACK;                 /* The root is always black. */                     \
+}                                                                                           \
+static inline void P##FixDelete (P* t,P##Node* p,P##Node* pp)                               \
+{                                                                                           \
+  while (p!=t->root&&(p==NULL||p->color==BLACK))/* p is short a black. */                   \
+  {                                                                                         \
+    if (p==pp->left)                    /* Left side. */                                    \
+    {                                                                                       \
+      P##Node* s=pp->right;             /* The sibling (never NULL here). */                \
+      if (s->color==RED)                /* Red sibling: make it black. */                   \
+      {                                                                                     \
+        s->color=BLACK;                                                                     \
+        pp->color=RED;                                                                      \
+        P##RotateLeft(t,pp);                                                                \
+        s=pp->right;                                                                        \
+      }                                                                                     \
+      if ((s->left==NULL||s->left->color==BLACK)&&(s->right==NULL||s->right->color==BLACK)) \
+      {                                                                                     \
+        s->color=RED;                   /* Both nephews black: push it up. */               \
+        p=pp;                                                                               \
+        pp=p->parent;                                                                       \
+        continue;                                                                           \
+      }                                                                                     \
+      if (s->right==NULL||s->right->color==BLACK)/* Near nephew red: make it far. */        \
+      {                                                                                     \
+        s->left->color=BLACK;                                                               \
+        s->color=RED;                                                                       \
+        P##RotateRight(t,s);                                                                \
+        s=pp->right;                                                                        \
+      }                                                                                     \
+      s->color=pp->color;               /* Far nephew red: rotate and stop. */              \
+      pp->color=BLACK;                                                                      \
+      s->right->color=BLACK;                                                                \
+      P##RotateLeft(t,pp);                                                                  \
+      p=t->root;                                                                            \
+    }                                                                                       \
+    else                                /* Mirror image. */                                 \
+    {                                                                                       \
+      P##Node* s=pp->left;                                                                  \
+      if (s->color==RED)                                                                    \
+      {                                                                                     \
+        s->color=BLACK;                                                                     \
+        pp->color=RED;                                                                      \
+        P##RotateRight(t,pp);                                                               \
+        s=pp->left;                                                                         \
+      }                                                                                     \
+      if ((s->left==NULL||s->left->color==BLACK)&&(s->right==NULL||s->right->color==BLACK)) \
+      {                                                                                     \
+        s->color=RED;                                                                       \
+        p=pp;                                                                               \
+        pp=p->parent;                                                                       \
+        continue;                                                                           \
+      }                                                                                     \
+      if (s->left==NULL||s->left->color==BLACK)                                             \
+      {                                                                                     \
+        s->right->color=BLACK;                                                              \
+        s->color=RED;                                                                       \
+        P##RotateLeft(t,s);                                                                 \
+        s=pp->left;                                                                         \
+      }                                                                                     \
+      s->color=pp->color;                                                                   \
+      pp->color=BLACK;                                                                      \
+      s->left->color=BLACK;                                                                 \
+      P##RotateRight(t,pp);                                                                 \
+      p=t->root;                                                                            \
+    }                                                                                       \
+  }                                                                                         \
+  if (p!=NULL)                                                                              \
+    p->color=BLACK;                                                                         \
+}                                                                                           \
+static inline P##Node* P##Find (P* t,K key,P##Node** parent,int* dir)                       \
+{                                                                                           \
+  P##Node* p=t->root;                   /* Start at the root. */                            \
+  P##Node* o=NULL;                      /* No parent yet. */                                \
+  int c=0;                              /* Last comparison. */                              \
+  while (p!=NULL)                       /* Until we fall off the tree. */                   \
+  {                                                                                         \
+    c=CMP(key,p->key);                  /* Which way? */                                    \
+    if (c==0)                           /* Found it? */                                     \
+      break;                                                                                \
+    o=p;                                /* Remember the parent. */                          \
+    p=(c<0)?p->left:p->right;           /* Down. */                                         \
+  }                                                                                         \
+  *parent=o;                            /* Where key would hang... */                       \
+  *dir=c;                               /* ...and on which side. */                         \
+  return p;                             /* The node holding key, or NULL. */                \
+}                                                                                           \
+static inline bool P##Insert (P* t,K key,V value)                                           \
+{                                                                                           \
+  P##Node* q=(P##Node*) malloc(sizeof(P##Node));/* Made outside the lock. */                \
+  if (q==NULL)                          /* Did we fail to allocate memory? */               \
+    errExit("malloc");                                                                      \
+  P##Node* o=NULL;                      /* Parent of the insertion point. */                \
+  int c=0;                              /* Side of it. */                                   \
+  P##Lock(t);                                                                               \
+  P##Node* m=P##Find(t,key,&o,&c);      /* Already there? */                                \
+  if (m!=NULL)                                                                              \
+    m->value=value;                     /* Yes, new value. */                               \
+  else                                  /* No, link q in. */                                \
+  {                                                                                         \
+    q->key=key;                                                                             \
+    q->value=value;                                                                         \
+    q->color=RED;                                                                           \
+    q->left=q->right=NULL;                                                                  \
+    q->parent=o;                                                                            \
+    if (o==NULL)                                                                            \
+      t->root=q;                                                                            \
+    else if (c<0)                                                                           \
+      o->left=q;                                                                            \
+    else                                                                                    \
+      o->right=q;                                                                           \
+    P##FixInsert(t,q);                                                                      \
+    t->size++;                                                                              \
+    q=NULL;                             /* The tree's now. */                               \
+  }                                                                                         \
+  P##Unlock(t);                                                                             \
+  free(q);                              /* Not needed after all. */                         \
+  return m==NULL;                       /* New key? */                                      \
+}                                                                                           \
+static inline bool P##Delete (P* t,K key)                                                   \
+{                                                                                           \
+  P##Node* o=NULL;                      /* Parent (unused). */                              \
+  int c=0;                              /* Side (unused). */                                \
+  P##Lock(t);                                                                               \
+  P##Node* p=P##Find(t,key,&o,&c);      /* The node to delete. */                           \
+  if (p==NULL)                          /* Not there? */                                    \
+  {                                                                                         \
+    P##Unlock(t);                                                                           \
+    return false;                                                                           \
+  }                                                                                         \
+  P##Node* x;                           /* Moves into the gap. */                           \
+  P##Node* xp;                          /* Its parent (x may be NULL). */                   \
+  NodeColor gone=p->color;              /* Color taken out of the tree. */                  \
+  if (p->left==NULL)                    /* At most a right child? */                        \
+  {                                                                                         \
+    x=p->right;                                                                             \
+    xp=p->parent;                                                                           \
+    P##Replace(t,p,x);                                                                      \
+  }                                                                                         \
+  else if (p->right==NULL)              /* Only a left child? */                            \
+  {                                                                                         \
+    x=p->left;                                                                              \
+    xp=p->parent;                                                                           \
+    P##Replace(t,p,x);                                                                      \
+  }                                                                                         \
+  else                                  /* Two: the successor takes p's place. */           \
+  {                                                                                         \
+    P##Node* y=p->right;                                                                    \
+    while (y->left!=NULL)                                                                   \
+      y=y->left;                                                                            \
+    gone=y->color;                                                                          \
+    x=y->right;                                                                             \
+    if (y->parent==p)                                                                       \
+      xp=y;                                                                                 \
+    else                                                                                    \
+    {                                                                                       \
+      xp=y->parent;                                                                         \
+      P##Replace(t,y,x);                                                                    \
+      y->right=p->right;                                                                    \
+      y->right->parent=y;                                                                   \
+    }                                                                                       \
+    P##Replace(t,p,y);                                                                      \
+    y->left=p->left;                                                                        \
+    y->left->parent=y;                                                                      \
+    y->color=p->color;                                                                      \
+  }                                                                                         \
+  if (gone==BLACK)                      /* Did a path lose a black? */                      \
+    P##FixDelete(t,x,xp);                                                                   \
+  t->size--;                                                                                \
+  P##Unlock(t);                                                                             \
+  free(p);                                                                                  \
+  return true;                                                                              \
+}                                                                                           \
+static inline bool P##Lookup (P* t,K key,V* value)                                          \
+{                                                                                           \
+  P##Node* o=NULL;                      /* Parent (unused). */                              \
+  int c=0;                              /* Side (unused). */                                \
+  P##Lock(t);                                                                               \
+  P##Node* p=P##Find(t,key,&o,&c);      /* The node holding key. */                         \
+  if (p!=NULL&&value!=NULL)             /* Found, and wanted? */                            \
+    *value=p->value;                                                                        \
+  P##Unlock(t);                                                                             \
+  return p!=NULL;                                                                           \
+}
+
+#endif
@@ -0,0 +1,207 @@
+/**
+ * This file implements the sharded map declared in thread_shard.h. A key's
+ * shard is picked by hashing the whole key (FNV-1a with a final mix), so
+ * neighbouring keys spread over all shards; ordered walks pay for that with
+ * a k-way merge of one cursor per shard.
+ */
+#include <stdint.h>
+#include "thread_shard.h"
+
+// The shard holding key.
+static Tree* ShardOf (
+  ShardedTree* st,                      // The map.
+  const char* key)                      // The key.
+{                                       // ------------- ShardOf ----------------
+  uint64_t h=0xcbf29ce484222325ULL;     // FNV-1a offset basis.
+  for (const unsigned char* p=(const unsigned char*)key;*p!='\0';p++)
+  {
+    h^=*p;                              // Fold in a byte...
+    h*=0x100000001b3ULL;                // ...and spread it.
+  }                                     // Done hashing.
+  h^=h>>33;                             // FNV leaves the low bits weak,
+  h*=0xff51afd7ed558ccdULL;             // so finish with a mix...
+  h^=h>>33;                             // ...before taking the remainder.
+  return st->shards[h%(uint64_t)st->nshards];// The shard.
+}                                       // ------------- ShardOf ----------------
+// A function to initialize a map of nshards trees. Each tree gets whole
+// cache lines of its own.
+void ShardedInitialize (
+  ShardedTree* st,                      // The map.
+  int nshards,                          // Shards (1..SHARD_MAX).
+  const TreeOptions* opts)              // Options for every shard, or NULL.
+{                                       // --------- ShardedInitialize ----------
+  if (nshards<1||nshards>SHARD_MAX)     // A sensible number of shards?
+    fatal("ShardedInitialize: %d shards (1..%d)",nshards,SHARD_MAX);
+  st->nshards=nshards;                  // How many.
+  st->shards=(Tree**) malloc(nshards*sizeof(Tree*));// Their trees.
+  if (st->shards==NULL)                 // Did we fail to allocate memory?
+    errExit("malloc");                  // Yes, print error and exit.
+  size_t size=(sizeof(Tree)+63)&~(size_t)63;// A tree in whole cache lines.
+  for (int i=0;i<nshards;i++)           // Every shard...
+  {
+    st->shards[i]=(Tree*) aligned_alloc(64,size);// ...on its own lines...
+    if (st->shards[i]==NULL)            // Did we fail to allocate memory?
+      errExit("aligned_alloc");         // Yes, print error and exit.
+    InitializeWithOptions(st->shards[i],opts);// ...with its own lock.
+  }                                     // Done with the shards.
+}                                       // --------- ShardedInitialize ----------
+// A function to destroy every shard.
+void ShardedDestroy (ShardedTree* st)
+{                                       // ---------- ShardedDestroy ------------
+  for (int i=0;i<st->nshards;i++)       // Every shard...
+    DestroyTree(st->shards[i]);         // ...and its memory.
+  free(st->shards);                     // The list.
+  st->shards=NULL;                      // Nothing left.
+  st->nshards=0;                        // No shards.
+}                                       // ---------- ShardedDestroy ------------
+// A function to insert or update a key.
+void ShardedInsert (
+  ShardedTree* st,                      // The map.
+  char* key,                            // The key.
+  int value)                            // Its value.
+{                                       // ---------- ShardedInsert -------------
+  InsertNode(ShardOf(st,key),key,value);// Its shard does the work.
+}                                       // ---------- ShardedInsert -------------
+// A function to delete a key.
+void ShardedDelete (
+  ShardedTree* st,                      // The map.
+  char* key)                            // The key.
+{                                       // ---------- ShardedDelete -------------
+  DeleteNode(ShardOf(st,key),key);      // Its shard does the work.
+}                                       // ---------- ShardedDelete -------------
+// A function to look a key up.
+bool ShardedLookup (
+  ShardedTree* st,                      // The map.
+  char* key,                            // The key.
+  int* value)                           // Out: its value.
+{                                       // ---------- ShardedLookup -------------
+  return Lookup(ShardOf(st,key),key,value);// Its shard knows.
+}                                       // ---------- ShardedLookup -------------
+// A function to count the keys in every shard. Shards are read one after
+// the other, so under concurrent updates this is only an estimate.
+long ShardedSize (ShardedTree* st)
+{                                       // ----------- ShardedSize --------------
+  long n=0;                             // Keys.
+  for (int i=0;i<st->nshards;i++)       // Every shard.
+    n+=__atomic_load_n(&st->shards[i]->size,__ATOMIC_RELAXED);
+  return n;                             // The total.
+}                                       // ----------- ShardedSize --------------
+// Is cursor a's key below cursor b's?
+static bool HeapLess (
+  const ShardedCursor* cur,             // The walk.
+  int a,                                // A cursor.
+  int b)                                // Another.
+{                                       // ------------- HeapLess ---------------
+  return strcmp(cur->key[a],cur->key[b])<0;// By current key.
+}                                       // ------------- HeapLess ---------------
+// Move heap entry i down until both children are above it.
+static void SiftDown (
+  ShardedCursor* cur,                   // The walk.
+  int i)                                // The entry.
+{                                       // ------------- SiftDown ---------------
+  for (;;)                              // Until it settles.
+  {
+    int s=i;                            // Smallest of i and its children.
+    int l=2*i+1,r=2*i+2;                // The children.
+    if (l<cur->nheap&&HeapLess(cur,cur->heap[l],cur->heap[s]))
+      s=l;                              // The left one is smaller.
+    if (r<cur->nheap&&HeapLess(cur,cur->heap[r],cur->heap[s]))
+      s=r;                              // The right one is smaller still.
+    if (s==i)                           // Already in place?
+      return;                           // Yes.
+    int t=cur->heap[i];                 // Swap with the smaller child...
+    cur->heap[i]=cur->heap[s];
+    cur->heap[s]=t;
+    i=s;                                // ...and carry on from there.
+  }                                     // Done sifting.
+}                                       // ------------- SiftDown ---------------
+// Advance cursor c and put it back in the heap, at the top, if it has a pair.
+static void HeapRefill (
+  ShardedCursor* cur,                   // The walk.
+  int c)                                // The cursor (just taken off the top).
+{                                       // ------------ HeapRefill --------------
+  if (CursorNext(&cur->cur[c],&cur->key[c],&cur->value[c]))// Another pair?
+    cur->heap[0]=c;                     // Yes, back on top...
+  else                                  // No, this shard is done.
+    cur->heap[0]=cur->heap[--cur->nheap];// Its place goes to the last entry...
+  SiftDown(cur,0);                      // ...either way sifted into place.
+}                                       // ------------ HeapRefill --------------
+// A function to open an ordered walk over lo<=key<=hi on every shard.
+void ShardedCursorOpen (
+  ShardedCursor* cur,                   // The walk.
+  ShardedTree* st,                      // The map.
+  const char* lo,                       // Lower bound, or NULL.
+  const char* hi)                       // Upper bound, or NULL.
+{                                       // -------- ShardedCursorOpen -----------
+  int n=st->nshards;                    // A cursor per shard.
+  cur->n=n;                             // How many.
+  cur->cur=(TreeCursor*) malloc(n*sizeof(TreeCursor));
+  cur->key=(const char**) malloc(n*sizeof(char*));
+  cur->value=(int*) malloc(n*sizeof(int));
+  cur->heap=(int*) malloc(n*sizeof(int));
+  if (cur->cur==NULL||cur->key==NULL||cur->value==NULL||cur->heap==NULL)
+    errExit("malloc");                  // Out of memory.
+  cur->nheap=0;                         // Nothing merged yet.
+  cur->last=-1;                         // Nothing handed out yet.
+  for (int i=0;i<n;i++)                 // Every shard...
+  {
+    CursorOpen(&cur->cur[i],st->shards[i],lo,hi);// ...gets a cursor...
+    if (CursorNext(&cur->cur[i],&cur->key[i],&cur->value[i]))// ...and its first pair...
+      cur->heap[cur->nheap++]=i;        // ...goes in the heap.
+  }                                     // Done opening.
+  for (int i=cur->nheap/2-1;i>=0;i--)   // Heapify.
+    SiftDown(cur,i);
+}                                       // -------- ShardedCursorOpen -----------
+// A function to get the smallest pair not handed out yet. The shard that
+// supplied the previous pair is only advanced now, which keeps that pair's
+// key valid until this call.
+bool ShardedCursorNext (
+  ShardedCursor* cur,                   // The walk.
+  const char** key,                     // Out: the key.
+  int* value)                           // Out: its value.
+{                                       // -------- ShardedCursorNext -----------
+  if (cur->last>=0)                     // Did we hand out a pair last time?
+    HeapRefill(cur,cur->last);          // Yes, its shard moves on now.
+  cur->last=-1;                         // Nothing handed out yet.
+  if (cur->nheap==0)                    // Every shard done?
+    return false;                       // Yes, the walk is over.
+  int c=cur->heap[0];                   // The smallest current key.
+  *key=cur->key[c];                     // Hand it out...
+  *value=cur->value[c];                 // ...with its value.
+  cur->last=c;                          // Advance that shard next time.
+  return true;                          // A pair.
+}                                       // -------- ShardedCursorNext -----------
+// A function to release a walk.
+void ShardedCursorClose (ShardedCursor* cur)
+{                                       // -------- ShardedCursorClose ----------
+  for (int i=0;i<cur->n;i++)            // Every shard's cursor.
+    CursorClose(&cur->cur[i]);
+  free(cur->cur);                       // The cursors...
+  free(cur->key);                       // ...their keys...
+  free(cur->value);                     // ...values...
+  free(cur->heap);                      // ...and the heap.
+  memset(cur,0,sizeof(*cur));           // Nothing left.
+}                                       // -------- ShardedCursorClose ----------
+// A function to visit the pairs with lo<=key<=hi in order. fn runs with no
+// lock held.
+long ShardedRangeScan (
+  ShardedTree* st,                      // The map.
+  const char* lo,                       // Lower bound, or NULL.
+  const char* hi,                       // Upper bound, or NULL.
+  TreeScanFn fn,                        // Called for every pair.
+  void* arg)                            // Passed to fn.
+{                                       // -------- ShardedRangeScan ------------
+  ShardedCursor cur;                    // The walk.
+  const char* k=NULL;                   // Current key.
+  int v=0;                              // Its value.
+  long n=0;                             // Pairs visited.
+  ShardedCursorOpen(&cur,st,lo,hi);     // From lo to hi.
+  while (ShardedCursorNext(&cur,&k,&v)) // Every pair...
+  {
+    n++;                                // ...counted...
+    if (!fn(k,v,arg))                   // ...and visited, unless told to stop.
+      break;                            // Stop.
+  }                                     // Done walking.
+  ShardedCursorClose(&cur);             // Done with the walk.
+  return n;                             // Pairs visited.
+}                                       // -------- ShardedRangeScan ------------
@@ -0,0 +1,58 @@
+/**
+ * This interface file defines a sharded map on top of thread_tree: keys are
+ * hashed across a fixed number of independent Tree instances, each with its
+ * own lock, so writers to different shards never meet on the same tmtx. Every
+ * shard's Tree is allocated on a cache-line boundary and rounded up to whole
+ * lines, so two shards' locks and roots never share a line. Point operations
+ * go to one shard. Ordered walks open a TreeCursor on every shard and merge
+ * them with a small heap (a k-way merge), so keys still come out in order;
+ * each shard's cursor carries the usual guarantees, but the walk as a whole is
+ * not a snapshot across shards.
+ */
+#ifndef THREAD_SHARD_H
+#define THREAD_SHARD_H
+#include "thread_tree.h"
+
+// Most shards a map may have.
+#define SHARD_MAX 1024
+
+// The map.
+typedef struct ShardedTree
+{
+    int nshards;                        // Shards.
+    Tree** shards;                      // Their trees (line aligned, padded).
+} ShardedTree;                          // ShardedTree structure.
+// An ordered walk over every shard.
+typedef struct ShardedCursor
+{
+    int n;                              // Shards walked.
+    TreeCursor* cur;                    // A cursor per shard.
+    const char** key;                   // Current key of each cursor.
+    int* value;                         // Its value.
+    int* heap;                          // Cursors with a current key, smallest key first.
+    int nheap;                          // How many.
+    int last;                           // Cursor handed out last (advanced next), or -1.
+} ShardedCursor;                        // ShardedCursor structure.
+
+// A function to initialize a map of nshards trees (opts as for InitializeWithOptions()).
+void ShardedInitialize(ShardedTree* st,int nshards,const TreeOptions* opts);
+// A function to destroy every shard.
+void ShardedDestroy(ShardedTree* st);
+// A function to insert or update a key.
+void ShardedInsert(ShardedTree* st,char* key,int value);
+// A function to delete a key.
+void ShardedDelete(ShardedTree* st,char* key);
+// A function to look a key up.
+bool ShardedLookup(ShardedTree* st,char* key,int* value);
+// A function to count the keys in every shard.
+long ShardedSize(ShardedTree* st);
+// A function to open an ordered walk over lo<=key<=hi (NULL: unbounded).
+void ShardedCursorOpen(ShardedCursor* cur,ShardedTree* st,const char* lo,const char* hi);
+// A function to get the next pair; *key stays valid until the next call.
+bool ShardedCursorNext(ShardedCursor* cur,const char** key,int* value);
+// A function to release a walk.
+void ShardedCursorClose(ShardedCursor* cur);
+// A function to visit the pairs with lo<=key<=hi in order; returns the count.
+long ShardedRangeScan(ShardedTree* st,const char* lo,const char* hi,TreeScanFn fn,void* arg);
+
+#endif
@@ -0,0 +1,380 @@
+/**
+ * This file implements the lock-free skip list declared in thread_skiplist.h,
+ * after Herlihy and Shavit's LockFreeSkipList. Searches unlink the marked
+ * nodes they pass (retrying from the head when that races another thread),
+ * so the bottom list only ever holds a deleted node until the next search
+ * walks by. A node is retired once both its insert has stopped building its
+ * tower and its delete has searched for it again. Only then is it sure to be
+ * unlinked on every level, since an insert that loses the race can link an
+ * upper level after the delete's search went by. The node's refs count says
+ * which of the two finished last.
+ */
+#include "thread_skiplist.h"
+
+// Links are read with atomic loads, since writers CAS them under readers.
+#define LOAD(x) __atomic_load_n(&(x),__ATOMIC_ACQUIRE)
+// Compare-and-swap a link.
+#define CAS(x,old,new) __atomic_compare_exchange_n(&(x),&(old),(new),false,__ATOMIC_ACQ_REL,__ATOMIC_ACQUIRE)
+
+// The node a link points to, and whether the link's owner is deleted.
+static SkipNode* Ptr (uintptr_t n)
+{                                       // ------------- Ptr --------------------
+  return (SkipNode*)(n&~(uintptr_t)1);  // Without the mark.
+}                                       // ------------- Ptr --------------------
+static bool Marked (uintptr_t n)
+{                                       // ------------- Marked -----------------
+  return (n&1)!=0;                      // The mark.
+}                                       // ------------- Marked -----------------
+// The key stored after p's tower.
+static const char* Key (const SkipNode* p)
+{                                       // ------------- Key --------------------
+  return (const char*)(p->next+p->height);// Right after the last link.
+}                                       // ------------- Key --------------------
+// The calling thread's epoch slot, handed out round robin on first use.
+static __thread int skipSlot=-1;        // This thread's slot.
+static unsigned int skipSlotNext=0;     // Next slot to hand out.
+static int SkipSlot (void)
+{                                       // ------------- SkipSlot ---------------
+  if (skipSlot<0)                       // First time through?
+    skipSlot=__atomic_fetch_add(&skipSlotNext,1,__ATOMIC_RELAXED)%TREE_EPOCH_SLOTS;
+  return skipSlot;                      // Ours.
+}                                       // ------------- SkipSlot ---------------
+// Count ourselves in the current epoch (see EpochEnter() in thread_tree.c).
+static unsigned long SkipEnter (
+  SkipList* sl,                         // The list.
+  int slot)                             // Our slot.
+{                                       // ------------- SkipEnter --------------
+  for (;;)                              // Until we are counted in a current epoch.
+  {
+    unsigned long e=__atomic_load_n(&sl->epoch,__ATOMIC_ACQUIRE);
+    __atomic_fetch_add(&sl->slots[slot].active[e&1],1,__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&sl->epoch,__ATOMIC_SEQ_CST)==e)// Still current?
+      return e;                         // Yes, we are in.
+    __atomic_fetch_sub(&sl->slots[slot].active[e&1],1,__ATOMIC_RELEASE);
+  }                                     // It moved on, count ourselves again.
+}                                       // ------------- SkipEnter --------------
+static void SkipExit (
+  SkipList* sl,                         // The list.
+  int slot,                             // Our slot.
+  unsigned long e)                      // What SkipEnter() returned.
+{                                       // ------------- SkipExit ---------------
+  __atomic_fetch_sub(&sl->slots[slot].active[e&1],1,__ATOMIC_RELEASE);
+}                                       // ------------- SkipExit ---------------
+// Free the limbo nodes whose grace period is over, if nobody else is at it.
+// A node retired in epoch e can go in epoch e+2.
+static void SkipReclaim (SkipList* sl)
+{                                       // ------------- SkipReclaim ------------
+  if (pthread_mutex_trylock(&sl->rmtx)!=0)// Somebody else reclaiming?
+    return;                             // Yes, they will get to it.
+  unsigned long e=__atomic_load_n(&sl->epoch,__ATOMIC_SEQ_CST);// Current epoch.
+  bool idle=true;                       // Nobody left in e-1?
+  for (int i=0;i<TREE_EPOCH_SLOTS&&idle;i++)
+    idle=__atomic_load_n(&sl->slots[i].active[(e-1)&1],__ATOMIC_SEQ_CST)==0;
+  if (idle)                             // Can the epoch move on?
+    __atomic_store_n(&sl->epoch,++e,__ATOMIC_SEQ_CST);// Yes.
+  SkipNode* p=__atomic_exchange_n(&sl->limbo,NULL,__ATOMIC_ACQ_REL);// Take the list.
+  SkipNode* keep=NULL;                  // Nodes still too young...
+  SkipNode* last=NULL;                  // ...and the last of them.
+  while (p!=NULL)                       // Every retired node.
+  {
+    SkipNode* n=p->limbo;               // Next on the list.
+    if (p->retired+2<=e)                // Grace period over?
+      free(p);                          // Yes, nobody can reach it.
+    else                                // No, keep it.
+    {
+      p->limbo=keep;
+      if (keep==NULL)
+        last=p;
+      keep=p;
+    }
+    p=n;                                // Next.
+  }                                     // Done sorting.
+  if (keep!=NULL)                       // Anything kept?
+  {                                     // Yes, put it back in front of newer ones.
+    SkipNode* old=__atomic_load_n(&sl->limbo,__ATOMIC_ACQUIRE);
+    do
+      last->limbo=old;
+    while (!CAS(sl->limbo,old,keep));
+  }                                     // Done putting back.
+  pthread_mutex_unlock(&sl->rmtx);      // Done reclaiming.
+}                                       // ------------- SkipReclaim ------------
+// Drop one owner of p; the last one retires it. Unlinked on every level by now.
+static void SkipRelease (
+  SkipList* sl,                         // The list.
+  SkipNode* p)                          // The node.
+{                                       // ------------- SkipRelease ------------
+  if (__atomic_sub_fetch(&p->refs,1,__ATOMIC_ACQ_REL)!=0)// Somebody still on it?
+    return;                             // Yes, they retire it.
+  p->retired=__atomic_load_n(&sl->epoch,__ATOMIC_SEQ_CST);// Unreachable from here on.
+  SkipNode* old=__atomic_load_n(&sl->limbo,__ATOMIC_ACQUIRE);
+  do                                    // Push it on limbo.
+    p->limbo=old;
+  while (!CAS(sl->limbo,old,p));
+  SkipReclaim(sl);                      // Free what is old enough.
+}                                       // ------------- SkipRelease ------------
+// A tower height: one more level with probability 1/4 each, from one
+// random number per node (two bits per level).
+static int SkipHeight (void)
+{                                       // ------------- SkipHeight -------------
+  static __thread uint64_t x=0;         // This thread's generator.
+  if (x==0)                             // First time through?
+    x=(uintptr_t)&x*0x9e3779b97f4a7c15ULL|1;// Seed it per thread.
+  x^=x<<13;                             // Next number.
+  x^=x>>7;
+  x^=x<<17;
+  int h=1;                              // At least the bottom level.
+  for (uint64_t r=x;h<SKIP_MAX_LEVEL&&(r&3)==0;r>>=2)// Both bits clear: 1/4.
+    h++;                                // One more.
+  return h;                             // The height.
+}                                       // ------------- SkipHeight -------------
+// A function to allocate a node with its tower and key in whole cache lines.
+static SkipNode* NewSkipNode (
+  const char* key,                      // The key (copied), NULL for the head.
+  int value,                            // Its value.
+  int height)                           // Links in the tower.
+{                                       // ------------- NewSkipNode ------------
+  size_t len=(key!=NULL)?strlen(key)+1:1;// Key bytes.
+  size_t size=sizeof(SkipNode)+height*sizeof(uintptr_t)+len;// Tower and key...
+  size=(size+63)&~(size_t)63;           // ...in whole cache lines.
+  SkipNode* p=(SkipNode*) aligned_alloc(64,size);
+  if (p==NULL)                          // Did we fail to allocate memory?
+    errExit("aligned_alloc");           // Yes, print error and exit.
+  p->value=value;                       // The value.
+  p->height=(unsigned short)height;     // The tower.
+  p->refs=2;                            // Its insert and its delete.
+  p->retired=0;                         // Not yet.
+  p->limbo=NULL;                        // Not on limbo.
+  memset(p->next,0,height*sizeof(uintptr_t));// No links yet.
+  memcpy((char*)Key(p),(key!=NULL)?key:"",len);// The key.
+  return p;                             // The node.
+}                                       // ------------- NewSkipNode ------------
+// Find key's place on every level: preds[l] is the last node below key and
+// succs[l] the first not below it. Marked nodes met on the way are unlinked.
+// True if an undeleted node holds key (it is succs[0]).
+static bool Find (
+  SkipList* sl,                         // The list.
+  const char* key,                      // The key.
+  SkipNode** preds,                     // Out: predecessors per level.
+  SkipNode** succs)                     // Out: successors per level.
+{                                       // ------------- Find -------------------
+retry:                                  // Start over from the head.
+  ;
+  SkipNode* pred=sl->head;              // Below every key.
+  for (int l=SKIP_MAX_LEVEL-1;l>=0;l--) // Top level down.
+  {
+    SkipNode* curr=Ptr(LOAD(pred->next[l]));// First candidate on this level.
+    while (curr!=NULL)                  // Until we fall off the level.
+    {
+      uintptr_t n=LOAD(curr->next[l]);  // Its successor.
+      if (Marked(n))                    // Is curr deleted?
+      {                                 // Yes, unlink it here.
+        uintptr_t exp=(uintptr_t)curr;  // pred must still point at it, unmarked.
+        if (!CAS(pred->next[l],exp,(uintptr_t)Ptr(n)))// Did pred change or die?
+          goto retry;                   // Yes, start over.
+        curr=Ptr(n);                    // Carry on past it.
+        continue;
+      }                                 // Done unlinking.
+      if (strcmp(Key(curr),key)>=0)     // Reached key's place?
+        break;                          // Yes.
+      pred=curr;                        // No, move along.
+      curr=Ptr(n);
+    }                                   // Done with the level.
+    preds[l]=pred;                      // Last node below key...
+    succs[l]=curr;                      // ...and the first not below it.
+  }                                     // Done with the levels.
+  return succs[0]!=NULL&&strcmp(Key(succs[0]),key)==0;
+}                                       // ------------- Find -------------------
+// The first node not below key (NULL: the first node) on the bottom level,
+// marked or not, without unlinking anything: the read-only walk of lookups
+// and scans.
+static SkipNode* Seek (
+  SkipList* sl,                         // The list.
+  const char* key)                      // The key, or NULL.
+{                                       // ------------- Seek -------------------
+  SkipNode* pred=sl->head;              // Below every key.
+  SkipNode* curr=NULL;                  // First candidate.
+  for (int l=SKIP_MAX_LEVEL-1;l>=0;l--) // Top level down.
+  {
+    curr=Ptr(LOAD(pred->next[l]));      // First candidate on this level.
+    while (key!=NULL&&curr!=NULL&&strcmp(Key(curr),key)<0)// Still below key?
+    {
+      pred=curr;                        // Move along.
+      curr=Ptr(LOAD(curr->next[l]));
+    }                                   // Done with the level.
+  }                                     // Done with the levels.
+  return curr;                          // Bottom level's answer.
+}                                       // ------------- Seek -------------------
+
+// A function to initialize an empty skip list.
+void SkipListInit (SkipList* sl)
+{                                       // ------------- SkipListInit -----------
+  sl->head=NewSkipNode(NULL,0,SKIP_MAX_LEVEL);// Full tower, empty key.
+  sl->size=0;                           // No keys.
+  sl->epoch=2;                          // Epoch 0 and 1 are over, 2 is current.
+  sl->limbo=NULL;                       // Nothing retired.
+  memset(sl->slots,0,sizeof(sl->slots));// Nobody inside.
+  int status=pthread_mutex_init(&sl->rmtx,NULL);
+  if (status!=0)                        // Did we fail to initialize the mutex?
+    errExitEN(status,"pthread_mutex_init");// Yes, print error and exit.
+}                                       // ------------- SkipListInit -----------
+// A function to free every node of a skip list.
+void SkipListDestroy (SkipList* sl)
+{                                       // ----------- SkipListDestroy ----------
+  SkipNode* p=sl->head;                 // Every node still on the bottom level...
+  while (p!=NULL)
+  {
+    SkipNode* n=Ptr(p->next[0]);        // ...deleted or not...
+    free(p);                            // ...goes.
+    p=n;
+  }
+  while (sl->limbo!=NULL)               // So does everything retired.
+  {
+    p=sl->limbo;
+    sl->limbo=p->limbo;
+    free(p);
+  }
+  sl->head=NULL;                        // Nothing left.
+  sl->size=0;
+  int status=pthread_mutex_destroy(&sl->rmtx);
+  if (status!=0)                        // Did we fail to destroy the mutex?
+    errExitEN(status,"pthread_mutex_destroy");// Yes, print error and exit.
+}                                       // ----------- SkipListDestroy ----------
+// A function to insert or update key. The node is in the list once its
+// bottom link is in; the upper links follow one by one, and the tower is
+// abandoned if the node is deleted while it is being built.
+bool SkipListInsert (
+  SkipList* sl,                         // The list.
+  const char* key,                      // The key (copied).
+  int value)                            // Its value.
+{                                       // ------------ SkipListInsert ----------
+  SkipNode* preds[SKIP_MAX_LEVEL];      // Where key goes on every level...
+  SkipNode* succs[SKIP_MAX_LEVEL];      // ...and what comes after it.
+  SkipNode* q=NULL;                     // The new node, made on first need.
+  int h=SkipHeight();                   // Its height.
+  int slot=SkipSlot();                  // Our epoch slot.
+  unsigned long e=SkipEnter(sl,slot);   // Nodes stay put until we leave.
+  for (;;)                              // Until linked on the bottom level.
+  {
+    if (Find(sl,key,preds,succs))       // Already there?
+    {
+      __atomic_store_n(&succs[0]->value,value,__ATOMIC_RELEASE);// Yes, new value.
+      SkipExit(sl,slot,e);              // Done.
+      free(q);                          // Nobody ever saw it.
+      return false;                     // Not new.
+    }                                   // Done updating.
+    if (q==NULL)                        // No node yet?
+      q=NewSkipNode(key,value,h);       // Make it.
+    for (int l=0;l<h;l++)               // Point it at its successors.
+      q->next[l]=(uintptr_t)succs[l];
+    uintptr_t exp=(uintptr_t)succs[0];  // The bottom link must not have moved.
+    if (CAS(preds[0]->next[0],exp,(uintptr_t)q))// Linked?
+      break;                            // Yes, the key is in.
+  }                                     // Somebody got in between: search again.
+  __atomic_add_fetch(&sl->size,1,__ATOMIC_RELAXED);// One more key.
+  for (int l=1;l<h;l++)                 // Now the upper levels.
+  {
+    for (;;)                            // Until linked on this level.
+    {
+      uintptr_t n=LOAD(q->next[l]);     // Our link on this level.
+      if (Marked(n))                    // Deleted meanwhile?
+        goto built;                     // Yes, stop building.
+      if (Ptr(n)!=succs[l]&&!CAS(q->next[l],n,(uintptr_t)succs[l]))// Repoint it.
+        goto built;                     // Only a delete can have changed it.
+      uintptr_t exp=(uintptr_t)succs[l];// pred must still point at succ.
+      if (CAS(preds[l]->next[l],exp,(uintptr_t)q))// Linked?
+        break;                          // Yes, next level.
+      if (!Find(sl,key,preds,succs)||succs[0]!=q)// Search again; still us?
+        goto built;                     // No, we were deleted.
+    }                                   // Done with this level.
+  }                                     // Done with the levels.
+built:                                  // Done building the tower.
+  if (Marked(LOAD(q->next[0])))         // Deleted while we were building?
+    Find(sl,key,preds,succs);           // Yes, unlink whatever we linked late.
+  SkipRelease(sl,q);                    // The insert is done with it.
+  SkipExit(sl,slot,e);                  // Leave the epoch.
+  return true;                          // New key.
+}                                       // ------------ SkipListInsert ----------
+// A function to delete key: mark the tower top down, then the bottom link,
+// which is what deletes it. Whoever marks the bottom link wins.
+bool SkipListDelete (
+  SkipList* sl,                         // The list.
+  const char* key)                      // The key.
+{                                       // ------------ SkipListDelete ----------
+  SkipNode* preds[SKIP_MAX_LEVEL];      // Key's neighbours on every level...
+  SkipNode* succs[SKIP_MAX_LEVEL];      // ...and its node.
+  int slot=SkipSlot();                  // Our epoch slot.
+  unsigned long e=SkipEnter(sl,slot);   // Nodes stay put until we leave.
+  if (!Find(sl,key,preds,succs))        // Is it there?
+  {
+    SkipExit(sl,slot,e);                // No, leave.
+    return false;                       // Nothing deleted.
+  }                                     // Done with a miss.
+  SkipNode* p=succs[0];                 // The node.
+  for (int l=p->height-1;l>=1;l--)      // Mark the upper links...
+  {
+    uintptr_t n=LOAD(p->next[l]);       // ...one level at a time...
+    while (!Marked(n)&&!CAS(p->next[l],n,n|1))// ...until marked by someone.
+      ;
+  }                                     // Done with the upper links.
+  uintptr_t n=LOAD(p->next[0]);         // The bottom link decides.
+  for (;;)
+  {
+    if (Marked(n))                      // Another delete got there first?
+    {
+      SkipExit(sl,slot,e);              // Yes, leave.
+      return false;                     // It deleted the key, not us.
+    }                                   // Done losing.
+    if (CAS(p->next[0],n,n|1))          // Marked it?
+      break;                            // Yes, the key is gone.
+  }                                     // Lost to an insert behind it: try again.
+  __atomic_sub_fetch(&sl->size,1,__ATOMIC_RELAXED);// One less key.
+  Find(sl,key,preds,succs);             // Unlink it on every level.
+  SkipRelease(sl,p);                    // The delete is done with it.
+  SkipExit(sl,slot,e);                  // Leave the epoch.
+  return true;                          // Deleted.
+}                                       // ------------ SkipListDelete ----------
+// A function to look up key. It only reads: marked nodes are skipped, not
+// unlinked.
+bool SkipListLookup (
+  SkipList* sl,                         // The list.
+  const char* key,                      // The key.
+  int* value)                           // Out: its value.
+{                                       // ------------ SkipListLookup ----------
+  int slot=SkipSlot();                  // Our epoch slot.
+  unsigned long e=SkipEnter(sl,slot);   // Nodes stay put until we leave.
+  SkipNode* p=Seek(sl,key);             // First node not below key.
+  bool found=p!=NULL&&strcmp(Key(p),key)==0&&!Marked(LOAD(p->next[0]));
+  if (found)                            // There and not deleted?
+    *value=__atomic_load_n(&p->value,__ATOMIC_ACQUIRE);// Yes, its value.
+  SkipExit(sl,slot,e);                  // Leave the epoch.
+  return found;                         // Found or not.
+}                                       // ------------ SkipListLookup ----------
+// A function to visit the pairs with lo<=key<=hi in order. The walk runs in
+// one epoch, so the keys handed to fn stay valid for the call; fn may call
+// back into the list, but a long walk holds up reclaiming.
+long SkipListRangeScan (
+  SkipList* sl,                         // The list.
+  const char* lo,                       // Lower bound, or NULL.
+  const char* hi,                       // Upper bound, or NULL.
+  TreeScanFn fn,                        // Called for every pair.
+  void* arg)                            // Passed to fn.
+{                                       // ---------- SkipListRangeScan ---------
+  long count=0;                         // Pairs visited.
+  int slot=SkipSlot();                  // Our epoch slot.
+  unsigned long e=SkipEnter(sl,slot);   // Nodes stay put until we leave.
+  for (SkipNode* p=Seek(sl,lo);p!=NULL;)// From the first key not below lo...
+  {
+    uintptr_t n=LOAD(p->next[0]);       // ...along the bottom level...
+    if (hi!=NULL&&strcmp(Key(p),hi)>0)  // ...up to hi.
+      break;                            // Past it.
+    if (!Marked(n))                     // Deleted nodes are skipped.
+    {
+      count++;                          // Counted...
+      if (!fn(Key(p),__atomic_load_n(&p->value,__ATOMIC_ACQUIRE),arg))// ...and visited.
+        break;                          // Told to stop.
+    }                                   // Done with this one.
+    p=Ptr(n);                           // Next.
+  }                                     // Done walking.
+  SkipExit(sl,slot,e);                  // Leave the epoch.
+  return count;                         // Pairs visited.
+}                                       // ---------- SkipListRangeScan ---------
@@ -0,0 +1,60 @@
+/**
+ * This interface file defines a lock-free skip list of string keys and int values,
+ * an ordered map whose writers never block each other (thread_tree serializes them
+ * on tmtx). Nodes are linked level by level with compare-and-swap: an insert is
+ * done once its node is in the bottom list, and a delete once it has marked the
+ * node's bottom link (the low bit of the pointer), after which any thread that
+ * walks past the node unlinks it. Every operation runs inside an epoch, as in
+ * thread_tree's TREE_MODE_EPOCH, so an unlinked node waits on a limbo list until no
+ * thread can still be standing on it. Reclaiming uses a trylock, so it is skipped
+ * rather than waited for.
+ *
+ * Towers: a node reaches level l+1 with probability 1/4, not the textbook 1/2, so
+ * three nodes in four have a single link and the average tower is 1.33 links.
+ * The tower and the key share one allocation rounded to whole cache lines, so a
+ * node with a short key is one cache line and a search reads one line per node
+ * visited.
+ */
+#ifndef THREAD_SKIPLIST_H
+#define THREAD_SKIPLIST_H
+#include <stdint.h>
+#include "thread_tree.h"
+
+// Levels (1/4 per level up: enough for 4^16 keys).
+#define SKIP_MAX_LEVEL 16
+
+// A node: its tower of links, then its key (NUL terminated).
+typedef struct SkipNode
+{
+    int value;                          // Its value (updated in place).
+    unsigned short height;              // Links in the tower.
+    unsigned short refs;                // Owners left: the insert building it, its delete.
+    unsigned long retired;              // Epoch it was retired in.
+    struct SkipNode* limbo;             // Next on the limbo list.
+    uintptr_t next[];                   // Successor per level; low bit: node deleted.
+} SkipNode;                             // SkipNode structure.
+// The list.
+typedef struct SkipList
+{
+    SkipNode* head;                     // Sentinel with a full tower and no key.
+    long size;                          // Keys in the list.
+    unsigned long epoch;                // Global epoch.
+    SkipNode* limbo;                    // Retired nodes awaiting a grace period.
+    pthread_mutex_t rmtx;               // Held by whoever is reclaiming.
+    TreeEpochSlot slots[TREE_EPOCH_SLOTS];// Threads inside per slot and epoch parity.
+} SkipList;                             // SkipList structure.
+
+// A function to initialize an empty skip list.
+void SkipListInit(SkipList* sl);
+// A function to free every node of a skip list (no other thread may be using it).
+void SkipListDestroy(SkipList* sl);
+// A function to insert or update key (copied); true if the key was new.
+bool SkipListInsert(SkipList* sl,const char* key,int value);
+// A function to delete key; true if this call deleted it.
+bool SkipListDelete(SkipList* sl,const char* key);
+// A function to look up key.
+bool SkipListLookup(SkipList* sl,const char* key,int* value);
+// A function to visit the pairs with lo<=key<=hi in order (NULL: unbounded); returns the count.
+long SkipListRangeScan(SkipList* sl,const char* lo,const char* hi,TreeScanFn fn,void* arg);
+
+#endif
@@ -21,19 +21,553 @@
 
 #include "thread_tree.h"
 
+// Lockless readers load fields a writer may be changing under them with
+// relaxed atomics; whatever they see is checked against tree->seq after.
+#define LOAD(x) __atomic_load_n(&(x),__ATOMIC_RELAXED)
 
+// Start a lockless read: the sequence to validate against (odd: writer busy).
+static unsigned long ReadBegin (Tree* tree)
+{                                       // ------------- ReadBegin ---------------
+  return __atomic_load_n(&tree->seq,__ATOMIC_ACQUIRE);
+}                                       // ------------- ReadBegin ---------------
+// Did no writer touch the tree since ReadBegin() returned s?
+static bool ReadValid (
+  Tree* tree,                           // The tree read.
+  unsigned long s)                      // What ReadBegin() returned.
+{                                       // ------------- ReadValid ---------------
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);// Our loads happen before the recheck.
+  return (s&1)==0&&__atomic_load_n(&tree->seq,__ATOMIC_RELAXED)==s;
+}                                       // ------------- ReadValid ---------------
+// Writers (holding tmtx) bracket every change to links, colors or values.
+static void WriteBegin (Tree* tree)
+{                                       // ------------- WriteBegin --------------
+  __atomic_store_n(&tree->seq,tree->seq+1,__ATOMIC_RELAXED);// Odd: readers retry.
+  __atomic_thread_fence(__ATOMIC_RELEASE);// Seen before any of our stores.
+}                                       // ------------- WriteBegin --------------
+static void WriteEnd (Tree* tree)
+{                                       // ------------- WriteEnd ----------------
+  __atomic_store_n(&tree->seq,tree->seq+1,__ATOMIC_RELEASE);// Even: stable again.
+}                                       // ------------- WriteEnd ----------------
+// Monotonic time in nanoseconds, for the lock-wait counters.
+static unsigned long WaitClock (void)
+{                                       // ------------- WaitClock ---------------
+  struct timespec ts;                   // The time.
+  clock_gettime(CLOCK_MONOTONIC,&ts);   // Cannot fail with this clock.
+  return (unsigned long)ts.tv_sec*1000000000UL+(unsigned long)ts.tv_nsec;
+}                                       // ------------- WaitClock ---------------
+// Count a lock acquisition that had to wait, and for how long.
+static void WaitDone (
+  Tree* tree,                           // The tree locked.
+  unsigned long t0)                     // WaitClock() before blocking.
+{                                       // ------------- WaitDone ----------------
+  __atomic_add_fetch(&tree->lockwaits,1,__ATOMIC_RELAXED);// One more wait...
+  __atomic_add_fetch(&tree->lockwaitns,WaitClock()-t0,__ATOMIC_RELAXED);// ...this long.
+}                                       // ------------- WaitDone ----------------
+// Take the writers' lock: trw for writing in rwlock mode, tmtx otherwise.
+// An uncontended lock is taken with a trylock and costs no clock reads; only
+// a lock that blocks is timed.
+static int LockTree (Tree* tree)
+{                                       // ------------- LockTree ----------------
+  int status=0;                         // Status code.
+  unsigned long t0=0;                   // When we started waiting.
+  if (tree->mode==TREE_MODE_RWLOCK)     // Reader/writer lock?
+  {                                     // Yes, exclusive.
+    if (pthread_rwlock_trywrlock(&tree->trw)==0)// Free?
+      return 0;                         // Yes, ours.
+    t0=WaitClock();                     // No, time the wait.
+    status=pthread_rwlock_wrlock(&tree->trw);
+  }                                     // Done with the reader/writer lock.
+  else                                  // No, the tree's mutex.
+  {
+    if (pthread_mutex_trylock(&tree->tmtx)==0)// Free?
+      return 0;                         // Yes, ours.
+    t0=WaitClock();                     // No, time the wait.
+    status=pthread_mutex_lock(&tree->tmtx);
+  }                                     // Done with the mutex.
+  if (status==0)                        // Did we get it?
+    WaitDone(tree,t0);                  // Yes, count the wait.
+  return status;                        // Locked or not.
+}                                       // ------------- LockTree ----------------
+// Take the readers' lock: trw for reading in rwlock mode, tmtx otherwise.
+static int LockTreeRead (Tree* tree)
+{                                       // ------------- LockTreeRead ------------
+  if (tree->mode!=TREE_MODE_RWLOCK)     // Just the mutex?
+    return LockTree(tree);              // Yes, same as for writers.
+  if (pthread_rwlock_tryrdlock(&tree->trw)==0)// Free for readers?
+    return 0;                           // Yes, in.
+  unsigned long t0=WaitClock();         // No, time the wait.
+  int status=pthread_rwlock_rdlock(&tree->trw);// Readers run side by side.
+  if (status==0)                        // Did we get it?
+    WaitDone(tree,t0);                  // Yes, count the wait.
+  return status;                        // Locked or not.
+}                                       // ------------- LockTreeRead ------------
+// Drop whichever lock LockTree() or LockTreeRead() took.
+static int UnlockTree (Tree* tree)
+{                                       // ------------- UnlockTree --------------
+  if (tree->mode==TREE_MODE_RWLOCK)     // Reader/writer lock?
+    return pthread_rwlock_unlock(&tree->trw);// Yes, read or write side.
+  return pthread_mutex_unlock(&tree->tmtx);// No, the tree's mutex.
+}                                       // ------------- UnlockTree --------------
+// The slot (epoch counters, node cache) of the calling thread, handed out
+// round robin on first use.
+static __thread int threadSlot=-1;      // This thread's slot.
+static unsigned int slotNext=0;         // Next slot to hand out.
+static int ThreadSlot (void)
+{                                       // ------------- ThreadSlot --------------
+  if (threadSlot<0)                     // First time through?
+    threadSlot=__atomic_fetch_add(&slotNext,1,__ATOMIC_RELAXED)%TREE_EPOCH_SLOTS;
+  return threadSlot;                    // Ours.
+}                                       // ------------- ThreadSlot --------------
+// Enter a read-side section in epoch mode: count ourselves in the current
+// epoch's parity and make sure the epoch did not move while we did.
+static unsigned long EpochEnter (
+  Tree* tree,                           // The tree to read.
+  int slot)                             // Our slot.
+{                                       // ------------- EpochEnter --------------
+  for (;;)                              // Until we are counted in a current epoch.
+  {
+    unsigned long e=__atomic_load_n(&tree->epoch,__ATOMIC_ACQUIRE);
+    __atomic_fetch_add(&tree->slots[slot].active[e&1],1,__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&tree->epoch,__ATOMIC_SEQ_CST)==e)// Still current?
+      return e;                         // Yes, we are in.
+    __atomic_fetch_sub(&tree->slots[slot].active[e&1],1,__ATOMIC_RELEASE);
+  }                                     // It moved on, count ourselves again.
+}                                       // ------------- EpochEnter --------------
+static void EpochExit (
+  Tree* tree,                           // The tree read.
+  int slot,                             // Our slot.
+  unsigned long e)                      // What EpochEnter() returned.
+{                                       // ------------- EpochExit ---------------
+  __atomic_fetch_sub(&tree->slots[slot].active[e&1],1,__ATOMIC_RELEASE);
+}                                       // ------------- EpochExit ---------------
+// Writers (holding tmtx): move to the next epoch once no reader is left in
+// the previous one. A node unlinked in epoch e can be freed in epoch e+2.
+static void EpochAdvance (Tree* tree)
+{                                       // ------------- EpochAdvance ------------
+  unsigned long e=tree->epoch;          // Current epoch.
+  for (int i=0;i<TREE_EPOCH_SLOTS;i++)  // Anybody still in e-1?
+    if (__atomic_load_n(&tree->slots[i].active[(e-1)&1],__ATOMIC_SEQ_CST)!=0)
+      return;                           // Yes, not yet.
+  __atomic_store_n(&tree->epoch,e+1,__ATOMIC_SEQ_CST);// No, move on.
+}                                       // ------------- EpochAdvance ------------
+// Lock or unlock the tree's slab mutex.
+static void SlabLock (Tree* tree)
+{                                       // ------------- SlabLock ----------------
+  int status=pthread_mutex_lock(&tree->smtx);// Lock the slab.
+  if (status!=0)                        // Did we fail to lock the mutex?
+    errExitEN(status,"pthread_mutex_lock");// Yes, print error and exit.
+}                                       // ------------- SlabLock ----------------
+static void SlabUnlock (Tree* tree)
+{                                       // ------------- SlabUnlock --------------
+  int status=pthread_mutex_unlock(&tree->smtx);// Unlock the slab.
+  if (status!=0)                        // Did we fail to unlock the mutex?
+    errExitEN(status,"pthread_mutex_unlock");// Yes, print error and exit.
+}                                       // ------------- SlabUnlock --------------
+// Carve a new chunk of nodes onto the tree-wide free list (smtx held). Key
+// never dangles from now on.
+static void SlabGrow (Tree* tree)
+{                                       // ------------- SlabGrow ----------------
+  TreeSlab* c=(TreeSlab*) calloc(1,sizeof(TreeSlab));// A zeroed chunk.
+  if (c==NULL)                          // Did we fail to allocate memory?
+    errExit("calloc");                  // Yes, print error and exit.
+  for (int i=TREE_SLAB_NODES-1;i>=0;i--)// Every node, so the first one ends up on top.
+  {
+    TreeNode* q=&c->nodes[i];           // This node.
+    q->key=q->ikey;                     // An empty key, not a NULL one.
+    q->left=tree->freenodes;            // Push it...
+    tree->freenodes=q;                  // ...on the free list.
+  }                                     // Done carving.
+  c->next=tree->slabs;                  // Remember the chunk...
+  tree->slabs=c;                        // ...for DestroyTree().
+}                                       // ------------- SlabGrow ----------------
+// Take the calling thread's node cache. Uncontended unless more threads than
+// slots use the tree.
+static TreeNodeCache* CacheLock (Tree* tree)
+{                                       // ------------- CacheLock ---------------
+  TreeNodeCache* k=&tree->caches[ThreadSlot()];// Our slot's cache.
+  while (__atomic_exchange_n(&k->lock,1,__ATOMIC_ACQUIRE)!=0)// Somebody else on it?
+    sched_yield();                      // Yes, let them finish.
+  return k;                             // Ours now.
+}                                       // ------------- CacheLock ---------------
+static void CacheUnlock (TreeNodeCache* k)
+{                                       // ------------- CacheUnlock -------------
+  __atomic_store_n(&k->lock,0,__ATOMIC_RELEASE);// Free for the next user.
+}                                       // ------------- CacheUnlock -------------
+// Get a node from the thread's cache, refilling it from the tree-wide list
+// (or a new chunk) a batch at a time.
+static TreeNode* SlabAlloc (Tree* tree)
+{                                       // ------------- SlabAlloc ---------------
+  TreeNodeCache* k=CacheLock(tree);     // Our cache.
+  if (k->head==NULL)                    // Empty?
+  {                                     // Yes, refill it.
+    SlabLock(tree);                     // The shared part.
+    if (tree->freenodes==NULL)          // Nothing free anywhere?
+      SlabGrow(tree);                   // Yes, carve some more.
+    while (tree->freenodes!=NULL&&k->count<TREE_NODE_BATCH)
+    {
+      TreeNode* q=tree->freenodes;      // Move one...
+      tree->freenodes=q->left;          // ...off the shared list...
+      q->left=k->head;                  // ...onto...
+      k->head=q;                        // ...ours.
+      k->count++;                       // One more cached.
+    }                                   // Done refilling.
+    SlabUnlock(tree);                   // Done with the shared part.
+  }                                     // Done with an empty cache.
+  TreeNode* q=k->head;                  // Pop one.
+  k->head=q->left;                      // Next one up.
+  k->count--;                           // One less cached.
+  CacheUnlock(k);                       // Done with our cache.
+  return q;                             // The node.
+}                                       // ------------- SlabAlloc ---------------
+// Give a node back to the thread's cache, spilling a batch to the tree-wide
+// list when it holds too many. The memory stays a TreeNode until DestroyTree().
+static void SlabFree (
+  Tree* tree,                           // The tree it came from.
+  TreeNode* p)                          // The node.
+{                                       // ------------- SlabFree ----------------
+  TreeNodeCache* k=CacheLock(tree);     // Our cache.
+  p->right=p->parent=NULL;              // Lockless readers on it stop soon.
+  p->left=k->head;                      // Push it...
+  k->head=p;                            // ...on our cache.
+  if (++k->count>2*TREE_NODE_BATCH)     // Too many?
+  {                                     // Yes, spill down to one batch.
+    SlabLock(tree);                     // The shared part.
+    while (k->count>TREE_NODE_BATCH)    // Until one batch is left.
+    {
+      TreeNode* q=k->head;              // Move one...
+      k->head=q->left;                  // ...off ours...
+      q->left=tree->freenodes;          // ...onto...
+      tree->freenodes=q;                // ...the shared list.
+      k->count--;                       // One less cached.
+    }                                   // Done spilling.
+    SlabUnlock(tree);                   // Done with the shared part.
+  }                                     // Done checking the cache size.
+  CacheUnlock(k);                       // Done with our cache.
+}                                       // ------------- SlabFree ----------------
+// Smallest key buffer class (2^c bytes, at least 32) that holds len bytes plus NUL.
+static int KeyClass (size_t len)
+{                                       // ------------- KeyClass ----------------
+  int c=5;                              // 32 bytes at least.
+  while (((size_t)1<<c)<len+1)          // Too small?
+    c++;                                // Double it.
+  return c;                             // The class.
+}                                       // ------------- KeyClass ----------------
+// Give node q its key. Short keys are copied into the node in every mode;
+// long ones are copied into a buffer the node owns in the optimistic and
+// epoch modes (recycled ones first in optimistic mode), and are the
+// caller's pointer otherwise. Owned buffers keep their last byte NUL, so a
+// reader racing a reuse cannot run off the end.
+static void SetKey (
+  Tree* tree,                           // The tree the node is for.
+  TreeNode* q,                          // The node.
+  char* key)                            // The key.
+{                                       // ------------- SetKey ------------------
+  size_t len=strlen(key);               // Key length.
+  if (len<TREE_INLINE_KEY)              // Fits in the node?
+  {                                     // Yes, copy it in.
+    strcpy(q->ikey,key);                // Never touches the last byte but with NUL.
+    q->keycap=TREE_INLINE_KEY-1;        // Owned...
+    q->key=q->ikey;                     // ...and inline.
+    return;                             // Done.
+  }                                     // Done with a short key.
+  if (tree->mode!=TREE_MODE_OPTIMISTIC&&tree->mode!=TREE_MODE_EPOCH)
+  {                                     // The caller's key will do.
+    q->keycap=0;                        // Not ours...
+    q->key=key;                         // ...just pointed at.
+    return;                             // Done.
+  }                                     // Done with a borrowed key.
+  int c=KeyClass(len);                  // Buffer class.
+  char* b=NULL;                         // The buffer.
+  if (tree->mode==TREE_MODE_OPTIMISTIC) // Recycled buffers?
+  {
+    SlabLock(tree);                     // Free lists are shared.
+    b=tree->keyfree[c];                 // Pop one...
+    if (b!=NULL)                        // ...if there is one...
+      tree->keyfree[c]=*(char**)b;      // ...off the list.
+    SlabUnlock(tree);                   // Done with the free list.
+  }                                     // Done recycling.
+  if (b==NULL)                          // Nothing to recycle?
+  {
+    b=(char*) calloc(1,(size_t)1<<c);   // New buffer, all NUL.
+    if (b==NULL)                        // Did we fail to allocate memory?
+      errExit("calloc");                // Yes, print error and exit.
+  }                                     // Done getting a buffer.
+  strcpy(b,key);                        // Copy the key in.
+  q->keycap=((size_t)1<<c)-1;           // Longest key it holds.
+  q->key=b;                             // Point at it.
+}                                       // ------------- SetKey ------------------
+// Give back the key storage of a node that is being released. In optimistic
+// mode long-key buffers are recycled, since readers may still be in them.
+static void DropKey (
+  Tree* tree,                           // The tree the node is in.
+  TreeNode* p)                          // The node.
+{                                       // ------------- DropKey -----------------
+  if (p->keycap!=0&&p->key!=p->ikey)    // An owned buffer outside the node?
+  {
+    if (tree->mode==TREE_MODE_OPTIMISTIC)// Might a reader be in it?
+    {                                   // Yes, push it on its free list.
+      int c=KeyClass(p->keycap);        // Its class.
+      SlabLock(tree);                   // Free lists are shared.
+      *(char**)p->key=tree->keyfree[c]; // Link through its first bytes; the
+      tree->keyfree[c]=p->key;          // last one stays NUL.
+      SlabUnlock(tree);                 // Done with the free list.
+    }                                   // Done recycling.
+    else                                // No, nobody can see it anymore.
+      free(p->key);                     // So free it.
+  }                                     // Done with the buffer.
+  p->key=p->ikey;                       // Never dangling.
+  p->keycap=0;                          // Nothing owned.
+}                                       // ------------- DropKey -----------------
+// A function to release a node nobody can reach anymore, with its key.
+static void ReleaseNode (
+  Tree* tree,                           // The tree it came from.
+  TreeNode* p)                          // The node.
+{                                       // ------------- ReleaseNode -------------
+  DropKey(tree,p);                      // Its key storage...
+  SlabFree(tree,p);                     // ...and the node.
+}                                       // ------------- ReleaseNode -------------
+// Writers (holding tmtx): free limbo nodes whose grace period is over. The
+// list is newest first, so everything from the first old enough node on goes.
+static void EpochReclaim (Tree* tree)
+{                                       // ------------- EpochReclaim ------------
+  TreeNode** pp=&tree->limbo;           // Link to the node being looked at.
+  while (*pp!=NULL&&(*pp)->retired+2>tree->epoch)// Readers may still hold it?
+    pp=&(*pp)->parent;                  // Yes, keep it and look at the next one.
+  TreeNode* p=*pp;                      // First one past its grace period.
+  *pp=NULL;                             // Cut the list there.
+  while (p!=NULL)                       // Free the rest.
+  {
+    TreeNode* n=p->parent;              // Next in limbo.
+    ReleaseNode(tree,p);                // Gone.
+    p=n;                                // Next.
+  }                                     // Done freeing.
+}                                       // ------------- EpochReclaim ------------
+// A function to make a node for key/value from the slab.
+static TreeNode* NewNode (
+  Tree* tree,                           // The tree the node is for.
+  char* key,                            // The key of the node.
+  int value)                            // The value of the node.
+{                                       // ------------- NewNode ----------------
+  TreeNode* q=SlabAlloc(tree);          // A node from our cache.
+  SetKey(tree,q,key);                   // Its key.
+  q->value=value;                       // Set the value of the new node.
+  q->color=RED;                         // Set the color of the new node to red.
+  q->count=1;                           // A subtree of its own.
+  q->left=q->right=q->parent=NULL;      // This node has no relationship yet.
+  return q;                             // The node.
+}                                       // ------------- NewNode ----------------
+// A function to dispose of a node that was unlinked from the tree. In epoch
+// mode lockless readers may still be on it, so it waits out a grace period
+// in limbo. Everywhere else it goes straight back to the slab: optimistic
+// readers that are still on it only ever see TreeNode memory and fail
+// validation.
+static void RetireNode (
+  Tree* tree,                           // The tree it was in.
+  TreeNode* p)                          // The unlinked node.
+{                                       // ------------- RetireNode -------------
+  if (tree->mode==TREE_MODE_EPOCH)      // Deferred free?
+  {                                     // Yes, into limbo.
+    p->retired=tree->epoch;             // Unlinked in this epoch.
+    p->parent=tree->limbo;              // Readers only walk down, so the parent
+    tree->limbo=p;                      // link is free to chain limbo with.
+    EpochAdvance(tree);                 // Move on if readers allow...
+    EpochReclaim(tree);                 // ...and free what is old enough.
+    return;                             // Freed later.
+  }                                     // Done with epoch mode.
+  ReleaseNode(tree,p);                  // Back to the slab.
+}                                       // ------------- RetireNode -------------
+// Nodes in the subtree under p (0 for none).
+static int NodeCount (const TreeNode* p)
+{                                       // ------------- NodeCount --------------
+  return (p!=NULL)?p->count:0;          // Kept up to date by every writer.
+}                                       // ------------- NodeCount --------------
+// Walk from the root towards key. *match is the node holding key or NULL;
+// *parent is the last node passed and *dir which side of it key belongs on.
+// Loads are relaxed atomics so lockless callers can use it as long as they
+// validate against tree->seq; false if the walk ran away (only possible
+// when racing a writer).
+static bool Descend (
+  Tree* tree,                           // The tree to search.
+  const char* key,                      // The key to look for.
+  TreeNode** match,                     // Out: node holding key, or NULL.
+  TreeNode** parent,                    // Out: last node passed.
+  int* dir)                             // Out: <0 left of it, >0 right of it.
+{                                       // ------------- Descend ----------------
+  TreeNode* p=LOAD(tree->root);         // Start at the root of the tree.
+  TreeNode* o=NULL;                     // No parent yet.
+  int c=0;                              // Last comparison.
+  int depth=0;                          // Nodes visited.
+  while (p!=NULL)                       // While we haven't fallen off the tree.
+  {
+    if (++depth>TREE_MAX_DEPTH)         // Deeper than any real tree?
+      return false;                     // Yes, we are chasing a writer.
+    c=strcmp(key,LOAD(p->key));         // Which way?
+    if (c==0)                           // Found it?
+      break;                            // Yes.
+    o=p;                                // Remember the parent.
+    p=(c<0)?LOAD(p->left):LOAD(p->right);// Go left or right.
+  }                                     // Done walking.
+  *match=p;                             // Node with the key, if any.
+  *parent=o;                            // Where it would hang.
+  *dir=c;                               // On which side.
+  return true;                          // The walk finished.
+}                                       // ------------- Descend ----------------
+
+// Link nodes[lo,hi) (in key order) into a subtree under parent: the middle
+// node on top and each half below it the same way. Every level but the last
+// is full, so nodes on depth red (the last level, when it is not full) are
+// red and everything else black, which gives every path the same number of
+// black nodes and no red node a red child.
+static TreeNode* BuildSubtree (
+  TreeNode** nodes,                     // The nodes in key order.
+  size_t lo,                            // First node of the subtree.
+  size_t hi,                            // One past its last node.
+  TreeNode* parent,                     // Its parent, or NULL.
+  int depth,                            // Its depth.
+  int red)                              // The depth colored red.
+{                                       // ------------- BuildSubtree -----------
+  if (lo>=hi)                           // Nothing here?
+    return NULL;                        // Then an empty subtree.
+  size_t mid=lo+(hi-lo)/2;              // The middle node...
+  TreeNode* p=nodes[mid];               // ...goes on top.
+  p->parent=parent;                     // Below parent.
+  p->color=(depth==red)?RED:BLACK;      // Red only on a partial last level.
+  p->count=(int)(hi-lo);                // Nodes under it, itself included.
+  p->left=BuildSubtree(nodes,lo,mid,p,depth+1,red);// Smaller keys...
+  p->right=BuildSubtree(nodes,mid+1,hi,p,depth+1,red);// ...and larger ones.
+  return p;                             // The subtree.
+}                                       // ------------- BuildSubtree -----------
+// Link n nodes (in key order) into a balanced red-black tree; returns its root.
+static TreeNode* BuildTree (
+  TreeNode** nodes,                     // The nodes in key order.
+  size_t n)                             // How many.
+{                                       // ------------- BuildTree --------------
+  int red=0;                            // Last level: largest d with 2^d-1<=n.
+  while (red<62&&((size_t)1<<(red+1))-1<=n)
+    red++;                              // One more full level fits.
+  return BuildSubtree(nodes,0,n,NULL,0,red);
+}                                       // ------------- BuildTree --------------
+// The node array of a snapshot image.
+static const TreeSnapNode* SnapNodes (const TreeSnapHeader* h)
+{                                       // ------------- SnapNodes --------------
+  return (const TreeSnapNode*)(h+1);    // Right after the header.
+}                                       // ------------- SnapNodes --------------
+// Key i of a snapshot image. An offset outside the heap (a damaged file)
+// reads as the empty string, never as memory past the mapping.
+static const char* SnapKey (
+  const TreeSnapHeader* h,              // The image.
+  size_t i)                             // Which node.
+{                                       // ------------- SnapKey ----------------
+  const char* heap=(const char*)(SnapNodes(h)+h->count);// Keys follow the nodes.
+  uint64_t off=SnapNodes(h)[i].key;     // Where its key is.
+  return (off<h->heaplen)?heap+off:heap+h->heaplen-1;// The last byte is a NUL.
+}                                       // ------------- SnapKey ----------------
+// Binary search of a snapshot image: the first node whose key is not below
+// key (strict: above key), or count if there is none.
+static size_t SnapBound (
+  const TreeSnapHeader* h,              // The image.
+  const char* key,                      // The key.
+  bool strict)                          // Skip key itself?
+{                                       // ------------- SnapBound --------------
+  size_t lo=0;                          // Every node below lo is too small...
+  size_t hi=h->count;                   // ...and every one from hi on will do.
+  while (lo<hi)                         // Until they meet.
+  {
+    size_t mid=lo+(hi-lo)/2;            // The middle node.
+    int c=strcmp(SnapKey(h,mid),key);   // Where is it?
+    if (c>0||(c==0&&!strict))           // Above key (or at it, if allowed)?
+      hi=mid;                           // Yes, a candidate.
+    else                                // No, too small.
+      lo=mid+1;                         // Look above it.
+  }                                     // Done searching.
+  return lo;                            // The bound.
+}                                       // ------------- SnapBound --------------
+// Turn the snapshot image still serving the tree (if any) into an ordinary
+// tree of the tree's kind, as BulkLoad() would build it. Every writer calls
+// this first, holding the writers' lock. Lockless readers that already
+// chose the image finish on it; it stays mapped and still holds the pairs
+// as they were before this write.
+static void Thaw (Tree* tree)
+{                                       // ------------- Thaw -------------------
+  const TreeSnapHeader* h=tree->snap;   // The image.
+  if (h==NULL)                          // Already an ordinary tree?
+    return;                             // Yes, nothing to do.
+  size_t n=h->count;                    // Pairs in it.
+  WriteBegin(tree);                     // Readers must revalidate from here.
+  if (n>0&&tree->kind==TREE_KIND_BPLUS) // B+tree?
+  {
+    TreePair* pairs=(TreePair*) malloc(n*sizeof(TreePair));// Yes, the pairs...
+    if (pairs==NULL)                    // Did we fail to allocate memory?
+      errExit("malloc");                // Yes, print error and exit.
+    for (size_t i=0;i<n;i++)            // ...straight from the image...
+    {
+      pairs[i].key=(char*)SnapKey(h,i); // ...(the B+tree copies keys)...
+      pairs[i].value=SnapNodes(h)[i].value;
+    }
+    BTreeBulkLoad(&tree->bt,pairs,n);   // ...filled in bottom up.
+    free(pairs);                        // Done with them.
+  }                                     // Done with the B+tree.
+  else if (n>0)                         // No, a red-black tree.
+  {
+    TreeNode** nodes=(TreeNode**) malloc(n*sizeof(TreeNode*));// The nodes in key order.
+    if (nodes==NULL)                    // Did we fail to allocate memory?
+      errExit("malloc");                // Yes, print error and exit.
+    for (size_t i=0;i<n;i++)            // A node per pair (long keys may stay mapped).
+      nodes[i]=NewNode(tree,(char*)SnapKey(h,i),SnapNodes(h)[i].value);
+    tree->root=BuildTree(nodes,n);      // Linked up.
+    free(nodes);                        // Done with the list.
+  }                                     // Done with the red-black tree.
+  __atomic_store_n(&tree->snap,NULL,__ATOMIC_RELEASE);// Readers use the tree from now on.
+  WriteEnd(tree);                       // Stable again.
+}                                       // ------------- Thaw -------------------
 // A function to initialize the Red and Black Tree.
 void Initialize (Tree* tree)
 {                                       // ------------- Initialize --------------
+  InitializeWithOptions(tree,NULL);     // One mutex around everything.
+}                                       // ------------- Initialize --------------
+// A function to initialize the tree with a concurrency mode (NULL: mutex).
+void InitializeWithOptions (
+  Tree* tree,                           // The tree to initialize.
+  const TreeOptions* opts)              // The options, or NULL for the defaults.
+{                                       // -------- InitializeWithOptions --------
   int status=0;                         // Status code.
   if (tree == NULL)                     // Have we allocated memory for the tree?
     return;                             // No, handle null pointer gracefully.
   tree->root=NULL;                      // Initialize the root of the tree.
   tree->size=0;                         // Initialize the # of nodes to zero.
+  tree->mode=(opts!=NULL)?opts->mode:TREE_MODE_MUTEX;// How we synchronize.
+  tree->kind=(opts!=NULL)?opts->kind:TREE_KIND_RB;// How we store.
+  BTreeInit(&tree->bt);                 // Empty B+tree (unused by the RB kind).
+  tree->seq=0;                          // Stable, nobody writing.
+  tree->lockwaits=0;                    // Nobody has waited for the lock...
+  tree->lockwaitns=0;                   // ...for any time.
+  tree->snap=NULL;                      // Not serving a snapshot...
+  tree->snapmap=NULL;                   // ...nor holding one mapped.
+  tree->snaplen=0;                      // Nothing mapped.
+  memset(tree->keyfree,0,sizeof(tree->keyfree));// Nothing recycled yet.
+  tree->slabs=NULL;                     // No nodes carved yet.
+  tree->freenodes=NULL;                 // None free.
+  memset(tree->caches,0,sizeof(tree->caches));// None cached.
+  tree->epoch=2;                        // Epoch 0 and 1 are over, 2 is current.
+  tree->limbo=NULL;                     // Nothing waiting to be freed.
+  memset(tree->slots,0,sizeof(tree->slots));// No readers.
   status=pthread_mutex_init(&tree->tmtx,NULL); // Initialize the tree's thread mutex.
   if (status!=0)                        // Did we fail to initialize the mutex?
     errExitEN(status,"pthread_mutex_init");// Yes, print error and exit.
-}                                       // ------------- Initialize --------------
+  pthread_rwlockattr_t rwa;             // Reader/writer lock attributes.
+  pthread_rwlockattr_init(&rwa);        // Defaults...
+#ifdef __GLIBC__
+  // ...except that glibc lets a steady stream of readers starve writers.
+  pthread_rwlockattr_setkind_np(&rwa,PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+  status=pthread_rwlock_init(&tree->trw,&rwa);// Initialize the reader/writer lock.
+  pthread_rwlockattr_destroy(&rwa);     // Done with the attributes.
+  if (status!=0)                        // Did we fail to initialize it?
+    errExitEN(status,"pthread_rwlock_init");// Yes, print error and exit.
+  status=pthread_mutex_init(&tree->smtx,NULL);// Initialize the slab mutex.
+  if (status!=0)                        // Did we fail to initialize the mutex?
+    errExitEN(status,"pthread_mutex_init");// Yes, print error and exit.
+}                                       // -------- InitializeWithOptions --------
 
 // A function to destroy the tree and free memory allocated for it.
 void DestroyTree (Tree* p)
@@ -41,85 +575,227 @@ void DestroyTree (Tree* p)
   int status=0;                         // Status code.
     if (p->root!=NULL)                  // Do we have the root populated ?
     DestroySubtree(p->root);           // Yes, it's safe to destroy it.
+  BTreeDestroy(&p->bt);                 // The B+tree kind's nodes and keys.
+  if (p->snapmap!=NULL&&munmap(p->snapmap,p->snaplen)==-1)// Snapshot (and borrowed keys)?
+    errExit("munmap");                  // Failed, print error and exit.
+  while (p->limbo!=NULL)                // Nodes still in limbo?
+  {
+    TreeNode* q=p->limbo;               // Yes, take one...
+    p->limbo=q->parent;                 // ...off the list...
+    DropKey(p,q);                       // ...and free its key (no readers left).
+  }                                     // Done with limbo.
+  for (int c=0;c<TREE_KEY_CLASSES;c++)  // Every key free list...
+    while (p->keyfree[c]!=NULL)         // ...until it is empty...
+    {
+      char* b=p->keyfree[c];            // ...pop a recycled buffer...
+      p->keyfree[c]=*(char**)b;         // ...off it...
+      free(b);                          // ...and free it for good.
+    }                                   // Done with free lists.
+  while (p->slabs!=NULL)                // Every chunk of nodes...
+  {
+    TreeSlab* c=p->slabs;               // ...take it...
+    p->slabs=c->next;                   // ...off the list...
+    free(c);                            // ...and free it.
+  }                                     // Done with the slab.
+  status=pthread_mutex_destroy(&p->smtx);// Destroy the slab mutex.
+  if (status!=0)                        // Did we fail to destroy the mutex?
+    errExitEN(status,"pthread_mutex_destroy");// Yes, print error and exit.
   status=pthread_mutex_destroy(&p->tmtx);// Destroy the tree's mutex.
   if (status!=0)                        // Did we fail to destroy the mutex?
     errExitEN(status,"pthread_mutex_destroy");// Yes, print error and exit.
+  status=pthread_rwlock_destroy(&p->trw);// Destroy the reader/writer lock.
+  if (status!=0)                        // Did we fail to destroy it?
+    errExitEN(status,"pthread_rwlock_destroy");// Yes, print error and exit.
   free((void*) p);                      // Free the tree's memory.
   p=NULL;                               // Set the pointer to NULL.
 }                                       // ------------ DestroyTree -------------
-// A function to destroy the subtree rooted at the given node.
+// A function to free the keys owned by the subtree rooted at the given node.
+// The nodes themselves belong to the tree's slab, which DestroyTree() frees.
 void DestroySubtree (TreeNode* p)
 {                                       // ---------- DestroySubtree ------------
-  int status=0;                         // Status code.
     if (p->left!=NULL)                  // Do we have a left child?
     DestroySubtree(p->left);            // Yes, destroy the left subtree.
   if (p->right!=NULL)                   // Do we have a right child?
     DestroySubtree(p->right);           // Yes, destroy the right subtree.
-  status=pthread_mutex_destroy(&p->nmtx);// Destroy the node's mutex.
-  if (status!=0)                        // Did we fail to destroy the mutex?
-    errExitEN(status,"pthread_mutex_destroy");// Yes, print error and exit.
-  free((void*) p);                      // Free the node's memory.
-  p=NULL;                               // Set the pointer to NULL.
+  if (p->keycap!=0&&p->key!=p->ikey)    // Do we own a key buffer?
+    free(p->key);                       // Yes, free it.
+  p->key=p->ikey;                       // Never dangling.
+  p->keycap=0;                          // Nothing owned.
 }                                       // ---------- DestroySubtree ------------
-// A function to insert a new node given a key and value.
+// A function to hang new node q on side c of o (NULL: as the root) and
+// rebalance (tmtx held, inside WriteBegin()/WriteEnd()).
+static void LinkNode (
+  Tree* tree,                           // The tree to insert into.
+  TreeNode* q,                          // The new (red) node.
+  TreeNode* o,                          // Its parent, or NULL.
+  int c)                                // <0 left of o, >0 right of o.
+{                                       // ------------- LinkNode ---------------
+  q->parent=o;                          // The parent of the new node is the current node.
+  if (o==NULL)                          // Is this the first element in the tree?
+    tree->root=q;                       // Yes, so this new node will be the root node.
+  else if (c<0)                         // Is the new key less than the parent's key?
+    o->left=q;                          // Yes, so insert as a left child.
+  else                                  // Else the new key is greater than the parent's key.
+    o->right=q;                         // So insert as a right child.
+  for (TreeNode* a=o;a!=NULL;a=a->parent)// Every subtree it joined...
+    a->count++;                         // ...has one more node.
+  FixInsert(tree,q);                    // Restore the Red-Black properties.
+  tree->size++;                         // We inserted a new element.
+}                                       // ------------- LinkNode ---------------
+// A function to take node p out of the tree and rebalance (tmtx held,
+// inside WriteBegin()/WriteEnd()). p itself is left to the caller.
+static void UnlinkNode (
+  Tree* tree,                           // The tree to delete from.
+  TreeNode* p)                          // The node to take out.
+{                                       // ------------- UnlinkNode -------------
+  TreeNode* y=p;                        // The node to delete.
+  TreeNode* x=NULL;                     // The node to replace the deleted node.
+  TreeNode* xp=NULL;                    // The parent x ends up under (x may be NULL).
+  NodeColor clr=y->color;               // The color of the node to delete.
+  TreeNode* gone=(p->left!=NULL&&p->right!=NULL)?FindMin(p->right):p;// Position that empties.
+  for (TreeNode* a=gone->parent;a!=NULL;a=a->parent)// Every subtree above it...
+    a->count--;                         // ...loses a node.
+  if (p->left==NULL)                    // Does the node to delete have a left child?
+  {                                     // No, so we will
+    x=p->right;                         // Set the node to replace with the right child.
+    xp=p->parent;                       // It moves up to p's parent.
+    ReplaceNode(tree,p,x);              // Replace the node with the right child.
+  }                                     // Done with NULL left subtree ptr.
+  else if (p->right==NULL)              // Does the node to delete have a right child?
+  {                                     // No, so we will...
+    x=p->left;                          // Set the node to replace with the left child.
+    xp=p->parent;                       // It moves up to p's parent.
+    ReplaceNode(tree,p,x);              // Replace the node with the left child.
+  }                                     // Done with NULL right subtree.
+  else                                  // Else the node to delete has two children.
+  {                                     // So we will...
+    y=gone;                             // The min node in the right subtree.
+    clr=y->color;                       // Save the color of the node to delete.
+    x=y->right;                         // Set the node to replace as the right child.
+    if (y->parent==p)                   // Is the parent of the min node the node to delete?
+      xp=y;                             // Yes, x stays under y.
+    else                                // Else the parent of the node to delete is not the min node.
+    {                                   // So we will..
+      xp=y->parent;                     // x takes y's place under y's parent.
+      ReplaceNode(tree,y,y->right);     // Replace the min node with its right child.
+      y->right=p->right;                // Set the right child of the min node to the right child of the node to delete.
+      y->right->parent=y;               // Set the parent of the right child to the min node.
+    }                                   // Done with else parent of min node not the node to delete.
+    ReplaceNode(tree,p,y);              // Replace the node to delete with the min node.
+    y->left=p->left;                    // Update y's left pointer.
+    y->left->parent=y;                  // Update y's left child's parent.
+    y->color=p->color;                  // Update y's color.
+    y->count=p->count;                  // And the count of the subtree it heads now.
+  }                                     // Done with else two children.
+  if (clr==BLACK)                       // Is the original color BLACK?
+    FixDelete(tree,x,xp);               // Yes, so fix the tree.
+  tree->size--;                         // Decrement the size of the tree, we just deleted a node.
+}                                       // ------------- UnlinkNode -------------
+// The B+tree kind has no lockless paths: whatever the mode, writers take
+// the writers' lock and readers the readers' lock around the whole call.
+static void BPlusInsert (
+  Tree* tree,                           // The tree to insert into.
+  char* key,                            // The key (copied).
+  int value)                            // Its value.
+{                                       // ------------- BPlusInsert -------------
+  int status=LockTree(tree);            // Lock the tree.
+  if (status!=0)                        // Did we fail to lock the mutex?
+    return;                             // Yes, so return.
+  Thaw(tree);                           // Off the snapshot, if still on it.
+  if (BTreeInsert(&tree->bt,key,value)) // Was the key new?
+    tree->size++;                       // Yes, one more.
+  status=UnlockTree(tree);              // Unlock the tree.
+  if (status!=0)                        // Did we fail to unlock the mutex?
+    errExitEN(status,"pthread_mutex_unlock");// Yes, print error and exit.
+}                                       // ------------- BPlusInsert -------------
+static void BPlusDelete (
+  Tree* tree,                           // The tree to delete from.
+  char* key)                            // The key.
+{                                       // ------------- BPlusDelete -------------
+  int status=LockTree(tree);            // Lock the tree.
+  if (status!=0)                        // Did we fail to lock the mutex?
+    return;                             // Yes, so return.
+  Thaw(tree);                           // Off the snapshot, if still on it.
+  if (BTreeDelete(&tree->bt,key))       // Was it there?
+    tree->size--;                       // Yes, one less.
+  status=UnlockTree(tree);              // Unlock the tree.
+  if (status!=0)                        // Did we fail to unlock the mutex?
+    errExitEN(status,"pthread_mutex_unlock");// Yes, print error and exit.
+}                                       // ------------- BPlusDelete -------------
+static bool BPlusLookup (
+  Tree* tree,                           // The tree to look in.
+  char* key,                            // The key.
+  int* value)                           // Out: its value.
+{                                       // ------------- BPlusLookup -------------
+  int status=LockTreeRead(tree);        // Lock the tree for reading.
+  if (status!=0)                        // Did we fail to lock the mutex?
+    return false;                       // Yes so return
+  bool found=BTreeLookup(&tree->bt,key,value);// Search.
+  status=UnlockTree(tree);              // Unlock the tree.
+  if (status!=0)                        // Did we fail to unlock the mutex?
+    errExitEN(status,"pthread_mutex_unlock");// Yes, print error and exit.
+  return found;                         // Found or not.
+}                                       // ------------- BPlusLookup -------------
+// A function to insert a new node given a key and value. An existing key
+// gets the new value.
 void InsertNode (                       // Insert a new node into the tree.
     Tree* tree,                         // The tree to insert into.
     char* key,                          // The key of the node.
     int value)                          // The value of the node.
 {                                       // ------------- InsertNode -------------
   int status=0;                         // Status code.
-  status=pthread_mutex_lock(&tree->tmtx);// Lock the tree's mutex.
+  TreeNode* m=NULL;                     // Node already holding the key.
+  TreeNode* o=NULL;                     // Parent of the insertion point.
+  int c=0;                              // Side of the parent it goes on.
+  unsigned long s=1;                    // Sequence of a lockless search (odd: none).
+  TreeNode* q=NULL;                     // The new node, made before locking.
+  if (tree->kind==TREE_KIND_BPLUS)      // B+tree?
+  {
+    BPlusInsert(tree,key,value);        // Yes, it does the work.
+    return;                             // Done.
+  }                                     // Done with the B+tree.
+  if (tree->mode==TREE_MODE_OPTIMISTIC||tree->mode==TREE_MODE_EPOCH)
+  {                                     // Search before locking: only the relinking is locked.
+    int slot=ThreadSlot();              // Epoch slot (epoch mode).
+    unsigned long e=(tree->mode==TREE_MODE_EPOCH)?EpochEnter(tree,slot):0;
+    s=ReadBegin(tree);                  // Snapshot of the writers' count.
+    if ((s&1)!=0||!Descend(tree,key,&m,&o,&c))// Writer busy or walk ran away?
+      s=1;                              // Yes, search again under the lock.
+    if (tree->mode==TREE_MODE_EPOCH)    // Were we counted as a reader?
+      EpochExit(tree,slot,e);           // Yes, the node stays put while seq does.
+  }                                     // Done searching without the lock.
+  if (m==NULL)                          // Not there, as far as we know?
+    q=NewNode(tree,key,value);          // Get the node ready outside the lock.
+  status=LockTree(tree);                // Lock the tree.
   if (status!=0)                        // Did we fail to lock the mutex?
-    return;                             // Yes, so return.
-  TreeNode* q=NULL;                     // Pointer to the new node.
-  q=(TreeNode*) malloc(sizeof(TreeNode)); // Allocate memory for the new node.
-  if (q==NULL)                          // Did we fail to allocate memory?
-    errExit("malloc");                  // Yes, print error and exit.
-  q->key=key;                           // Set the key of the new node.
-  q->value=value;                       // Set the value of the new node.
-  q->color=RED;                         // Set the color of the new node to red.
-  q->left=q->right=q->parent=NULL;      // This node has no relationship yet.
-  status=pthread_mutex_init(&q->nmtx,NULL);// Initialize the node's mutex.
-  if (status!=0)                        // Did we fail to initialize the mutex?
-    errExitEN(status,"pthread_mutex_init");// Yes, print error and exit.
-  if (tree->root==NULL)                 // Is this the first element in the tree?
-  {                                     // Yes
-    tree->root=q;                       // So this new node will be the root node.
-    tree->root->parent=NULL;            // The root has no parent it the great ancestor.
-    tree->root->color=BLACK;            // The root is always black.
-    tree->size=1;                       // The size of the tree is 1.
-  }                                     // Done with if first element.
-  else                                  // Else it is not the first element.
-  {                                     // So we will have to find where it goes.
-    TreeNode* p=tree->root;             // Current node is the root of the tree (starting point).
-    TreeNode* o=NULL;                   // Currently the parent is NULL.
-    while (p!=NULL)                     // While we haven't found an empty insertion point.
-    {                                   // Start searching for the insertion point.
-      o=p;                              // The parent is now the current node.
-      if (strcmp(key,p->key)<0)         // Is the new key less than the current key?
-        p=p->left;                      // Yes, so go left.
-      else                              // Else the new key is greater than the current key.
-        p=p->right;                     // So switch with the right child.
-    }                                   // Done searching for the insertion point.
-    q->parent=o;                        // The parent of the new node is the current node.
-    if (strcmp(key,o->key)<0)           // Is the new key less than the current key?
-      o->left=q;                        // Yes, so insert as a left child.
-    else if (strcmp(key,o->key)>0)      // Else the new key is greater than the current key.
-      o->right=q;                       // So insert as a right child.
-    else                                // Else the new key is equal to the current key.
-    {                                   // So let's replace the old node with the new node.
-        ReplaceNode(tree,o,q);          // Replace the old node with the new node.
-    }                                   // Done with else not first element in the tree.
-    if (q->parent->color==RED)          // Is the parent of the new node red?
-      FixInsert(tree,q);                // Yes, so fix the tree to maintain the Red-Black properties.
-    else                                // Else the parent of the new node is black.
-      q->color=RED;                     // So set the color of the new node to red.
-//    FixInsert(tree,q);                  // Fix the tree to maintain the Red-Black properties.
-  }                                     // Done with else not first element in the tree.
-  tree->size++;                         // We inserted a new element.
-  status=pthread_mutex_unlock(&tree->tmtx);// Unlock the tree's mutex.
+  {
+    if (q!=NULL)                        // Did we make a node?
+      ReleaseNode(tree,q);              // Yes, give it back.
+    return;                             // And return.
+  }                                     // Done with lock failure.
+  Thaw(tree);                           // Off the snapshot, if still on it.
+  if (tree->seq!=s)                     // No lockless search, or a writer since?
+    Descend(tree,key,&m,&o,&c);         // Yes, find the insertion point now.
+  WriteBegin(tree);                     // Readers must revalidate from here.
+  if (m!=NULL)                          // Is the key already in the tree?
+  {                                     // Yes, so replace its value.
+    m->value=value;                     // The new value.
+    if (m->keycap==0)                   // Is the key the caller's?
+      m->key=key;                       // Yes, take the new one as the old node did.
+  }                                     // Done replacing.
+  else                                  // No, so link a new node in.
+  {
+    if (q==NULL)                        // Somebody deleted it since we looked?
+      q=NewNode(tree,key,value);        // Yes, make the node after all.
+    LinkNode(tree,q,o,c);               // Hang it in and rebalance.
+    q=NULL;                             // It is the tree's now.
+  }                                     // Done linking.
+  WriteEnd(tree);                       // Stable again.
+  status=UnlockTree(tree);              // Unlock the tree.
   if (status!=0)                        // Did we fail to unlock the mutex?
     errExitEN(status,"pthread_mutex_unlock");// Yes, print error and exit.          
+  if (q!=NULL)                          // Made a node we did not need?
+    ReleaseNode(tree,q);                // Yes, nobody ever saw it.
 }                                       // ------------- InsertNode -------------
 // A function to find the minimum node in the tree.
 TreeNode* FindMin (TreeNode* p)
@@ -161,156 +837,116 @@ void DeleteNode (
     Tree* tree,                         // The tree to delete from.
     char* key)                          // The key of the node to delete.
 {                                       // ------------- DeleteNode -------------
-  int status=pthread_mutex_lock(&tree->tmtx);// Lock the tree's mutex.
+  TreeNode* p=NULL;                     // The node to delete.
+  TreeNode* o=NULL;                     // Its parent (unused).
+  int c=0;                              // Last comparison (unused).
+  unsigned long s=1;                    // Sequence of a lockless search (odd: none).
+  if (tree->kind==TREE_KIND_BPLUS)      // B+tree?
+  {
+    BPlusDelete(tree,key);              // Yes, it does the work.
+    return;                             // Done.
+  }                                     // Done with the B+tree.
+  if (tree->mode==TREE_MODE_OPTIMISTIC||tree->mode==TREE_MODE_EPOCH)
+  {                                     // Search before locking: only the unlinking is locked.
+    int slot=ThreadSlot();              // Epoch slot (epoch mode).
+    unsigned long e=(tree->mode==TREE_MODE_EPOCH)?EpochEnter(tree,slot):0;
+    s=ReadBegin(tree);                  // Snapshot of the writers' count.
+    if ((s&1)!=0||!Descend(tree,key,&p,&o,&c))// Writer busy or walk ran away?
+      s=1;                              // Yes, search again under the lock.
+    if (tree->mode==TREE_MODE_EPOCH)    // Were we counted as a reader?
+      EpochExit(tree,slot,e);           // Yes, the node stays put while seq does.
+  }                                     // Done searching without the lock.
+  int status=LockTree(tree);            // Lock the tree.
   if (status!=0)                        // Did we fail to lock the mutex?
     return;                             // Yes, so return.
-  TreeNode* p=tree->root;               // Start at the root of the tree.
-  while (p!=NULL && strcmp(key,p->key)!=0)// While we haven't found the node to delete.
-  {                                     // Search for the node be deleted.
-    if (strcmp(key,p->key)<0)           // Is the key less than the current key?
-    {                                   // Yes, so we go left.
-      p=p->left;                        // Go left.
-    }                                   // Done working with left subtree.
-    else                                // Else the key is greater than the current key.
-    {                                   // So it must be in the right subtree.
-      p=p->right;                       // Go right.
-    }                                   // Done searching right subtree.
-  }                                     // Done searching for the node to delete.
+  Thaw(tree);                           // Off the snapshot, if still on it.
+  if (tree->seq!=s)                     // No lockless search, or a writer since?
+    Descend(tree,key,&p,&o,&c);         // Yes, find the node now.
   if (p==NULL)                          // Did we find the node to delete?
   {                                     // No, so we will..
-    status=pthread_mutex_unlock(&tree->tmtx);// Unlock the tree's mutex.
+    status=UnlockTree(tree);            // Unlock the tree.
     if (status!=0)                      // Did we fail to unlock the mutex?
       errExitEN(status,"pthread_mutex_unlock");// Yes, print error and exit.
     return;                             // Return, no key was found.
   }                                     // Done checking if no node to delete.
-  TreeNode* y=p;                        // The node to delete.
-  TreeNode* x=NULL;                     // The node to replace the deleted node.
-  NodeColor clr=y->color;               // The color of the node to delete.
-  if (p->left==NULL)                    // Does the node to delete have a left child?
-  {                                     // No, so we will
-    x=p->right;                         // Set the node to replace with the right child.
-    if (x!=NULL)                        // Is the right child Null?
-      ReplaceNode(tree,p,x);            // No, replace the node with the right child.
-  }                                     // Done with NULL left subtree ptr.
-  else if (p->right==NULL)              // Does the node to delete have a right child?
-  {                                     // No, so we will...
-    x=p->left;                          // Set the node to replace with the left child.
-    if (x!=NULL)                        // Is the left child NULL?
-      ReplaceNode(tree,p,x);            // No, replace the node with the left child.
-  }                                     // Done with NULL right subtree.
-  else                                  // Else the node to delete has two children.
-  {                                     // So we will...
-    y=FindMin(p->right);                // Find the min node in the right subtree.
-    clr=y->color;                       // Save the color of the node to delete.
-    x=y->right;                         // Set the node to replace as the right child.
-    if (y->parent==p)                   // Is the parent of the min node the node to delete?
-      if (x!=NULL)                      // Is the replacement node NULL?
-        x->parent=y;                    // No, so set the parent of the replacement node.
-    else                                // Else the parent of the node to delete is not the min node.
-    {                                   // So we will..
-      ReplaceNode(tree,y,y->right);     // Replace the min node with its right child.
-      y->right=p->right;                // Set the right child of the min node to the right child of the node to delete.
-      y->right->parent=y;               // Set the parent of the right child to the min node.
-    }                                   // Done with else parent of min node not the node to delete.
-    ReplaceNode(tree,p,y);              // Replace the node to delete with the min node.
-    y->left=p->left;                    // Update y's left pointer.
-    y->left->parent=y;                  // Update y's left child's parent.
-    y->color=p->color;                  // Update y's color.
-  }                                     // Done with else two children.
-  status=pthread_mutex_destroy(&p->nmtx);// Destroy the node's mutex.
-  if (status!=0)                        // Did we fail to destroy the mutex?
-    errExitEN(status,"pthread_mutex_destroy");// Yes, print error and exit.
-  free(p);                              // Free the node.
-  p=NULL;                               // Set the pointer to NULL.
-  if (clr==BLACK)                       // Is the original color BLACK?
-    FixDelete(tree,x);                  // Yes, so fix the tree.
-  tree->size--;                         // Decrement the size of the tree, we just deleted a node.
-  status=pthread_mutex_unlock(&tree->tmtx);// Unlock the tree's mutex.
+  WriteBegin(tree);                     // Readers must revalidate from here.
+  UnlinkNode(tree,p);                   // Take it out and rebalance.
+  WriteEnd(tree);                       // Stable again.
+  RetireNode(tree,p);                   // Free or recycle the node.
+  status=UnlockTree(tree);              // Unlock the tree.
   if (status!=0)                        // Did we fail to unlock the mutex?
     errExitEN(status,"pthread_mutex_unlock");// Yes, print error and exit.
 }                                       // ------------- DeleteNode -------------
-// A function to fix the tree after deletion.
+// A function to fix the tree after deletion. p carries the extra black and
+// may be NULL, which is why its parent is passed along.
 void FixDelete (
     Tree* tree,                         // The tree to fix
-    TreeNode* p)                        // The node of the tree that needs fixing.
+    TreeNode* p,                        // The node of the tree that needs fixing.
+    TreeNode* pp)                       // The parent of p.
 {                                       // ------------- FixDelete --------------
   while (p != tree->root && (p == NULL || p->color == BLACK))
   {
     TreeNode* w = NULL;                 // The sibling of the node to fix.
-    if (p->parent != NULL) {            // Ensure p->parent is not NULL.
-      if (p == p->parent->left) {       // Is the node the left child of its parent?
-        w = p->parent->right;           // No, the sibling is the right child.
-      } else {                          // Otherwise, it is the left child.
-        w = p->parent->left;            // Yes, set sibling as left child.
-      }                                 // Done setting sibling as left child.                                
-    }                                   // Done with existence of parent.
-    if (w == NULL) {                    // Is the sibling NULL?
-      break;                            // Yes, so break from the while loop.                     
-    }                                   // Done checking for leaf brother.
-    if (w->color == RED) {              // Is the sibling red?
-      w->color = BLACK;                 // Set the sibling to black.
-      p->parent->color = RED;           // Set the parent to red.
+    if (p == pp->left) {                // Is the node the left child of its parent?
+      w = pp->right;                    // Yes, the sibling is the right child.
+      if (w->color == RED) {            // Is the sibling red?
+        w->color = BLACK;               // Set the sibling to black.
+        pp->color = RED;                // Set the parent to red.
+        LeftRotate(tree, pp);           // Rotate the tree to the left.
+        w = pp->right;                  // Update the sibling.
+      }                                 // Done with red sibling.
       // ------------------------------ //
-      // Now we have to rotate based on the position of p
+      // Are the left and right child of the sibling NULL or BLACK?
       // ------------------------------ //
-      if (p == p->parent->left) {       // Is p it's parent's left uncle?
-        LeftRotate(tree, p->parent);    // Yes, rotate the tree to the left.
-        w = p->parent->right;           // Update the sibling.
-      } else {                          // Else, it is its right uncle.                
-        RightRotate(tree, p->parent);   // Rotate the tree to the right.
-        w = p->parent->left;            // Update the sibling.
-      }                                 // Done with right uncle.
-    }                                   // Done with p-based rotation.
-    // -------------------------------- //
-    // Now we have to enfore color rules of the tree.
-    // Are the left and right child of the sibling NULL and BLACK?
-    // -------------------------------- //
-    if ((w->left == NULL || w->left->color == BLACK) &&
-        (w->right == NULL || w->right->color == BLACK)) 
-    {
-      w->color = RED;                   // Yes, set the sibling to red.
-      p = p->parent;                    // Move p up the tree.
-    } else {                            // Else they are not one of those.
-      if (p == p->parent->left) {       // Is p the left child?
-        // ---------------------------- //
-        // Is w's right child NULL or BLACK?
-        // ---------------------------- //
+      if ((w->left == NULL || w->left->color == BLACK) &&
+          (w->right == NULL || w->right->color == BLACK)) {
+        w->color = RED;                 // Yes, set the sibling to red.
+        p = pp;                         // Move p up the tree.
+        pp = p->parent;                 // And its parent.
+      } else {                          // Else one of them is red.
         if (w->right == NULL || w->right->color == BLACK) {
-          if (w->left != NULL) {        // .. and left child not NULL?
-            w->left->color = BLACK;     // Yes, set the left child of the sibling to black.
-          }                             // Done setting left child of the sibling to black.
+          w->left->color = BLACK;       // The red one is on the left, set it to black.
           w->color = RED;               // Set the sibling to red.
           RightRotate(tree, w);         // Rotate the tree to the right.
-          w = p->parent->right;         // Update the sibling.
+          w = pp->right;                // Update the sibling.
         }                               // Done handling if right child NULL or BLACK.
-        w->color = p->parent->color;    // Set the sibling's color to the parent's color.
-        p->parent->color = BLACK;       // Set the parent to black.
+        w->color = pp->color;           // Set the sibling's color to the parent's color.
+        pp->color = BLACK;              // Set the parent to black.
         if (w->right != NULL) {         // Is the right child NULL?
-          w->right->color = BLACK;      // Set the right child of the sibling to black.
+          w->right->color = BLACK;      // No, set the right child of the sibling to black.
         }                               // Done checking if right child NULL?   
-        LeftRotate(tree, p->parent);    // Rotate the tree to the left.
+        LeftRotate(tree, pp);           // Rotate the tree to the left.
         p = tree->root;                 // Set p to the root.
-      } else {                          // If p is the right child.
-        // ---------------------------- //
-        // Is the left child NULL or BLACK?
-        // ---------------------------- //
+      }                                 // Done with red nephew.
+    } else {                            // If p is the right child.
+      w = pp->left;                     // The sibling is the left child.
+      if (w->color == RED) {            // Is the sibling red?
+        w->color = BLACK;               // Set the sibling to black.
+        pp->color = RED;                // Set the parent to red.
+        RightRotate(tree, pp);          // Rotate the tree to the right.
+        w = pp->left;                   // Update the sibling.
+      }                                 // Done with red sibling.
+      if ((w->left == NULL || w->left->color == BLACK) &&
+          (w->right == NULL || w->right->color == BLACK)) {
+        w->color = RED;                 // Yes, set the sibling to red.
+        p = pp;                         // Move p up the tree.
+        pp = p->parent;                 // And its parent.
+      } else {                          // Else one of them is red.
         if (w->left == NULL || w->left->color == BLACK) {
-          if (w->right != NULL) {       // Is the right child NULL?
-            w->right->color = BLACK;    // No, set the right child of the sibling to black.
-          }                             // Done checking if right child not a leaf.
+          w->right->color = BLACK;      // The red one is on the right, set it to black.
           w->color = RED;               // Set the sibling to red.
           LeftRotate(tree, w);          // Rotate the tree to the left.
-          w = p->parent->left;          // Update the sibling.
+          w = pp->left;                 // Update the sibling.
         }                               // Done handling leafy left child or black.
-        w->color = p->parent->color;    // Set the sibling's color to the parent's color.
-        p->parent->color = BLACK;       // Set the parent to black.
+        w->color = pp->color;           // Set the sibling's color to the parent's color.
+        pp->color = BLACK;              // Set the parent to black.
         if (w->left != NULL) {          // Is the left child NULL?
           w->left->color = BLACK;       // No, set the left child of the sibling to black.
         }                               // Done checking if left child not a leaf.
-        RightRotate(tree, p->parent);   // Rotate the tree to the right.
+        RightRotate(tree, pp);          // Rotate the tree to the right.
         p = tree->root;                 // Set p to the root.
-      }                                 // Done checking if p is the right child.
-    }                                   // Done checking if left or right child NULL or BLACK.
+      }                                 // Done with red nephew.
+    }                                   // Done checking if p is the right child.
   }                                     // Done with while p is not root and p is NULL or BLACK
   if (p != NULL) {                      // Is p NULL?
     p->color = BLACK;                   // No, set the node to black.
@@ -392,13 +1028,8 @@ void LeftRotate (
         p->parent->right=y;             // So set the right child of the parent to the right child.
     y->left=p;                          // Set the left child of the right child to the node.
     p->parent=y;                        // Set the parent of the node to the right child.
-    y->color=p->color;                  // Set the color of the right child to the color of the node.
-    p->color=RED;                       // Set the color of the node to red.
-    p->right=y->left;                   // Set the right child of the node to the left child of the right child.
-    if (y->left!=NULL)                  // Is the left child NULL?
-        y->left->parent=p;              // No, set the parent of the left child to the node.
-    y->left=p;                          // Set the left child of the right child to the node.
-    p->parent=y;                        // Set the parent of the node to the right child.
+    y->count=p->count;                  // y heads the whole subtree now...
+    p->count=1+NodeCount(p->left)+NodeCount(p->right);// ...and p what is left below it.
 }                                       // ------------- LeftRotate -------------
 // A function to Rotate the tree right.
 void RightRotate (
@@ -418,13 +1049,8 @@ void RightRotate (
         p->parent->left=y;              // So set the left child of the parent to the left child.
     y->right=p;                         // Set the right child of the left child to the node.
     p->parent=y;                        // Set the parent of the node to the left child.
-    y->color=p->color;                  // Set the color of the left child to the color of the node.
-    p->color=RED;                       // Set the color of the node to red.
-    p->left=y->right;                   // Set the left child of the node to the right child of the left child.
-    if (y->right!=NULL)                 // Is the right child NULL?
-        y->right->parent=p;             // No, set the parent of the right child to the node.
-    y->right=p;                         // Set the right child of the left child to the node.
-    p->parent=y;                        // Set the parent of the node to be equal to y. 
+    y->count=p->count;                  // y heads the whole subtree now...
+    p->count=1+NodeCount(p->left)+NodeCount(p->right);// ...and p what is left below it.
 }                                       // ------------- RightRotate -------------
 
 // A function to look up a key in the tree.
@@ -435,7 +1061,63 @@ bool Lookup (
 {                                       // ------------- Lookup ----------------
   int status=0;                         // Status code.
   TreeNode* p=NULL;                     // Pointer to the node to look up.
-  status=pthread_mutex_lock(&tree->tmtx);// Lock the tree's mutex.
+  const TreeSnapHeader* h=__atomic_load_n(&tree->snap,__ATOMIC_ACQUIRE);
+  if (h!=NULL)                          // Still on a snapshot? It never changes, so no lock.
+  {
+    size_t i=SnapBound(h,key,false);    // Yes, the first key not below key.
+    if (i==h->count||strcmp(SnapKey(h,i),key)!=0)// Is it key?
+      return false;                     // No, not there.
+    *value=SnapNodes(h)[i].value;       // Yes, return the value.
+    return true;                        // Found.
+  }                                     // Done with the snapshot.
+  if (tree->kind==TREE_KIND_BPLUS)      // B+tree?
+    return BPlusLookup(tree,key,value); // Yes, it does the work.
+  if (tree->mode==TREE_MODE_OPTIMISTIC) // Lockless first?
+  {                                     // Yes, walk and validate.
+    for (int i=0;i<TREE_OPTIMISTIC_RETRIES;i++)
+    {
+      TreeNode* o=NULL;                 // Parent (unused).
+      int c=0;                          // Last comparison (unused).
+      unsigned long s=ReadBegin(tree);  // Writers' count before the walk.
+      if ((s&1)!=0)                     // Writer relinking right now?
+      {
+        sched_yield();                  // Yes, let it finish.
+        continue;                       // Try again.
+      }                                 // Done waiting for the writer.
+      bool ok=Descend(tree,key,&p,&o,&c);// Walk.
+      int v=(ok&&p!=NULL)?LOAD(p->value):0;// Copy the value out before validating.
+      if (ok&&ReadValid(tree,s))        // Nobody changed anything meanwhile?
+      {                                 // Yes, the answer stands.
+        if (p!=NULL)                    // Found?
+          *value=v;                     // Yes, return the value.
+        return p!=NULL;                 // Found or not.
+      }                                 // Done with a valid walk.
+    }                                   // Writers kept getting in the way...
+  }                                     // ...so fall back to the lock.
+  else if (tree->mode==TREE_MODE_EPOCH) // Epoch-protected walk?
+  {                                     // Yes, nodes cannot be freed under us.
+    int slot=ThreadSlot();              // Where we announce ourselves.
+    for (int i=0;i<TREE_OPTIMISTIC_RETRIES;i++)
+    {
+      TreeNode* o=NULL;                 // Parent (unused).
+      int c=0;                          // Last comparison (unused).
+      unsigned long s=ReadBegin(tree);  // Writers' count before the walk.
+      unsigned long e=EpochEnter(tree,slot);// Pin the nodes.
+      bool ok=Descend(tree,key,&p,&o,&c);// Walk.
+      int v=(ok&&p!=NULL)?LOAD(p->value):0;// Copy the value out while pinned.
+      EpochExit(tree,slot,e);           // Unpin.
+      if (ok&&p!=NULL)                  // Found it?
+      {                                 // Yes, a hit needs no validation.
+        *value=v;                       // Return the value.
+        return true;                    // Found.
+      }                                 // Done with a hit.
+      if (ok&&ReadValid(tree,s))        // A miss no rotation could have caused?
+        return false;                   // Yes, it is not there.
+      if ((s&1)!=0)                     // Writer relinking right now?
+        sched_yield();                  // Yes, let it finish.
+    }                                   // Writers kept getting in the way...
+  }                                     // ...so fall back to the lock.
+  status=LockTreeRead(tree);            // Lock the tree for reading.
   if (status!=0)                        // Did we fail to lock the mutex?
     return false;                       // Yes so return
   p=tree->root;                         // Start at the root of the tree.
@@ -448,15 +1130,936 @@ bool Lookup (
   }                                     // Done searching for the node to look up.
   if (p==NULL)                          // Did we find the node to look up?
   {                                     // No, so we will..
-    status=pthread_mutex_unlock(&tree->tmtx);// Unlock the tree's mutex.
+    status=UnlockTree(tree);            // Unlock the tree.
     if (status!=0)                      // Did we fail to unlock the mutex?
       errExitEN(status,"pthread_mutex_unlock");// Yes, print error and exit.
     return false;                       // Return false, no key was found.
   }                                     // Done checking if no node to look up.
   *value=p->value;                      // Set the value to be returned to the value of the node found.
-  status=pthread_mutex_unlock(&tree->tmtx);// Unlock the tree's mutex.
+  status=UnlockTree(tree);              // Unlock the tree.
   if (status!=0)                        // Did we fail to unlock the mutex?
     errExitEN(status,"pthread_mutex_unlock");// Yes, print error and exit.          
   return true;                          // Return true, key was found. 
 }                                       // ------------- Lookup ----------------
 
+// Smallest node whose key is not below key (strict: above key), or NULL.
+static TreeNode* CeilingNode (
+  Tree* tree,                           // The tree to search.
+  const char* key,                      // The key.
+  bool strict)                          // Skip key itself?
+{                                       // ------------- CeilingNode ------------
+  TreeNode* p=tree->root;               // Start at the root of the tree.
+  TreeNode* best=NULL;                  // Best candidate so far.
+  while (p!=NULL)                       // While we haven't fallen off the tree.
+  {
+    int c=strcmp(p->key,key);           // Where is p?
+    if (c>0||(c==0&&!strict))           // Above key (or at it, if allowed)?
+    {
+      best=p;                           // Yes, a candidate...
+      p=p->left;                        // ...but something smaller may do.
+    }
+    else                                // No, too small.
+      p=p->right;                       // Go right.
+  }                                     // Done walking.
+  return best;                          // The ceiling, if any.
+}                                       // ------------- CeilingNode ------------
+// Largest node whose key is not above key, or NULL.
+static TreeNode* FloorNode (
+  Tree* tree,                           // The tree to search.
+  const char* key)                      // The key.
+{                                       // ------------- FloorNode --------------
+  TreeNode* p=tree->root;               // Start at the root of the tree.
+  TreeNode* best=NULL;                  // Best candidate so far.
+  while (p!=NULL)                       // While we haven't fallen off the tree.
+  {
+    if (strcmp(p->key,key)<=0)          // Not above key?
+    {
+      best=p;                           // Yes, a candidate...
+      p=p->right;                       // ...but something larger may do.
+    }
+    else                                // No, too large.
+      p=p->left;                        // Go left.
+  }                                     // Done walking.
+  return best;                          // The floor, if any.
+}                                       // ------------- FloorNode --------------
+// The node after p in key order, through the parent pointers.
+static TreeNode* Successor (TreeNode* p)
+{                                       // ------------- Successor --------------
+  if (p->right!=NULL)                   // Anything to the right?
+    return FindMin(p->right);           // Yes, its smallest.
+  TreeNode* o=p->parent;                // No, climb...
+  while (o!=NULL&&p==o->right)          // ...while we come from the right.
+  {
+    p=o;                                // Up...
+    o=o->parent;                        // ...one level.
+  }                                     // Done climbing.
+  return o;                             // First ancestor we are left of.
+}                                       // ------------- Successor --------------
+// Floor() and Ceiling(): the key is copied out before the lock is dropped.
+static bool Nearest (
+  Tree* tree,                           // The tree to search.
+  const char* key,                      // The key.
+  bool below,                           // Floor (true) or ceiling (false)?
+  char* found,                          // Out: the key found (may be NULL).
+  size_t len,                           // Bytes at found.
+  int* value)                           // Out: its value (may be NULL).
+{                                       // ------------- Nearest ----------------
+  const char* k=NULL;                   // The key found.
+  int v=0;                              // Its value.
+  int status=LockTreeRead(tree);        // Lock the tree for reading.
+  if (status!=0)                        // Did we fail to lock the mutex?
+    return false;                       // Yes so return
+  if (tree->snap!=NULL)                 // Still on a snapshot?
+  {
+    const TreeSnapHeader* h=tree->snap; // Yes, search the image.
+    size_t i=SnapBound(h,key,below);    // First key above (floor) or not below (ceiling).
+    if (below?i>0:i<h->count)           // Anything on the right side?
+    {
+      i-=below?1:0;                     // The floor is just before the bound.
+      k=SnapKey(h,i);                   // The key...
+      v=SnapNodes(h)[i].value;          // ...and value.
+    }
+  }                                     // Done with the snapshot.
+  else if (tree->kind==TREE_KIND_BPLUS) // B+tree?
+  {
+    const BTreeLeaf* l=NULL;            // Leaf holding it.
+    int i=0;                            // Position there.
+    if (below?BTreeFloor(&tree->bt,key,&l,&i):BTreeCeiling(&tree->bt,key,false,&l,&i))
+    {
+      k=l->h.keys[i];                   // The key...
+      v=l->value[i];                    // ...and value.
+    }
+  }                                     // Done with the B+tree.
+  else                                  // Red-black tree.
+  {
+    TreeNode* p=below?FloorNode(tree,key):CeilingNode(tree,key,false);
+    if (p!=NULL)                        // Found one?
+    {
+      k=p->key;                         // The key...
+      v=p->value;                       // ...and value.
+    }
+  }                                     // Done with the red-black tree.
+  if (k!=NULL)                          // Found one?
+  {
+    if (found!=NULL&&len>0)             // Room for the key?
+      snprintf(found,len,"%s",k);       // Yes, copy it (truncated).
+    if (value!=NULL)                    // Want the value?
+      *value=v;                         // Yes.
+  }                                     // Done copying out.
+  status=UnlockTree(tree);              // Unlock the tree.
+  if (status!=0)                        // Did we fail to unlock the mutex?
+    errExitEN(status,"pthread_mutex_unlock");// Yes, print error and exit.
+  return k!=NULL;                       // Found or not.
+}                                       // ------------- Nearest ----------------
+// A function to find the largest key not above key.
+bool Floor (
+  Tree* tree,                           // The tree to search.
+  const char* key,                      // The key.
+  char* found,                          // Out: the key found (may be NULL).
+  size_t len,                           // Bytes at found.
+  int* value)                           // Out: its value (may be NULL).
+{                                       // ------------- Floor ------------------
+  return Nearest(tree,key,true,found,len,value);
+}                                       // ------------- Floor ------------------
+// A function to find the smallest key not below key.
+bool Ceiling (
+  Tree* tree,                           // The tree to search.
+  const char* key,                      // The key.
+  char* found,                          // Out: the key found (may be NULL).
+  size_t len,                           // Bytes at found.
+  int* value)                           // Out: its value (may be NULL).
+{                                       // ------------- Ceiling ----------------
+  return Nearest(tree,key,false,found,len,value);
+}                                       // ------------- Ceiling ----------------
+// Select() and Percentile(): the pair with k keys below it, or for k<0 the
+// one at percentile pct of however many keys there are once the lock is
+// held. The key is copied out before the lock is dropped.
+static bool Nth (
+  Tree* tree,                           // The tree to search.
+  long k,                               // Keys below the one wanted, or -1.
+  double pct,                           // Percentile wanted (k<0).
+  char* found,                          // Out: the key found (may be NULL).
+  size_t len,                           // Bytes at found.
+  int* value)                           // Out: its value (may be NULL).
+{                                       // ------------- Nth --------------------
+  const char* key=NULL;                 // The key found.
+  int v=0;                              // Its value.
+  int status=LockTreeRead(tree);        // Lock the tree for reading.
+  if (status!=0)                        // Did we fail to lock the mutex?
+    return false;                       // Yes so return
+  long n=tree->size;                    // Keys right now.
+  if (k<0)                              // By percentile?
+  {                                     // Yes, nearest rank: the ceil(pct*n/100)-th key.
+    double r=pct/100.0*n;               // Its rank...
+    k=(long)r;                          // ...rounded...
+    if (k<r)                            // ...up...
+      k++;                              // ...to a whole key...
+    k=(k>0)?k-1:0;                      // ...and counted from 0.
+  }                                     // Done with the percentile.
+  if (k<n&&tree->snap!=NULL)            // On a snapshot?
+  {
+    key=SnapKey(tree->snap,(size_t)k);  // Yes, the node array is in key order.
+    v=SnapNodes(tree->snap)[k].value;   // Its value.
+  }                                     // Done with the snapshot.
+  else if (k<n&&tree->kind==TREE_KIND_BPLUS)// B+tree?
+  {
+    const BTreeLeaf* l=tree->bt.head;   // Yes, count along the leaves.
+    while (k>=l->h.n)                   // Past this leaf?
+    {
+      k-=l->h.n;                        // Yes, skip its keys...
+      l=l->next;                        // ...to the next one.
+    }                                   // Done skipping.
+    key=l->h.keys[k];                   // The key...
+    v=l->value[k];                      // ...and value.
+  }                                     // Done with the B+tree.
+  else if (k<n)                         // Red-black tree.
+  {
+    TreeNode* p=tree->root;             // From the root down.
+    while (k!=NodeCount(p->left))       // Not this one?
+    {
+      if (k<NodeCount(p->left))         // In the left subtree?
+        p=p->left;                      // Yes, go left.
+      else                              // No, in the right one.
+      {
+        k-=NodeCount(p->left)+1;        // Past the left subtree and p...
+        p=p->right;                     // ...go right.
+      }
+    }                                   // Done walking.
+    key=p->key;                         // The key...
+    v=p->value;                         // ...and value.
+  }                                     // Done with the red-black tree.
+  if (key!=NULL)                        // Found one?
+  {
+    if (found!=NULL&&len>0)             // Room for the key?
+      snprintf(found,len,"%s",key);     // Yes, copy it (truncated).
+    if (value!=NULL)                    // Want the value?
+      *value=v;                         // Yes.
+  }                                     // Done copying out.
+  status=UnlockTree(tree);              // Unlock the tree.
+  if (status!=0)                        // Did we fail to unlock the mutex?
+    errExitEN(status,"pthread_mutex_unlock");// Yes, print error and exit.
+  return key!=NULL;                     // Found or not.
+}                                       // ------------- Nth --------------------
+// A function to find the k-th smallest key (k from 0), in O(log n).
+bool Select (
+  Tree* tree,                           // The tree to search.
+  long k,                               // Keys below the one wanted.
+  char* found,                          // Out: the key found (may be NULL).
+  size_t len,                           // Bytes at found.
+  int* value)                           // Out: its value (may be NULL).
+{                                       // ------------- Select -----------------
+  if (k<0)                              // Before the first key?
+    return false;                       // Nothing there.
+  return Nth(tree,k,0,found,len,value);
+}                                       // ------------- Select -----------------
+// A function to count the keys below key, in O(log n). Returns minus the
+// errno value if the tree could not be locked.
+long Rank (
+  Tree* tree,                           // The tree to search.
+  const char* key)                      // The key.
+{                                       // ------------- Rank -------------------
+  long r=0;                             // Keys below key so far.
+  int status=LockTreeRead(tree);        // Lock the tree for reading.
+  if (status!=0)                        // Did we fail to lock the mutex?
+    return -status;                     // Yes, tell the caller why.
+  if (tree->snap!=NULL)                 // On a snapshot?
+    r=(long)SnapBound(tree->snap,key,false);// Yes, where key would go.
+  else if (tree->kind==TREE_KIND_BPLUS) // B+tree?
+  {
+    for (const BTreeLeaf* l=tree->bt.head;l!=NULL;l=l->next)// Yes, along the leaves.
+    {
+      int i=0;                          // Keys of this leaf below key.
+      while (i<l->h.n&&strcmp(l->h.keys[i],key)<0)
+        i++;                            // One more.
+      r+=i;                             // Counted.
+      if (i<l->h.n)                     // Reached key?
+        break;                          // Yes, nothing further is below it.
+    }                                   // Done walking.
+  }                                     // Done with the B+tree.
+  else                                  // Red-black tree.
+  {
+    TreeNode* p=tree->root;             // From the root down.
+    while (p!=NULL)                     // While we haven't fallen off the tree.
+    {
+      if (strcmp(key,p->key)<=0)        // Is p at or above key?
+        p=p->left;                      // Yes, the ones below are to the left.
+      else                              // No, p and its left subtree are below.
+      {
+        r+=NodeCount(p->left)+1;        // Count them...
+        p=p->right;                     // ...and go right.
+      }
+    }                                   // Done walking.
+  }                                     // Done with the red-black tree.
+  status=UnlockTree(tree);              // Unlock the tree.
+  if (status!=0)                        // Did we fail to unlock the mutex?
+    errExitEN(status,"pthread_mutex_unlock");// Yes, print error and exit.
+  return r;                             // Keys below key.
+}                                       // ------------- Rank -------------------
+// A function to find the key at percentile pct of the keys (nearest rank:
+// the smallest key with at least pct percent of the keys at or below it;
+// 0 gives the smallest key, 100 the largest), in O(log n).
+bool Percentile (
+  Tree* tree,                           // The tree to search.
+  double pct,                           // The percentile, 0 to 100.
+  char* found,                          // Out: the key found (may be NULL).
+  size_t len,                           // Bytes at found.
+  int* value)                           // Out: its value (may be NULL).
+{                                       // ------------- Percentile -------------
+  if (!(pct>=0&&pct<=100))              // Out of range (or NaN)?
+    return false;                       // No such key.
+  return Nth(tree,-1,pct,found,len,value);
+}                                       // ------------- Percentile -------------
+// Make key the cursor's resume point.
+static void CursorFrom (
+  TreeCursor* cur,                      // The cursor.
+  const char* key)                      // Where to resume.
+{                                       // ------------- CursorFrom -------------
+  size_t len=strlen(key)+1;             // Bytes needed.
+  if (len>cur->fromcap)                 // Room for it?
+  {
+    char* p=(char*) realloc(cur->from,len);// No, grow.
+    if (p==NULL)                        // Did we fail to allocate memory?
+      errExit("realloc");               // Yes, print error and exit.
+    cur->from=p;                        // The bigger buffer.
+    cur->fromcap=len;                   // Its size.
+  }                                     // Done growing.
+  memcpy(cur->from,key,len);            // Our copy.
+}                                       // ------------- CursorFrom -------------
+// Add a pair to the cursor's batch (readers' lock held).
+static void CursorAdd (
+  TreeCursor* cur,                      // The cursor.
+  const char* key,                      // The key.
+  int value)                            // Its value.
+{                                       // ------------- CursorAdd --------------
+  size_t len=strlen(key)+1;             // Bytes needed.
+  if (cur->used+len>cur->cap)           // Room for it?
+  {
+    size_t cap=(cur->cap*2>cur->used+len)?cur->cap*2:cur->used+len;
+    char* p=(char*) realloc(cur->buf,cap);// No, grow.
+    if (p==NULL)                        // Did we fail to allocate memory?
+      errExit("realloc");               // Yes, print error and exit.
+    cur->buf=p;                         // The bigger buffer.
+    cur->cap=cap;                       // Its size.
+  }                                     // Done growing.
+  memcpy(cur->buf+cur->used,key,len);   // The key...
+  cur->off[cur->n]=cur->used;           // ...where it is...
+  cur->value[cur->n]=value;             // ...its value.
+  cur->used+=len;                       // Bytes used.
+  cur->n++;                             // One more pair.
+}                                       // ------------- CursorAdd --------------
+// Is key past the cursor's upper bound?
+static bool CursorPast (
+  const TreeCursor* cur,                // The cursor.
+  const char* key)                      // The key.
+{                                       // ------------- CursorPast -------------
+  return cur->hi!=NULL&&strcmp(key,cur->hi)>0;
+}                                       // ------------- CursorPast -------------
+// Copy the next batch, starting after the last key handed out.
+static void CursorFill (TreeCursor* cur)
+{                                       // ------------- CursorFill -------------
+  Tree* tree=cur->tree;                 // The tree walked.
+  bool more=false;                      // Stopped on a full batch?
+  if (cur->n>0)                         // Handed anything out yet?
+  {
+    CursorFrom(cur,cur->buf+cur->off[cur->n-1]);// Yes, resume after the last one.
+    cur->strict=true;                   // Not at it.
+  }                                     // Done with the resume point.
+  cur->n=cur->pos=0;                    // Empty batch.
+  cur->used=0;                          // No keys.
+  int status=LockTreeRead(tree);        // Lock the tree for reading.
+  if (status!=0)                        // Did we fail to lock the mutex?
+    errExitEN(status,"pthread_mutex_lock");// Yes, print error and exit.
+  if (tree->snap!=NULL)                 // Still on a snapshot?
+  {                                     // Yes, along the node array.
+    const TreeSnapHeader* h=tree->snap; // The image.
+    size_t i=(cur->from!=NULL)?SnapBound(h,cur->from,cur->strict):0;
+    for (;i<h->count&&!CursorPast(cur,SnapKey(h,i));i++)
+    {
+      if (cur->n==TREE_SCAN_BATCH)      // Batch full?
+      {
+        more=true;                      // Yes, there is more.
+        break;                          // Next time.
+      }                                 // Done checking the batch.
+      CursorAdd(cur,SnapKey(h,i),SnapNodes(h)[i].value);// Take it.
+    }                                   // Done walking the image.
+  }                                     // Done with the snapshot.
+  else if (tree->kind==TREE_KIND_BPLUS) // B+tree?
+  {                                     // Yes, along the leaves.
+    const BTreeLeaf* l=tree->bt.head;   // From the start...
+    int i=0;                            // ...of the first leaf...
+    if (cur->from!=NULL&&!BTreeCeiling(&tree->bt,cur->from,cur->strict,&l,&i))
+      l=NULL;                           // ...or the resume point, if anything is there.
+    while (l!=NULL)                     // Until we run off the last leaf.
+    {
+      if (i==l->h.n)                    // Off this leaf?
+      {
+        l=l->next;                      // Yes, on to the next one.
+        i=0;                            // From its start.
+        continue;                       // Check it.
+      }                                 // Done moving on.
+      if (CursorPast(cur,l->h.keys[i])) // Past the range?
+        break;                          // Yes, done.
+      if (cur->n==TREE_SCAN_BATCH)      // Batch full?
+      {
+        more=true;                      // Yes, there is more.
+        break;                          // Next time.
+      }                                 // Done checking the batch.
+      CursorAdd(cur,l->h.keys[i],l->value[i]);// Take it.
+      i++;                              // Next one.
+    }                                   // Done walking leaves.
+  }                                     // Done with the B+tree.
+  else                                  // Red-black tree.
+  {
+    TreeNode* p=NULL;                   // First node of the batch.
+    if (cur->from!=NULL)                // Resuming?
+      p=CeilingNode(tree,cur->from,cur->strict);// Yes, from there.
+    else if (tree->root!=NULL)          // No, from the start, if any.
+      p=FindMin(tree->root);            // The smallest key.
+    for (;p!=NULL&&!CursorPast(cur,p->key);p=Successor(p))
+    {
+      if (cur->n==TREE_SCAN_BATCH)      // Batch full?
+      {
+        more=true;                      // Yes, there is more.
+        break;                          // Next time.
+      }                                 // Done checking the batch.
+      CursorAdd(cur,p->key,p->value);   // Take it.
+    }                                   // Done walking in order.
+  }                                     // Done with the red-black tree.
+  status=UnlockTree(tree);              // Unlock the tree.
+  if (status!=0)                        // Did we fail to unlock the mutex?
+    errExitEN(status,"pthread_mutex_unlock");// Yes, print error and exit.
+  cur->done=!more;                      // Last batch?
+}                                       // ------------- CursorFill -------------
+// A function to open a cursor on lo<=key<=hi.
+void CursorOpen (
+  TreeCursor* cur,                      // The cursor.
+  Tree* tree,                           // The tree to walk.
+  const char* lo,                       // Lower bound, or NULL.
+  const char* hi)                       // Upper bound, or NULL.
+{                                       // ------------- CursorOpen -------------
+  memset(cur,0,sizeof(*cur));           // Empty, nothing handed out.
+  cur->tree=tree;                       // The tree.
+  if (hi!=NULL)                         // Bounded above?
+  {
+    cur->hi=strdup(hi);                 // Yes, our own copy.
+    if (cur->hi==NULL)                  // Did we fail to allocate memory?
+      errExit("strdup");                // Yes, print error and exit.
+  }                                     // Done with the upper bound.
+  if (lo!=NULL)                         // Bounded below?
+    CursorFrom(cur,lo);                 // Yes, start there.
+}                                       // ------------- CursorOpen -------------
+// A function to get the next pair in order.
+bool CursorNext (
+  TreeCursor* cur,                      // The cursor.
+  const char** key,                     // Out: the key (valid until the next call).
+  int* value)                           // Out: its value.
+{                                       // ------------- CursorNext -------------
+  while (cur->pos==cur->n)              // Batch used up?
+  {
+    if (cur->done)                      // Was it the last one?
+      return false;                     // Yes, the walk is over.
+    CursorFill(cur);                    // No, get the next one.
+  }                                     // Done refilling.
+  *key=cur->buf+cur->off[cur->pos];     // The key...
+  *value=cur->value[cur->pos];          // ...its value...
+  cur->pos++;                           // ...and on to the next.
+  return true;                          // A pair.
+}                                       // ------------- CursorNext -------------
+// A function to move a cursor so the next pair is the first not below key.
+void CursorSeek (
+  TreeCursor* cur,                      // The cursor.
+  const char* key)                      // Where to go.
+{                                       // ------------- CursorSeek -------------
+  CursorFrom(cur,key);                  // Resume there...
+  cur->strict=false;                    // ...at key itself if present.
+  cur->n=cur->pos=0;                    // Drop the batch.
+  cur->done=false;                      // Look again.
+}                                       // ------------- CursorSeek -------------
+// A function to release a cursor.
+void CursorClose (TreeCursor* cur)
+{                                       // ------------- CursorClose ------------
+  free(cur->hi);                        // The bound...
+  free(cur->from);                      // ...the resume point...
+  free(cur->buf);                       // ...and the batch.
+  memset(cur,0,sizeof(*cur));           // Nothing left.
+}                                       // ------------- CursorClose ------------
+// A function to visit the pairs with lo<=key<=hi in order. fn runs with no
+// lock held, so it may call back into the tree.
+long RangeScan (
+  Tree* tree,                           // The tree to walk.
+  const char* lo,                       // Lower bound, or NULL.
+  const char* hi,                       // Upper bound, or NULL.
+  TreeScanFn fn,                        // Called for every pair.
+  void* arg)                            // Passed to fn.
+{                                       // ------------- RangeScan --------------
+  TreeCursor cur;                       // The walk.
+  const char* k=NULL;                   // Current key.
+  int v=0;                              // Its value.
+  long n=0;                             // Pairs visited.
+  CursorOpen(&cur,tree,lo,hi);          // From lo to hi.
+  while (CursorNext(&cur,&k,&v))        // Every pair...
+  {
+    n++;                                // ...counted...
+    if (!fn(k,v,arg))                   // ...and visited, unless told to stop.
+      break;                            // Stop.
+  }                                     // Done walking.
+  CursorClose(&cur);                    // Done with the cursor.
+  return n;                             // Pairs visited.
+}                                       // ------------- RangeScan --------------
+// The node before p in key order, through the parent pointers.
+static TreeNode* Predecessor (TreeNode* p)
+{                                       // ------------- Predecessor ------------
+  if (p->left!=NULL)                    // Anything to the left?
+    return FindMax(p->left);            // Yes, its largest.
+  TreeNode* o=p->parent;                // No, climb...
+  while (o!=NULL&&p==o->left)           // ...while we come from the left.
+  {
+    p=o;                                // Up...
+    o=o->parent;                        // ...one level.
+  }                                     // Done climbing.
+  return o;                             // First ancestor we are right of.
+}                                       // ------------- Predecessor ------------
+// Where a batch's next key search starts (tmtx held). Keys come in increasing
+// order, so instead of the root the walk starts from the last node the batch
+// touched (x, NULL for the root), climbing only until the subtree is bounded
+// above by a key larger than key: neighbouring keys share most of their path.
+static TreeNode* Finger (
+  Tree* tree,                           // The tree.
+  TreeNode* x,                          // Last node touched (key above it), or NULL.
+  const char* key)                      // The next key.
+{                                       // ------------- Finger -----------------
+  if (x==NULL)                          // Nowhere to start from?
+    return tree->root;                  // Then from the top.
+  while (x->parent!=NULL&&!(x==x->parent->left&&strcmp(key,x->parent->key)<0))
+    x=x->parent;                        // Key may lie beyond this subtree: up.
+  return x;                             // Key is under x if anywhere.
+}                                       // ------------- Finger -----------------
+// Descend() from node p rather than the root, for writers holding tmtx.
+static void Seek (
+  TreeNode* p,                          // Where to start.
+  const char* key,                      // The key to look for.
+  TreeNode** match,                     // Out: node holding key, or NULL.
+  TreeNode** parent,                    // Out: last node passed.
+  int* dir)                             // Out: <0 left of it, >0 right of it.
+{                                       // ------------- Seek -------------------
+  TreeNode* o=NULL;                     // No parent yet.
+  int c=0;                              // Last comparison.
+  while (p!=NULL)                       // While we haven't fallen off the tree.
+  {
+    c=strcmp(key,p->key);               // Which way?
+    if (c==0)                           // Found it?
+      break;                            // Yes.
+    o=p;                                // Remember the parent.
+    p=(c<0)?p->left:p->right;           // Go left or right.
+  }                                     // Done walking.
+  *match=p;                             // Node with the key, if any.
+  *parent=o;                            // Where it would hang.
+  *dir=c;                               // On which side.
+}                                       // ------------- Seek -------------------
+// Order batch pairs by key; equal keys keep their order in the batch.
+static int ComparePairs (
+  const void* a,                        // A TreePair**.
+  const void* b)                        // Another.
+{                                       // ------------- ComparePairs -----------
+  const TreePair* p=*(const TreePair* const*)a;// First pair.
+  const TreePair* q=*(const TreePair* const*)b;// Second pair.
+  int c=strcmp(p->key,q->key);          // By key...
+  if (c!=0)                             // ...if they differ...
+    return c;                           // ...that decides.
+  return (p>q)-(p<q);                   // Then by place in the batch.
+}                                       // ------------- ComparePairs -----------
+// Order batch keys.
+static int CompareKeys (
+  const void* a,                        // A char**.
+  const void* b)                        // Another.
+{                                       // ------------- CompareKeys ------------
+  return strcmp(*(char* const*)a,*(char* const*)b);
+}                                       // ------------- CompareKeys ------------
+// A function to build an empty tree from n pairs sorted by strictly increasing
+// key in O(n), without a single comparison-driven descent or rotation. The
+// tree is built before the lock is taken and published in one step. Returns
+// 0, EINVAL if the pairs are out of order or ENOTEMPTY if the tree has keys.
+int BulkLoad (
+  Tree* tree,                           // The tree to load.
+  const TreePair* pairs,                // The pairs in key order.
+  size_t n)                             // How many.
+{                                       // ------------- BulkLoad ---------------
+  for (size_t i=1;i<n;i++)              // Strictly increasing?
+    if (strcmp(pairs[i-1].key,pairs[i].key)>=0)// Out of order or repeated?
+      return EINVAL;                    // Yes, refuse.
+  if (n==0)                             // Nothing to load?
+    return 0;                           // Done.
+  BTree bt;                             // The B+tree (B+tree kind).
+  TreeNode** nodes=NULL;                // The nodes in key order (red-black kind).
+  TreeNode* root=NULL;                  // Their root.
+  if (tree->kind==TREE_KIND_BPLUS)      // B+tree?
+  {
+    BTreeInit(&bt);                     // Yes, an empty one...
+    BTreeBulkLoad(&bt,pairs,n);         // ...built bottom up.
+  }                                     // Done with the B+tree.
+  else                                  // No, a red-black tree.
+  {
+    nodes=(TreeNode**) malloc(n*sizeof(TreeNode*));// Room for the nodes.
+    if (nodes==NULL)                    // Did we fail to allocate memory?
+      errExit("malloc");                // Yes, print error and exit.
+    for (size_t i=0;i<n;i++)            // Make them outside the lock.
+      nodes[i]=NewNode(tree,pairs[i].key,pairs[i].value);
+    root=BuildTree(nodes,n);            // Link them up.
+  }                                     // Done building.
+  int err=LockTree(tree);               // Lock the tree.
+  if (err==0)                           // Did we get the lock?
+  {
+    if (tree->size!=0)                  // Yes, but does the tree (or snapshot) have keys?
+      err=ENOTEMPTY;                    // Yes, loading is for empty trees; leave it be.
+    else                                // No, publish what we built.
+    {
+      Thaw(tree);                       // Off an (empty) snapshot, if still on it.
+      WriteBegin(tree);                 // Readers must revalidate from here.
+      if (tree->kind==TREE_KIND_BPLUS)  // B+tree?
+        tree->bt=bt;                    // Yes, take it over.
+      else                              // No.
+        tree->root=root;                // The red-black tree.
+      tree->size=(int)n;                // All of them.
+      WriteEnd(tree);                   // Stable again.
+    }                                   // Done publishing.
+    int status=UnlockTree(tree);        // Unlock the tree.
+    if (status!=0)                      // Did we fail to unlock the mutex?
+      errExitEN(status,"pthread_mutex_unlock");// Yes, print error and exit.
+  }                                     // Done with the lock.
+  if (err!=0)                           // Nobody saw what we built?
+  {
+    if (tree->kind==TREE_KIND_BPLUS)    // B+tree?
+      BTreeDestroy(&bt);                // Yes, free it.
+    else                                // No, give the nodes back.
+      for (size_t i=0;i<n;i++)
+        ReleaseNode(tree,nodes[i]);
+  }                                     // Done cleaning up.
+  free(nodes);                          // Done with the list.
+  return err;                           // Loaded or not.
+}                                       // ------------- BulkLoad ---------------
+// A function to insert or update n pairs under one acquisition of the lock.
+// The batch is sorted first (a key given twice gets its last value), so the
+// inserts walk the tree left to right and each search starts from the node
+// the previous one touched rather than from the root. New nodes are made
+// before the lock is taken. Returns the number of keys that were new.
+long InsertBatch (
+  Tree* tree,                           // The tree to insert into.
+  const TreePair* pairs,                // The pairs, in any order.
+  size_t n)                             // How many.
+{                                       // ------------- InsertBatch ------------
+  long added=0;                         // Keys that were new.
+  if (n==0)                             // Nothing to do?
+    return 0;                           // No.
+  const TreePair** order=(const TreePair**) malloc(n*sizeof(TreePair*));
+  TreeNode** spare=NULL;                // Nodes made ahead (red-black kind).
+  if (order==NULL)                      // Did we fail to allocate memory?
+    errExit("malloc");                  // Yes, print error and exit.
+  for (size_t i=0;i<n;i++)              // The batch...
+    order[i]=pairs+i;                   // ...by reference...
+  qsort(order,n,sizeof(order[0]),ComparePairs);// ...in key order.
+  if (tree->kind==TREE_KIND_RB)         // Red-black tree?
+  {
+    spare=(TreeNode**) malloc(n*sizeof(TreeNode*));// Yes, a node per pair...
+    if (spare==NULL)                    // Did we fail to allocate memory?
+      errExit("malloc");                // Yes, print error and exit.
+    for (size_t i=0;i<n;i++)            // ...made outside the lock.
+      spare[i]=NewNode(tree,order[i]->key,order[i]->value);
+  }                                     // Done making nodes.
+  int status=LockTree(tree);            // Lock the tree.
+  if (status==0)                        // Did we get the lock?
+  {
+    Thaw(tree);                         // Yes, off the snapshot if still on it.
+    WriteBegin(tree);                   // Readers must revalidate from here.
+    TreeNode* x=NULL;                   // Last node touched.
+    for (size_t i=0;i<n;i++)            // Every pair, in key order.
+    {
+      char* key=order[i]->key;          // The key.
+      int value=order[i]->value;        // Its value.
+      if (tree->kind==TREE_KIND_BPLUS)  // B+tree?
+      {
+        if (BTreeInsert(&tree->bt,key,value))// Yes, was the key new?
+        {
+          tree->size++;                 // Yes, one more.
+          added++;                      // Counted.
+        }                               // Done counting.
+        continue;                       // Next pair.
+      }                                 // Done with the B+tree.
+      TreeNode* m=NULL;                 // Node already holding the key.
+      TreeNode* o=NULL;                 // Parent of the insertion point.
+      int c=0;                          // Side of the parent it goes on.
+      Seek(Finger(tree,x,key),key,&m,&o,&c);// Search from near the last one.
+      if (m!=NULL)                      // Is the key already in the tree?
+      {                                 // Yes, so replace its value.
+        m->value=value;                 // The new value.
+        if (m->keycap==0)               // Is the key the caller's?
+          m->key=key;                   // Yes, take the new one.
+        x=m;                            // Next search starts here.
+      }                                 // Done replacing.
+      else                              // No, so link a new node in.
+      {
+        LinkNode(tree,spare[i],o,c);    // Hang it in and rebalance.
+        x=spare[i];                     // Next search starts here.
+        spare[i]=NULL;                  // It is the tree's now.
+        added++;                        // One more new key.
+      }                                 // Done linking.
+    }                                   // Done with the batch.
+    WriteEnd(tree);                     // Stable again.
+    status=UnlockTree(tree);            // Unlock the tree.
+    if (status!=0)                      // Did we fail to unlock the mutex?
+      errExitEN(status,"pthread_mutex_unlock");// Yes, print error and exit.
+  }                                     // Done with the lock.
+  for (size_t i=0;spare!=NULL&&i<n;i++) // Nodes we did not need...
+    if (spare[i]!=NULL)                 // ...(nobody ever saw them)...
+      ReleaseNode(tree,spare[i]);       // ...go back.
+  free(spare);                          // Done with the nodes...
+  free(order);                          // ...and the order.
+  return added;                         // Keys that were new.
+}                                       // ------------- InsertBatch ------------
+// A function to delete n keys under one acquisition of the lock. The keys
+// are sorted first and each search starts from the predecessor of the last
+// key deleted. Returns the number of keys that were there.
+long DeleteBatch (
+  Tree* tree,                           // The tree to delete from.
+  char* const* keys,                    // The keys, in any order.
+  size_t n)                             // How many.
+{                                       // ------------- DeleteBatch ------------
+  long removed=0;                       // Keys that were there.
+  if (n==0)                             // Nothing to do?
+    return 0;                           // No.
+  char** order=(char**) malloc(n*sizeof(char*));// The keys in order.
+  TreeNode** gone=(TreeNode**) malloc(n*sizeof(TreeNode*));// Nodes unlinked.
+  if (order==NULL||gone==NULL)          // Did we fail to allocate memory?
+    errExit("malloc");                  // Yes, print error and exit.
+  memcpy(order,keys,n*sizeof(char*));   // The batch...
+  qsort(order,n,sizeof(order[0]),CompareKeys);// ...in key order.
+  int status=LockTree(tree);            // Lock the tree.
+  if (status!=0)                        // Did we fail to lock the mutex?
+  {
+    free(order);                        // Yes, done with the order...
+    free(gone);                         // ...and the list.
+    return 0;                           // Nothing deleted.
+  }                                     // Done with lock failure.
+  Thaw(tree);                           // Off the snapshot, if still on it.
+  WriteBegin(tree);                     // Readers must revalidate from here.
+  TreeNode* x=NULL;                     // Where the next search starts.
+  for (size_t i=0;i<n;i++)              // Every key, in order.
+  {
+    if (tree->kind==TREE_KIND_BPLUS)    // B+tree?
+    {
+      if (BTreeDelete(&tree->bt,order[i]))// Yes, was it there?
+      {
+        tree->size--;                   // Yes, one less.
+        removed++;                      // Counted.
+      }                                 // Done counting.
+      continue;                         // Next key.
+    }                                   // Done with the B+tree.
+    TreeNode* p=NULL;                   // The node to delete.
+    TreeNode* o=NULL;                   // Its parent (unused).
+    int c=0;                            // Last comparison (unused).
+    Seek(Finger(tree,x,order[i]),order[i],&p,&o,&c);// Search from near the last one.
+    if (p==NULL)                        // Is it there?
+      continue;                         // No, next key.
+    x=Predecessor(p);                   // Stays in the tree, below the next key.
+    UnlinkNode(tree,p);                 // Take it out and rebalance.
+    gone[removed++]=p;                  // Free it once readers are told.
+  }                                     // Done with the batch.
+  WriteEnd(tree);                       // Stable again.
+  for (long i=0;i<removed&&tree->kind==TREE_KIND_RB;i++)
+    RetireNode(tree,gone[i]);           // Free or recycle the nodes.
+  status=UnlockTree(tree);              // Unlock the tree.
+  if (status!=0)                        // Did we fail to unlock the mutex?
+    errExitEN(status,"pthread_mutex_unlock");// Yes, print error and exit.
+  free(order);                          // Done with the order...
+  free(gone);                           // ...and the list.
+  return removed;                       // Keys that were there.
+}                                       // ------------- DeleteBatch ------------
+// A function to report how often a lock acquisition on the tree had to wait
+// (tmtx, or trw in rwlock mode) and for how many nanoseconds in all.
+void LockWaitStats (
+  Tree* tree,                           // The tree.
+  unsigned long* waits,                 // Out: acquisitions that blocked.
+  unsigned long* ns)                    // Out: total time they blocked.
+{                                       // ------------ LockWaitStats -----------
+  *waits=__atomic_load_n(&tree->lockwaits,__ATOMIC_RELAXED);
+  *ns=__atomic_load_n(&tree->lockwaitns,__ATOMIC_RELAXED);
+}                                       // ------------ LockWaitStats -----------
+// A snapshot image being put together in memory.
+typedef struct SnapImage
+{
+  TreeSnapNode* nodes;                  // The nodes in key order.
+  size_t n;                             // How many so far.
+  char* heap;                           // Their keys.
+  size_t used;                          // Bytes used at heap.
+  size_t cap;                           // Bytes at heap.
+} SnapImage;                            // SnapImage structure.
+// Append a pair to a snapshot image (pairs come in key order).
+static void SnapAdd (
+  SnapImage* im,                        // The image.
+  const char* key,                      // The key.
+  int value)                            // Its value.
+{                                       // ------------- SnapAdd ----------------
+  size_t len=strlen(key)+1;             // Bytes needed.
+  if (im->used+len>im->cap)             // Room for it?
+  {
+    size_t cap=(im->cap*2>im->used+len)?im->cap*2:im->used+len+4096;
+    char* p=(char*) realloc(im->heap,cap);// No, grow.
+    if (p==NULL)                        // Did we fail to allocate memory?
+      errExit("realloc");               // Yes, print error and exit.
+    im->heap=p;                         // The bigger heap.
+    im->cap=cap;                        // Its size.
+  }                                     // Done growing.
+  memcpy(im->heap+im->used,key,len);    // The key...
+  im->nodes[im->n].key=im->used;        // ...where it is...
+  im->nodes[im->n].value=value;         // ...its value.
+  im->nodes[im->n].unused=0;            // Nothing else.
+  im->used+=len;                        // Bytes used.
+  im->n++;                              // One more pair.
+}                                       // ------------- SnapAdd ----------------
+// Write len bytes to fd whatever the short writes; 0 or an errno value.
+static int WriteAll (
+  int fd,                               // Where to.
+  const void* buf,                      // What.
+  size_t len)                           // How much.
+{                                       // ------------- WriteAll ---------------
+  const char* p=(const char*)buf;       // What is left...
+  while (len>0)                         // ...until nothing is.
+  {
+    ssize_t w=write(fd,p,len);          // Write some.
+    if (w==-1)                          // Did it fail?
+    {
+      if (errno==EINTR)                 // Interrupted?
+        continue;                       // Yes, again.
+      return errno;                     // No, give up.
+    }                                   // Done with the failure.
+    p+=w;                               // Past what was written.
+    len-=(size_t)w;                     // Less left.
+  }                                     // Done writing.
+  return 0;                             // All of it.
+}                                       // ------------- WriteAll ---------------
+// A function to write the tree to path as a snapshot image (see the top of
+// thread_tree.h). The pairs are copied under the readers' lock, so the image
+// is the tree at one instant, and written after it is dropped. The file is
+// written next to path and renamed over it once it is on disk, so path
+// always holds a whole image. Returns 0 or an errno value.
+int SaveSnapshot (
+  Tree* tree,                           // The tree to save.
+  const char* path)                     // Where to.
+{                                       // ------------- SaveSnapshot -----------
+  SnapImage im;                         // The image.
+  memset(&im,0,sizeof(im));             // Empty.
+  int err=LockTreeRead(tree);           // Lock the tree for reading.
+  if (err!=0)                           // Did we fail to lock the mutex?
+    return err;                         // Yes, nothing written.
+  im.nodes=(TreeSnapNode*) malloc((tree->size+1)*sizeof(TreeSnapNode));
+  if (im.nodes==NULL)                   // Did we fail to allocate memory?
+    errExit("malloc");                  // Yes, print error and exit.
+  if (tree->snap!=NULL)                 // Still on a snapshot?
+  {
+    const TreeSnapHeader* h=tree->snap; // Yes, copy the image.
+    for (size_t i=0;i<h->count;i++)
+      SnapAdd(&im,SnapKey(h,i),SnapNodes(h)[i].value);
+  }                                     // Done with the snapshot.
+  else if (tree->kind==TREE_KIND_BPLUS) // B+tree?
+  {
+    for (const BTreeLeaf* l=tree->bt.head;l!=NULL;l=l->next)// Yes, along the leaves.
+      for (int i=0;i<l->h.n;i++)
+        SnapAdd(&im,l->h.keys[i],l->value[i]);
+  }                                     // Done with the B+tree.
+  else if (tree->root!=NULL)            // Red-black tree with keys?
+    for (TreeNode* p=FindMin(tree->root);p!=NULL;p=Successor(p))
+      SnapAdd(&im,p->key,p->value);     // In order.
+  err=UnlockTree(tree);                 // Unlock the tree.
+  if (err!=0)                           // Did we fail to unlock the mutex?
+    errExitEN(err,"pthread_mutex_unlock");// Yes, print error and exit.
+  TreeSnapHeader h;                     // The header.
+  memset(&h,0,sizeof(h));               // No stray bytes in the file.
+  memcpy(h.magic,TREE_SNAP_MAGIC,sizeof(h.magic));
+  h.version=TREE_SNAP_VERSION;          // This format...
+  h.nodesize=sizeof(TreeSnapNode);      // ...with nodes this big...
+  h.count=im.n;                         // ...this many...
+  h.heaplen=im.used;                    // ...and their keys.
+  char* tmp=(char*) malloc(strlen(path)+5);// Where it is written first.
+  if (tmp==NULL)                        // Did we fail to allocate memory?
+    errExit("malloc");                  // Yes, print error and exit.
+  sprintf(tmp,"%s.tmp",path);           // Next to path.
+  int fd=open(tmp,O_WRONLY|O_CREAT|O_TRUNC,S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+  if (fd==-1)                           // Could we create it?
+    err=errno;                          // No.
+  else                                  // Yes, fill it.
+  {
+    err=WriteAll(fd,&h,sizeof(h));      // The header...
+    if (err==0)
+      err=WriteAll(fd,im.nodes,im.n*sizeof(TreeSnapNode));// ...the nodes...
+    if (err==0)
+      err=WriteAll(fd,im.heap,im.used); // ...and the keys.
+    if (err==0&&fsync(fd)==-1)          // All on disk?
+      err=errno;                        // No.
+    if (close(fd)==-1&&err==0)          // Closed cleanly?
+      err=errno;                        // No.
+    if (err==0&&rename(tmp,path)==-1)   // In place of the old one?
+      err=errno;                        // No.
+    if (err!=0)                         // Anything go wrong?
+      unlink(tmp);                      // Yes, no half images left behind.
+  }                                     // Done with the file.
+  free(tmp);                            // Done with the name...
+  free(im.nodes);                       // ...the nodes...
+  free(im.heap);                        // ...and the keys.
+  return err;                           // Saved or not.
+}                                       // ------------- SaveSnapshot -----------
+// A function to map a snapshot file as a new tree configured by opts (NULL:
+// mutex mode, red-black kind), which serves reads from the mapping until its
+// first write. The header and sizes are checked, not every key, so loading
+// takes the same time whatever the file's size. The tree is the caller's;
+// DestroyTree() frees it and unmaps the file. Returns NULL with errno set if
+// the file cannot be opened or mapped, or EINVAL if it is not a snapshot.
+Tree* LoadSnapshot (
+  const char* path,                     // The snapshot file.
+  const TreeOptions* opts)              // The tree's options, or NULL.
+{                                       // ------------- LoadSnapshot -----------
+  int fd=open(path,O_RDONLY);           // Open the file.
+  if (fd==-1)                           // Could we?
+    return NULL;                        // No, errno says why.
+  struct stat st;                       // Its size.
+  if (fstat(fd,&st)==-1)                // Can we tell?
+  {
+    int e=errno;                        // No, keep the reason...
+    close(fd);                          // ...across the close.
+    errno=e;                            // Why we failed.
+    return NULL;                        // No tree.
+  }                                     // Done with the failure.
+  size_t len=(size_t)st.st_size;        // Bytes in the file.
+  if (len<sizeof(TreeSnapHeader))       // Room for a header?
+  {
+    close(fd);                          // No, done with the file.
+    errno=EINVAL;                       // Not a snapshot.
+    return NULL;                        // No tree.
+  }                                     // Done with a short file.
+  void* m=mmap(NULL,len,PROT_READ,MAP_PRIVATE,fd,0);// Map it.
+  int e=errno;                          // Why, if it failed.
+  close(fd);                            // The mapping keeps the file.
+  if (m==MAP_FAILED)                    // Did it fail?
+  {
+    errno=e;                            // Yes, that is why.
+    return NULL;                        // No tree.
+  }                                     // Done with the failure.
+  const TreeSnapHeader* h=(const TreeSnapHeader*)m;// The header.
+  uint64_t room=(len-sizeof(*h))/sizeof(TreeSnapNode);// Most nodes the file holds.
+  if (memcmp(h->magic,TREE_SNAP_MAGIC,sizeof(h->magic))!=0||h->version!=TREE_SNAP_VERSION||
+      h->nodesize!=sizeof(TreeSnapNode)||h->count>room||h->count>INT_MAX||h->heaplen>len||
+      sizeof(*h)+h->count*sizeof(TreeSnapNode)+h->heaplen!=len||
+      (h->count>0&&(h->heaplen==0||((const char*)m)[len-1]!='\0')))
+  {                                     // Not ours, or cut short.
+    munmap(m,len);                      // Done with it.
+    errno=EINVAL;                       // Not a snapshot.
+    return NULL;                        // No tree.
+  }                                     // Done checking.
+  Tree* tree=(Tree*) malloc(sizeof(Tree));// DestroyTree() frees it.
+  if (tree==NULL)                       // Did we fail to allocate memory?
+    errExit("malloc");                  // Yes, print error and exit.
+  InitializeWithOptions(tree,opts);     // An empty tree...
+  tree->snapmap=m;                      // ...holding the mapping...
+  tree->snaplen=len;                    // ...all of it...
+  tree->snap=h;                         // ...and serving the image...
+  tree->size=(int)h->count;             // ...with its keys.
+  return tree;                          // Ready.
+}                                       // ------------- LoadSnapshot -----------
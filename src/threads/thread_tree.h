@@ -17,6 +17,89 @@
  * to update the mutex of the parent element to point to the new element. The
  * function will also need to update the mutex of the deleted element to point
  * to the new element. 
+ *
+ * Concurrency modes (InitializeWithOptions()):
+ *   TREE_MODE_MUTEX       every operation takes tree->tmtx (what Initialize() sets up).
+ *                         Keys longer than the inline buffer are the caller's pointers
+ *                         and must outlive their node.
+ *   TREE_MODE_OPTIMISTIC  Lookup() takes no lock: it walks the tree and validates the
+ *                         walk against tree->seq, a sequence count writers make odd
+ *                         while they relink nodes, retrying (and after a few failures
+ *                         falling back to tmtx) if a writer got in the way. Insert and
+ *                         delete also search without the lock and only hold tmtx while
+ *                         linking, unlinking and rebalancing. Because readers may be
+ *                         standing on a node while it is deleted, the tree copies keys
+ *                         and never hands memory back before DestroyTree(): nodes go
+ *                         back to the slab and long keys' buffers to per-size free
+ *                         lists. This is the seqlock mode.
+ *   TREE_MODE_RWLOCK      Lookup() takes tree->trw for reading, so readers run in
+ *                         parallel with each other; writers take it for writing.
+ *   TREE_MODE_EPOCH       RCU-like. Lookup() takes no lock and never retries a hit:
+ *                         readers only announce themselves in one of the tree's epoch
+ *                         slots, and deleted nodes (with their copied keys) sit on a
+ *                         limbo list until every reader that could have seen them has
+ *                         left, then are freed. A miss that raced a rebalance is
+ *                         checked against tree->seq and retried, since a rotation can
+ *                         briefly hide a key from a walk. Writers search as in the
+ *                         optimistic mode and lock tmtx only to relink.
+ *
+ * Kinds (TreeOptions.kind):
+ *   TREE_KIND_RB          the red-black tree above, in any of the modes.
+ *   TREE_KIND_BPLUS       a B+tree (thread_btree.h) with cache-line aligned nodes of
+ *                         16 keys, SIMD prefix search and linked leaves. It copies its
+ *                         keys and has no lockless paths: Lookup() takes trw for
+ *                         reading in rwlock mode and tmtx in every other mode.
+ *
+ * Ordered access: Floor()/Ceiling() find the nearest key at or below/above a key, and
+ * a TreeCursor walks a key range in order. The cursor copies up to TREE_SCAN_BATCH
+ * pairs at a time under the readers' lock and hands them out with the lock dropped,
+ * then picks up again after the last key it handed out, so a long scan only ever
+ * holds writers off for one batch and carries on correctly whatever they did in
+ * between: every key is reported at most once and in increasing order, keys
+ * inserted ahead of the cursor are seen, and keys deleted ahead of it are not.
+ * RangeScan() is the callback form of the same walk.
+ *
+ * Bulk updates: BulkLoad() builds an empty tree from pairs already in key order in
+ * O(n), linking the nodes (or filling the B+tree's leaves and inner levels) directly
+ * instead of inserting them one by one, and publishes the result in one step.
+ * InsertBatch() and DeleteBatch() apply many updates under a single acquisition of
+ * the writers' lock. They sort the batch first, so the updates walk the tree from
+ * left to right and each red-black search starts from the node the last one touched
+ * instead of from the root.
+ *
+ * Lock waits: every acquisition of tmtx (trw in rwlock mode) is first tried without
+ * blocking; the ones that have to block are counted and timed, and LockWaitStats()
+ * reports both, so a benchmark can tell how much of its time went to contention.
+ *
+ * Order statistics: every red-black node counts the nodes in its subtree, kept up to
+ * date on the way up from an insert or delete and in LeftRotate()/RightRotate(), so
+ * Select() (the k-th smallest key), Rank() (keys below a key) and Percentile() take
+ * the readers' lock for one O(log n) walk. A mapped snapshot answers them by position
+ * in its node array. The B+tree kind keeps no counts and walks its leaves, in O(n).
+ *
+ * Snapshots: SaveSnapshot() writes the tree's pairs to a file in key order as a
+ * position-independent image: a header, an array of nodes in key order, each holding
+ * its key as an offset into a string heap that follows them, and the heap. No
+ * pointers are stored, so LoadSnapshot() just maps the file and the tree serves
+ * Lookup(), Floor(), Ceiling() and cursors from the mapping straight away, by binary
+ * search over the node array (the walk BulkLoad()'s balanced tree would take).
+ * Pages are only read as lookups touch them. The first write converts the image to
+ * an ordinary tree of the configured kind under the writers' lock, as BulkLoad()
+ * would, and from then on the tree behaves as if it had been built by inserts. Long
+ * keys may stay in the mapping (TREE_MODE_MUTEX and TREE_MODE_RWLOCK borrow them), so
+ * it is only unmapped by DestroyTree(). Images are in host byte order.
+ *
+ * Memory: nodes are carved out of per-tree slabs of TREE_SLAB_NODES and freed nodes
+ * go to a small per-thread cache (per thread slot, really) before the tree-wide free
+ * list, so InsertNode() gets its node before taking the tree lock and a delete hands
+ * it back without calling free(). Keys shorter than TREE_INLINE_KEY bytes are copied
+ * into the node itself in every mode, so a walk compares keys without leaving the
+ * node's cache lines.
+ *
+ * Other key types: keys here are strings compared with strcmp(). thread_gtree.h
+ * generates the same red-black tree (one mutex, like TREE_MODE_MUTEX) for any key and
+ * value type with an inlined comparison, and ThreadTree.hpp is its C++ template
+ * counterpart with the comparator as a template parameter.
  */
 #ifndef THREAD_TREE_H
 #define THREAD_TREE_H
@@ -29,7 +112,14 @@
 #include <assert.h>
 #include <limits.h>
 #include <stdbool.h>
+#include <sched.h>
+#include <time.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "tlpi_hdr.h"
+#include "thread_btree.h"
 
 // Define the color of the tree node (red or black).
 typedef enum
@@ -38,31 +128,159 @@ typedef enum
     BLACK                               // Black color.
 } NodeColor;                            // Color of each node.
 
+// Concurrency modes.
+typedef enum
+{
+    TREE_MODE_MUTEX,                    // One mutex around everything.
+    TREE_MODE_OPTIMISTIC,               // Lockless validated lookups.
+    TREE_MODE_RWLOCK,                   // Shared lock for lookups.
+    TREE_MODE_EPOCH                     // Lockless lookups, deferred frees.
+} TreeMode;                             // How the tree is synchronized.
+
+// Data structures behind the API.
+typedef enum
+{
+    TREE_KIND_RB,                       // Red-black tree.
+    TREE_KIND_BPLUS                     // B+tree.
+} TreeKind;                             // What the tree is made of.
+
+// Options for InitializeWithOptions().
+typedef struct TreeOptions
+{
+    TreeMode mode;                      // Concurrency mode.
+    TreeKind kind;                      // Data structure.
+} TreeOptions;                          // TreeOptions structure.
+
+// Lockless attempts before a reader gives up and takes tmtx.
+#define TREE_OPTIMISTIC_RETRIES 8
+// Deepest walk a lockless reader trusts (a red-black tree of 2^63 nodes is shallower).
+#define TREE_MAX_DEPTH 128
+// Key buffer size classes (powers of two) for recycled key buffers.
+#define TREE_KEY_CLASSES 32
+// Pairs a cursor copies per trip under the lock.
+#define TREE_SCAN_BATCH 64
+// Thread slots: epoch counters and node caches (threads share them round robin).
+#define TREE_EPOCH_SLOTS 64
+// Keys shorter than this live in the node (64 bytes rounds a node to 128).
+#define TREE_INLINE_KEY 64
+// Nodes per slab chunk.
+#define TREE_SLAB_NODES 64
+// Nodes a thread slot's cache moves to or from the tree-wide free list at once.
+#define TREE_NODE_BATCH 32
+
+// Readers inside the tree, per epoch parity. One cache line per slot.
+typedef struct TreeEpochSlot
+{
+    unsigned long active[2];            // Readers that entered in an even/odd epoch.
+    char pad[64-2*sizeof(unsigned long)];// Keep slots off each other's lines.
+} TreeEpochSlot;                        // TreeEpochSlot structure.
+
+// First bytes of a snapshot file.
+#define TREE_SNAP_MAGIC "TREESNAP"
+// Snapshot format version.
+#define TREE_SNAP_VERSION 1
+
+// The start of a snapshot image; count nodes and heaplen bytes of keys follow.
+typedef struct TreeSnapHeader
+{
+    char magic[8];                      // TREE_SNAP_MAGIC (no NUL).
+    uint32_t version;                   // TREE_SNAP_VERSION.
+    uint32_t nodesize;                  // sizeof(TreeSnapNode) when it was written.
+    uint64_t count;                     // Nodes, in increasing key order.
+    uint64_t heaplen;                   // Bytes in the string heap.
+} TreeSnapHeader;                       // TreeSnapHeader structure.
+// A pair in a snapshot image.
+typedef struct TreeSnapNode
+{
+    uint64_t key;                       // Offset of its key (NUL terminated) in the heap.
+    int32_t value;                      // Its value.
+    uint32_t unused;                    // Zero.
+} TreeSnapNode;                         // TreeSnapNode structure.
+
 // Define the structure for each element in the tree
 typedef struct TreeNode
 {
     char* key;                          // The key of the node.
+    size_t keycap;                      // Bytes the tree owns at key (0: caller's key).
     int value;                          // Value of the element.
     int height;                         // Height of the element.
     NodeColor color;                    // Color of the element.
-    pthread_mutex_t nmtx;               // Mutex to protect the element.
+    int count;                          // Nodes in its subtree, itself included.
     struct TreeNode *left;              // Pointer to the left child.
     struct TreeNode *right;             // Pointer to the right child.
     struct TreeNode *parent;            // Pointer to the root of the tree.
+    unsigned long retired;              // Epoch it was unlinked in (epoch mode).
+    char ikey[TREE_INLINE_KEY];         // Short keys live here (last byte stays NUL).
 } TreeNode;                             // TreeNode structure.
+// A chunk of nodes. Chunks are only freed by DestroyTree().
+typedef struct TreeSlab
+{
+    struct TreeSlab* next;              // Next chunk of the tree.
+    TreeNode nodes[TREE_SLAB_NODES];    // The nodes.
+} TreeSlab;                             // TreeSlab structure.
+// Free nodes of one thread slot. One cache line per slot.
+typedef struct TreeNodeCache
+{
+    int lock;                           // Held while the cache is used (spin).
+    int count;                          // Nodes on the list.
+    TreeNode* head;                     // Free nodes linked through left.
+    char pad[64-2*sizeof(int)-sizeof(TreeNode*)];// Keep caches off each other's lines.
+} TreeNodeCache;                        // TreeNodeCache structure.
 // Define the structure for the tree
 typedef struct Tree
 {
     TreeNode *root;                     // Pointer to the root of the tree.
     pthread_mutex_t tmtx;               // Mutex to protect the tree.
     int size;                           // Number of nodes in the tree.             
+    TreeMode mode;                      // Concurrency mode.
+    unsigned long seq;                  // Odd while a writer relinks nodes.
+    char* keyfree[TREE_KEY_CLASSES];    // Recycled long-key buffers by class (optimistic).
+    pthread_rwlock_t trw;               // Reader/writer lock (rwlock mode).
+    unsigned long epoch;                // Global epoch (epoch mode).
+    TreeNode* limbo;                    // Unlinked nodes awaiting a grace period.
+    TreeEpochSlot slots[TREE_EPOCH_SLOTS];// Readers per slot and epoch parity.
+    pthread_mutex_t smtx;               // Protects slabs, freenodes and keyfree.
+    TreeSlab* slabs;                    // Node chunks.
+    TreeNode* freenodes;                // Tree-wide free nodes (through left).
+    TreeNodeCache caches[TREE_EPOCH_SLOTS];// Free nodes per thread slot.
+    TreeKind kind;                      // Data structure.
+    BTree bt;                           // The B+tree (B+tree kind).
+    unsigned long lockwaits;            // Lock acquisitions that had to wait.
+    unsigned long lockwaitns;           // Nanoseconds spent waiting in them.
+    const TreeSnapHeader* snap;         // Image still serving the tree, or NULL.
+    void* snapmap;                      // Mapped snapshot file, or NULL.
+    size_t snaplen;                     // Bytes mapped.
 } Tree;                                 // Tree structure.
 
+// A key/value pair for BulkLoad() and InsertBatch().
+typedef BTreePair TreePair;
+// Called by RangeScan() for every pair in the range; return false to stop.
+typedef bool (*TreeScanFn)(const char* key,int value,void* arg);
+// An ordered walk over a key range (see the top of this file).
+typedef struct TreeCursor
+{
+    Tree* tree;                         // The tree walked.
+    char* hi;                           // Upper bound (owned copy), or NULL.
+    char* from;                         // Where the next batch starts (owned copy), or NULL.
+    size_t fromcap;                     // Bytes at from.
+    bool strict;                        // Start after from rather than at it.
+    bool done;                          // Nothing left after this batch.
+    int n;                              // Pairs in the batch.
+    int pos;                            // Next pair to hand out.
+    int value[TREE_SCAN_BATCH];         // Their values.
+    size_t off[TREE_SCAN_BATCH];        // Their keys' offsets in buf.
+    char* buf;                          // The batch's keys.
+    size_t cap;                         // Bytes at buf.
+    size_t used;                        // Bytes used at buf.
+} TreeCursor;                           // TreeCursor structure.
+
 // A function to initialize the Red-Black tree.
 void Initialize(Tree* tree);
+// A function to initialize the tree with a concurrency mode.
+void InitializeWithOptions(Tree* tree,const TreeOptions* opts);
 // A function to destroy the tree.
 void DestroyTree(Tree* tree);
-// A function to delete a subtree.
+// A function to release the keys a subtree owns (its nodes belong to the slab).
 void DestroySubtree(TreeNode* node);
 // A function to insert or add a node.
 void InsertNode(Tree* tree, char* key, int value);
@@ -70,6 +288,38 @@ void InsertNode(Tree* tree, char* key, int value);
 void DeleteNode(Tree* tree, char* key);
 // A function to search the Red-Black Tree.
 bool Lookup(Tree* tree,char* key, int* value);
+// A function to find the largest key not above key (copied to found, truncated to len).
+bool Floor(Tree* tree,const char* key,char* found,size_t len,int* value);
+// A function to find the smallest key not below key (copied to found, truncated to len).
+bool Ceiling(Tree* tree,const char* key,char* found,size_t len,int* value);
+// A function to visit the pairs with lo<=key<=hi in order (NULL: unbounded); returns the count.
+long RangeScan(Tree* tree,const char* lo,const char* hi,TreeScanFn fn,void* arg);
+// A function to open a cursor on lo<=key<=hi (NULL: unbounded).
+void CursorOpen(TreeCursor* cur,Tree* tree,const char* lo,const char* hi);
+// A function to get the next pair; *key stays valid until the next call.
+bool CursorNext(TreeCursor* cur,const char** key,int* value);
+// A function to move a cursor so the next pair is the first not below key.
+void CursorSeek(TreeCursor* cur,const char* key);
+// A function to release a cursor.
+void CursorClose(TreeCursor* cur);
+// A function to build an empty tree from pairs in increasing key order (0, EINVAL or ENOTEMPTY).
+int BulkLoad(Tree* tree,const TreePair* pairs,size_t n);
+// A function to insert or update n pairs under one lock; returns the keys that were new.
+long InsertBatch(Tree* tree,const TreePair* pairs,size_t n);
+// A function to delete n keys under one lock; returns the keys that were there.
+long DeleteBatch(Tree* tree,char* const* keys,size_t n);
+// A function to report lock acquisitions that waited and the total wait in nanoseconds.
+void LockWaitStats(Tree* tree,unsigned long* waits,unsigned long* ns);
+// A function to find the k-th smallest key, from 0 (copied to found, truncated to len).
+bool Select(Tree* tree,long k,char* found,size_t len,int* value);
+// A function to count the keys below key (minus an errno value if it could not lock).
+long Rank(Tree* tree,const char* key);
+// A function to find the key at percentile pct (0-100, nearest rank), copied as by Select().
+bool Percentile(Tree* tree,double pct,char* found,size_t len,int* value);
+// A function to write the tree to path as a snapshot image (0 or an errno value).
+int SaveSnapshot(Tree* tree,const char* path);
+// A function to map a snapshot as a new tree (NULL opts: mutex); NULL and errno on failure.
+Tree* LoadSnapshot(const char* path,const TreeOptions* opts);
 // A function to balance the tree.
 //void BalanceTree(Tree* tree, TreeNode* node);
 // A function to rotate a node left.
@@ -78,8 +328,8 @@ void LeftRotate(Tree* tree,TreeNode* node);
 void RightRotate(Tree* tree,TreeNode* node);
 // A function to balance after insertion.
 void FixInsert(Tree* tree,TreeNode* node);
-// A function to balance after deletion.
-void FixDelete(Tree* tree,TreeNode* node);
+// A function to balance after deletion (node may be NULL, hence its parent).
+void FixDelete(Tree* tree,TreeNode* node,TreeNode* parent);
 // A function to find the minimum node in the tree.
 TreeNode* FindMin(TreeNode* node);
 // A function to find the maximum node in a tree.
@@ -0,0 +1,250 @@
+/**
+ * This program measures the thread_tree kinds against each other: the red-black
+ * tree and the B+tree behind the same Initialize/InsertNode/DeleteNode/Lookup API.
+ * For each kind it inserts n distinct keys in random order, looks every one of them
+ * up in a different random order, looks up keys that are not there, asks for every
+ * key's Rank() and Select()s every position (red-black only), and deletes
+ * them all again, printing the average time per operation of each phase. Then it
+ * does the same through the bulk calls: BulkLoad() from sorted pairs, DeleteBatch()
+ * and InsertBatch() of the whole key set in random order. Last it saves the tree
+ * with SaveSnapshot(), maps it back with LoadSnapshot(), looks every key up in the
+ * mapped image and times the first write, which turns the image into a tree. Keys are
+ * decimal numbers scattered over the key space, padded to the requested length, so
+ * neighbouring inserts land in different parts of the tree. Once n keys no longer
+ * fit in the caches, lookups are dominated by cache misses on the way down, which
+ * is where the B+tree's wide nodes pay off.
+ *
+ *    tree_bench [-n keys] [-l keylen] [-k rb|bplus|both] [-m mutex|optimistic|rwlock|epoch]
+ *               [-s snapshot-file]
+ */
+#include <time.h>
+#include <stdint.h>
+#include "thread_tree.h"
+
+static int n=1000000;                   // Keys to insert.
+static int keyLen=16;                   // Bytes per key.
+static char* keys;                      // The keys, keyLen+1 bytes apart.
+static char* misses;                    // Keys that are never inserted.
+static int nMiss;                       // How many of those.
+static int* order;                      // A random permutation of [0,n).
+static const char* snapPath="/tmp/tree_bench.snap";// Where snapshots go (removed after).
+
+// Monotonic time in nanoseconds.
+static double nowNs (void)
+{
+  struct timespec ts;                   // The time.
+  if (clock_gettime(CLOCK_MONOTONIC,&ts)==-1)
+    errExit("clock_gettime");
+  return ts.tv_sec*1e9+ts.tv_nsec;      // In nanoseconds.
+}
+__extension__ typedef unsigned __int128 u128;// For the scattering product.
+// Write key number i into buf: i scattered over [0,10^d) (a bijection, since the
+// multiplier is prime to 10), d digits wide, then padded to keyLen.
+static void makeKey (
+  char* buf,                            // keyLen+1 bytes.
+  uint64_t i)                           // Key number.
+{
+  int d=(keyLen<18)?keyLen:18;          // Digits.
+  uint64_t mod=1;                       // 10^d.
+  for (int j=0;j<d;j++)
+    mod*=10;
+  uint64_t mul=6364136223846793005ULL%mod;// A large multiplier...
+  while (mul%2==0||mul%5==0)            // ...prime to 10.
+    mul++;
+  uint64_t v=(uint64_t)((u128)(i%mod)*mul%mod);// Scattered.
+  for (int j=d-1;j>=0;j--,v/=10)        // Digits, most significant first.
+    buf[j]='0'+(char)(v%10);
+  memset(buf+d,'x',keyLen-d);           // Padding.
+  buf[keyLen]='\0';                     // End of key.
+}
+// Shuffle a[0..m) (xorshift, fixed seed so runs compare).
+static void shuffle (
+  int* a,                               // The array.
+  int m,                                // Its length.
+  uint64_t seed)                        // Seed.
+{
+  uint64_t x=seed;                      // Generator state.
+  for (int i=m-1;i>0;i--)
+  {
+    x^=x<<13;
+    x^=x>>7;
+    x^=x<<17;
+    int j=(int)(x%(uint64_t)(i+1));     // Pick one of [0,i].
+    int t=a[i];
+    a[i]=a[j];
+    a[j]=t;
+  }
+}
+// Order key numbers by their keys.
+static int compareKeys (
+  const void* a,                        // An int (key number).
+  const void* b)                        // Another.
+{
+  return strcmp(keys+(size_t)*(const int*)a*(keyLen+1),keys+(size_t)*(const int*)b*(keyLen+1));
+}
+// Print one phase.
+static void report (
+  const char* kind,                     // Tree kind.
+  const char* phase,                    // What was measured.
+  double ns,                            // Total time.
+  long ops,                             // Operations.
+  long hits)                            // Lookups that found their key.
+{
+  printf("%-6s %-12s %10.1f ns/op %9.2f Mops/s %10ld found\n",kind,phase,ns/ops,
+    ops/ns*1e3,hits);
+}
+// Run every phase against one kind of tree.
+static void runKind (
+  TreeKind kind,                        // Which tree.
+  TreeMode mode)                        // Which concurrency mode.
+{
+  const char* name=(kind==TREE_KIND_BPLUS)?"bplus":"rb";
+  Tree* tree=(Tree*) malloc(sizeof(Tree));// DestroyTree() frees it.
+  if (tree==NULL)
+    errExit("malloc");
+  TreeOptions opts={mode,kind};         // Options.
+  InitializeWithOptions(tree,&opts);    // Empty tree.
+  shuffle(order,n,0x9e3779b97f4a7c15ULL);// Insert order.
+  double t=nowNs();                     // Start.
+  for (int i=0;i<n;i++)
+    InsertNode(tree,keys+(size_t)order[i]*(keyLen+1),order[i]);
+  report(name,"insert",nowNs()-t,n,0);
+  shuffle(order,n,0x2545f4914f6cdd1dULL);// A different order for lookups.
+  long hits=0;                          // Lookups that found their key.
+  int v;                                // Value found.
+  t=nowNs();
+  for (int i=0;i<n;i++)
+    hits+=Lookup(tree,keys+(size_t)order[i]*(keyLen+1),&v)&&v==order[i];
+  report(name,"lookup-hit",nowNs()-t,n,hits);
+  hits=0;
+  t=nowNs();
+  for (int i=0;i<n;i++)
+    hits+=Lookup(tree,misses+(size_t)(i%nMiss)*(keyLen+1),&v);
+  report(name,"lookup-miss",nowNs()-t,n,hits);
+  if (kind==TREE_KIND_RB)               // The B+tree answers these in O(n).
+  {
+    hits=0;
+    t=nowNs();
+    for (int i=0;i<n;i++)               // Keys are distinct, so ranks are too.
+    {
+      long r=Rank(tree,keys+(size_t)order[i]*(keyLen+1));
+      hits+=r>=0&&r<n;                  // A rank, not an error.
+    }
+    report(name,"rank",nowNs()-t,n,hits);
+    hits=0;
+    t=nowNs();
+    for (int i=0;i<n;i++)
+      hits+=Select(tree,order[i],NULL,0,&v);
+    report(name,"select",nowNs()-t,n,hits);
+  }
+  t=nowNs();
+  for (int i=0;i<n;i++)
+    DeleteNode(tree,keys+(size_t)order[i]*(keyLen+1));
+  report(name,"delete",nowNs()-t,n,tree->size);
+  TreePair* pairs=(TreePair*) malloc((size_t)n*sizeof(TreePair));
+  char** batch=(char**) malloc((size_t)n*sizeof(char*));
+  if (pairs==NULL||batch==NULL)
+    errExit("malloc");
+  qsort(order,n,sizeof(int),compareKeys);// Key order for BulkLoad().
+  for (int i=0;i<n;i++)
+  {
+    pairs[i].key=keys+(size_t)order[i]*(keyLen+1);
+    pairs[i].value=order[i];
+  }
+  t=nowNs();
+  if (BulkLoad(tree,pairs,n)!=0)        // Empty again, so this must work.
+    fatal("BulkLoad failed");
+  report(name,"bulk-load",nowNs()-t,n,tree->size);
+  shuffle(order,n,0x9e3779b97f4a7c15ULL);// Batches come in random order.
+  for (int i=0;i<n;i++)
+  {
+    batch[i]=keys+(size_t)order[i]*(keyLen+1);
+    pairs[i].key=batch[i];
+    pairs[i].value=order[i];
+  }
+  t=nowNs();
+  long done=DeleteBatch(tree,batch,n);  // Keys that were there.
+  report(name,"delete-batch",nowNs()-t,n,done);
+  t=nowNs();
+  done=InsertBatch(tree,pairs,n);       // Keys that were new.
+  report(name,"insert-batch",nowNs()-t,n,done);
+  free(pairs);
+  free(batch);
+  t=nowNs();
+  int err=SaveSnapshot(tree,snapPath);  // 0 or an errno value.
+  if (err!=0)
+    errExitEN(err,"SaveSnapshot %s",snapPath);
+  report(name,"snap-save",nowNs()-t,n,tree->size);
+  DestroyTree(tree);                    // Frees tree too.
+  t=nowNs();
+  tree=LoadSnapshot(snapPath,&opts);    // Mapped, not read.
+  if (tree==NULL)
+    errExit("LoadSnapshot %s",snapPath);
+  report(name,"snap-load",nowNs()-t,n,tree->size);
+  hits=0;
+  t=nowNs();
+  for (int i=0;i<n;i++)                 // Served from the image.
+    hits+=Lookup(tree,keys+(size_t)order[i]*(keyLen+1),&v)&&v==order[i];
+  report(name,"snap-lookup",nowNs()-t,n,hits);
+  t=nowNs();
+  InsertNode(tree,misses,-1);           // Turns the image into a tree.
+  report(name,"snap-thaw",nowNs()-t,n,tree->size);
+  DestroyTree(tree);                    // Unmaps the file too.
+  unlink(snapPath);
+}
+
+int main (
+  int argc,                             // The argument count.
+  char* argv[])                         // The argument vector.
+{
+  const char* kinds="both";             // Which trees.
+  TreeMode mode=TREE_MODE_MUTEX;        // Which concurrency mode.
+  int opt;                              // Current option.
+  while ((opt=getopt(argc,argv,"n:l:k:m:s:"))!=-1)
+  {
+    switch (opt)
+    {
+      case 'n': n=getInt(optarg,GN_GT_0,"keys"); break;
+      case 'l': keyLen=getInt(optarg,GN_GT_0,"keylen"); break;
+      case 'k': kinds=optarg; break;
+      case 's': snapPath=optarg; break;
+      case 'm':
+        if (strcmp(optarg,"mutex")==0) mode=TREE_MODE_MUTEX;
+        else if (strcmp(optarg,"optimistic")==0) mode=TREE_MODE_OPTIMISTIC;
+        else if (strcmp(optarg,"rwlock")==0) mode=TREE_MODE_RWLOCK;
+        else if (strcmp(optarg,"epoch")==0) mode=TREE_MODE_EPOCH;
+        else cmdLineErr("unknown mode %s\n",optarg);
+        break;
+      default:
+        usageErr("%s [-n keys] [-l keylen] [-k rb|bplus|both] [-m mutex|optimistic|rwlock|epoch]"
+          " [-s snapshot-file]\n",argv[0]);
+    }
+  }
+  double space=1;                       // Distinct keys of this length.
+  for (int j=0;j<keyLen&&j<18;j++)
+    space*=10;
+  if (2.0*n>space)                      // Room for n keys plus as many misses?
+    cmdLineErr("%d keys do not fit in %d digits; use a longer -l\n",n,keyLen);
+  nMiss=(n<1000000)?n:1000000;          // Misses are reused beyond a million.
+  keys=(char*) malloc((size_t)n*(keyLen+1));
+  misses=(char*) malloc((size_t)nMiss*(keyLen+1));
+  order=(int*) malloc((size_t)n*sizeof(int));
+  if (keys==NULL||misses==NULL||order==NULL)
+    errExit("malloc");
+  for (int i=0;i<n;i++)                 // Key numbers [0,n) go in...
+  {
+    makeKey(keys+(size_t)i*(keyLen+1),(uint64_t)i);
+    order[i]=i;
+  }
+  for (int i=0;i<nMiss;i++)             // ...[n,n+nMiss) never do.
+    makeKey(misses+(size_t)i*(keyLen+1),(uint64_t)n+i);
+  printf("%d keys of %d bytes\n",n,keyLen);
+  if (strcmp(kinds,"rb")==0||strcmp(kinds,"both")==0)
+    runKind(TREE_KIND_RB,mode);
+  if (strcmp(kinds,"bplus")==0||strcmp(kinds,"both")==0)
+    runKind(TREE_KIND_BPLUS,mode);
+  free(keys);
+  free(misses);
+  free(order);
+  exit(EXIT_SUCCESS);
+}